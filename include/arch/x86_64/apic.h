@@ -1,8 +1,11 @@
 #pragma once
 #include <stdint.h>
+#include <stdbool.h>
 
 #define APIC_SPURIOUS_VECTOR 0xF0
 #define APIC_RESCHED_VECTOR  0xF1
+#define APIC_TIMER_VECTOR    0xF2
+#define APIC_TLB_VECTOR      0xF3
 
 void apic_init_bsp(void);
 void apic_init_ap(void);
@@ -11,3 +14,15 @@ void apic_eoi(void);
 void apic_send_init(uint32_t apic_id);
 void apic_send_sipi(uint32_t apic_id, uint8_t vector);
 void apic_send_ipi_all(uint8_t vector);
+void apic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+/* Local APIC timer.  Calibrate once on the BSP (against the TSC when
+ * tsc_hz is non-zero, otherwise PIT channel 2); the rest program the
+ * calling CPU's own timer. */
+bool apic_timer_calibrate(uint64_t tsc_hz);
+uint64_t apic_timer_hz(void);
+void apic_timer_periodic(uint32_t hz);
+void apic_timer_oneshot(uint64_t ns);
+void apic_timer_deadline_mode(void);
+void apic_timer_deadline(uint64_t tsc);   /* absolute TSC; needs deadline mode */
+void apic_timer_stop(void);
@@ -6,6 +6,23 @@ static inline void cpu_sti(void) { __asm__ volatile("sti"); }
 static inline void cpu_hlt(void) { __asm__ volatile("hlt"); }
 static inline void cpu_pause(void) { __asm__ volatile("pause"); }
 
+/* Halt with interrupts just enabled: sti holds them off for one more
+ * instruction, so none can slip in between a last check and the halt. */
+static inline void cpu_sti_hlt(void) { __asm__ volatile("sti; hlt" ::: "memory"); }
+
+/* Arm address monitoring on the line holding addr. */
+static inline void cpu_monitor(const volatile void* addr) {
+    __asm__ volatile("monitor" : : "a"(addr), "c"(0), "d"(0) : "memory");
+}
+
+/* MWAIT in C-state `hint` until the monitored line is written or an
+ * interrupt arrives; like cpu_sti_hlt() for the interrupt window. */
+static inline void cpu_sti_mwait(uint32_t hint) {
+    __asm__ volatile("sti; mwait" : : "a"(hint), "c"(0) : "memory");
+}
+
+#define RFLAGS_IF (1ULL << 9)
+
 static inline uint64_t read_rflags(void) {
     uint64_t r;
     __asm__ volatile ("pushfq; popq %0" : "=r"(r));
@@ -28,6 +45,54 @@ static inline void write_cr3(uint64_t v) {
     __asm__ volatile ("movq %0, %%cr3" : : "r"(v) : "memory");
 }
 
+static inline uint64_t read_cr0(void) {
+    uint64_t v;
+    __asm__ volatile ("movq %%cr0, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr0(uint64_t v) {
+    __asm__ volatile ("movq %0, %%cr0" : : "r"(v) : "memory");
+}
+
+static inline uint64_t read_cr4(void) {
+    uint64_t v;
+    __asm__ volatile ("movq %%cr4, %0" : "=r"(v));
+    return v;
+}
+
+static inline void write_cr4(uint64_t v) {
+    __asm__ volatile ("movq %0, %%cr4" : : "r"(v) : "memory");
+}
+
+static inline void xsetbv(uint32_t index, uint64_t v) {
+    __asm__ volatile ("xsetbv" : : "c"(index), "a"((uint32_t)v), "d"((uint32_t)(v >> 32)));
+}
+
+static inline uint64_t xgetbv(uint32_t index) {
+    uint32_t lo, hi;
+    __asm__ volatile ("xgetbv" : "=a"(lo), "=d"(hi) : "c"(index));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void cpuid(uint32_t leaf, uint32_t subleaf,
+                         uint32_t* a, uint32_t* b, uint32_t* c, uint32_t* d) {
+    uint32_t ra, rb, rc, rd;
+    __asm__ volatile ("cpuid" : "=a"(ra), "=b"(rb), "=c"(rc), "=d"(rd) : "a"(leaf), "c"(subleaf));
+    if (a) *a = ra;
+    if (b) *b = rb;
+    if (c) *c = rc;
+    if (d) *d = rd;
+}
+
+static inline uint64_t rdtsc(void) {
+    uint32_t lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((uint64_t)hi << 32) | lo;
+}
+
+#define MSR_FS_BASE 0xC0000100
+
 static inline uint64_t read_msr(uint32_t msr) {
     uint32_t lo, hi;
     __asm__ volatile ("rdmsr" : "=a"(lo), "=d"(hi) : "c"(msr));
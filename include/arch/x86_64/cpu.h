@@ -1,8 +1,19 @@
 #pragma once
 #include <stdint.h>
 #include <stdbool.h>
+#include "arch/x86_64/percpu.h"
 
 #define MAX_CPUS 8
+#define CPU_MASK_ALL ((1ULL << MAX_CPUS) - 1)
+
+/* CPUID feature bits, valid after cpu_detect_features(). */
+#define CPU_FEAT_ERMS          (1u << 0) /* enhanced REP MOVSB/STOSB */
+#define CPU_FEAT_FSRM          (1u << 1) /* fast short REP MOVSB */
+#define CPU_FEAT_TSC_INVARIANT (1u << 2)
+#define CPU_FEAT_XSAVE         (1u << 3)
+#define CPU_FEAT_AVX           (1u << 4)
+#define CPU_FEAT_TSC_DEADLINE  (1u << 5) /* LAPIC timer TSC-deadline mode */
+#define CPU_FEAT_MWAIT         (1u << 6) /* MONITOR/MWAIT */
 
 typedef struct {
     uint32_t apic_id;
@@ -15,6 +26,19 @@ uint32_t cpu_register(uint32_t apic_id, bool is_bsp);
 void cpu_set_online(uint32_t cpu_id, bool online);
 uint32_t cpu_count(void);
 uint32_t cpu_online_count(void);
+/* Bit i set: cpu_info_t entry i is present and online. */
+uint64_t cpu_online_mask(void);
 uint32_t cpu_apic_id(uint32_t cpu_id);
-uint32_t cpu_current_id(void);
+
+/* Index of the running CPU: one load from the per-CPU area. */
+static inline uint32_t cpu_current_id(void) {
+    return this_cpu_id();
+}
+
 void cpu_set_apic_ready(bool ready);
+
+void cpu_detect_features(void);
+bool cpu_has_feature(uint32_t feature);
+
+/* Enable SSE (and AVX state via XCR0 when present) on the calling CPU. */
+void cpu_init_fpu(void);
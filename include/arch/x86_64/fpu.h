@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+struct thread;
+
+/* Size the extended-state area and pick XSAVEOPT/XSAVE/FXSAVE (BSP, once). */
+void fpu_init(void);
+
+/*
+ * Lazy switching: CR0.TS is set for any thread whose state is not already in
+ * this CPU's registers, and the first FPU/SSE instruction traps (#NM) to load
+ * it.  State is saved on switch-out only if the outgoing thread used the FPU.
+ */
+void fpu_switch(struct thread* prev, struct thread* next, uint32_t cpu);
+
+/* #NM handler; returns false if the fault could not be resolved. */
+bool fpu_handle_nm(void);
+
+/* Copy parent's state into child (fork). Returns false on allocation failure. */
+bool fpu_fork(struct thread* child, struct thread* parent);
+
+/* Drop t's state (exit, or execve restarting from the init state). */
+void fpu_release(struct thread* t);
@@ -13,4 +13,6 @@ const char* irq_get_name(uint8_t irq);
 
 void irq_enter(uint8_t irq);
 void irq_exit(void);
+/* Handlers currently active (0 outside IRQ context). */
+uint8_t irq_nesting_level(void);
 void irq_dispatch(uint8_t irq, intr_frame_t* frame);
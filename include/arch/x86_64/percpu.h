@@ -0,0 +1,91 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "arch/x86_64/common.h"
+
+/*
+ * Per-CPU area, addressed through the GS base.  In the kernel GS always
+ * points at the running CPU's percpu_t; entry from and exit to user mode
+ * swapgs, so user code never sees it (and cannot redirect it).  Fields
+ * are read with a single %gs-relative load, which is what makes
+ * thread_current() and cpu_current_id() cheap.
+ *
+ * Only the owning CPU writes its area, except `current`, which the
+ * scheduler sets under the run queue lock, and `need_resched`, which any
+ * CPU may set to make this one reschedule.
+ */
+
+#define MSR_GS_BASE        0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102
+
+struct thread;
+struct tss;
+struct runqueue;
+
+typedef struct percpu {
+    struct percpu*   self;          /* %gs:0, for this_cpu() */
+    struct thread*   current;
+    uint32_t         cpu_id;
+    uint32_t         apic_id;
+    struct tss*      tss;
+    struct runqueue* rq;
+
+    uint64_t         irq_count;
+    uint64_t         syscall_count;
+
+    /* CPU accounting (cputime.h): TSC at the last charge, IRQ nesting. */
+    uint64_t         acct_stamp;
+    uint32_t         irq_depth;
+
+    /* Idle (idle.h): an MWAITing CPU watches this line, so a store to
+     * need_resched wakes it; idle_polling says it is doing so right now,
+     * idle_stamp is the TSC at which it went to sleep (0 when awake). */
+    volatile bool    need_resched;
+    volatile bool    idle_polling;
+    uint64_t         idle_stamp;
+
+    /* Kernel preemption (preempt.h): reasons not to switch threads, and
+     * switches away from a thread running kernel code. */
+    uint32_t         preempt_count;
+    uint64_t         kernel_preemptions;
+
+    /* Address space loaded here (vmm_activate()), for TLB shootdowns. */
+    uint64_t         cr3;
+} __attribute__((aligned(64))) percpu_t;
+
+extern percpu_t g_percpu[];
+
+/* Point this CPU's GS base at its area; first thing on every CPU. */
+void percpu_init(uint32_t cpu_id);
+
+/* Registers /proc/cpus. */
+void percpu_proc_init(void);
+
+static inline percpu_t* percpu_of(uint32_t cpu_id) {
+    return &g_percpu[cpu_id];
+}
+
+#define PERCPU_READ64(field, out) \
+    __asm__ volatile("movq %%gs:%c1, %0" : "=r"(out) : "i"(offsetof(percpu_t, field)))
+
+#define PERCPU_INC64(field) \
+    __asm__ volatile("incq %%gs:%c0" : : "i"(offsetof(percpu_t, field)) : "memory")
+
+static inline percpu_t* this_cpu(void) {
+    percpu_t* p;
+    PERCPU_READ64(self, p);
+    return p;
+}
+
+static inline struct thread* this_cpu_current(void) {
+    struct thread* t;
+    PERCPU_READ64(current, t);
+    return t;
+}
+
+static inline uint32_t this_cpu_id(void) {
+    uint32_t id;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(offsetof(percpu_t, cpu_id)));
+    return id;
+}
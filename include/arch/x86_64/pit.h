@@ -1,10 +1,31 @@
 #pragma once
 #include <stdint.h>
+#include <stdbool.h>
+
+#define PIT_BASE_HZ 1193182
 
 void pit_init(uint32_t hz);
 
 /* Called from IRQ0 handler to advance the tick counter. */
 void pit_handle_irq0(void);
 
+/* Stop the periodic IRQ and derive the tick count from the TSC instead;
+ * IRQ0 then fires only when armed with pit_arm_oneshot(). */
+bool pit_enter_oneshot(uint64_t tsc_hz);
+
+/* Fire IRQ0 once after about `ticks` ticks (clamped to what the 16-bit
+ * counter can hold).  Returns the number of ticks actually armed. */
+uint64_t pit_arm_oneshot(uint64_t ticks);
+
+/* TSC value at which tick `tick` starts (TSC clock only). */
+uint64_t pit_tick_tsc(uint64_t tick);
+
+/* First tick starting at or after TSC value `tsc` (TSC clock only). */
+uint64_t pit_tsc_tick(uint64_t tsc);
+
+/* Polled countdown on channel 2, for calibrating other clocks. */
+void pit_ch2_start(uint16_t count);
+bool pit_ch2_expired(void);
+
 uint64_t pit_ticks(void);
 uint32_t pit_frequency_hz(void);
@@ -0,0 +1,121 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+#include "arch/x86_64/common.h"
+#include "arch/x86_64/interrupts.h"
+#include "arch/x86_64/percpu.h"
+
+/*
+ * Kernel preemption.  Each CPU counts the reasons it must not switch
+ * threads right now: held spinlocks and rwlocks, RCU read sections and
+ * explicit preempt_disable() in the low bits, a running interrupt handler
+ * in PREEMPT_HARDIRQ units above them.  An interrupt returning to kernel
+ * code may switch threads there only if that code's count was zero;
+ * otherwise schedule() leaves need_resched set and the preempt_enable()
+ * that ends the section switches instead.
+ *
+ * Syscalls still run with interrupts off, so no IRQ reaches them.  Long
+ * loops in them call cond_resched(), which lets pending interrupts in for
+ * an instant and switches if need_resched is set; callers must not rely
+ * on interrupts staying off across it.
+ *
+ * Building with PREEMPT_STATS=1 times every stretch in which a CPU could
+ * not switch threads (from the lock, interrupt or syscall entry that
+ * began it to the next preemption point) and lists the longest, with the
+ * code address, vector or syscall that began each, in /proc/preempt.
+ */
+
+#define PREEMPT_VECTOR  0x81        /* ring-0 int: reschedule from kernel code */
+#define PREEMPT_MASK    0xFFFFu
+#define PREEMPT_HARDIRQ 0x10000u
+
+/* Sites that are not code addresses. */
+#define PREEMPT_SITE_VECTOR  (1ULL << 62)
+#define PREEMPT_SITE_SYSCALL (1ULL << 63)
+
+static inline uint32_t preempt_count(void) {
+    uint32_t c;
+    __asm__ volatile("movl %%gs:%c1, %0" : "=r"(c) : "i"(offsetof(percpu_t, preempt_count)));
+    return c;
+}
+
+static inline void preempt_count_add(uint32_t n) {
+    __asm__ volatile("addl %0, %%gs:%c1"
+                     : : "ri"(n), "i"(offsetof(percpu_t, preempt_count)) : "memory", "cc");
+}
+
+static inline void preempt_count_sub(uint32_t n) {
+    __asm__ volatile("subl %0, %%gs:%c1"
+                     : : "ri"(n), "i"(offsetof(percpu_t, preempt_count)) : "memory", "cc");
+}
+
+/* Enter schedule() from kernel code through PREEMPT_VECTOR. */
+void preempt_schedule(void);
+
+/* A preemption point for long loops; see above. */
+void cond_resched(void);
+
+/* Registers /proc/preempt. */
+void preempt_init(void);
+
+#ifdef PREEMPT_STATS
+/* Start timing a stretch at site unless one is already open; end it. */
+void preempt_stat_begin(uint64_t site);
+void preempt_stat_end(void);
+
+static inline __attribute__((always_inline)) uint64_t preempt_here(void) {
+    uint64_t ip;
+    __asm__ volatile("leaq 0(%%rip), %0" : "=r"(ip));
+    return ip;
+}
+#else
+static inline void preempt_stat_begin(uint64_t site) {
+    (void)site;
+}
+
+static inline void preempt_stat_end(void) {
+}
+#endif
+
+static inline void preempt_disable(void) {
+    preempt_count_add(1);
+#ifdef PREEMPT_STATS
+    if (preempt_count() == 1) preempt_stat_begin(preempt_here());
+#endif
+    __asm__ volatile("" ::: "memory");
+}
+
+static inline void preempt_enable_no_resched(void) {
+    __asm__ volatile("" ::: "memory");
+    preempt_count_sub(1);
+}
+
+/* With interrupts off the section goes on (a syscall, a handler); the
+ * syscall return path or the next cond_resched() reschedules. */
+static inline void preempt_enable(void) {
+    __asm__ volatile("" ::: "memory");
+    preempt_count_sub(1);
+    if (preempt_count() || !(read_rflags() & RFLAGS_IF)) return;
+    preempt_stat_end();
+    if (this_cpu()->need_resched) preempt_schedule();
+}
+
+/* Interrupt entry and exit (interrupt_dispatch()). */
+static inline void preempt_irq_enter(uint64_t vector) {
+    preempt_count_add(PREEMPT_HARDIRQ);
+    preempt_stat_begin(PREEMPT_SITE_VECTOR | vector);
+}
+
+static inline void preempt_irq_exit(void) {
+    preempt_count_sub(PREEMPT_HARDIRQ);
+}
+
+/* About to resume `out`: the stretch ends if that code is preemptible. */
+static inline void preempt_stat_resume(const intr_frame_t* out) {
+#ifdef PREEMPT_STATS
+    if (!preempt_count() && ((out->cs & 3) == 3 || (out->rflags & RFLAGS_IF))) preempt_stat_end();
+#else
+    (void)out;
+#endif
+}
@@ -2,5 +2,8 @@
 #include <stdint.h>
 
 void smp_init(void);
-void smp_broadcast_tick(void);
+
+/* Ask cpu_id to run the scheduler (targeted RESCHED IPI, unless it is
+ * MWAITing on a need_resched flag the caller has already set). */
+void smp_send_resched(uint32_t cpu_id);
 uint32_t smp_cpu_count(void);
@@ -1,23 +1,237 @@
 #pragma once
 #include <stdint.h>
+#include <stdbool.h>
 #include "arch/x86_64/common.h"
+#include "arch/x86_64/preempt.h"
+
+/*
+ * Ticket spinlocks: lockers take a ticket with one atomic add and spin
+ * reading owner until it comes up, so the lock is handed out in FIFO
+ * order and waiters only read the shared line until it is released.
+ *
+ * None of these touch the interrupt flag.  A lock that an IRQ handler
+ * may take must be held with interrupts off everywhere else; use the
+ * _irqsave variants there (syscalls already run with IF=0).  Every lock
+ * here, spinlock or rwlock, disables preemption while held (preempt.h).
+ *
+ * Building with LOCK_STATS=1 gives every lock named with
+ * spinlock_set_name() acquisition, contention, spin and hold-time
+ * counters, listed in /proc/locks.
+ */
+
+static inline uint64_t irq_save(void) {
+    uint64_t flags = read_rflags();
+    cpu_cli();
+    return flags;
+}
+
+static inline void irq_restore(uint64_t flags) {
+    if (flags & RFLAGS_IF) cpu_sti();
+}
+
+typedef struct lock_stat {
+    const char*       name;
+    uint64_t          acquisitions;
+    uint64_t          contended;        /* acquisitions that had to spin */
+    uint64_t          spins;
+    uint64_t          hold_cycles;
+    uint64_t          max_hold_cycles;
+    struct lock_stat* next;
+} lock_stat_t;
 
 typedef struct {
-    volatile uint32_t locked;
+    union {
+        volatile uint32_t word;
+        struct {
+            volatile uint16_t owner;    /* ticket being served */
+            volatile uint16_t next;     /* next ticket to hand out */
+        };
+    };
+#ifdef LOCK_STATS
+    lock_stat_t* stat;
+    uint64_t     held_since;
+#endif
 } spinlock_t;
 
+#ifdef LOCK_STATS
+#define SPINLOCK_INIT { { 0 }, 0, 0 }
+#else
+#define SPINLOCK_INIT { { 0 } }
+#endif
+
+#ifdef LOCK_STATS
+void spinlock_set_name(spinlock_t* lock, const char* name);
+
+static inline void lock_stat_acquired(spinlock_t* lock, uint64_t spins) {
+    lock_stat_t* s = lock->stat;
+    if (!s) return;
+    s->acquisitions++;
+    if (spins) {
+        s->contended++;
+        s->spins += spins;
+    }
+    lock->held_since = rdtsc();
+}
+
+static inline void lock_stat_released(spinlock_t* lock) {
+    lock_stat_t* s = lock->stat;
+    if (!s) return;
+    uint64_t held = rdtsc() - lock->held_since;
+    s->hold_cycles += held;
+    if (held > s->max_hold_cycles) s->max_hold_cycles = held;
+}
+#else
+static inline void spinlock_set_name(spinlock_t* lock, const char* name) {
+    (void)lock;
+    (void)name;
+}
+
+static inline void lock_stat_acquired(spinlock_t* lock, uint64_t spins) {
+    (void)lock;
+    (void)spins;
+}
+
+static inline void lock_stat_released(spinlock_t* lock) {
+    (void)lock;
+}
+#endif
+
+/* Registers /proc/locks. */
+void spinlock_stats_init(void);
+
 static inline void spinlock_init(spinlock_t* lock) {
-    if (lock) lock->locked = 0;
+    if (!lock) return;
+    lock->word = 0;
+#ifdef LOCK_STATS
+    lock->stat = 0;
+#endif
 }
 
 static inline void spinlock_lock(spinlock_t* lock) {
-    while (__sync_lock_test_and_set(&lock->locked, 1)) {
-        while (lock->locked) {
-            cpu_pause();
-        }
+    preempt_disable();
+    uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    uint64_t spins = 0;
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+        cpu_pause();
+        spins++;
+    }
+    lock_stat_acquired(lock, spins);
+}
+
+static inline bool spinlock_trylock(spinlock_t* lock) {
+    preempt_disable();
+    uint32_t w = lock->word;
+    if ((uint16_t)w != (uint16_t)(w >> 16) ||
+        !__sync_bool_compare_and_swap(&lock->word, w, w + 0x10000u)) {
+        preempt_enable();
+        return false;
     }
+    lock_stat_acquired(lock, 0);
+    return true;
+}
+
+static inline void spinlock_release(spinlock_t* lock) {
+    lock_stat_released(lock);
+    __atomic_store_n(&lock->owner, (uint16_t)(lock->owner + 1), __ATOMIC_RELEASE);
 }
 
 static inline void spinlock_unlock(spinlock_t* lock) {
-    __sync_lock_release(&lock->locked);
+    spinlock_release(lock);
+    preempt_enable();
+}
+
+static inline bool spinlock_is_locked(const spinlock_t* lock) {
+    uint32_t w = lock->word;
+    return (uint16_t)w != (uint16_t)(w >> 16);
+}
+
+static inline uint64_t spinlock_lock_irqsave(spinlock_t* lock) {
+    uint64_t flags = irq_save();
+    spinlock_lock(lock);
+    return flags;
+}
+
+/* Interrupts back on before preemption is: a switch it allows happens
+ * here, not at the next interrupt. */
+static inline void spinlock_unlock_irqrestore(spinlock_t* lock, uint64_t flags) {
+    spinlock_release(lock);
+    irq_restore(flags);
+    preempt_enable();
+}
+
+/*
+ * Reader-writer spinlock for data read far more often than written.
+ * A waiting writer sets RWLOCK_WAITING, which keeps new readers out so
+ * writers are not starved; readers must therefore not nest read_lock().
+ */
+typedef struct {
+    volatile uint32_t state;    /* reader count | RWLOCK_WAITING | RWLOCK_WRITER */
+} rwlock_t;
+
+#define RWLOCK_WRITER  0x80000000u
+#define RWLOCK_WAITING 0x40000000u
+#define RWLOCK_INIT    { 0 }
+
+static inline void rwlock_init(rwlock_t* rw) {
+    rw->state = 0;
+}
+
+static inline void read_lock(rwlock_t* rw) {
+    preempt_disable();
+    for (;;) {
+        uint32_t s = rw->state;
+        if (!(s & (RWLOCK_WRITER | RWLOCK_WAITING)) &&
+            __sync_bool_compare_and_swap(&rw->state, s, s + 1)) {
+            return;
+        }
+        cpu_pause();
+    }
+}
+
+static inline void read_unlock(rwlock_t* rw) {
+    __sync_fetch_and_sub(&rw->state, 1);
+    preempt_enable();
+}
+
+static inline void write_lock(rwlock_t* rw) {
+    preempt_disable();
+    for (;;) {
+        uint32_t s = rw->state;
+        if ((s & ~RWLOCK_WAITING) == 0) {
+            if (__sync_bool_compare_and_swap(&rw->state, s, RWLOCK_WRITER)) return;
+        } else if (!(s & RWLOCK_WAITING)) {
+            __sync_fetch_and_or(&rw->state, RWLOCK_WAITING);
+        }
+        cpu_pause();
+    }
+}
+
+/* Leaves RWLOCK_WAITING alone: it may belong to the next writer. */
+static inline void write_unlock(rwlock_t* rw) {
+    __sync_fetch_and_and(&rw->state, ~RWLOCK_WRITER);
+    preempt_enable();
+}
+
+static inline uint64_t read_lock_irqsave(rwlock_t* rw) {
+    uint64_t flags = irq_save();
+    read_lock(rw);
+    return flags;
+}
+
+static inline void read_unlock_irqrestore(rwlock_t* rw, uint64_t flags) {
+    __sync_fetch_and_sub(&rw->state, 1);
+    irq_restore(flags);
+    preempt_enable();
+}
+
+static inline uint64_t write_lock_irqsave(rwlock_t* rw) {
+    uint64_t flags = irq_save();
+    write_lock(rw);
+    return flags;
+}
+
+static inline void write_unlock_irqrestore(rwlock_t* rw, uint64_t flags) {
+    __sync_fetch_and_and(&rw->state, ~RWLOCK_WRITER);
+    irq_restore(flags);
+    preempt_enable();
 }
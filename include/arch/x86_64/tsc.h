@@ -0,0 +1,15 @@
+#pragma once
+#include <stdint.h>
+
+/* Calibrate the TSC against PIT channel 2 (BSP, before IRQs are enabled). */
+void tsc_init(void);
+
+/* TSC frequency in Hz, or 0 if calibration failed. */
+uint64_t tsc_hz(void);
+uint64_t tsc_to_ns(uint64_t cycles);
+uint64_t tsc_from_ns(uint64_t ns);
+
+/* Monotonic nanoseconds since calibration, and the TSC value at which
+ * that clock reads `ns` (TSC-deadline arming). */
+uint64_t tsc_now_ns(void);
+uint64_t tsc_deadline_ns(uint64_t ns);
@@ -0,0 +1,71 @@
+#pragma once
+#include <stdint.h>
+#include "thread.h"
+#include "arch/x86_64/common.h"
+#include "arch/x86_64/percpu.h"
+
+/*
+ * Per-thread CPU time, charged at kernel entry and exit rather than
+ * sampled at the tick.  Each CPU keeps the TSC of its last charge; the
+ * cycles since then go to the running thread as user time on entry from
+ * user mode, as system time on the way back and at a context switch, and
+ * as IRQ time when an interrupt handler finishes.  An idle thread's
+ * system time is its CPU's idle time.
+ */
+
+static inline uint64_t cputime_advance(percpu_t* pc) {
+    uint64_t now = rdtsc();
+    uint64_t d = now - pc->acct_stamp;
+    pc->acct_stamp = now;
+    return d;
+}
+
+/* Kernel entry from user mode. */
+static inline void cputime_user_exit(void) {
+    percpu_t* pc = this_cpu();
+    uint64_t d = cputime_advance(pc);
+    if (pc->current) pc->current->cpu.user_cycles += d;
+}
+
+/* Return to user mode. */
+static inline void cputime_user_enter(void) {
+    percpu_t* pc = this_cpu();
+    uint64_t d = cputime_advance(pc);
+    if (pc->current) pc->current->cpu.sys_cycles += d;
+}
+
+/* Around an IRQ handler: what ran before it was system time (or the
+ * outer handler's), the handler itself is IRQ time. */
+static inline void cputime_irq_enter(void) {
+    percpu_t* pc = this_cpu();
+    uint64_t d = cputime_advance(pc);
+    thread_t* t = pc->current;
+    if (t) {
+        if (pc->irq_depth) t->cpu.irq_cycles += d;
+        else t->cpu.sys_cycles += d;
+    }
+    pc->irq_depth++;
+}
+
+static inline void cputime_irq_exit(void) {
+    percpu_t* pc = this_cpu();
+    uint64_t d = cputime_advance(pc);
+    if (pc->current) pc->current->cpu.irq_cycles += d;
+    pc->irq_depth--;
+}
+
+/* Bring the running thread t, in the kernel since the last charge, up to
+ * date: at a context switch away from it, or for a usage snapshot. */
+static inline void cputime_sys(thread_t* t) {
+    uint64_t d = cputime_advance(this_cpu());
+    t->cpu.sys_cycles += d;
+}
+
+static inline void cputime_add(cputime_t* dst, const cputime_t* src) {
+    dst->user_cycles += src->user_cycles;
+    dst->sys_cycles += src->sys_cycles;
+    dst->irq_cycles += src->irq_cycles;
+    dst->wait_ns += src->wait_ns;
+    dst->nvcsw += src->nvcsw;
+    dst->nivcsw += src->nivcsw;
+}
@@ -0,0 +1,25 @@
+#pragma once
+#include <stdint.h>
+
+/*
+ * Fast user-space mutexes: user code handles the uncontended case with
+ * atomics on a 32-bit word and only enters the kernel to sleep on it or
+ * wake its sleepers.  Waiters are keyed by the word's physical address,
+ * hashed into buckets with their own locks.
+ */
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+void futex_init(void);
+
+/* Sleep while *uaddr == val.  Returns 0 when woken, -1 if the value had
+ * already changed, the address is bad, or the caller was killed. */
+int64_t futex_wait(uint32_t* uaddr, uint32_t val);
+
+/* Wake up to n threads sleeping on uaddr; returns how many. */
+int64_t futex_wake(uint32_t* uaddr, uint32_t n);
+
+/* futex_wake() on a word given by physical address, from any context that
+ * may take a spinlock (exit of a thread in another address space). */
+int64_t futex_wake_phys(uint64_t phys, uint32_t n);
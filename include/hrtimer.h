@@ -0,0 +1,46 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "rbtree.h"
+
+/*
+ * High-resolution timers: per-CPU trees of nanosecond deadlines on the
+ * monotonic clock (time_now_ns), fired by the CPU's TSC-deadline or
+ * one-shot local APIC timer.  A timer may fire anywhere in [expires,
+ * expires + slack]: the CPU timer is armed for the earliest hard deadline
+ * and every timer whose soft deadline has passed then runs in the same
+ * interrupt, batching wakeups.  Callbacks run from schedule() on the CPU
+ * the timer was started on, with interrupts off, and must not block.
+ */
+
+typedef void (*hrtimer_fn_t)(void* arg);
+
+typedef struct hrtimer {
+    rb_node_t    node;
+    uint64_t     soft;      /* expires: earliest firing time (ns) */
+    uint64_t     hard;      /* expires + slack: tree key (ns) */
+    hrtimer_fn_t fn;
+    void*        arg;
+    uint32_t     cpu;
+    bool         queued;
+} hrtimer_t;
+
+void hrtimer_init(void);
+
+void hrtimer_setup(hrtimer_t* t, hrtimer_fn_t fn, void* arg);
+
+/* (Re)start t on the calling CPU for absolute monotonic time `expires`. */
+void hrtimer_start(hrtimer_t* t, uint64_t expires, uint64_t slack);
+
+/* Stop t; returns true if it was queued.  Waits for a running callback. */
+bool hrtimer_cancel(hrtimer_t* t);
+
+/* Run the calling CPU's expired timers (scheduler). */
+void hrtimer_run(void);
+
+/* Earliest hard deadline queued on cpu, UINT64_MAX when none. */
+uint64_t hrtimer_next_event(uint32_t cpu);
+
+/* Tick by which cpu must run its earliest hrtimer (the current tick once
+ * it is due), for tick sources that cannot fire between ticks. */
+uint64_t hrtimer_next_tick(uint32_t cpu);
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "arch/x86_64/percpu.h"
+
+/*
+ * The idle loop.  Where the CPU has MONITOR/MWAIT, an idle CPU waits on
+ * the line holding its need_resched flag with idle_polling set: a store
+ * to the flag wakes it, so smp_send_resched() need not send an IPI.
+ * Otherwise it halts and every wakeup is an IPI, as before.
+ *
+ * A sleeping CPU has idle_stamp set; whatever wakes it (the store, or the
+ * first interrupt, through idle_irq_enter()) closes the interval, so the
+ * residency in /proc/idle counts only time actually asleep, not the
+ * handler or whatever the handler switched to.
+ */
+
+/* Picks MWAIT or HLT and registers /proc/idle; before smp_init(). */
+void idle_init(void);
+
+/* Every CPU ends up here once it is set up, with interrupts on. */
+__attribute__((noreturn)) void idle_loop(void);
+
+/* cpu is MWAITing and its need_resched is set: the store that set it is
+ * the wakeup.  The caller has set the flag; called before sending an IPI. */
+bool idle_skip_ipi(uint32_t cpu);
+
+void idle_wake_irq(percpu_t* pc);
+
+/* Interrupt entry: an interrupt that ends a sleep stops the clock. */
+static inline void idle_irq_enter(void) {
+    percpu_t* pc = this_cpu();
+    if (pc->idle_stamp) idle_wake_irq(pc);
+}
@@ -20,4 +20,6 @@ void input_handle_irq1(uint8_t irq, intr_frame_t* frame);
 void input_handle_irq12(uint8_t irq, intr_frame_t* frame);
 
 int input_read_key(key_event_t* out);
+/* Sleep until a key event is queued; -1 if the caller was killed. */
+int input_wait_key(void);
 int input_read_mouse(mouse_event_t* out);
@@ -0,0 +1,4 @@
+#pragma once
+
+/* In-kernel throughput benchmark for memcpy/memset/memcmp (build with KBENCH=1). */
+void kbench_run(void);
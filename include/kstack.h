@@ -0,0 +1,31 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+#include "pmm.h"
+
+/*
+ * Kernel thread stacks, mapped in their own virtual region with an
+ * unmapped guard page below each one: overflowing a stack faults at once,
+ * and as the CPU cannot push the #PF frame either, the fault becomes a
+ * double fault delivered on the IST1 stack, where kstack_guard_hit()
+ * names the cause.
+ *
+ * Stacks are never unmapped (so no TLB shootdown is ever needed).  Freed
+ * ones go to a small per-CPU cache, then to a global free list; creating
+ * a thread or forking takes one from there before mapping a new slot.
+ */
+
+#define KSTACK_PAGES 4  /* 16 KiB */
+#define KSTACK_SIZE  (KSTACK_PAGES * PAGE_SIZE)
+
+/* Registers /proc/kstacks; after vmm_init(). */
+void kstack_init(void);
+
+/* Lowest address of a KSTACK_SIZE stack, or 0. */
+void* kstack_alloc(void);
+
+/* Back to the pool; stacks not from kstack_alloc() are ignored. */
+void kstack_free(void* base);
+
+/* addr lies in one of the region's guard pages. */
+bool kstack_guard_hit(uint64_t addr);
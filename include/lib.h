@@ -1,15 +1,27 @@
 #pragma once
 #include <stddef.h>
 #include <stdint.h>
+#include <stdarg.h>
 
 void* memcpy(void* dst, const void* src, size_t n);
 void* memset(void* dst, int v, size_t n);
 int   memcmp(const void* a, const void* b, size_t n);
 
+/* Pick memcpy/memset strategies from CPUID; call after cpu_detect_features(). */
+void  lib_init_string_ops(void);
+
 size_t strlen(const char* s);
 int    strcmp(const char* a, const char* b);
 int    strncmp(const char* a, const char* b, size_t n);
 char*  strncpy(char* dst, const char* src, size_t n);
 
+/* Bounded formatter with the log_* conversions (%s %c %d %i %u %x %X %p, l/ll).
+ * Returns the length the full output would have had. */
+int ksnprintf(char* buf, size_t size, const char* fmt, ...);
+int kvsnprintf(char* buf, size_t size, const char* fmt, va_list ap);
+
 uint64_t align_up_u64(uint64_t v, uint64_t a);
 uint64_t align_down_u64(uint64_t v, uint64_t a);
+
+#define container_of(ptr, type, member) \
+    ((type*)((char*)(ptr) - offsetof(type, member)))
@@ -0,0 +1,11 @@
+#pragma once
+#include <stddef.h>
+
+/* Fill buf (capacity size) with the file's current text; return its length. */
+typedef size_t (*procfs_show_t)(char* buf, size_t size);
+
+/* Mount /proc and create every file registered so far. */
+void procfs_init(void);
+
+/* Register /proc/<name>; may be called before or after procfs_init(). */
+int procfs_register(const char* name, procfs_show_t show);
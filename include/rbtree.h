@@ -0,0 +1,40 @@
+#pragma once
+#include <stddef.h>
+#include <stdbool.h>
+
+/*
+ * Intrusive red-black tree with a cached leftmost node, so the minimum
+ * is O(1) and insert/erase are O(log n).  Ordering is supplied by the
+ * caller at insert time; equal keys go to the right (FIFO among equals).
+ */
+
+typedef struct rb_node {
+    struct rb_node* parent;
+    struct rb_node* left;
+    struct rb_node* right;
+    bool red;
+} rb_node_t;
+
+typedef struct {
+    rb_node_t* root;
+    rb_node_t* leftmost;
+} rb_root_t;
+
+#define RB_ROOT_INIT { 0, 0 }
+
+#define rb_entry(ptr, type, member) \
+    ((type*)((char*)(ptr) - offsetof(type, member)))
+
+typedef bool (*rb_less_t)(const rb_node_t* a, const rb_node_t* b);
+
+void rb_insert(rb_root_t* root, rb_node_t* node, rb_less_t less);
+void rb_erase(rb_root_t* root, rb_node_t* node);
+rb_node_t* rb_next(const rb_node_t* node);
+
+static inline rb_node_t* rb_first(const rb_root_t* root) {
+    return root->leftmost;
+}
+
+static inline bool rb_empty(const rb_root_t* root) {
+    return root->root == 0;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Read-copy-update for read-mostly data.  Readers bracket their accesses
+ * with rcu_read_lock()/rcu_read_unlock(), take no locks and never write
+ * shared memory.  Writers serialize among themselves, publish new
+ * versions with rcu_assign_pointer() and free what they replaced only
+ * after a grace period: once every CPU has passed a quiescent state
+ * (context switch, user-mode tick, idle), no reader can still hold it.
+ *
+ * A read-side section must not sleep; it holds off preemption, not IRQs.
+ */
+
+typedef struct rcu_head {
+    struct rcu_head* next;
+    void (*func)(struct rcu_head* head);
+} rcu_head_t;
+
+/* After scheduler_init(): starts the callback thread. */
+void rcu_init(void);
+
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+
+/* Run func(head) after a grace period, from the rcu thread. */
+void call_rcu(rcu_head_t* head, void (*func)(rcu_head_t* head));
+
+/* Wait for a grace period: every reader running now has finished. */
+void synchronize_rcu(void);
+
+/* Quiescent-state reports from the scheduler, the idle loops and kernel
+ * entry from user mode. */
+void rcu_note_qs(uint32_t cpu);
+void rcu_idle_enter(uint32_t cpu);
+
+/* Publish p after the stores that initialized it; read it back in a
+ * reader.  x86 keeps stores and loads in order, so only the compiler
+ * needs restraining. */
+#define rcu_assign_pointer(p, v) __atomic_store_n(&(p), (v), __ATOMIC_RELEASE)
+#define rcu_dereference(p)       __atomic_load_n(&(p), __ATOMIC_ACQUIRE)
+
+/*
+ * Singly linked lists with a `next` member, read under rcu_read_lock().
+ * Writers hold the list's own lock.  A deleted entry keeps its next
+ * pointer so readers standing on it can walk on; free it with call_rcu().
+ */
+#define rcu_slist_for_each(pos, head) \
+    for ((pos) = rcu_dereference(head); (pos); (pos) = rcu_dereference((pos)->next))
+
+#define rcu_slist_add_head(head, node) do {    \
+        (node)->next = (head);                 \
+        rcu_assign_pointer((head), (node));    \
+    } while (0)
+
+/* pprev points at the link holding node (the head or a predecessor's next). */
+#define rcu_slist_del(pprev, node) rcu_assign_pointer(*(pprev), (node)->next)
@@ -0,0 +1,64 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Scheduler tracepoints.  While tracing is on, each CPU appends the
+ * events it sees to its own ring of SCHED_TRACE_EVENTS records, the oldest
+ * overwritten first.  Only that CPU writes its ring, with interrupts off,
+ * and a record is published by bumping the ring's head, so recording
+ * takes no lock; a reader copies the ring and drops whatever the writer
+ * lapped meanwhile.  Timestamps are raw TSC values.
+ *
+ * Whether tracing is on or not, every context switch feeds two log2
+ * histograms: how long the incoming thread waited runnable (run-queue
+ * latency) and how long the outgoing one ran (its time slice).
+ * /proc/schedlat shows them.
+ */
+
+#define SCHED_TRACE_EVENTS 1024     /* per CPU, a power of two */
+
+/* Event types and what their fields hold. */
+#define SCHED_EV_SWITCH  1  /* pid: prev, arg0: next, arg1: prev state */
+#define SCHED_EV_WAKEUP  2  /* pid: woken, arg0: its CPU, arg1: waker (0: none) */
+#define SCHED_EV_MIGRATE 3  /* pid, arg0: destination CPU, arg1: source CPU */
+#define SCHED_EV_FORK    4  /* pid: parent, arg0: child */
+#define SCHED_EV_EXIT    5  /* pid, arg0: exit code */
+
+typedef struct {
+    uint64_t tsc;
+    uint32_t type;
+    uint32_t cpu;           /* CPU that recorded it */
+    uint32_t pid;
+    uint32_t arg0;
+    uint32_t arg1;
+    uint32_t reserved;
+} sched_event_t;
+
+/* sched_trace syscall operations. */
+#define SCHED_TRACE_STOP   0
+#define SCHED_TRACE_START  1    /* forget earlier events and histograms */
+#define SCHED_TRACE_READ   2    /* one CPU's events, oldest first */
+#define SCHED_TRACE_TSC_HZ 3
+
+extern volatile bool g_sched_trace_on;
+
+/* Registers /proc/schedlat. */
+void sched_trace_init(void);
+
+void sched_trace_record(uint32_t type, uint32_t pid, uint32_t arg0, uint32_t arg1);
+
+static inline void sched_trace(uint32_t type, uint32_t pid, uint32_t arg0, uint32_t arg1) {
+    if (g_sched_trace_on) sched_trace_record(type, pid, arg0, arg1);
+}
+
+/* Histogram samples, from the CPU's own schedule(). */
+void sched_hist_runq(uint32_t cpu, uint64_t wait_ns);
+void sched_hist_slice(uint32_t cpu, uint64_t ran_ns);
+
+void sched_trace_start(void);
+void sched_trace_stop(void);
+
+/* Copy up to max of cpu's most recent events to out; returns how many,
+ * or -1 for a bad CPU. */
+int64_t sched_trace_read(uint32_t cpu, sched_event_t* out, uint64_t max);
@@ -16,24 +16,115 @@ thread_t* thread_create_user(const char* name, uint64_t user_rip, uint64_t brk_s
 /* Called from timer IRQ handler; returns frame to resume. */
 intr_frame_t* scheduler_on_tick(intr_frame_t* frame);
 
+/* For the tick source: mask of CPUs that must run the scheduler at tick
+ * `now`, and the tick of the next event any CPU needs (UINT64_MAX: none). */
+uint64_t scheduler_timer_due(uint64_t now, uint64_t* next_event);
+
+/* Reschedule if a wakeup flagged this CPU (syscall return path). */
+intr_frame_t* scheduler_preempt_check(intr_frame_t* frame);
+
 /* Fork current user thread; returns frame to resume parent/child. */
 intr_frame_t* scheduler_fork(intr_frame_t* frame);
 
 /* Called when a thread exits (syscall or fault). Returns next frame to resume. */
 intr_frame_t* scheduler_on_exit(intr_frame_t* frame, int exit_code);
 
+/* New thread in the caller's process: shares its address space and files,
+ * starts at entry(arg) on the given user stack with FS base tls, and has
+ * *clear_tid zeroed and futex-woken when it exits.  Returns its id. */
+int64_t scheduler_clone(intr_frame_t* frame, uint64_t entry, uint64_t stack, uint64_t arg,
+                        uint64_t tls, uint64_t clear_tid);
+
+/* Set the current thread's FS base (user TLS pointer). */
+void scheduler_set_tls(uint64_t base);
+
 /* Cooperative yield (invoked by syscall yield). */
 intr_frame_t* scheduler_yield(intr_frame_t* frame);
 
-/* Wait for a child process to exit (invoked by syscall waitpid). */
-intr_frame_t* scheduler_waitpid(intr_frame_t* frame, int pid, uint64_t status_ptr);
+/* From the idle loop, once need_resched is set: run schedule() now. */
+void scheduler_idle_resched(void);
+
+/* Wait for child pid (any child if pid <= 0) to exit and reap it; returns
+ * its id, or -1 if there is no such child or the caller was killed. */
+int64_t scheduler_waitpid(int pid, int* status);
 
-/* Send a signal to a user thread (simple kill). */
+/* Send a signal to a user thread (simple kill).  A thread inside a kernel
+ * wait dies when it leaves the kernel. */
 int scheduler_kill(int pid, int sig);
 
+/* Blocking for wait queues (wait.h).  scheduler_can_block() is false for
+ * the boot/idle threads and in atomic context (a spinlock, rwlock or RCU
+ * read section held); blocking or sleeping there anyway halts the kernel,
+ * naming the caller.  The current thread marks itself BLOCKED, then
+ * gives up its CPU unless woken meanwhile; scheduler_block_cancel() makes
+ * it RUNNING again however the wait ended.  Callers keep interrupts off
+ * around prepare and cancel. */
+bool scheduler_can_block(void);
+void scheduler_block_prepare(void);
+void scheduler_block(void);
+void scheduler_block_cancel(void);
+
+/* Wake t if it is BLOCKED; false if it was not. */
+bool scheduler_wake_blocked(thread_t* t);
+
 /* Sleep current thread for n ticks (called from kernel code only). */
 void scheduler_sleep(uint64_t ticks);
 
+/* Sleep the current thread for n ticks from a syscall; returns the frame
+ * to resume (invoked by syscall sleep). */
+intr_frame_t* scheduler_sleep_ticks(intr_frame_t* frame, uint64_t ticks);
+
+/* Sleep the current thread until monotonic time `deadline` (ns), give or
+ * take its timer slack; returns the frame to resume (nanosleep). */
+intr_frame_t* scheduler_sleep_until_ns(intr_frame_t* frame, uint64_t deadline);
+
+/* ktimer/hrtimer callback: wake `thread` if it is still sleeping. */
+void scheduler_timer_wakeup(void* thread);
+
+/* Set t's nice value (clamped to THREAD_NICE_MIN..MAX); returns it. */
+int scheduler_set_nice(thread_t* t, int nice);
+
+/* Policy parameters for scheduler_setscheduler (same layout as the
+ * user's sched_attr_t). */
+typedef struct {
+    int64_t  priority;      /* SCHED_FIFO / SCHED_RR: 1..SCHED_RT_PRIO_MAX */
+    uint64_t runtime_ns;    /* SCHED_DEADLINE: runtime <= deadline <= period */
+    uint64_t deadline_ns;
+    uint64_t period_ns;
+} sched_attr_t;
+
+/* Change the scheduling class of pid (0: caller).  Returns 0, or -1 for
+ * bad parameters or a deadline reservation that fails admission. */
+int scheduler_setscheduler(int pid, int policy, const sched_attr_t* attr);
+
+/* Policy of pid (0: caller), filling attr if non-null; -1 if no such pid. */
+int scheduler_getscheduler(int pid, sched_attr_t* attr);
+
+/* Restrict pid (0: caller) to the online CPUs in mask, moving it if its
+ * current CPU is no longer allowed.  Returns 0, or -1 if no allowed CPU
+ * is online or pid cannot move. */
+int scheduler_set_affinity(int pid, uint64_t mask);
+
+/* Allowed online CPUs of pid (0: caller), or -1 if no such pid. */
+int64_t scheduler_get_affinity(int pid);
+
+/* CPU usage (same layout as the user's rusage_t). */
+typedef struct {
+    uint64_t utime_ns;
+    uint64_t stime_ns;
+    uint64_t irq_ns;        /* in IRQ handlers that interrupted it */
+    uint64_t wait_ns;       /* runnable, waiting for a CPU */
+    uint64_t nvcsw;         /* voluntary context switches */
+    uint64_t nivcsw;        /* involuntary ones: preemptions and yields */
+} sched_rusage_t;
+
+#define SCHED_RUSAGE_SELF      0    /* all threads of the caller's process */
+#define SCHED_RUSAGE_CHILDREN  (-1) /* its reaped children, and theirs */
+#define SCHED_RUSAGE_THREAD    1    /* the calling thread */
+
+/* Fill ru for who; -1 for an unknown who. */
+int scheduler_getrusage(int who, sched_rusage_t* ru);
+
 /* Count active threads (non-unused). */
 uint64_t scheduler_thread_count(void);
 
@@ -0,0 +1,70 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "wait.h"
+
+/*
+ * Sleeping synchronization built on wait queues.  All of these may block,
+ * so they are for thread context only; IRQ handlers may call the release
+ * side (mutex_unlock excepted: it must come from the owner).
+ */
+
+struct thread;
+
+/* Mutex: one owner, contended lockers sleep in FIFO order. */
+typedef struct {
+    volatile uint32_t locked;
+    struct thread*    owner;
+    wait_queue_t      wq;
+    uint64_t          contended;    /* acquisitions that had to sleep */
+} mutex_t;
+
+#define MUTEX_INIT { 0, 0, WAIT_QUEUE_INIT, 0 }
+
+void mutex_init(mutex_t* m);
+void mutex_lock(mutex_t* m);
+bool mutex_trylock(mutex_t* m);
+void mutex_unlock(mutex_t* m);
+
+static inline bool mutex_is_locked(const mutex_t* m) {
+    return m->locked != 0;
+}
+
+/* Counting semaphore. */
+typedef struct {
+    volatile int64_t count;
+    wait_queue_t     wq;
+} semaphore_t;
+
+void sem_init(semaphore_t* s, int64_t count);
+void sem_down(semaphore_t* s);
+bool sem_trydown(semaphore_t* s);
+void sem_up(semaphore_t* s);
+
+/* Completion: waiters sleep until complete() has been called once for
+ * each of them, or complete_all() once for everyone (until reinit). */
+typedef struct {
+    volatile uint32_t done;
+    wait_queue_t      wq;
+} completion_t;
+
+#define COMPLETION_DONE_ALL 0x80000000u
+
+void completion_init(completion_t* c);
+void completion_reinit(completion_t* c);
+void wait_for_completion(completion_t* c);
+bool try_wait_for_completion(completion_t* c);
+void complete(completion_t* c);
+void complete_all(completion_t* c);
+
+/* Condition variable, used with a mutex the caller holds.  cond_wait()
+ * drops it while sleeping and takes it back before returning; wakeups may
+ * be spurious, so callers re-check their predicate in a loop. */
+typedef struct {
+    wait_queue_t wq;
+} condvar_t;
+
+void cond_init(condvar_t* cv);
+void cond_wait(condvar_t* cv, mutex_t* m);
+void cond_signal(condvar_t* cv);
+void cond_broadcast(condvar_t* cv);
@@ -33,9 +33,30 @@
 #define SYS_route_get 29
 #define SYS_route_add 30
 #define SYS_net_socket_get 31
+#define SYS_munmap 32
+#define SYS_nanosleep 33
+#define SYS_clock_nanosleep 34
+#define SYS_clock_gettime 35
+#define SYS_timer_slack 36
+#define SYS_nice 37
+#define SYS_sched_setscheduler 38
+#define SYS_sched_getscheduler 39
+#define SYS_sched_setaffinity 40
+#define SYS_sched_getaffinity 41
+#define SYS_clone 42
+#define SYS_futex 43
+#define SYS_set_tls 44
+#define SYS_gettid 45
+#define SYS_times 46
+#define SYS_getrusage 47
+#define SYS_sched_trace 48
 
 #define SYS_SEEK_SET 0
 #define SYS_SEEK_CUR 1
 #define SYS_SEEK_END 2
 
+#define SYS_CLOCK_REALTIME  0
+#define SYS_CLOCK_MONOTONIC 1
+#define SYS_TIMER_ABSTIME   0x1
+
 intr_frame_t* syscall_handle(intr_frame_t* frame);
@@ -3,6 +3,11 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "arch/x86_64/interrupts.h"
+#include "arch/x86_64/percpu.h"
+#include "rbtree.h"
+#include "timer.h"
+#include "hrtimer.h"
+#include "wait.h"
 
 typedef enum {
     THREAD_UNUSED = 0,
@@ -16,6 +21,32 @@ typedef enum {
 typedef struct vfs_file vfs_file_t;
 
 #define THREAD_MAX_OPEN_FILES 8
+#define THREAD_MMAP_HOLES     6
+
+/* Fair-class nice range; each step is ~10% CPU relative to a neighbour. */
+#define THREAD_NICE_MIN (-20)
+#define THREAD_NICE_MAX 19
+
+/* Scheduling policies, highest class last: deadline threads run before
+ * real-time ones (FIFO/RR by rt_priority), which run before SCHED_NORMAL. */
+#define SCHED_NORMAL      0
+#define SCHED_FIFO        1
+#define SCHED_RR          2
+#define SCHED_DEADLINE    3
+#define SCHED_RT_PRIO_MAX 99
+
+/* Default hrtimer slack: how late a sleep may end so wakeups batch. */
+#define THREAD_TIMER_SLACK_NS 50000
+
+/* CPU accounting (cputime.h); times in TSC cycles except wait_ns. */
+typedef struct {
+    uint64_t user_cycles;
+    uint64_t sys_cycles;
+    uint64_t irq_cycles;        /* in IRQ handlers that interrupted it */
+    uint64_t wait_ns;           /* runnable, queued for a CPU */
+    uint64_t nvcsw;             /* switched out blocking or sleeping */
+    uint64_t nivcsw;            /* preempted or yielded */
+} cputime_t;
 
 typedef struct thread {
     uint64_t id;
@@ -23,16 +54,46 @@ typedef struct thread {
 
     thread_state_t state;
     bool     is_user;
-    int      priority;
 
-    /* Simple parent/child tracking for wait/exit. */
+    /* Parent/child tracking for wait/exit.  children counts live (not yet
+     * exited) children; the child list also holds zombies until reaped. */
     struct thread* parent;
     uint32_t children;
     int      exit_code;
-
-    /* Waiting information (used when state == THREAD_BLOCKED). */
-    int      wait_target;
-    uint64_t wait_status_ptr;
+    struct thread* first_child;
+    struct thread* sibling_next;
+    struct thread* sibling_prev;
+
+    /* Thread group.  clone()d threads share their creator's address space
+     * and, through group_leader, its open files, brk and mmap state (see
+     * thread_proc()); proc_lock guards that state.  The leader's thread_t
+     * lives on until every member is destroyed (group_refs). */
+    struct thread* group_leader;
+    struct thread* group_next;      /* leader: the other members */
+    uint32_t group_refs;
+    spinlock_t proc_lock;
+
+    /* User TLS base (IA32_FS_BASE), and the user word clone() asked to be
+     * zeroed and futex-woken when the thread exits. */
+    uint64_t fs_base;
+    uint64_t clear_tid;
+
+    /* PID hash chain; reused as the free/dead list link once unhashed. */
+    struct thread* hash_next;
+
+    /* In-kernel wait (wait.h): the queue this thread is on and its links
+     * there.  in_wait spans the whole wait, wakeup included.  A kill that
+     * finds the thread on a CPU, waiting or otherwise inside the kernel is
+     * left in pending_kill for the way out.  Exiting children wake
+     * child_exit. */
+    wait_queue_t*  wq;
+    struct thread* wq_next;
+    struct thread* wq_prev;
+    bool     wq_exclusive;
+    bool     wq_killable;
+    bool     in_wait;
+    int      pending_kill;
+    wait_queue_t child_exit;
 
     /* Saved interrupt-frame stack pointer (points to r15 in intr_frame_t). */
     uint64_t rsp;
@@ -58,18 +119,84 @@ typedef struct thread {
     vfs_file_t* open_files[THREAD_MAX_OPEN_FILES];
     size_t      open_file_count;
 
-    /* Simple mmap base for anonymous mappings. */
+    /* Anonymous mappings go at mmap_base, which only grows, unless an
+     * unmapped stretch below it (size 0: unused slot) fits. */
     uint64_t mmap_base;
+    struct {
+        uint64_t base;
+        uint64_t size;
+    } mmap_holes[THREAD_MMAP_HOLES];
 
-    uint64_t wakeup_tick;
+    /* Fire scheduler_timer_wakeup() at the end of a tick / ns sleep. */
+    ktimer_t sleep_timer;
+    hrtimer_t hr_sleep;
+    uint64_t timer_slack_ns;
 
     uint32_t cpu_id;
 
+    /* Scheduling class; run_node sorts fair threads by vruntime and
+     * deadline threads by dl_abs_deadline, rt_next/rt_prev link real-time
+     * threads into their priority's FIFO. */
+    uint8_t  policy;
+    uint8_t  rt_priority;
+    rb_node_t run_node;
+    struct thread* rt_next;
+    struct thread* rt_prev;
+    bool     on_rq;
+
+    /* SCHED_DEADLINE reservation (ns) and constant-bandwidth-server state:
+     * runtime left in the current period, and throttling until dl_timer
+     * replenishes it. */
+    uint64_t dl_runtime;
+    uint64_t dl_deadline;
+    uint64_t dl_period;
+    uint64_t dl_bw;
+    uint64_t dl_abs_deadline;
+    int64_t  dl_remaining;
+    bool     dl_throttled;
+    hrtimer_t dl_timer;
+
+    /* Fair class: weight from nice, weighted virtual runtime and real CPU
+     * time (ns). */
+    int      nice;
+    uint32_t weight;
+    uint64_t vruntime;
+    uint64_t sum_exec_ns;
+    uint64_t exec_start;        /* last accounted, while running */
+    uint64_t slice_start_ns;    /* sum_exec_ns when its current slice began */
+
+    /* Accounting: the thread's own, and on a group leader the totals of
+     * its exited members and of its reaped children (with theirs).
+     * wait_start: when it was last queued runnable, 0 once picked. */
+    cputime_t cpu;
+    cputime_t cpu_dead;
+    cputime_t cpu_children;
+    uint64_t  wait_start;
+
+    /* Load balancing: allowed CPUs, executing now, last switch-out tick. */
+    uint64_t cpu_affinity;
+    bool     on_cpu;
+    uint64_t last_ran_tick;
+    uint64_t nr_migrations;
+
+    /* Extended (x87/SSE/AVX) state; allocated on first FPU use. */
+    uint8_t* fpu_area;
+    uint32_t fpu_last_cpu;
+
     /* For kernel thread trampoline */
     void (*kentry)(void*);
     void* karg;
 } thread_t;
 
-thread_t* thread_current(void);
+/* One %gs-relative load; the scheduler keeps percpu->current up to date. */
+static inline thread_t* thread_current(void) {
+    return (thread_t*)this_cpu_current();
+}
+
+/* The thread holding t's process-wide state: t, or its group leader. */
+static inline thread_t* thread_proc(thread_t* t) {
+    return t->group_leader ? t->group_leader : t;
+}
+
 void thread_kstack_canary_init(thread_t* t);
 bool thread_kstack_canary_ok(const thread_t* t);
@@ -0,0 +1,39 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Scheduler tick rate; build with HZ=<n> to change it. */
+#ifndef HZ
+#define HZ 100
+#endif
+
+/*
+ * Timer events.  Each CPU's local APIC timer is armed one-shot (or with a
+ * TSC deadline) for the next tick that CPU needs, so idle CPUs and CPUs
+ * running a single thread take no tick at all.  Without a usable local
+ * APIC timer the PIT on the BSP is armed for the earliest event any CPU
+ * needs and due CPUs get a RESCHED IPI.  Build with TICK_PERIODIC=1 to
+ * keep a fixed per-CPU tick instead.
+ */
+
+/* Calibrate and start timer events (BSP, after smp_init and tsc_init). */
+void tick_init(void);
+
+/* IRQ0 on the BSP. */
+void tick_handle_irq(void);
+
+/* Local APIC timer interrupt on the calling CPU. */
+void tick_handle_timer(void);
+
+/* Arm the calling CPU's next event for tick `when` (UINT64_MAX: none), or
+ * for its earliest hrtimer deadline if that comes first.  Called from
+ * schedule() with the CPU's runqueue lock held. */
+void tick_rearm(uint64_t when);
+
+/* Tick the next event on cpu is armed for; read under cpu's runqueue lock. */
+uint64_t tick_armed(uint32_t cpu);
+
+/* Make sure cpu takes a timer event no later than tick `when`. */
+void tick_request(uint32_t cpu, uint64_t when);
+
+bool tick_is_dynamic(void);
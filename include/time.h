@@ -6,7 +6,27 @@ typedef struct {
     uint64_t tv_usec;
 } time_val_t;
 
+typedef struct {
+    int64_t tv_sec;
+    int64_t tv_nsec;
+} time_spec_t;
+
+/* times(): CPU time in clock ticks of TIME_CLK_TCK per second, fixed
+ * whatever the kernel's HZ. */
+typedef struct {
+    uint64_t tms_utime;
+    uint64_t tms_stime;     /* includes IRQ time */
+    uint64_t tms_cutime;
+    uint64_t tms_cstime;
+} time_tms_t;
+
+#define TIME_NS_PER_SEC 1000000000ull
+#define TIME_CLK_TCK    100
+
 void time_init(void);
 void time_gettimeofday(time_val_t* out);
 uint64_t time_now_ms(void);
 uint64_t time_now_ns(void);
+
+/* Wall-clock nanoseconds since the epoch (RTC at boot + monotonic). */
+uint64_t time_realtime_ns(void);
@@ -0,0 +1,42 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+
+/*
+ * Kernel timers on a per-CPU hierarchical timing wheel (tick resolution).
+ * Add, cancel and expiry are O(1); far timers are cascaded into finer
+ * levels as their time approaches.  Callbacks run from schedule() on the
+ * CPU the timer was added on, with interrupts off, and must not block.
+ */
+
+typedef void (*ktimer_fn_t)(void* arg);
+
+typedef struct ktimer {
+    struct ktimer*  next;
+    struct ktimer** pprev;      /* non-null while pending */
+    uint64_t        expires;    /* absolute tick */
+    ktimer_fn_t     fn;
+    void*           arg;
+    uint32_t        cpu;
+} ktimer_t;
+
+void timer_init(void);
+
+void ktimer_init(ktimer_t* t, ktimer_fn_t fn, void* arg);
+
+/* (Re)arm t to fire at tick `expires` on the calling CPU. */
+void ktimer_add(ktimer_t* t, uint64_t expires);
+
+/* Disarm t.  Returns true if it was pending; if its callback is running
+ * on another CPU, waits for it to finish first. */
+bool ktimer_cancel(ktimer_t* t);
+
+static inline bool ktimer_pending(const ktimer_t* t) {
+    return t->pprev != 0;
+}
+
+/* Run the calling CPU's expired timers (scheduler). */
+void timer_run(uint64_t now);
+
+/* Lower bound on cpu's earliest pending expiry; UINT64_MAX when none. */
+uint64_t timer_next_expiry(uint32_t cpu);
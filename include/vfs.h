@@ -2,6 +2,7 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "rcu.h"
 
 typedef struct vfs_node vfs_node_t;
 typedef struct vfs_file vfs_file_t;
@@ -29,8 +30,11 @@ struct vfs_node {
     void* data;
     vfs_node_ops_t* ops;
     vfs_node_t* parent;
+    /* Sibling list: lookups walk it under rcu_read_lock(); changes go
+     * through vfs_add_child()/vfs_remove_child(). */
     vfs_node_t* children;
     vfs_node_t* next;
+    rcu_head_t  rcu;        /* deferred free after unlink */
 };
 
 struct vfs_file {
@@ -55,6 +59,8 @@ void vfs_set_cwd(vfs_node_t* node);
 vfs_node_t* vfs_create_node(const char* name, vfs_node_type_t type, vfs_node_ops_t* ops, void* data);
 int vfs_add_child(vfs_node_t* parent, vfs_node_t* child);
 vfs_node_t* vfs_find_child(vfs_node_t* parent, const char* name);
+/* Unlinks child; readers may still see it until a grace period ends,
+ * so free it with call_rcu() on child->rcu. */
 int vfs_remove_child(vfs_node_t* parent, vfs_node_t* child);
 
 vfs_node_t* vfs_resolve(const char* path, vfs_node_t* cwd);
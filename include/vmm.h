@@ -30,5 +30,16 @@ bool vmm_map_range(uint64_t cr3, uint64_t virt, uint64_t phys, size_t size, uint
 uint64_t vmm_unmap_page(uint64_t cr3, uint64_t virt);
 bool vmm_resolve(uint64_t cr3, uint64_t virt, uint64_t* out_phys, uint64_t* out_flags);
 
+/* Unmap [virt, virt + size) from a user space and free its frames once no
+ * other CPU running that space can still reach them through its TLB.
+ * Ranges outside the user region are ignored. */
+void vmm_unmap_user_range(uint64_t cr3, uint64_t virt, uint64_t size);
+
+/* Load cr3 on this CPU. */
+void vmm_activate(uint64_t cr3);
+
+/* APIC_TLB_VECTOR: flush this CPU's TLB and acknowledge. */
+void vmm_tlb_ipi(void);
+
 /* Simple heap grow/shrink for user brk handling. */
 bool vmm_user_set_brk(struct thread* t, uint64_t new_end);
@@ -0,0 +1,57 @@
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "arch/x86_64/spinlock.h"
+
+/*
+ * Wait queues: a thread that cannot make progress puts itself on a queue,
+ * turns BLOCKED and gives up its CPU; whoever changes the condition it
+ * waits for calls wake_up() on the queue.  Waiters are linked through
+ * their thread_t (a thread waits on one queue at a time).  Wakers may run
+ * in IRQ handlers; the queue lock is always taken with interrupts off.
+ *
+ * Exclusive waiters (locks, semaphores) are woken one per wake_up();
+ * everyone else is woken every time.
+ */
+
+struct thread;
+
+typedef struct wait_queue {
+    spinlock_t     lock;
+    struct thread* head;
+    struct thread* tail;
+} wait_queue_t;
+
+#define WAIT_QUEUE_INIT { SPINLOCK_INIT, 0, 0 }
+
+/* wait_until() flags. */
+#define WAIT_EXCLUSIVE 0x1   /* woken one at a time, FIFO */
+#define WAIT_KILLABLE  0x2   /* a kill ends the wait early */
+
+/* Re-checked after every wakeup, without the queue lock held. */
+typedef bool (*wait_cond_t)(void* arg);
+
+void wait_queue_init(wait_queue_t* wq);
+
+/* Block until cond(arg) holds.  Returns 0, or -1 if WAIT_KILLABLE and the
+ * thread was killed meanwhile.  Contexts that cannot sleep (the boot/idle
+ * thread) spin on the condition instead. */
+int wait_until(wait_queue_t* wq, wait_cond_t cond, void* arg, uint32_t flags);
+
+/* Low-level halves of wait_until() for callers that must drop a lock of
+ * their own between queueing and sleeping (condition variables):
+ * wait_prepare() queues the current thread and marks it BLOCKED,
+ * wait_sleep() gives up the CPU unless a wakeup already came, and
+ * wait_finish() leaves the queue and makes the thread RUNNING again. */
+void wait_prepare(wait_queue_t* wq, uint32_t flags);
+void wait_sleep(void);
+void wait_finish(wait_queue_t* wq);
+
+/* Wake every non-exclusive waiter and the first exclusive one / everyone.
+ * Return the number of threads taken off the queue. */
+uint32_t wake_up(wait_queue_t* wq);
+uint32_t wake_up_all(wait_queue_t* wq);
+
+static inline bool wait_queue_active(const wait_queue_t* wq) {
+    return wq->head != 0;
+}
@@ -1,7 +1,9 @@
 #include "arch/x86_64/apic.h"
 #include "arch/x86_64/common.h"
 #include "arch/x86_64/cpu.h"
+#include "arch/x86_64/pit.h"
 #include "console.h"
+#include "log.h"
 
 #define APIC_MSR_BASE 0x1B
 
@@ -14,6 +16,21 @@
 #define APIC_REG_LVT_LINT1 0x360
 #define APIC_REG_ICR_LOW 0x300
 #define APIC_REG_ICR_HIGH 0x310
+#define APIC_REG_LVT_TIMER 0x320
+#define APIC_REG_TIMER_INIT 0x380
+#define APIC_REG_TIMER_CUR  0x390
+#define APIC_REG_TIMER_DIV  0x3E0
+
+#define APIC_MSR_TSC_DEADLINE 0x6E0
+
+#define APIC_LVT_MASKED          (1u << 16)
+#define APIC_TIMER_ONESHOT       (0u << 17)
+#define APIC_TIMER_PERIODIC      (1u << 17)
+#define APIC_TIMER_TSC_DEADLINE  (2u << 17)
+#define APIC_TIMER_DIV_16        0x3u
+
+#define APIC_CAL_MS        10
+#define APIC_CAL_MAX_SPINS 50000000ull
 
 #define APIC_ICR_DELIV_STATUS (1u << 12)
 #define APIC_ICR_LEVEL_ASSERT (1u << 14)
@@ -22,6 +39,9 @@
 
 static volatile uint32_t* g_apic = 0;
 
+/* Timer input clock after the divide-by-16, measured on the BSP. */
+static uint64_t g_timer_hz = 0;
+
 static inline void apic_write(uint32_t reg, uint32_t val) {
     g_apic[reg / 4] = val;
     (void)g_apic[reg / 4];
@@ -50,6 +70,8 @@ static void apic_init_common(void) {
 
     apic_write(APIC_REG_LVT_LINT0, 1U << 16);
     apic_write(APIC_REG_LVT_LINT1, 1U << 16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED | APIC_TIMER_VECTOR);
+    apic_write(APIC_REG_TIMER_INIT, 0);
 
     apic_write(APIC_REG_SVR, APIC_SPURIOUS_VECTOR | 0x100U);
 }
@@ -91,9 +113,94 @@ void apic_send_sipi(uint32_t apic_id_value, uint8_t vector) {
     apic_wait_icr();
 }
 
+void apic_send_ipi(uint32_t apic_id_value, uint8_t vector) {
+    if (!g_apic) return;
+    apic_wait_icr();
+    apic_write(APIC_REG_ICR_HIGH, apic_id_value << 24);
+    apic_write(APIC_REG_ICR_LOW, vector);
+    apic_wait_icr();
+}
+
 void apic_send_ipi_all(uint8_t vector) {
     apic_wait_icr();
     apic_write(APIC_REG_ICR_HIGH, 0);
     apic_write(APIC_REG_ICR_LOW, vector | APIC_ICR_DEST_ALL_EXCL);
     apic_wait_icr();
 }
+
+/* Free-run the (masked) timer from its maximum count across a known
+ * interval: APIC_CAL_MS of TSC if calibrated, else a PIT channel 2 countdown. */
+bool apic_timer_calibrate(uint64_t tsc_hz) {
+    if (!g_apic) return false;
+    apic_write(APIC_REG_TIMER_DIV, APIC_TIMER_DIV_16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_LVT_MASKED | APIC_TIMER_ONESHOT | APIC_TIMER_VECTOR);
+
+    uint64_t spins = 0;
+    if (tsc_hz) {
+        uint64_t wait = tsc_hz / (1000 / APIC_CAL_MS);
+        uint64_t start = rdtsc();
+        apic_write(APIC_REG_TIMER_INIT, 0xFFFFFFFFu);
+        while (rdtsc() - start < wait) cpu_pause();
+    } else {
+        pit_ch2_start((uint16_t)(PIT_BASE_HZ / (1000 / APIC_CAL_MS)));
+        apic_write(APIC_REG_TIMER_INIT, 0xFFFFFFFFu);
+        while (!pit_ch2_expired()) {
+            if (++spins > APIC_CAL_MAX_SPINS) break;
+        }
+    }
+    uint32_t left = apic_read(APIC_REG_TIMER_CUR);
+    apic_write(APIC_REG_TIMER_INIT, 0);
+
+    if (spins > APIC_CAL_MAX_SPINS || left == 0) {
+        log_warn("apic: timer calibration failed\n");
+        return false;
+    }
+    g_timer_hz = (uint64_t)(0xFFFFFFFFu - left) * (1000 / APIC_CAL_MS);
+    log_info("apic: timer %llu kHz%s\n", (unsigned long long)(g_timer_hz / 1000),
+             cpu_has_feature(CPU_FEAT_TSC_DEADLINE) ? ", TSC-deadline capable" : "");
+    return g_timer_hz != 0;
+}
+
+uint64_t apic_timer_hz(void) {
+    return g_timer_hz;
+}
+
+void apic_timer_periodic(uint32_t hz) {
+    if (!g_apic || !g_timer_hz || hz == 0) return;
+    uint64_t count = g_timer_hz / hz;
+    if (count == 0) count = 1;
+    if (count > 0xFFFFFFFFu) count = 0xFFFFFFFFu;
+    apic_write(APIC_REG_TIMER_DIV, APIC_TIMER_DIV_16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_TIMER_PERIODIC | APIC_TIMER_VECTOR);
+    apic_write(APIC_REG_TIMER_INIT, (uint32_t)count);
+}
+
+void apic_timer_oneshot(uint64_t ns) {
+    if (!g_apic || !g_timer_hz) return;
+    uint64_t count = ((ns + 999) / 1000) * g_timer_hz / 1000000ull;
+    if (count == 0) count = 1;
+    if (count > 0xFFFFFFFFu) count = 0xFFFFFFFFu;
+    apic_write(APIC_REG_TIMER_DIV, APIC_TIMER_DIV_16);
+    apic_write(APIC_REG_LVT_TIMER, APIC_TIMER_ONESHOT | APIC_TIMER_VECTOR);
+    apic_write(APIC_REG_TIMER_INIT, (uint32_t)count);
+}
+
+void apic_timer_deadline_mode(void) {
+    if (!g_apic) return;
+    apic_write(APIC_REG_LVT_TIMER, APIC_TIMER_TSC_DEADLINE | APIC_TIMER_VECTOR);
+    /* The LVT write must land before the first IA32_TSC_DEADLINE write. */
+    __asm__ volatile("mfence" ::: "memory");
+}
+
+void apic_timer_deadline(uint64_t tsc) {
+    write_msr(APIC_MSR_TSC_DEADLINE, tsc ? tsc : 1);
+}
+
+void apic_timer_stop(void) {
+    if (!g_apic) return;
+    if ((apic_read(APIC_REG_LVT_TIMER) & (3u << 17)) == APIC_TIMER_TSC_DEADLINE) {
+        write_msr(APIC_MSR_TSC_DEADLINE, 0);
+    } else {
+        apic_write(APIC_REG_TIMER_INIT, 0);
+    }
+}
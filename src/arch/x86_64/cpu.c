@@ -1,15 +1,17 @@
 #include "arch/x86_64/cpu.h"
 #include "arch/x86_64/apic.h"
+#include "arch/x86_64/common.h"
+#include "arch/x86_64/percpu.h"
 #include "lib.h"
 
 static cpu_info_t g_cpus[MAX_CPUS];
 static uint32_t g_cpu_count = 0;
 static uint32_t g_online_count = 0;
 static uint32_t g_bsp_id = 0;
-static bool g_apic_ready = false;
+static uint32_t g_features = 0;
 
 void cpu_set_apic_ready(bool ready) {
-    g_apic_ready = ready;
+    this_cpu()->apic_id = ready ? apic_id() : 0;
 }
 
 void cpu_init_bsp(uint32_t apic_id) {
@@ -59,20 +61,76 @@ uint32_t cpu_online_count(void) {
     return g_online_count ? g_online_count : 1;
 }
 
+uint64_t cpu_online_mask(void) {
+    uint64_t mask = 0;
+    for (uint32_t i = 0; i < g_cpu_count; i++) {
+        if (g_cpus[i].present && g_cpus[i].online) mask |= 1ULL << i;
+    }
+    return mask ? mask : 1ULL << g_bsp_id;
+}
+
 uint32_t cpu_apic_id(uint32_t cpu_id) {
     if (cpu_id >= g_cpu_count) return g_cpus[g_bsp_id].apic_id;
     return g_cpus[cpu_id].apic_id;
 }
 
-static uint32_t cpu_index_for_apic(uint32_t apic_id) {
-    for (uint32_t i = 0; i < g_cpu_count; i++) {
-        if (g_cpus[i].present && g_cpus[i].apic_id == apic_id) return i;
+void cpu_detect_features(void) {
+    uint32_t max_leaf = 0;
+    uint32_t b = 0, d = 0;
+    g_features = 0;
+
+    cpuid(0, 0, &max_leaf, 0, 0, 0);
+    if (max_leaf >= 1) {
+        uint32_t c = 0;
+        cpuid(1, 0, 0, 0, &c, 0);
+        if (c & (1u << 3)) g_features |= CPU_FEAT_MWAIT;
+        if (c & (1u << 24)) g_features |= CPU_FEAT_TSC_DEADLINE;
+        if (c & (1u << 26)) g_features |= CPU_FEAT_XSAVE;
+        if (c & (1u << 28)) g_features |= CPU_FEAT_AVX;
+    }
+    if (max_leaf >= 7) {
+        cpuid(7, 0, 0, &b, 0, &d);
+        if (b & (1u << 9)) g_features |= CPU_FEAT_ERMS;
+        if (d & (1u << 4)) g_features |= CPU_FEAT_FSRM;
+    }
+
+    uint32_t max_ext = 0;
+    cpuid(0x80000000u, 0, &max_ext, 0, 0, 0);
+    if (max_ext >= 0x80000007u) {
+        cpuid(0x80000007u, 0, 0, 0, 0, &d);
+        if (d & (1u << 8)) g_features |= CPU_FEAT_TSC_INVARIANT;
     }
-    return g_bsp_id;
 }
 
-uint32_t cpu_current_id(void) {
-    if (!g_apic_ready) return g_bsp_id;
-    uint32_t apic = apic_id();
-    return cpu_index_for_apic(apic);
+bool cpu_has_feature(uint32_t feature) {
+    return (g_features & feature) == feature;
+}
+
+#define CR0_MP         (1ull << 1)
+#define CR0_EM         (1ull << 2)
+#define CR0_NE         (1ull << 5)
+#define CR4_OSFXSR     (1ull << 9)
+#define CR4_OSXMMEXCPT (1ull << 10)
+#define CR4_OSXSAVE    (1ull << 18)
+
+#define XCR0_X87 (1ull << 0)
+#define XCR0_SSE (1ull << 1)
+#define XCR0_AVX (1ull << 2)
+
+void cpu_init_fpu(void) {
+    write_cr0((read_cr0() & ~CR0_EM) | CR0_MP | CR0_NE);
+
+    uint64_t cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (cpu_has_feature(CPU_FEAT_XSAVE)) cr4 |= CR4_OSXSAVE;
+    write_cr4(cr4);
+
+    if (cpu_has_feature(CPU_FEAT_XSAVE)) {
+        uint64_t xcr0 = XCR0_X87 | XCR0_SSE;
+        if (cpu_has_feature(CPU_FEAT_AVX)) xcr0 |= XCR0_AVX;
+        xsetbv(0, xcr0);
+    }
+    __asm__ volatile ("fninit");
+
+    /* Nobody owns the FPU yet: first use traps to fpu_handle_nm(). */
+    write_cr0(read_cr0() | (1ull << 3));
 }
@@ -0,0 +1,207 @@
+#include "arch/x86_64/fpu.h"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/common.h"
+#include "thread.h"
+#include "pmm.h"
+#include "lib.h"
+#include "log.h"
+#include "procfs.h"
+
+#define CR0_TS (1ull << 3)
+
+/* Legacy FXSAVE region offsets used to build the init image. */
+#define FXSAVE_FCW   0
+#define FXSAVE_MXCSR 24
+#define FXSAVE_SIZE  512
+
+typedef enum {
+    FPU_MODE_FXSAVE,
+    FPU_MODE_XSAVE,
+    FPU_MODE_XSAVEOPT,
+} fpu_mode_t;
+
+typedef struct {
+    uint64_t saves;    /* state written to memory (switch-out, fork) */
+    uint64_t restores; /* state loaded from memory (#NM) */
+    uint64_t reuses;   /* switch-ins whose state was still in the registers */
+    uint64_t allocs;   /* first-use area allocations */
+} fpu_stats_t;
+
+static fpu_mode_t g_mode = FPU_MODE_FXSAVE;
+static uint32_t g_area_size = FXSAVE_SIZE;
+static size_t g_area_pages = 1;
+
+/* Per CPU: whose state the registers hold, and whether CR0.TS is clear
+ * (i.e. the running thread may be modifying them). */
+static thread_t* g_owner[MAX_CPUS];
+static bool g_active[MAX_CPUS];
+static fpu_stats_t g_stats[MAX_CPUS];
+
+static const char* mode_name(void) {
+    switch (g_mode) {
+        case FPU_MODE_XSAVEOPT: return "xsaveopt";
+        case FPU_MODE_XSAVE: return "xsave";
+        default: return "fxsave";
+    }
+}
+
+static inline void set_ts(void) {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static inline void clear_ts(void) {
+    __asm__ volatile ("clts");
+}
+
+/* XSAVEOPT skips components that are unmodified since the last XRSTOR from
+ * the same area or still in their init state. */
+static void area_save(uint8_t* area) {
+    switch (g_mode) {
+        case FPU_MODE_XSAVEOPT:
+            __asm__ volatile ("xsaveopt64 (%0)" : : "r"(area), "a"(0xFFFFFFFFu), "d"(0xFFFFFFFFu) : "memory");
+            break;
+        case FPU_MODE_XSAVE:
+            __asm__ volatile ("xsave64 (%0)" : : "r"(area), "a"(0xFFFFFFFFu), "d"(0xFFFFFFFFu) : "memory");
+            break;
+        default:
+            __asm__ volatile ("fxsave64 (%0)" : : "r"(area) : "memory");
+            break;
+    }
+}
+
+static void area_restore(const uint8_t* area) {
+    if (g_mode == FPU_MODE_FXSAVE) {
+        __asm__ volatile ("fxrstor64 (%0)" : : "r"(area) : "memory");
+    } else {
+        __asm__ volatile ("xrstor64 (%0)" : : "r"(area), "a"(0xFFFFFFFFu), "d"(0xFFFFFFFFu) : "memory");
+    }
+}
+
+/* Init image: default control words; an all-zero XSAVE header makes XRSTOR
+ * put every other component in its init state. */
+static void area_init(uint8_t* area) {
+    memset(area, 0, g_area_size);
+    *(uint16_t*)(area + FXSAVE_FCW) = 0x037F;
+    *(uint32_t*)(area + FXSAVE_MXCSR) = 0x1F80;
+}
+
+static void forget_owner(thread_t* t) {
+    for (uint32_t c = 0; c < MAX_CPUS; c++) {
+        if (g_owner[c] == t) g_owner[c] = 0;
+    }
+}
+
+static size_t fpu_proc_show(char* buf, size_t size) {
+    fpu_stats_t sum = {0};
+    for (uint32_t c = 0; c < MAX_CPUS; c++) {
+        sum.saves += g_stats[c].saves;
+        sum.restores += g_stats[c].restores;
+        sum.reuses += g_stats[c].reuses;
+        sum.allocs += g_stats[c].allocs;
+    }
+    return (size_t)ksnprintf(buf, size,
+                             "mode: %s\narea_bytes: %u\nsaves: %llu\nrestores: %llu\nreuses: %llu\nareas: %llu\n",
+                             mode_name(), g_area_size,
+                             (unsigned long long)sum.saves, (unsigned long long)sum.restores,
+                             (unsigned long long)sum.reuses, (unsigned long long)sum.allocs);
+}
+
+void fpu_init(void) {
+    if (cpu_has_feature(CPU_FEAT_XSAVE)) {
+        uint32_t size = 0, sub1 = 0;
+        /* EBX = bytes needed for the components enabled in XCR0. */
+        cpuid(0xD, 0, 0, &size, 0, 0);
+        if (size >= FXSAVE_SIZE + 64) {
+            g_area_size = size;
+            g_mode = FPU_MODE_XSAVE;
+            cpuid(0xD, 1, &sub1, 0, 0, 0);
+            if (sub1 & 1u) g_mode = FPU_MODE_XSAVEOPT;
+        }
+    }
+    g_area_pages = (size_t)(align_up_u64(g_area_size, PAGE_SIZE) / PAGE_SIZE);
+    procfs_register("fpu", fpu_proc_show);
+    log_info("fpu: %s, %u-byte state, lazy switching\n", mode_name(), g_area_size);
+}
+
+void fpu_switch(thread_t* prev, thread_t* next, uint32_t cpu) {
+    if (cpu >= MAX_CPUS) return;
+
+    if (g_active[cpu]) {
+        /* prev owns the registers and may have changed them. */
+        if (prev->state != THREAD_ZOMBIE && prev->fpu_area) {
+            area_save(prev->fpu_area);
+            prev->fpu_last_cpu = cpu;
+            g_stats[cpu].saves++;
+        } else {
+            g_owner[cpu] = 0;
+        }
+    }
+
+    if (next->fpu_area && g_owner[cpu] == next && next->fpu_last_cpu == cpu) {
+        if (!g_active[cpu]) clear_ts();
+        g_active[cpu] = true;
+        g_stats[cpu].reuses++;
+        return;
+    }
+
+    /* Threads that never touch the FPU leave TS set and pay nothing. */
+    if (g_active[cpu]) {
+        set_ts();
+        g_active[cpu] = false;
+    }
+}
+
+bool fpu_handle_nm(void) {
+    thread_t* cur = thread_current();
+    uint32_t cpu = cpu_current_id();
+    if (!cur || cpu >= MAX_CPUS) return false;
+
+    if (!cur->fpu_area) {
+        cur->fpu_area = (uint8_t*)(uintptr_t)pmm_alloc_pages(g_area_pages);
+        if (!cur->fpu_area) return false;
+        area_init(cur->fpu_area);
+        g_stats[cpu].allocs++;
+    }
+
+    clear_ts();
+    area_restore(cur->fpu_area);
+    g_owner[cpu] = cur;
+    g_active[cpu] = true;
+    cur->fpu_last_cpu = cpu;
+    g_stats[cpu].restores++;
+    return true;
+}
+
+bool fpu_fork(thread_t* child, thread_t* parent) {
+    child->fpu_area = 0;
+    if (!parent->fpu_area) return true;
+
+    /* Flush the parent's live registers so the copy is current. */
+    uint32_t cpu = cpu_current_id();
+    if (cpu < MAX_CPUS && g_active[cpu] && g_owner[cpu] == parent) {
+        area_save(parent->fpu_area);
+        parent->fpu_last_cpu = cpu;
+        g_stats[cpu].saves++;
+    }
+
+    child->fpu_area = (uint8_t*)(uintptr_t)pmm_alloc_pages(g_area_pages);
+    if (!child->fpu_area) return false;
+    memcpy(child->fpu_area, parent->fpu_area, g_area_size);
+    if (cpu < MAX_CPUS) g_stats[cpu].allocs++;
+    return true;
+}
+
+void fpu_release(thread_t* t) {
+    if (!t) return;
+    forget_owner(t);
+
+    uint32_t cpu = cpu_current_id();
+    if (t == thread_current() && cpu < MAX_CPUS && g_active[cpu]) {
+        set_ts();
+        g_active[cpu] = false;
+    }
+    if (t->fpu_area) {
+        pmm_free_pages((uint64_t)(uintptr_t)t->fpu_area, g_area_pages);
+        t->fpu_area = 0;
+    }
+}
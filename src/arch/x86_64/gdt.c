@@ -3,7 +3,7 @@
 #include "console.h"
 #include "lib.h"
 
-typedef struct {
+typedef struct tss {
     uint32_t reserved0;
     uint64_t rsp0;
     uint64_t rsp1;
@@ -48,9 +48,9 @@ static void set_tss_descriptor(uint64_t* gdt, uint64_t base, uint32_t limit) {
 }
 
 void tss_set_rsp0(uint64_t rsp0) {
-    uint32_t cpu_id = cpu_current_id();
-    if (cpu_id >= MAX_CPUS) cpu_id = 0;
-    tss_tables[cpu_id].rsp0 = rsp0;
+    tss_t* tss = this_cpu()->tss;
+    if (!tss) tss = &tss_tables[0];
+    tss->rsp0 = rsp0;
 }
 
 void gdt_init_cpu(uint32_t cpu_id) {
@@ -61,6 +61,7 @@ void gdt_init_cpu(uint32_t cpu_id) {
 
     memset(gdt, 0, sizeof(gdt_tables[cpu_id]));
     memset(tss, 0, sizeof(tss_tables[cpu_id]));
+    percpu_of(cpu_id)->tss = tss;
 
     /* Kernel code/data */
     gdt[1] = 0x00AF9A000000FFFFULL;
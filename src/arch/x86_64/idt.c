@@ -47,7 +47,8 @@ void idt_init(void) {
         idt_set_gate(i, isr_stub_table[i], 0x8E, ist);
     }
 
-    /* Syscall (int 0x80): DPL=3 so user mode can invoke. */
+    /* Syscall (int 0x80): DPL=3 so user mode can invoke.  PREEMPT_VECTOR
+     * (0x81) stays DPL=0: only the kernel may preempt itself. */
     idt_set_gate(0x80, isr_stub_table[0x80], 0xEE, 0);
 
     idt_ptr_t idtr = {
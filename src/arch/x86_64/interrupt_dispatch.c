@@ -4,11 +4,20 @@
 #include "arch/x86_64/pic.h"
 #include "arch/x86_64/pit.h"
 #include "arch/x86_64/apic.h"
+#include "arch/x86_64/fpu.h"
+#include "arch/x86_64/percpu.h"
+#include "arch/x86_64/preempt.h"
 #include "console.h"
 #include "gdb.h"
 #include "scheduler.h"
 #include "thread.h"
 #include "syscall.h"
+#include "tick.h"
+#include "cputime.h"
+#include "kstack.h"
+#include "idle.h"
+#include "vmm.h"
+#include "rcu.h"
 
 static const char* exc_name(uint64_t n) {
     switch (n) {
@@ -93,8 +102,21 @@ static void log_current_thread(void) {
     console_write(")");
 }
 
-intr_frame_t* interrupt_dispatch(intr_frame_t* frame) {
+static intr_frame_t* dispatch(intr_frame_t* frame) {
     thread_t* cur = thread_current();
+
+    /* A push into a stack's guard page faults, and the #PF frame cannot be
+     * pushed either: we get here on the double-fault IST stack. */
+    if (frame->int_no == 8 && kstack_guard_hit(read_cr2())) {
+        console_write("\n[STACK] kernel stack overflow, guard page hit at ");
+        console_write_hex64(read_cr2());
+        log_current_thread();
+        console_write("\n");
+        dump_frame(frame);
+        console_write("[PANIC] kernel stack overflow, halting.\n");
+        for (;;) { cpu_hlt(); }
+    }
+
     if (cur && cur->kstack && cur->kstack_size >= sizeof(uint64_t)) {
         uint64_t actual = *(uint64_t*)(uintptr_t)cur->kstack;
         if (actual != cur->kstack_canary) {
@@ -117,10 +139,17 @@ intr_frame_t* interrupt_dispatch(intr_frame_t* frame) {
 
     uint64_t n = frame->int_no;
 
+    if (n == 0x80) PERCPU_INC64(syscall_count);
+    else if (n >= 32 && n != PREEMPT_VECTOR) {
+        PERCPU_INC64(irq_count);
+        idle_irq_enter();
+    }
+
     /* IRQs (PIC remapped to 32-47) */
     if (n >= 32 && n <= 47) {
         uint8_t irq = (uint8_t)(n - 32);
 
+        cputime_irq_enter();
         irq_enter(irq);
         if (irq == 0) {
             pit_handle_irq0();
@@ -130,6 +159,7 @@ intr_frame_t* interrupt_dispatch(intr_frame_t* frame) {
 
         cpu_cli();
         pic_send_eoi(irq);
+        cputime_irq_exit();
 
         if (irq == 0) {
             intr_frame_t* next = scheduler_on_tick(frame);
@@ -138,21 +168,48 @@ intr_frame_t* interrupt_dispatch(intr_frame_t* frame) {
         }
 
         irq_exit();
+        /* A handler may have woken a thread that should run now; not from
+         * inside another handler, whose masking is still in force. */
+        if (irq_nesting_level() == 0) return scheduler_preempt_check(frame);
         return frame;
     }
 
+    if (n == APIC_TIMER_VECTOR) {
+        cputime_irq_enter();
+        tick_handle_timer();
+        apic_eoi();
+        cputime_irq_exit();
+        return scheduler_on_tick(frame);
+    }
+
     if (n == APIC_RESCHED_VECTOR) {
         apic_eoi();
         return scheduler_on_tick(frame);
     }
 
+    if (n == APIC_TLB_VECTOR) {
+        apic_eoi();
+        vmm_tlb_ipi();
+        return frame;
+    }
+
     if (n == APIC_SPURIOUS_VECTOR) {
         return frame;
     }
 
+    /* preempt_schedule(): kernel code found need_resched set. */
+    if (n == PREEMPT_VECTOR) {
+        return scheduler_preempt_check(frame);
+    }
+
     /* Syscall */
     if (n == 0x80) {
-        return syscall_handle(frame);
+        return scheduler_preempt_check(syscall_handle(frame));
+    }
+
+    /* Lazy FPU: first FPU/SSE use since the last switch. */
+    if (n == 7 && fpu_handle_nm()) {
+        return frame;
     }
 
     if (n == 1 || n == 3) {
@@ -205,3 +262,23 @@ intr_frame_t* interrupt_dispatch(intr_frame_t* frame) {
     console_write("[PANIC] kernel exception, halting.\n");
     for (;;) { cpu_hlt(); }
 }
+
+/* Entered from isr_common_stub; returns the frame to resume, which after
+ * a context switch belongs to another thread. */
+intr_frame_t* interrupt_dispatch(intr_frame_t* frame) {
+    uint64_t n = frame->int_no;
+    bool hardirq = n >= 32 && n != 0x80 && n != PREEMPT_VECTOR;
+    if ((frame->cs & 3) == 3) {
+        /* User code holds no RCU references: a quiescent state even on a
+         * CPU whose tick has stopped. */
+        rcu_note_qs(this_cpu()->cpu_id);
+        cputime_user_exit();
+    }
+    if (hardirq) preempt_irq_enter(n);
+    else if (n == 0x80) preempt_stat_begin(PREEMPT_SITE_SYSCALL | frame->rax);
+    intr_frame_t* out = dispatch(frame);
+    if (hardirq) preempt_irq_exit();
+    preempt_stat_resume(out);
+    if ((out->cs & 3) == 3) cputime_user_enter();
+    return out;
+}
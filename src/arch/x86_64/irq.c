@@ -96,6 +96,10 @@ void irq_exit(void) {
     }
 }
 
+uint8_t irq_nesting_level(void) {
+    return irq_nesting;
+}
+
 void irq_dispatch(uint8_t irq, intr_frame_t* frame) {
     if (irq >= IRQ_MAX) return;
     if (irq_handlers[irq]) {
@@ -0,0 +1,36 @@
+#include "arch/x86_64/percpu.h"
+#include "arch/x86_64/cpu.h"
+#include "thread.h"
+#include "procfs.h"
+#include "lib.h"
+
+percpu_t g_percpu[MAX_CPUS];
+
+void percpu_init(uint32_t cpu_id) {
+    if (cpu_id >= MAX_CPUS) cpu_id = 0;
+    percpu_t* p = &g_percpu[cpu_id];
+    p->self = p;
+    p->cpu_id = cpu_id;
+    p->acct_stamp = rdtsc();
+    write_msr(MSR_GS_BASE, (uint64_t)(uintptr_t)p);
+    /* What swapgs hands user mode; nothing uses GS there. */
+    write_msr(MSR_KERNEL_GS_BASE, 0);
+}
+
+static size_t percpu_proc_show(char* buf, size_t size) {
+    size_t n = 0;
+    uint32_t online = cpu_online_count();
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        percpu_t* p = &g_percpu[c];
+        n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                               "cpu%u: apic=%u irqs=%llu syscalls=%llu current=%s\n",
+                               c, p->apic_id, (unsigned long long)p->irq_count,
+                               (unsigned long long)p->syscall_count,
+                               p->current ? p->current->name : "-");
+    }
+    return n;
+}
+
+void percpu_proc_init(void) {
+    procfs_register("cpus", percpu_proc_show);
+}
@@ -1,13 +1,22 @@
 #include "arch/x86_64/pit.h"
-#include "arch/x86_64/smp.h"
+#include "arch/x86_64/common.h"
+#include "tick.h"
 #include "io.h"
 
-#define PIT_CH0      0x40
-#define PIT_CMD      0x43
-#define PIT_BASE_HZ  1193182
+#define PIT_CH0       0x40
+#define PIT_CH2       0x42
+#define PIT_CMD       0x43
+#define PIT_GATE_PORT 0x61
 
 static volatile uint64_t g_ticks = 0;
 static volatile uint32_t g_hz = 100;
+static uint32_t g_divisor = 0;
+
+/* One-shot mode: time comes from the TSC, not from counting IRQs. */
+static volatile bool g_oneshot = false;
+static uint64_t g_tsc_base = 0;
+static uint64_t g_tsc_per_tick = 0;
+static uint64_t g_ticks_base = 0;
 
 void pit_init(uint32_t hz) {
     if (hz == 0) hz = 100;
@@ -16,6 +25,7 @@ void pit_init(uint32_t hz) {
     uint32_t divisor = PIT_BASE_HZ / hz;
     if (divisor == 0) divisor = 1;
     if (divisor > 0xFFFF) divisor = 0xFFFF;
+    g_divisor = divisor;
 
     /* Channel 0, lobyte/hibyte, mode 3 (square wave), binary */
     outb(PIT_CMD, 0x36);
@@ -23,14 +33,62 @@ void pit_init(uint32_t hz) {
     outb(PIT_CH0, (uint8_t)((divisor >> 8) & 0xFF));
 
     g_ticks = 0;
+    g_oneshot = false;
+}
+
+bool pit_enter_oneshot(uint64_t tsc_hz) {
+    if (tsc_hz < g_hz) return false;
+    g_ticks_base = g_ticks;
+    g_tsc_per_tick = tsc_hz / g_hz;
+    g_tsc_base = rdtsc();
+    g_oneshot = true;
+    return true;
+}
+
+uint64_t pit_arm_oneshot(uint64_t ticks) {
+    uint64_t max_ticks = 0xFFFFu / g_divisor;
+    if (max_ticks == 0) max_ticks = 1;
+    if (ticks == 0) ticks = 1;
+    if (ticks > max_ticks) ticks = max_ticks;
+    uint32_t count = (uint32_t)(ticks * g_divisor);
+
+    /* Channel 0, lobyte/hibyte, mode 0 (interrupt on terminal count) */
+    outb(PIT_CMD, 0x30);
+    outb(PIT_CH0, (uint8_t)(count & 0xFF));
+    outb(PIT_CH0, (uint8_t)((count >> 8) & 0xFF));
+    return ticks;
+}
+
+/* Channel 2 in mode 0 with the speaker disconnected; OUT2 (port 0x61
+ * bit 5) goes high once `count` input clocks have elapsed. */
+void pit_ch2_start(uint16_t count) {
+    outb(PIT_GATE_PORT, (uint8_t)((inb(PIT_GATE_PORT) & ~0x02) | 0x01));
+    outb(PIT_CMD, 0xB0);
+    outb(PIT_CH2, (uint8_t)(count & 0xFF));
+    outb(PIT_CH2, (uint8_t)((count >> 8) & 0xFF));
+}
+
+bool pit_ch2_expired(void) {
+    return (inb(PIT_GATE_PORT) & 0x20) != 0;
+}
+
+uint64_t pit_tick_tsc(uint64_t tick) {
+    if (!g_oneshot || tick < g_ticks_base) return g_tsc_base;
+    return g_tsc_base + (tick - g_ticks_base) * g_tsc_per_tick;
+}
+
+uint64_t pit_tsc_tick(uint64_t tsc) {
+    if (!g_oneshot || tsc <= g_tsc_base) return g_ticks_base;
+    return g_ticks_base + (tsc - g_tsc_base + g_tsc_per_tick - 1) / g_tsc_per_tick;
 }
 
 void pit_handle_irq0(void) {
-    g_ticks++;
-    smp_broadcast_tick();
+    if (!g_oneshot) g_ticks++;
+    tick_handle_irq();
 }
 
 uint64_t pit_ticks(void) {
+    if (g_oneshot) return g_ticks_base + (rdtsc() - g_tsc_base) / g_tsc_per_tick;
     return g_ticks;
 }
 
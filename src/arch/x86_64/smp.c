@@ -7,6 +7,7 @@
 #include "arch/x86_64/idt.h"
 #include "console.h"
 #include "scheduler.h"
+#include "idle.h"
 #include "vmm.h"
 #include "lib.h"
 
@@ -52,9 +53,10 @@ static void ap_trampoline_prepare(uint32_t cpu_id) {
     boot->cr3 = vmm_kernel_cr3();
 }
 
-void smp_broadcast_tick(void) {
-    if (!g_smp_enabled) return;
-    apic_send_ipi_all(APIC_RESCHED_VECTOR);
+void smp_send_resched(uint32_t cpu_id) {
+    if (!g_smp_enabled || cpu_id >= MAX_CPUS) return;
+    if (idle_skip_ipi(cpu_id)) return;
+    apic_send_ipi(cpu_apic_id(cpu_id), APIC_RESCHED_VECTOR);
 }
 
 uint32_t smp_cpu_count(void) {
@@ -119,7 +121,9 @@ void smp_init(void) {
 }
 
 void scheduler_ap_main(uint64_t cpu_id) {
+    percpu_init((uint32_t)cpu_id);
     cpu_set_online((uint32_t)cpu_id, true);
+    cpu_init_fpu();
     gdt_init_cpu((uint32_t)cpu_id);
     idt_init();
     apic_init_ap();
@@ -134,7 +138,5 @@ void scheduler_ap_main(uint64_t cpu_id) {
     console_write("\n");
 
     cpu_sti();
-    for (;;) {
-        cpu_hlt();
-    }
+    idle_loop();
 }
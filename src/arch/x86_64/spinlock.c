@@ -0,0 +1,56 @@
+#include "arch/x86_64/spinlock.h"
+#include "arch/x86_64/tsc.h"
+#include "procfs.h"
+#include "lib.h"
+
+#ifdef LOCK_STATS
+
+#define LOCK_STAT_MAX 32
+
+/* Locks given the same name share one entry, so e.g. all run queue
+ * locks are counted as a class.  Counters of a shared entry are bumped
+ * under different locks and may lose the odd update. */
+static lock_stat_t g_stats[LOCK_STAT_MAX];
+static uint32_t g_stat_count;
+static lock_stat_t* g_stat_list;
+static spinlock_t g_stat_lock;
+
+void spinlock_set_name(spinlock_t* lock, const char* name) {
+    spinlock_lock(&g_stat_lock);
+    lock_stat_t* s = g_stat_list;
+    while (s && strcmp(s->name, name) != 0) s = s->next;
+    if (!s && g_stat_count < LOCK_STAT_MAX) {
+        s = &g_stats[g_stat_count++];
+        s->name = name;
+        s->next = g_stat_list;
+        g_stat_list = s;
+    }
+    spinlock_unlock(&g_stat_lock);
+    lock->stat = s;
+}
+
+static size_t lock_proc_show(char* buf, size_t size) {
+    size_t n = (size_t)ksnprintf(buf, size, "name acquisitions contended spins avg_hold_ns max_hold_ns\n");
+    for (lock_stat_t* s = g_stat_list; s; s = s->next) {
+        uint64_t acq = s->acquisitions;
+        uint64_t avg = acq ? tsc_to_ns(s->hold_cycles / acq) : 0;
+        n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                               "%s %llu %llu %llu %llu %llu\n", s->name,
+                               (unsigned long long)acq, (unsigned long long)s->contended,
+                               (unsigned long long)s->spins, (unsigned long long)avg,
+                               (unsigned long long)tsc_to_ns(s->max_hold_cycles));
+    }
+    return n;
+}
+
+#else
+
+static size_t lock_proc_show(char* buf, size_t size) {
+    return (size_t)ksnprintf(buf, size, "lock statistics disabled (build with LOCK_STATS=1)\n");
+}
+
+#endif
+
+void spinlock_stats_init(void) {
+    procfs_register("locks", lock_proc_show);
+}
@@ -0,0 +1,66 @@
+#include "arch/x86_64/tsc.h"
+#include "arch/x86_64/pit.h"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/common.h"
+#include "log.h"
+
+#define CAL_MS        10
+#define CAL_LATCH     (PIT_BASE_HZ / (1000 / CAL_MS))
+#define CAL_RUNS      3
+#define CAL_MAX_SPINS 50000000ull
+
+static uint64_t g_tsc_hz = 0;
+static uint64_t g_tsc_boot = 0;     /* TSC at the monotonic clock's zero */
+
+/* Count TSC cycles across a CAL_MS countdown on PIT channel 2. */
+static uint64_t calibrate_once(void) {
+    pit_ch2_start((uint16_t)CAL_LATCH);
+
+    uint64_t start = rdtsc();
+    uint64_t spins = 0;
+    while (!pit_ch2_expired()) {
+        if (++spins > CAL_MAX_SPINS) return 0;
+    }
+    return rdtsc() - start;
+}
+
+void tsc_init(void) {
+    uint64_t best = 0;
+    for (int i = 0; i < CAL_RUNS; i++) {
+        uint64_t d = calibrate_once();
+        if (d && (best == 0 || d < best)) best = d;
+    }
+    if (best == 0) {
+        log_warn("tsc: PIT calibration failed\n");
+        g_tsc_hz = 0;
+        return;
+    }
+    g_tsc_hz = best * PIT_BASE_HZ / CAL_LATCH;
+    g_tsc_boot = rdtsc();
+    log_info("tsc: %llu kHz%s\n",
+             (unsigned long long)(g_tsc_hz / 1000),
+             cpu_has_feature(CPU_FEAT_TSC_INVARIANT) ? " (invariant)" : "");
+}
+
+uint64_t tsc_hz(void) {
+    return g_tsc_hz;
+}
+
+uint64_t tsc_to_ns(uint64_t cycles) {
+    if (g_tsc_hz == 0) return 0;
+    return (cycles / g_tsc_hz) * 1000000000ull +
+           (cycles % g_tsc_hz) * 1000000000ull / g_tsc_hz;
+}
+
+uint64_t tsc_from_ns(uint64_t ns) {
+    return (ns / 1000000000ull) * g_tsc_hz +
+           (ns % 1000000000ull) * g_tsc_hz / 1000000000ull;
+}
+
+uint64_t tsc_now_ns(void) {
+    return tsc_to_ns(rdtsc() - g_tsc_boot);
+}
+
+uint64_t tsc_deadline_ns(uint64_t ns) {
+    return g_tsc_boot + tsc_from_ns(ns);
+}
@@ -4,6 +4,7 @@
 #include "kmalloc.h"
 #include "lib.h"
 #include "input.h"
+#include "arch/x86_64/preempt.h"
 
 #define DEV_SECTOR_SIZE 512
 
@@ -25,6 +26,7 @@ static vfs_ssize_t dev_disk_read(vfs_node_t* node, size_t offset, void* buf, siz
         if (!virtio_blk_read_sector(sector_idx, sector)) return -1;
         memcpy(out + done, sector + sector_off, chunk);
         done += chunk;
+        cond_resched();
     }
 
     return (vfs_ssize_t)done;
@@ -52,6 +54,7 @@ static vfs_ssize_t dev_disk_write(vfs_node_t* node, size_t offset, const void* b
         memcpy(sector + sector_off, in + done, chunk);
         if (!virtio_blk_write_sector(sector_idx, sector)) return -1;
         done += chunk;
+        cond_resched();
     }
 
     return (vfs_ssize_t)done;
@@ -0,0 +1,159 @@
+#include "futex.h"
+#include "thread.h"
+#include "scheduler.h"
+#include "vmm.h"
+#include "procfs.h"
+#include "lib.h"
+#include "arch/x86_64/common.h"
+#include "arch/x86_64/spinlock.h"
+
+#define FUTEX_HASH_BITS 8
+#define FUTEX_HASH_SIZE (1u << FUTEX_HASH_BITS)
+
+/* A sleeping waiter, on its own kernel stack while it sleeps.  queued is
+ * cleared (under the bucket lock) by the waker that dequeues it. */
+typedef struct futex_q {
+    struct futex_q* next;
+    uint64_t key;
+    thread_t* thread;
+    bool queued;
+} futex_q_t;
+
+typedef struct {
+    spinlock_t lock;
+    futex_q_t* head;
+    futex_q_t* tail;
+} futex_bucket_t;
+
+static futex_bucket_t g_buckets[FUTEX_HASH_SIZE];
+static volatile uint64_t g_waits;
+static volatile uint64_t g_wait_eagain;
+static volatile uint64_t g_wakes;
+static volatile uint64_t g_woken;
+
+/* Key a user word by physical address, so every mapping of it agrees. */
+static bool futex_key(uint32_t* uaddr, uint64_t* key) {
+    thread_t* cur = thread_current();
+    uint64_t va = (uint64_t)(uintptr_t)uaddr;
+    uint64_t phys = 0;
+    uint64_t flags = 0;
+    if (!cur || !cur->is_user || (va & 3)) return false;
+    if (!vmm_resolve(cur->cr3, va, &phys, &flags) || !(flags & VMM_FLAG_USER)) return false;
+    *key = phys;
+    return true;
+}
+
+static futex_bucket_t* futex_bucket(uint64_t key) {
+    return &g_buckets[((key >> 2) * 0x9E3779B97F4A7C15ULL) >> (64 - FUTEX_HASH_BITS)];
+}
+
+static void bucket_unlink(futex_bucket_t* b, futex_q_t* q) {
+    futex_q_t* prev = 0;
+    for (futex_q_t* it = b->head; it; prev = it, it = it->next) {
+        if (it != q) continue;
+        if (prev) prev->next = q->next;
+        else b->head = q->next;
+        if (b->tail == q) b->tail = prev;
+        break;
+    }
+    q->queued = false;
+}
+
+int64_t futex_wait(uint32_t* uaddr, uint32_t val) {
+    uint64_t key;
+    if (!scheduler_can_block() || !futex_key(uaddr, &key)) return -1;
+    thread_t* cur = thread_current();
+    futex_bucket_t* b = futex_bucket(key);
+    futex_q_t q = { 0, key, cur, true };
+
+    uint64_t irq = irq_save();
+    spinlock_lock(&b->lock);
+    /* Checked under the bucket lock: a waker that changed the word after
+     * this must take the lock to wake, and will find us queued. */
+    if (*(volatile uint32_t*)uaddr != val) {
+        spinlock_unlock(&b->lock);
+        irq_restore(irq);
+        g_wait_eagain++;
+        return -1;
+    }
+    if (b->tail) b->tail->next = &q;
+    else b->head = &q;
+    b->tail = &q;
+    cur->wq_killable = true;
+    cur->in_wait = true;
+    scheduler_block_prepare();
+    spinlock_unlock(&b->lock);
+    irq_restore(irq);
+    g_waits++;
+
+    if (!cur->pending_kill) scheduler_block();
+
+    irq = irq_save();
+    spinlock_lock(&b->lock);
+    bool woken = !q.queued;
+    if (q.queued) bucket_unlink(b, &q);
+    spinlock_unlock(&b->lock);
+    scheduler_block_cancel();
+    cur->in_wait = false;
+    irq_restore(irq);
+    return woken ? 0 : -1;
+}
+
+int64_t futex_wake(uint32_t* uaddr, uint32_t n) {
+    uint64_t key;
+    if (!futex_key(uaddr, &key)) return -1;
+    return futex_wake_phys(key, n);
+}
+
+int64_t futex_wake_phys(uint64_t key, uint32_t n) {
+    futex_bucket_t* b = futex_bucket(key);
+    int64_t woken = 0;
+
+    uint64_t irq = irq_save();
+    spinlock_lock(&b->lock);
+    futex_q_t* prev = 0;
+    futex_q_t* q = b->head;
+    while (q && (uint64_t)woken < n) {
+        futex_q_t* next = q->next;
+        if (q->key != key) {
+            prev = q;
+            q = next;
+            continue;
+        }
+        if (prev) prev->next = next;
+        else b->head = next;
+        if (b->tail == q) b->tail = prev;
+        thread_t* t = q->thread;
+        q->queued = false;  /* q may vanish once the lock drops */
+        scheduler_wake_blocked(t);
+        woken++;
+        q = next;
+    }
+    spinlock_unlock(&b->lock);
+    irq_restore(irq);
+    g_wakes++;
+    g_woken += (uint64_t)woken;
+    return woken;
+}
+
+static size_t futex_proc_show(char* buf, size_t size) {
+    uint32_t busy = 0;
+    for (uint32_t i = 0; i < FUTEX_HASH_SIZE; i++) {
+        if (g_buckets[i].head) busy++;
+    }
+    return (size_t)ksnprintf(buf, size,
+                             "buckets %u busy %u\nwaits %llu eagain %llu\nwakes %llu woken %llu\n",
+                             FUTEX_HASH_SIZE, busy,
+                             (unsigned long long)g_waits, (unsigned long long)g_wait_eagain,
+                             (unsigned long long)g_wakes, (unsigned long long)g_woken);
+}
+
+void futex_init(void) {
+    for (uint32_t i = 0; i < FUTEX_HASH_SIZE; i++) {
+        spinlock_init(&g_buckets[i].lock);
+        spinlock_set_name(&g_buckets[i].lock, "futex_bucket");
+        g_buckets[i].head = 0;
+        g_buckets[i].tail = 0;
+    }
+    procfs_register("futex", futex_proc_show);
+}
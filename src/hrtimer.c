@@ -0,0 +1,156 @@
+#include "hrtimer.h"
+#include "tick.h"
+#include "time.h"
+#include "procfs.h"
+#include "lib.h"
+#include "arch/x86_64/pit.h"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/common.h"
+#include "arch/x86_64/spinlock.h"
+
+typedef struct {
+    spinlock_t lock;
+    rb_root_t  tree;            /* queued timers by hard deadline */
+    hrtimer_t* running;
+    uint32_t   count;
+    uint64_t   expired;
+    uint64_t   batched;         /* fired early, inside their slack */
+    uint64_t   max_late_ns;     /* worst hard-deadline overshoot seen */
+} hrtimer_base_t;
+
+static hrtimer_base_t g_bases[MAX_CPUS];
+
+static bool hard_less(const rb_node_t* a, const rb_node_t* b) {
+    return rb_entry(a, hrtimer_t, node)->hard < rb_entry(b, hrtimer_t, node)->hard;
+}
+
+void hrtimer_setup(hrtimer_t* t, hrtimer_fn_t fn, void* arg) {
+    memset(t, 0, sizeof(*t));
+    t->fn = fn;
+    t->arg = arg;
+}
+
+void hrtimer_start(hrtimer_t* t, uint64_t expires, uint64_t slack) {
+    hrtimer_cancel(t);
+
+    uint64_t flags = irq_save();
+    uint32_t cpu = cpu_current_id();
+    if (cpu >= MAX_CPUS) cpu = 0;
+    hrtimer_base_t* b = &g_bases[cpu];
+
+    spinlock_lock(&b->lock);
+    t->soft = expires;
+    t->hard = expires + slack < expires ? UINT64_MAX : expires + slack;
+    t->cpu = cpu;
+    rb_insert(&b->tree, &t->node, hard_less);
+    t->queued = true;
+    b->count++;
+    bool first = rb_first(&b->tree) == &t->node;
+    spinlock_unlock(&b->lock);
+
+    /* New earliest deadline: pull this CPU's timer in. */
+    if (first) tick_rearm(tick_armed(cpu));
+    irq_restore(flags);
+}
+
+bool hrtimer_cancel(hrtimer_t* t) {
+    for (;;) {
+        uint32_t cpu = t->cpu < MAX_CPUS ? t->cpu : 0;
+        hrtimer_base_t* b = &g_bases[cpu];
+        uint64_t flags = irq_save();
+        spinlock_lock(&b->lock);
+        if (t->cpu != cpu) {
+            spinlock_unlock(&b->lock);
+            irq_restore(flags);
+            continue;
+        }
+        if (t->queued) {
+            rb_erase(&b->tree, &t->node);
+            t->queued = false;
+            b->count--;
+            spinlock_unlock(&b->lock);
+            irq_restore(flags);
+            return true;
+        }
+        bool running = b->running == t;
+        spinlock_unlock(&b->lock);
+        irq_restore(flags);
+        if (!running) return false;
+        while (b->running == t) cpu_pause();
+        return false;
+    }
+}
+
+void hrtimer_run(void) {
+    uint32_t cpu = cpu_current_id();
+    if (cpu >= MAX_CPUS) return;
+    hrtimer_base_t* b = &g_bases[cpu];
+    if (rb_empty(&b->tree)) return;
+
+    uint64_t now = time_now_ns();
+    spinlock_lock(&b->lock);
+    for (;;) {
+        rb_node_t* n = rb_first(&b->tree);
+        if (!n) break;
+        hrtimer_t* t = rb_entry(n, hrtimer_t, node);
+        /* Sorted by hard deadline; a later one may still be soft-expired,
+         * but stopping here keeps expiry O(expired). */
+        if (t->soft > now) break;
+        rb_erase(&b->tree, n);
+        t->queued = false;
+        b->count--;
+        b->expired++;
+        if (t->hard > now) b->batched++;
+        else if (now - t->hard > b->max_late_ns) b->max_late_ns = now - t->hard;
+        b->running = t;
+        spinlock_unlock(&b->lock);
+        t->fn(t->arg);
+        spinlock_lock(&b->lock);
+        b->running = 0;
+    }
+    spinlock_unlock(&b->lock);
+}
+
+uint64_t hrtimer_next_event(uint32_t cpu) {
+    if (cpu >= MAX_CPUS) return UINT64_MAX;
+    hrtimer_base_t* b = &g_bases[cpu];
+    rb_node_t* n = rb_first(&b->tree);
+    return n ? rb_entry(n, hrtimer_t, node)->hard : UINT64_MAX;
+}
+
+uint64_t hrtimer_next_tick(uint32_t cpu) {
+    uint64_t hard = hrtimer_next_event(cpu);
+    if (hard == UINT64_MAX) return UINT64_MAX;
+    uint64_t now_ns = time_now_ns();
+    uint64_t tick = pit_ticks();
+    if (hard <= now_ns) return tick;
+    uint64_t d = hard - now_ns;
+    uint64_t hz = pit_frequency_hz();
+    uint64_t delta = (d / 1000000000ull) * hz +
+                     ((d % 1000000000ull) * hz + 999999999ull) / 1000000000ull;
+    return tick + (delta ? delta : 1);
+}
+
+static size_t hrtimer_proc_show(char* buf, size_t size) {
+    size_t n = 0;
+    uint32_t online = cpu_online_count();
+    if (online == 0) online = 1;
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        hrtimer_base_t* b = &g_bases[c];
+        n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                               "cpu%u: queued=%u expired=%llu batched=%llu max_late_ns=%llu\n",
+                               c, b->count, (unsigned long long)b->expired,
+                               (unsigned long long)b->batched,
+                               (unsigned long long)b->max_late_ns);
+    }
+    return n;
+}
+
+void hrtimer_init(void) {
+    memset(g_bases, 0, sizeof(g_bases));
+    for (uint32_t c = 0; c < MAX_CPUS; c++) {
+        spinlock_init(&g_bases[c].lock);
+        spinlock_set_name(&g_bases[c].lock, "hrtimer_base");
+    }
+    procfs_register("hrtimers", hrtimer_proc_show);
+}
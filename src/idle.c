@@ -0,0 +1,115 @@
+#include "idle.h"
+#include "rcu.h"
+#include "scheduler.h"
+#include "procfs.h"
+#include "lib.h"
+#include "log.h"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/common.h"
+#include "arch/x86_64/tsc.h"
+
+/* C1: deeper states need the CPU's own table (CPUID leaf 5 and beyond). */
+#define IDLE_MWAIT_HINT 0
+
+/* Per-CPU, a line each; only ipis_saved is written by other CPUs. */
+typedef struct {
+    uint64_t since;                 /* TSC when the CPU entered idle_loop() */
+    uint64_t cycles;                /* TSC cycles asleep */
+    uint64_t sleeps;
+    uint64_t irq_wakes;             /* woken by an interrupt */
+    uint64_t flag_wakes;            /* woken by a store to need_resched */
+    volatile uint64_t ipis_saved;   /* remote wakeups that sent no IPI */
+} __attribute__((aligned(64))) idle_stats_t;
+
+static idle_stats_t g_stats[MAX_CPUS];
+static bool g_mwait;
+
+static void idle_stop(percpu_t* pc) {
+    g_stats[pc->cpu_id].cycles += rdtsc() - pc->idle_stamp;
+    pc->idle_stamp = 0;
+}
+
+/* Clearing idle_polling and then reading need_resched pairs with the
+ * waker's set-then-read in idle_skip_ipi(): if the waker still saw us
+ * polling, whatever this interrupt runs (schedule()) sees its flag. */
+void idle_wake_irq(percpu_t* pc) {
+    pc->idle_polling = false;
+    __sync_synchronize();
+    g_stats[pc->cpu_id].irq_wakes++;
+    idle_stop(pc);
+}
+
+bool idle_skip_ipi(uint32_t cpu) {
+    percpu_t* pc = percpu_of(cpu);
+    __sync_synchronize();
+    if (!pc->idle_polling || !pc->need_resched) return false;
+    __sync_fetch_and_add(&g_stats[cpu].ipis_saved, 1);
+    return true;
+}
+
+/* Sleep until need_resched or an interrupt.  Interrupts are off from the
+ * last check of the flag until sti opens them together with the halt. */
+static void idle_sleep(percpu_t* pc) {
+    cpu_cli();
+    if (pc->need_resched) {
+        cpu_sti();
+        return;
+    }
+    g_stats[pc->cpu_id].sleeps++;
+    pc->idle_stamp = rdtsc();
+    if (g_mwait) {
+        /* Armed before the final check: a store after it wakes MWAIT. */
+        pc->idle_polling = true;
+        __sync_synchronize();
+        cpu_monitor(&pc->need_resched);
+        if (!pc->need_resched) cpu_sti_mwait(IDLE_MWAIT_HINT);
+        cpu_cli();
+        pc->idle_polling = false;
+    } else {
+        cpu_sti_hlt();
+        cpu_cli();
+    }
+    if (pc->idle_stamp) {
+        if (pc->need_resched) g_stats[pc->cpu_id].flag_wakes++;
+        idle_stop(pc);
+    }
+    cpu_sti();
+}
+
+void idle_loop(void) {
+    percpu_t* pc = this_cpu();
+    g_stats[pc->cpu_id].since = rdtsc();
+    for (;;) {
+        rcu_idle_enter(pc->cpu_id);
+        idle_sleep(pc);
+        /* An interrupt that set the flag has scheduled already. */
+        if (pc->need_resched) scheduler_idle_resched();
+    }
+}
+
+static size_t idle_proc_show(char* buf, size_t size) {
+    size_t n = (size_t)ksnprintf(buf, size, "method %s\n", g_mwait ? "mwait" : "hlt");
+    uint64_t now = rdtsc();
+    uint32_t online = cpu_online_count();
+    if (online == 0) online = 1;
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        idle_stats_t* s = &g_stats[c];
+        uint64_t total = s->since && now > s->since ? now - s->since : 0;
+        uint64_t pct = total ? s->cycles * 100 / total : 0;
+        n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                               "cpu%u: idle_ms=%llu residency=%llu%% sleeps=%llu "
+                               "irq_wakes=%llu flag_wakes=%llu ipis_saved=%llu\n",
+                               c, (unsigned long long)(tsc_to_ns(s->cycles) / 1000000),
+                               (unsigned long long)pct, (unsigned long long)s->sleeps,
+                               (unsigned long long)s->irq_wakes,
+                               (unsigned long long)s->flag_wakes,
+                               (unsigned long long)s->ipis_saved);
+    }
+    return n;
+}
+
+void idle_init(void) {
+    g_mwait = cpu_has_feature(CPU_FEAT_MWAIT);
+    log_info("idle: %s\n", g_mwait ? "mwait" : "hlt");
+    procfs_register("idle", idle_proc_show);
+}
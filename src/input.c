@@ -3,6 +3,7 @@
 #include "io.h"
 #include "lib.h"
 #include "console.h"
+#include "wait.h"
 
 #define PS2_DATA 0x60
 #define PS2_STATUS 0x64
@@ -20,6 +21,9 @@ static size_t mouse_head = 0;
 static size_t mouse_tail = 0;
 static uint8_t mouse_packet_size = 3;
 
+/* Readers waiting for a key; woken from IRQ1. */
+static wait_queue_t key_wait = WAIT_QUEUE_INIT;
+
 static int ps2_wait_read(void) {
     for (uint32_t i = 0; i < 100000; i++) {
         if (inb(PS2_STATUS) & 0x01) return 1;
@@ -123,6 +127,7 @@ void input_handle_irq1(uint8_t irq, intr_frame_t* frame) {
     (void)frame;
     uint8_t scancode = inb(PS2_DATA);
     queue_key(scancode);
+    wake_up(&key_wait);
 }
 
 void input_handle_irq12(uint8_t irq, intr_frame_t* frame) {
@@ -170,6 +175,15 @@ int input_read_key(key_event_t* out) {
     return 1;
 }
 
+static bool key_available(void* arg) {
+    (void)arg;
+    return key_tail != key_head;
+}
+
+int input_wait_key(void) {
+    return wait_until(&key_wait, key_available, 0, WAIT_KILLABLE);
+}
+
 int input_read_mouse(mouse_event_t* out) {
     if (!out) return 0;
     if (mouse_tail == mouse_head) return 0;
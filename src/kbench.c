@@ -0,0 +1,110 @@
+#include "kbench.h"
+#include "lib.h"
+#include "log.h"
+#include "pmm.h"
+#include "arch/x86_64/tsc.h"
+#include "arch/x86_64/common.h"
+
+#define KBENCH_BUF_BYTES   (1024u * 1024u)
+#define KBENCH_BUF_PAGES   (KBENCH_BUF_BYTES / PAGE_SIZE)
+#define KBENCH_TOTAL_BYTES (32ull * 1024 * 1024)
+
+typedef void (*kbench_fn_t)(uint8_t* dst, const uint8_t* src, size_t n);
+
+static volatile int g_sink;
+
+static void fast_copy(uint8_t* dst, const uint8_t* src, size_t n) { memcpy(dst, src, n); }
+static void fast_set(uint8_t* dst, const uint8_t* src, size_t n) { (void)src; memset(dst, 0x5A, n); }
+static void fast_cmp(uint8_t* dst, const uint8_t* src, size_t n) { g_sink += memcmp(dst, src, n); }
+
+/* Byte-at-a-time baselines (the pre-ERMS implementations).  Keep gcc from
+ * turning them back into calls to the routines under test. */
+__attribute__((noinline, optimize("no-tree-loop-distribute-patterns")))
+static void byte_copy(uint8_t* dst, const uint8_t* src, size_t n) {
+    for (size_t i = 0; i < n; i++) dst[i] = src[i];
+}
+
+__attribute__((noinline, optimize("no-tree-loop-distribute-patterns")))
+static void byte_set(uint8_t* dst, const uint8_t* src, size_t n) {
+    (void)src;
+    for (size_t i = 0; i < n; i++) dst[i] = 0x5A;
+}
+
+__attribute__((noinline, optimize("no-tree-loop-distribute-patterns")))
+static void byte_cmp(uint8_t* dst, const uint8_t* src, size_t n) {
+    for (size_t i = 0; i < n; i++) {
+        if (dst[i] != src[i]) {
+            g_sink += (int)dst[i] - (int)src[i];
+            return;
+        }
+    }
+}
+
+typedef struct {
+    const char* name;
+    kbench_fn_t fast;
+    kbench_fn_t ref;
+} kbench_op_t;
+
+static const kbench_op_t g_ops[] = {
+    { "memcpy", fast_copy, byte_copy },
+    { "memset", fast_set,  byte_set  },
+    { "memcmp", fast_cmp,  byte_cmp  },
+};
+
+/* 64 = small struct, 1500 = net message, 4096 = page, then cache-sized runs. */
+static const size_t g_sizes[] = { 64, 256, 1500, 4096, 65536, KBENCH_BUF_BYTES };
+
+/* Returns throughput in hundredths of GB/s (bytes per ns * 100). */
+static uint64_t measure(kbench_fn_t fn, uint8_t* dst, const uint8_t* src, size_t size) {
+    uint64_t iters = KBENCH_TOTAL_BYTES / size;
+    if (iters == 0) iters = 1;
+
+    fn(dst, src, size); /* warm caches and TLB */
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < iters; i++) fn(dst, src, size);
+    uint64_t ns = tsc_to_ns(rdtsc() - start);
+    if (ns == 0) ns = 1;
+    return iters * size * 100 / ns;
+}
+
+static void log_rate(const char* name, size_t size, uint64_t fast, uint64_t ref) {
+    log_info("kbench: %s %llu B: %llu.%llu%llu GB/s (byte loop %llu.%llu%llu GB/s)\n",
+             name, (unsigned long long)size,
+             (unsigned long long)(fast / 100),
+             (unsigned long long)((fast / 10) % 10), (unsigned long long)(fast % 10),
+             (unsigned long long)(ref / 100),
+             (unsigned long long)((ref / 10) % 10), (unsigned long long)(ref % 10));
+}
+
+void kbench_run(void) {
+    if (tsc_hz() == 0) {
+        log_warn("kbench: TSC not calibrated, skipping\n");
+        return;
+    }
+
+    uint8_t* src = (uint8_t*)(uintptr_t)pmm_alloc_pages(KBENCH_BUF_PAGES);
+    uint8_t* dst = (uint8_t*)(uintptr_t)pmm_alloc_pages(KBENCH_BUF_PAGES);
+    if (!src || !dst) {
+        log_warn("kbench: out of memory\n");
+        if (src) pmm_free_pages((uint64_t)(uintptr_t)src, KBENCH_BUF_PAGES);
+        if (dst) pmm_free_pages((uint64_t)(uintptr_t)dst, KBENCH_BUF_PAGES);
+        return;
+    }
+    for (size_t i = 0; i < KBENCH_BUF_BYTES; i++) src[i] = (uint8_t)(i * 31u + 7u);
+
+    for (size_t o = 0; o < sizeof(g_ops) / sizeof(g_ops[0]); o++) {
+        const kbench_op_t* op = &g_ops[o];
+        for (size_t s = 0; s < sizeof(g_sizes) / sizeof(g_sizes[0]); s++) {
+            size_t size = g_sizes[s];
+            /* memcmp must scan the whole buffer, so give it equal inputs. */
+            if (op->fast == fast_cmp) memcpy(dst, src, size);
+            uint64_t fast = measure(op->fast, dst, src, size);
+            uint64_t ref = measure(op->ref, dst, src, size);
+            log_rate(op->name, size, fast, ref);
+        }
+    }
+
+    pmm_free_pages((uint64_t)(uintptr_t)src, KBENCH_BUF_PAGES);
+    pmm_free_pages((uint64_t)(uintptr_t)dst, KBENCH_BUF_PAGES);
+}
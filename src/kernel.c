@@ -11,15 +11,31 @@
 #include "virtio_blk.h"
 #include "vmm.h"
 #include "kmalloc.h"
+#include "kstack.h"
 #include "input.h"
 #include "net.h"
 #include "time.h"
+#include "tick.h"
+#include "timer.h"
+#include "hrtimer.h"
+#include "futex.h"
+#include "rcu.h"
+#include "idle.h"
+#include "arch/x86_64/preempt.h"
+#include "sched_trace.h"
 #include "disk.h"
+#include "kbench.h"
 #include "arch/x86_64/gdt.h"
 #include "arch/x86_64/idt.h"
 #include "arch/x86_64/irq.h"
 #include "arch/x86_64/pic.h"
 #include "arch/x86_64/pit.h"
+#include "arch/x86_64/tsc.h"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/fpu.h"
+#include "arch/x86_64/spinlock.h"
+#include "arch/x86_64/percpu.h"
+#include "procfs.h"
 #include "arch/x86_64/smp.h"
 #include "arch/x86_64/common.h"
 #include "scheduler.h"
@@ -35,7 +51,7 @@ extern uint8_t _binary_build_initramfs_tar_end[];
 static void klogger(void* arg) {
     (void)arg;
     for (;;) {
-        scheduler_sleep(100); /* ~1 second at 100Hz */
+        scheduler_sleep(HZ); /* ~1 second */
         log_info("ticks=%llu free_mem=%llu KiB\n",
                  (unsigned long long)pit_ticks(),
                  (unsigned long long)(pmm_free_memory_bytes() / 1024));
@@ -57,10 +73,16 @@ static void pci_cb(const pci_dev_t* dev, void* user) {
 }
 
 void kernel_main(uint64_t mb2_magic, const mb2_info_t* mb2) {
+    percpu_init(0);
     console_init();
     log_init(LOG_LEVEL_INFO, LOG_TARGET_CONSOLE | LOG_TARGET_SERIAL);
     gdb_init();
 
+    cpu_detect_features();
+    cpu_init_fpu();
+    fpu_init();
+    lib_init_string_ops();
+
     log_info("mb2_magic=0x%llx mb2=0x%llx\n",
              (unsigned long long)mb2_magic,
              (unsigned long long)(uintptr_t)mb2);
@@ -96,6 +118,7 @@ void kernel_main(uint64_t mb2_magic, const mb2_info_t* mb2) {
     /* Virtual memory + kernel heap. */
     vmm_init();
     kmalloc_init();
+    kstack_init();
     vfs_init(memfs_create_root());
 
     /* CPU tables */
@@ -105,8 +128,13 @@ void kernel_main(uint64_t mb2_magic, const mb2_info_t* mb2) {
     /* PIC/PIT */
     pic_init();
     irq_init();
-    pit_init(100);
+    pit_init(HZ);
     time_init();
+    tsc_init();
+
+#ifdef KBENCH
+    kbench_run();
+#endif
 
     /* Mask all IRQs except PIT (IRQ0). */
     for (uint8_t i = 0; i < 16; i++) pic_set_mask(i, 1);
@@ -117,10 +145,20 @@ void kernel_main(uint64_t mb2_magic, const mb2_info_t* mb2) {
     pic_set_mask(14, 0);
 
     /* Scheduler */
+    timer_init();
+    hrtimer_init();
     scheduler_init();
+    futex_init();
+    spinlock_stats_init();
+    percpu_proc_init();
+    rcu_init();
+    idle_init();
+    preempt_init();
+    sched_trace_init();
 
     /* SMP bring-up (APIC + APs) */
     smp_init();
+    tick_init();
 
     input_init();
     disk_init();
@@ -131,6 +169,7 @@ void kernel_main(uint64_t mb2_magic, const mb2_info_t* mb2) {
     tarfs_populate_vfs(vfs_root());
     vfs_mkdir("/rw");
     devfs_init();
+    procfs_init();
 
     /* Load and run init.elf from initramfs in user mode (reserve its memory early). */
     vfs_file_t* init_file = vfs_open("/init.elf", VFS_O_RDONLY);
@@ -194,7 +233,5 @@ void kernel_main(uint64_t mb2_magic, const mb2_info_t* mb2) {
     cpu_sti();
 
     log_info("idle loop\n");
-    for (;;) {
-        cpu_hlt();
-    }
+    idle_loop();
 }
@@ -1,6 +1,7 @@
 #include "kmalloc.h"
 #include "pmm.h"
 #include "lib.h"
+#include "arch/x86_64/spinlock.h"
 
 typedef struct km_block {
     struct km_block* next;
@@ -10,6 +11,9 @@ typedef struct km_block {
 
 static km_block_t* g_heap = 0;
 static km_block_t* g_last = 0;
+/* Taken with IRQs off: kernel threads (the rcu thread's frees) run with
+ * interrupts on and may be preempted by a syscall path allocating here. */
+static spinlock_t g_heap_lock;
 
 static km_block_t* request_space(size_t size) {
     size_t total = sizeof(km_block_t) + size;
@@ -30,6 +34,7 @@ static km_block_t* request_space(size_t size) {
 }
 
 void kmalloc_init(void) {
+    spinlock_init(&g_heap_lock);
     g_heap = 0;
     g_last = 0;
 }
@@ -47,13 +52,15 @@ void* kmalloc(size_t size) {
     if (size == 0) return 0;
     size = align_up_u64(size, 16);
 
+    uint64_t irq = spinlock_lock_irqsave(&g_heap_lock);
     km_block_t* block = find_block(size);
     if (!block) {
         block = request_space(size);
-        if (!block) return 0;
     } else {
         block->free = 0;
     }
+    spinlock_unlock_irqrestore(&g_heap_lock, irq);
+    if (!block) return 0;
 
     uint8_t* data = (uint8_t*)(block + 1);
     return data;
@@ -75,6 +82,8 @@ static void merge_free_blocks(void) {
 void kfree(void* ptr) {
     if (!ptr) return;
     km_block_t* block = ((km_block_t*)ptr) - 1;
+    uint64_t irq = spinlock_lock_irqsave(&g_heap_lock);
     block->free = 1;
     merge_free_blocks();
+    spinlock_unlock_irqrestore(&g_heap_lock, irq);
 }
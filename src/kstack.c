@@ -0,0 +1,135 @@
+#include "kstack.h"
+#include "vmm.h"
+#include "procfs.h"
+#include "lib.h"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/spinlock.h"
+
+/* The region sits right above the 4 GiB identity map, inside PML4 entry 0,
+ * whose tables every user address space shares: a stack mapped once is
+ * mapped everywhere.  Slot i is a guard page followed by the stack. */
+#define KSTACK_REGION_BASE 0x100000000ULL
+#define KSTACK_SLOT_SIZE   ((KSTACK_PAGES + 1) * PAGE_SIZE)
+#define KSTACK_MAX_SLOTS   1024
+#define KSTACK_CACHE_SIZE  8
+
+typedef struct kstack_free {
+    struct kstack_free* next;
+} kstack_free_t;
+
+/* Touched by its own CPU only, with interrupts off. */
+typedef struct {
+    void*    stacks[KSTACK_CACHE_SIZE];
+    uint32_t count;
+    uint64_t hits;
+} __attribute__((aligned(64))) kstack_cache_t;
+
+static kstack_cache_t g_cache[MAX_CPUS];
+
+/* Slots past the per-CPU caches, and the high-water mark of mapped ones. */
+static spinlock_t g_pool_lock = SPINLOCK_INIT;
+static kstack_free_t* g_free;
+static uint32_t g_free_count;
+static uint32_t g_slots_mapped;
+static uint64_t g_pool_hits;
+
+static uint64_t slot_stack(uint32_t slot) {
+    return KSTACK_REGION_BASE + (uint64_t)slot * KSTACK_SLOT_SIZE + PAGE_SIZE;
+}
+
+static bool in_region(uint64_t addr) {
+    return addr >= KSTACK_REGION_BASE &&
+           addr < KSTACK_REGION_BASE + (uint64_t)KSTACK_MAX_SLOTS * KSTACK_SLOT_SIZE;
+}
+
+bool kstack_guard_hit(uint64_t addr) {
+    return in_region(addr) && (addr - KSTACK_REGION_BASE) % KSTACK_SLOT_SIZE < PAGE_SIZE;
+}
+
+/* Back a new slot with single pages; they need not be contiguous. */
+static void* map_slot(uint32_t slot) {
+    uint64_t cr3 = vmm_kernel_cr3();
+    uint64_t va = slot_stack(slot);
+    for (uint32_t i = 0; i < KSTACK_PAGES; i++) {
+        uint64_t pa = pmm_alloc_pages(1);
+        if (!pa || !vmm_map_page(cr3, va + i * PAGE_SIZE, pa,
+                                 VMM_FLAG_WRITABLE | VMM_FLAG_GLOBAL)) {
+            if (pa) pmm_free_pages(pa, 1);
+            while (i--) pmm_free_pages(vmm_unmap_page(cr3, va + i * PAGE_SIZE), 1);
+            return 0;
+        }
+    }
+    return (void*)(uintptr_t)va;
+}
+
+void* kstack_alloc(void) {
+    uint64_t irq = irq_save();
+    kstack_cache_t* c = &g_cache[cpu_current_id()];
+    if (c->count) {
+        void* s = c->stacks[--c->count];
+        c->hits++;
+        irq_restore(irq);
+        return s;
+    }
+
+    spinlock_lock(&g_pool_lock);
+    kstack_free_t* f = g_free;
+    if (f) {
+        g_free = f->next;
+        g_free_count--;
+        g_pool_hits++;
+        spinlock_unlock(&g_pool_lock);
+        irq_restore(irq);
+        return f;
+    }
+    if (g_slots_mapped >= KSTACK_MAX_SLOTS) {
+        spinlock_unlock(&g_pool_lock);
+        irq_restore(irq);
+        return 0;
+    }
+    /* Mapped under the lock: the page tables of the region are shared. */
+    void* s = map_slot(g_slots_mapped);
+    if (s) g_slots_mapped++;
+    spinlock_unlock(&g_pool_lock);
+    irq_restore(irq);
+    return s;
+}
+
+void kstack_free(void* base) {
+    uint64_t va = (uint64_t)(uintptr_t)base;
+    if (!base || !in_region(va) || kstack_guard_hit(va)) return;
+
+    uint64_t irq = irq_save();
+    kstack_cache_t* c = &g_cache[cpu_current_id()];
+    if (c->count < KSTACK_CACHE_SIZE) {
+        c->stacks[c->count++] = base;
+        irq_restore(irq);
+        return;
+    }
+    kstack_free_t* f = (kstack_free_t*)base;
+    spinlock_lock(&g_pool_lock);
+    f->next = g_free;
+    g_free = f;
+    g_free_count++;
+    spinlock_unlock(&g_pool_lock);
+    irq_restore(irq);
+}
+
+static size_t kstack_proc_show(char* buf, size_t size) {
+    size_t n = (size_t)ksnprintf(buf, size, "mapped %u/%u free %u pool_hits %llu\n",
+                                 g_slots_mapped, KSTACK_MAX_SLOTS, g_free_count,
+                                 (unsigned long long)g_pool_hits);
+    uint32_t online = cpu_online_count();
+    if (online == 0) online = 1;
+    for (uint32_t i = 0; i < online && i < MAX_CPUS; i++) {
+        n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                               "cpu%u: cached=%u hits=%llu\n", i, g_cache[i].count,
+                               (unsigned long long)g_cache[i].hits);
+    }
+    return n;
+}
+
+void kstack_init(void) {
+    spinlock_set_name(&g_pool_lock, "kstack_pool");
+    procfs_register("kstacks", kstack_proc_show);
+}
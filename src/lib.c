@@ -1,22 +1,128 @@
 #include "lib.h"
+#include "arch/x86_64/cpu.h"
+
+#define PAGE_BYTES 4096
+
+/* Unaligned, alias-safe 8-byte access for the word loops below. */
+typedef uint64_t __attribute__((may_alias, aligned(1))) u64_unaligned_t;
+
+/* Sizes at or above these go to REP MOVSB/STOSB.  Until lib_init_string_ops()
+ * runs we assume neither ERMS nor FSRM and stay on the word loops. */
+static size_t g_movsb_min = (size_t)-1;
+static size_t g_stosb_min = (size_t)-1;
+
+void lib_init_string_ops(void) {
+    if (cpu_has_feature(CPU_FEAT_FSRM)) {
+        g_movsb_min = 64;
+        g_stosb_min = 128;
+    } else if (cpu_has_feature(CPU_FEAT_ERMS)) {
+        g_movsb_min = 512;
+        g_stosb_min = 512;
+    } else {
+        g_movsb_min = (size_t)-1;
+        g_stosb_min = (size_t)-1;
+    }
+}
+
+static inline void rep_movsb(void* dst, const void* src, size_t n) {
+    __asm__ volatile ("rep movsb" : "+D"(dst), "+S"(src), "+c"(n) : : "memory");
+}
+
+static inline void rep_movsq(void* dst, const void* src, size_t qwords) {
+    __asm__ volatile ("rep movsq" : "+D"(dst), "+S"(src), "+c"(qwords) : : "memory");
+}
+
+static inline void rep_stosb(void* dst, uint8_t v, size_t n) {
+    __asm__ volatile ("rep stosb" : "+D"(dst), "+c"(n) : "a"(v) : "memory");
+}
+
+static inline void rep_stosq(void* dst, uint64_t v, size_t qwords) {
+    __asm__ volatile ("rep stosq" : "+D"(dst), "+c"(qwords) : "a"(v) : "memory");
+}
 
 void* memcpy(void* dst, const void* src, size_t n) {
     uint8_t* d = (uint8_t*)dst;
     const uint8_t* s = (const uint8_t*)src;
-    for (size_t i = 0; i < n; i++) d[i] = s[i];
+
+    /* Whole aligned pages (page copies, fork, ELF segments). */
+    if (n == PAGE_BYTES && (((uintptr_t)d | (uintptr_t)s) & 7) == 0) {
+        rep_movsq(d, s, PAGE_BYTES / 8);
+        return dst;
+    }
+    if (n >= g_movsb_min) {
+        rep_movsb(d, s, n);
+        return dst;
+    }
+    if (n < 8) {
+        for (size_t i = 0; i < n; i++) d[i] = s[i];
+        return dst;
+    }
+    if (n >= 256) {
+        size_t q = n / 8;
+        rep_movsq(d, s, q);
+        d += q * 8;
+        s += q * 8;
+        for (size_t i = 0; i < (n & 7); i++) d[i] = s[i];
+        return dst;
+    }
+
+    /* 8..255 bytes: word loop, then one overlapping word for the tail. */
+    uint64_t last = *(const u64_unaligned_t*)(s + n - 8);
+    for (size_t i = 0; i + 8 <= n; i += 8) {
+        *(u64_unaligned_t*)(d + i) = *(const u64_unaligned_t*)(s + i);
+    }
+    *(u64_unaligned_t*)(d + n - 8) = last;
     return dst;
 }
 
 void* memset(void* dst, int v, size_t n) {
     uint8_t* d = (uint8_t*)dst;
-    for (size_t i = 0; i < n; i++) d[i] = (uint8_t)v;
+    uint8_t b = (uint8_t)v;
+    uint64_t w = 0x0101010101010101ull * b;
+
+    if (n == PAGE_BYTES && ((uintptr_t)d & 7) == 0) {
+        rep_stosq(d, w, PAGE_BYTES / 8);
+        return dst;
+    }
+    if (n >= g_stosb_min) {
+        rep_stosb(d, b, n);
+        return dst;
+    }
+    if (n < 8) {
+        for (size_t i = 0; i < n; i++) d[i] = b;
+        return dst;
+    }
+    if (n >= 256) {
+        size_t q = n / 8;
+        rep_stosq(d, w, q);
+        d += q * 8;
+        for (size_t i = 0; i < (n & 7); i++) d[i] = b;
+        return dst;
+    }
+
+    for (size_t i = 0; i + 8 <= n; i += 8) {
+        *(u64_unaligned_t*)(d + i) = w;
+    }
+    *(u64_unaligned_t*)(d + n - 8) = w;
     return dst;
 }
 
 int memcmp(const void* a, const void* b, size_t n) {
     const uint8_t* x = (const uint8_t*)a;
     const uint8_t* y = (const uint8_t*)b;
-    for (size_t i = 0; i < n; i++) {
+    size_t i = 0;
+
+    /* Compare a word at a time; on mismatch, locate the first differing
+     * byte (lowest address = least significant on little-endian). */
+    for (; i + 8 <= n; i += 8) {
+        uint64_t wx = *(const u64_unaligned_t*)(x + i);
+        uint64_t wy = *(const u64_unaligned_t*)(y + i);
+        if (wx != wy) {
+            unsigned shift = (unsigned)__builtin_ctzll(wx ^ wy) & ~7u;
+            return (int)((wx >> shift) & 0xFF) - (int)((wy >> shift) & 0xFF);
+        }
+    }
+    for (; i < n; i++) {
         if (x[i] != y[i]) return (int)x[i] - (int)y[i];
     }
     return 0;
@@ -43,6 +149,96 @@ int strncmp(const char* a, const char* b, size_t n) {
     return 0;
 }
 
+static void fmt_putc(char* buf, size_t size, size_t* idx, char c) {
+    if (*idx + 1 < size) buf[*idx] = c;
+    (*idx)++;
+}
+
+static void fmt_u64(char* buf, size_t size, size_t* idx, uint64_t v, unsigned base, int upper) {
+    const char* digits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    char tmp[24];
+    size_t n = 0;
+    do {
+        tmp[n++] = digits[v % base];
+        v /= base;
+    } while (v && n < sizeof(tmp));
+    while (n > 0) fmt_putc(buf, size, idx, tmp[--n]);
+}
+
+int kvsnprintf(char* buf, size_t size, const char* fmt, va_list ap) {
+    size_t idx = 0;
+    for (const char* p = fmt; *p; p++) {
+        if (*p != '%') {
+            fmt_putc(buf, size, &idx, *p);
+            continue;
+        }
+        p++;
+        int long_count = 0;
+        while (*p == 'l') {
+            long_count++;
+            p++;
+        }
+        switch (*p) {
+            case 's': {
+                const char* s = va_arg(ap, const char*);
+                if (!s) s = "(null)";
+                while (*s) fmt_putc(buf, size, &idx, *s++);
+                break;
+            }
+            case 'c':
+                fmt_putc(buf, size, &idx, (char)va_arg(ap, int));
+                break;
+            case 'd':
+            case 'i': {
+                int64_t v = (long_count >= 1) ? va_arg(ap, long long) : va_arg(ap, int);
+                if (v < 0) {
+                    fmt_putc(buf, size, &idx, '-');
+                    fmt_u64(buf, size, &idx, (uint64_t)0 - (uint64_t)v, 10, 0);
+                } else {
+                    fmt_u64(buf, size, &idx, (uint64_t)v, 10, 0);
+                }
+                break;
+            }
+            case 'u': {
+                uint64_t v = (long_count >= 1) ? va_arg(ap, unsigned long long) : va_arg(ap, unsigned int);
+                fmt_u64(buf, size, &idx, v, 10, 0);
+                break;
+            }
+            case 'x':
+            case 'X': {
+                uint64_t v = (long_count >= 1) ? va_arg(ap, unsigned long long) : va_arg(ap, unsigned int);
+                fmt_u64(buf, size, &idx, v, 16, *p == 'X');
+                break;
+            }
+            case 'p':
+                fmt_putc(buf, size, &idx, '0');
+                fmt_putc(buf, size, &idx, 'x');
+                fmt_u64(buf, size, &idx, (uint64_t)(uintptr_t)va_arg(ap, void*), 16, 0);
+                break;
+            case '%':
+                fmt_putc(buf, size, &idx, '%');
+                break;
+            case 0:
+                p--;
+                break;
+            default:
+                fmt_putc(buf, size, &idx, '%');
+                fmt_putc(buf, size, &idx, *p);
+                break;
+        }
+    }
+    if (size > 0) buf[idx < size ? idx : size - 1] = 0;
+    return (int)idx;
+}
+
+int ksnprintf(char* buf, size_t size, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = kvsnprintf(buf, size, fmt, ap);
+    va_end(ap);
+    return n;
+}
+
 uint64_t align_up_u64(uint64_t v, uint64_t a) {
     return (v + (a - 1)) & ~(a - 1);
 }
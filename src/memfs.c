@@ -38,6 +38,10 @@ static void memfs_free_node(vfs_node_t* node) {
     kfree(node);
 }
 
+static void memfs_free_node_rcu(rcu_head_t* head) {
+    memfs_free_node(container_of(head, vfs_node_t, rcu));
+}
+
 static vfs_ssize_t memfs_read(vfs_node_t* node, size_t offset, void* buf, size_t len) {
     if (!node || node->type != VFS_NODE_FILE) return -1;
     memfs_file_t* file = (memfs_file_t*)node->data;
@@ -110,7 +114,8 @@ static int memfs_unlink(vfs_node_t* dir, const char* name) {
     if (child->type == VFS_NODE_DIR && child->children) return -1;
 
     if (vfs_remove_child(dir, child) != 0) return -1;
-    memfs_free_node(child);
+    /* Lookups may still be walking through it. */
+    call_rcu(&child->rcu, memfs_free_node_rcu);
     return 0;
 }
 
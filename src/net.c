@@ -1,6 +1,9 @@
 #include "net.h"
 #include "console.h"
 #include "lib.h"
+#include "kmalloc.h"
+#include "rcu.h"
+#include "arch/x86_64/spinlock.h"
 
 #define NET_MAX_SOCKETS 32
 #define NET_MAX_QUEUE 16
@@ -32,8 +35,20 @@ typedef struct {
 
 static net_socket_t g_sockets[NET_MAX_SOCKETS];
 static net_ifinfo_t g_netifs[NET_MAX_IFS];
-static net_route_t g_routes[NET_MAX_ROUTES];
-static size_t g_route_count;
+/* Interface table: read on every lookup, written by config. */
+static rwlock_t g_config_lock = RWLOCK_INIT;
+
+/* The route table is replaced whole on every change and read under RCU:
+ * readers take no lock, writers copy, publish and free the old copy
+ * after a grace period. */
+typedef struct {
+    rcu_head_t  rcu;
+    size_t      count;
+    net_route_t routes[NET_MAX_ROUTES];
+} net_route_table_t;
+
+static net_route_table_t* g_route_table;
+static spinlock_t g_route_lock;
 
 static int index_from_fd(int fd) {
     return fd - 1;
@@ -93,8 +108,6 @@ static int dequeue_pending(net_socket_t* s) {
 void net_init(void) {
     memset(g_sockets, 0, sizeof(g_sockets));
     memset(g_netifs, 0, sizeof(g_netifs));
-    memset(g_routes, 0, sizeof(g_routes));
-    g_route_count = 0;
     strncpy(g_netifs[0].name, "lo", NET_IF_NAME_MAX);
     g_netifs[0].addr = 0x7F000001u;
     g_netifs[0].netmask = 0xFF000000u;
@@ -112,11 +125,17 @@ void net_init(void) {
     g_netifs[1].mac[5] = 0x56;
     g_netifs[1].up = 1;
     g_netifs[1].present = 1;
-    g_routes[g_route_count++] = (net_route_t){
-        .dest = 0,
-        .netmask = 0,
-        .gateway = 0xC0A80001u
-    };
+    spinlock_init(&g_route_lock);
+    net_route_table_t* table = (net_route_table_t*)kmalloc(sizeof(net_route_table_t));
+    if (table) {
+        memset(table, 0, sizeof(*table));
+        table->routes[table->count++] = (net_route_t){
+            .dest = 0,
+            .netmask = 0,
+            .gateway = 0xC0A80001u
+        };
+    }
+    rcu_assign_pointer(g_route_table, table);
     console_write("[net] loopback stack initialized\n");
 }
 
@@ -285,13 +304,19 @@ int net_socket_get(size_t index, net_socket_info_t* out) {
 int net_if_get(size_t index, net_ifinfo_t* out) {
     if (!out) return -1;
     if (index >= NET_MAX_IFS) return -1;
-    if (!g_netifs[index].present) return -1;
-    *out = g_netifs[index];
-    return 0;
+    read_lock(&g_config_lock);
+    int ret = -1;
+    if (g_netifs[index].present) {
+        *out = g_netifs[index];
+        ret = 0;
+    }
+    read_unlock(&g_config_lock);
+    return ret;
 }
 
 int net_if_set(const net_ifreq_t* req) {
     if (!req) return -1;
+    write_lock(&g_config_lock);
     for (size_t i = 0; i < NET_MAX_IFS; i++) {
         if (!g_netifs[i].present) continue;
         if (strncmp(g_netifs[i].name, req->name, NET_IF_NAME_MAX) != 0) continue;
@@ -307,27 +332,55 @@ int net_if_set(const net_ifreq_t* req) {
         if (req->flags & NET_IF_SET_UP) {
             g_netifs[i].up = req->up ? 1 : 0;
         }
+        write_unlock(&g_config_lock);
         return 0;
     }
+    write_unlock(&g_config_lock);
     return -1;
 }
 
 int net_route_get(size_t index, net_route_t* out) {
     if (!out) return -1;
-    if (index >= g_route_count) return -1;
-    *out = g_routes[index];
-    return 0;
+    int ret = -1;
+    rcu_read_lock();
+    net_route_table_t* table = rcu_dereference(g_route_table);
+    if (table && index < table->count) {
+        *out = table->routes[index];
+        ret = 0;
+    }
+    rcu_read_unlock();
+    return ret;
+}
+
+static void route_table_free(rcu_head_t* head) {
+    kfree(container_of(head, net_route_table_t, rcu));
 }
 
 int net_route_add(const net_route_t* route) {
     if (!route) return -1;
-    for (size_t i = 0; i < g_route_count; i++) {
-        if (g_routes[i].dest == route->dest && g_routes[i].netmask == route->netmask) {
-            g_routes[i].gateway = route->gateway;
-            return 0;
+    net_route_table_t* fresh = (net_route_table_t*)kmalloc(sizeof(net_route_table_t));
+    if (!fresh) return -1;
+
+    uint64_t irq = spinlock_lock_irqsave(&g_route_lock);
+    net_route_table_t* old = g_route_table;
+    if (old) memcpy(fresh, old, sizeof(*fresh));
+    else memset(fresh, 0, sizeof(*fresh));
+    int ret = -1;
+    for (size_t i = 0; i < fresh->count; i++) {
+        if (fresh->routes[i].dest == route->dest && fresh->routes[i].netmask == route->netmask) {
+            fresh->routes[i].gateway = route->gateway;
+            ret = 0;
+            break;
         }
     }
-    if (g_route_count >= NET_MAX_ROUTES) return -1;
-    g_routes[g_route_count++] = *route;
-    return 0;
+    if (ret < 0 && fresh->count < NET_MAX_ROUTES) {
+        fresh->routes[fresh->count++] = *route;
+        ret = 0;
+    }
+    if (ret == 0) rcu_assign_pointer(g_route_table, fresh);
+    spinlock_unlock_irqrestore(&g_route_lock, irq);
+
+    if (ret < 0) kfree(fresh);
+    else if (old) call_rcu(&old->rcu, route_table_free);
+    return ret;
 }
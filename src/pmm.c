@@ -1,6 +1,7 @@
 #include "pmm.h"
 #include "console.h"
 #include "lib.h"
+#include "arch/x86_64/spinlock.h"
 
 #define MAX_PHYS_BYTES (4ULL * 1024 * 1024 * 1024) /* 4 GiB identity mapped */
 #define MAX_PAGES      (MAX_PHYS_BYTES / PAGE_SIZE)
@@ -10,6 +11,7 @@ static uint8_t pmm_bitmap[BITMAP_BYTES];
 static uint64_t pmm_free_pages_cnt = 0;
 static uint64_t pmm_total_pages_cnt = 0;
 static int pmm_ready = 0;
+static spinlock_t g_pmm_lock = SPINLOCK_INIT;
 
 extern uint8_t _kernel_start[];
 extern uint8_t _kernel_end[];
@@ -115,6 +117,7 @@ void pmm_init(const mb2_info_t* mb2) {
 
     pmm_recount_free();
     pmm_ready = 1;
+    spinlock_set_name(&g_pmm_lock, "pmm");
 
     /* Compute total pages that are actually usable under MAX_PHYS by scanning bitmap */
     uint64_t used = pmm_total_pages_cnt - pmm_free_pages_cnt;
@@ -144,7 +147,12 @@ uint64_t pmm_free_memory_bytes(void) {
 
 uint64_t pmm_alloc_pages(size_t pages) {
     if (pages == 0) return 0;
-    if (pages > pmm_free_pages_cnt) return 0;
+
+    uint64_t irq = spinlock_lock_irqsave(&g_pmm_lock);
+    if (pages > pmm_free_pages_cnt) {
+        spinlock_unlock_irqrestore(&g_pmm_lock, irq);
+        return 0;
+    }
 
     uint64_t run = 0;
     uint64_t start = 0;
@@ -156,6 +164,7 @@ uint64_t pmm_alloc_pages(size_t pages) {
             if (run == pages) {
                 for (uint64_t j = 0; j < pages; j++) bit_set(start + j);
                 pmm_free_pages_cnt -= pages;
+                spinlock_unlock_irqrestore(&g_pmm_lock, irq);
                 return start * PAGE_SIZE;
             }
         } else {
@@ -163,6 +172,7 @@ uint64_t pmm_alloc_pages(size_t pages) {
         }
     }
 
+    spinlock_unlock_irqrestore(&g_pmm_lock, irq);
     return 0;
 }
 
@@ -171,6 +181,7 @@ void pmm_free_pages(uint64_t addr, size_t pages) {
     if (addr == 0) return;
 
     uint64_t start = addr / PAGE_SIZE;
+    uint64_t irq = spinlock_lock_irqsave(&g_pmm_lock);
     for (uint64_t j = 0; j < pages; j++) {
         uint64_t idx = start + j;
         if (idx >= pmm_total_pages_cnt) break;
@@ -179,4 +190,5 @@ void pmm_free_pages(uint64_t addr, size_t pages) {
             pmm_free_pages_cnt++;
         }
     }
+    spinlock_unlock_irqrestore(&g_pmm_lock, irq);
 }
@@ -0,0 +1,148 @@
+#include "arch/x86_64/preempt.h"
+#include "arch/x86_64/cpu.h"
+#include "scheduler.h"
+#include "procfs.h"
+#include "lib.h"
+#include "arch/x86_64/tsc.h"
+
+void preempt_schedule(void) {
+    __asm__ volatile("int %0" : : "i"(PREEMPT_VECTOR) : "memory");
+}
+
+void cond_resched(void) {
+    percpu_t* pc = this_cpu();
+    if (pc->preempt_count || !scheduler_can_block()) return;
+    bool irqs_off = !(read_rflags() & RFLAGS_IF);
+    preempt_stat_end();
+    /* sti takes effect after the next instruction: pending interrupts
+     * are taken between the nop and the cli, and switch threads on their
+     * way back if they should. */
+    if (irqs_off) __asm__ volatile("sti; nop; cli" ::: "memory");
+    /* Set from this CPU, with no interrupt to act on it. */
+    if (pc->need_resched) preempt_schedule();
+    if (irqs_off) preempt_stat_begin((uint64_t)(uintptr_t)__builtin_return_address(0));
+}
+
+#ifdef PREEMPT_STATS
+#define PREEMPT_STAT_TOP 8
+
+typedef struct {
+    uint64_t cycles;
+    uint64_t site;
+} np_section_t;
+
+/* The open stretch and the longest finished ones, per CPU; written by
+ * their own CPU only, with interrupts off. */
+typedef struct {
+    uint64_t start;             /* 0: no stretch open */
+    uint64_t site;
+    np_section_t top[PREEMPT_STAT_TOP];
+} __attribute__((aligned(64))) np_stats_t;
+
+static np_stats_t g_np[MAX_CPUS];
+
+void preempt_stat_begin(uint64_t site) {
+    uint64_t irq = read_rflags();
+    cpu_cli();
+    np_stats_t* s = &g_np[cpu_current_id()];
+    if (!s->start) {
+        s->start = rdtsc();
+        s->site = site;
+    }
+    if (irq & RFLAGS_IF) cpu_sti();
+}
+
+/* A site keeps one entry, its longest; a new site displaces the
+ * shortest entry if it beats it. */
+void preempt_stat_end(void) {
+    uint64_t irq = read_rflags();
+    cpu_cli();
+    np_stats_t* s = &g_np[cpu_current_id()];
+    if (s->start) {
+        uint64_t cycles = rdtsc() - s->start;
+        s->start = 0;
+        np_section_t* slot = 0;
+        for (uint32_t i = 0; i < PREEMPT_STAT_TOP && !slot; i++) {
+            if (s->top[i].cycles && s->top[i].site == s->site) slot = &s->top[i];
+        }
+        if (!slot) {
+            slot = &s->top[0];
+            for (uint32_t i = 1; i < PREEMPT_STAT_TOP; i++) {
+                if (s->top[i].cycles < slot->cycles) slot = &s->top[i];
+            }
+        }
+        if (cycles > slot->cycles) {
+            slot->cycles = cycles;
+            slot->site = s->site;
+        }
+    }
+    if (irq & RFLAGS_IF) cpu_sti();
+}
+
+static size_t site_show(char* buf, size_t size, uint64_t site) {
+    if (site & PREEMPT_SITE_SYSCALL) {
+        return (size_t)ksnprintf(buf, size, "syscall %llu",
+                                 (unsigned long long)(site & ~PREEMPT_SITE_SYSCALL));
+    }
+    if (site & PREEMPT_SITE_VECTOR) {
+        return (size_t)ksnprintf(buf, size, "vector 0x%llx",
+                                 (unsigned long long)(site & ~PREEMPT_SITE_VECTOR));
+    }
+    return (size_t)ksnprintf(buf, size, "%p", (void*)(uintptr_t)site);
+}
+
+/* All CPUs' entries, longest first. */
+static size_t sections_show(char* buf, size_t size) {
+    np_section_t all[MAX_CPUS * PREEMPT_STAT_TOP];
+    uint32_t cpu_of[MAX_CPUS * PREEMPT_STAT_TOP];
+    uint32_t count = 0;
+    for (uint32_t c = 0; c < MAX_CPUS; c++) {
+        for (uint32_t i = 0; i < PREEMPT_STAT_TOP; i++) {
+            if (!g_np[c].top[i].cycles) continue;
+            all[count] = g_np[c].top[i];
+            cpu_of[count++] = c;
+        }
+    }
+    size_t n = (size_t)ksnprintf(buf, size, "longest non-preemptible sections (us cpu site):\n");
+    for (uint32_t k = 0; k < count; k++) {
+        uint32_t best = k;
+        for (uint32_t j = k + 1; j < count; j++) {
+            if (all[j].cycles > all[best].cycles) best = j;
+        }
+        np_section_t t = all[k];
+        all[k] = all[best];
+        all[best] = t;
+        uint32_t tc = cpu_of[k];
+        cpu_of[k] = cpu_of[best];
+        cpu_of[best] = tc;
+
+        n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0, "%llu cpu%u ",
+                               (unsigned long long)(tsc_to_ns(all[k].cycles) / 1000), cpu_of[k]);
+        n += site_show(buf + (n < size ? n : size), n < size ? size - n : 0, all[k].site);
+        n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0, "\n");
+    }
+    return n;
+}
+#else
+static size_t sections_show(char* buf, size_t size) {
+    return (size_t)ksnprintf(buf, size, "section timing disabled (build with PREEMPT_STATS=1)\n");
+}
+#endif
+
+static size_t preempt_proc_show(char* buf, size_t size) {
+    size_t n = 0;
+    uint32_t online = cpu_online_count();
+    if (online == 0) online = 1;
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        percpu_t* p = percpu_of(c);
+        n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                               "cpu%u: count=0x%x kernel_preemptions=%llu\n", c, p->preempt_count,
+                               (unsigned long long)p->kernel_preemptions);
+    }
+    n += sections_show(buf + (n < size ? n : size), n < size ? size - n : 0);
+    return n;
+}
+
+void preempt_init(void) {
+    procfs_register("preempt", preempt_proc_show);
+}
@@ -0,0 +1,79 @@
+#include "procfs.h"
+#include "vfs.h"
+#include "pmm.h"
+#include "lib.h"
+
+/*
+ * Read-only text files under /proc.  Each read regenerates the text into a
+ * scratch page and copies out the requested window.
+ */
+
+#define PROCFS_MAX_FILES 16
+#define PROCFS_BUF_PAGES 1
+
+typedef struct {
+    const char* name;
+    procfs_show_t show;
+} procfs_entry_t;
+
+static procfs_entry_t g_entries[PROCFS_MAX_FILES];
+static size_t g_entry_count = 0;
+static vfs_node_t* g_proc_dir = 0;
+
+static vfs_ssize_t procfs_read(vfs_node_t* node, size_t offset, void* buf, size_t len) {
+    procfs_entry_t* e = (procfs_entry_t*)node->data;
+    if (!e || !buf) return -1;
+
+    char* text = (char*)(uintptr_t)pmm_alloc_pages(PROCFS_BUF_PAGES);
+    if (!text) return -1;
+    size_t cap = PROCFS_BUF_PAGES * PAGE_SIZE;
+    size_t n = e->show(text, cap);
+    if (n >= cap) n = cap - 1;
+
+    size_t out = 0;
+    if (offset < n) {
+        out = n - offset;
+        if (out > len) out = len;
+        memcpy(buf, text + offset, out);
+    }
+    pmm_free_pages((uint64_t)(uintptr_t)text, PROCFS_BUF_PAGES);
+    return (vfs_ssize_t)out;
+}
+
+static vfs_node_ops_t procfs_ops = {
+    .read = procfs_read,
+    .write = 0,
+    .create = 0,
+    .unlink = 0,
+};
+
+static int procfs_create(procfs_entry_t* e) {
+    if (vfs_find_child(g_proc_dir, e->name)) return 0;
+    vfs_node_t* node = vfs_create_node(e->name, VFS_NODE_FILE, &procfs_ops, e);
+    if (!node) return -1;
+    return vfs_add_child(g_proc_dir, node);
+}
+
+void procfs_init(void) {
+    vfs_node_t* root = vfs_root();
+    if (!root) return;
+
+    vfs_node_t* dir = vfs_find_child(root, "proc");
+    if (!dir) {
+        vfs_mkdir("/proc");
+        dir = vfs_find_child(root, "proc");
+    }
+    if (!dir || dir->type != VFS_NODE_DIR) return;
+    g_proc_dir = dir;
+
+    for (size_t i = 0; i < g_entry_count; i++) procfs_create(&g_entries[i]);
+}
+
+int procfs_register(const char* name, procfs_show_t show) {
+    if (!name || !show || g_entry_count >= PROCFS_MAX_FILES) return -1;
+    procfs_entry_t* e = &g_entries[g_entry_count++];
+    e->name = name;
+    e->show = show;
+    if (g_proc_dir) return procfs_create(e);
+    return 0;
+}
@@ -0,0 +1,203 @@
+#include "rbtree.h"
+
+static void rotate_left(rb_root_t* root, rb_node_t* x) {
+    rb_node_t* y = x->right;
+    x->right = y->left;
+    if (y->left) y->left->parent = x;
+    y->parent = x->parent;
+    if (!x->parent) root->root = y;
+    else if (x == x->parent->left) x->parent->left = y;
+    else x->parent->right = y;
+    y->left = x;
+    x->parent = y;
+}
+
+static void rotate_right(rb_root_t* root, rb_node_t* x) {
+    rb_node_t* y = x->left;
+    x->left = y->right;
+    if (y->right) y->right->parent = x;
+    y->parent = x->parent;
+    if (!x->parent) root->root = y;
+    else if (x == x->parent->right) x->parent->right = y;
+    else x->parent->left = y;
+    y->right = x;
+    x->parent = y;
+}
+
+void rb_insert(rb_root_t* root, rb_node_t* node, rb_less_t less) {
+    rb_node_t* parent = 0;
+    rb_node_t** link = &root->root;
+    bool leftmost = true;
+    while (*link) {
+        parent = *link;
+        if (less(node, parent)) {
+            link = &parent->left;
+        } else {
+            link = &parent->right;
+            leftmost = false;
+        }
+    }
+    node->parent = parent;
+    node->left = node->right = 0;
+    node->red = true;
+    *link = node;
+    if (leftmost) root->leftmost = node;
+
+    /* Fix up: a red node may not have a red parent. */
+    rb_node_t* z = node;
+    while (z->parent && z->parent->red) {
+        rb_node_t* p = z->parent;
+        rb_node_t* g = p->parent;
+        if (p == g->left) {
+            rb_node_t* u = g->right;
+            if (u && u->red) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                z = g;
+                continue;
+            }
+            if (z == p->right) {
+                rotate_left(root, p);
+                z = p;
+                p = z->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rotate_right(root, g);
+        } else {
+            rb_node_t* u = g->left;
+            if (u && u->red) {
+                p->red = false;
+                u->red = false;
+                g->red = true;
+                z = g;
+                continue;
+            }
+            if (z == p->left) {
+                rotate_right(root, p);
+                z = p;
+                p = z->parent;
+            }
+            p->red = false;
+            g->red = true;
+            rotate_left(root, g);
+        }
+    }
+    root->root->red = false;
+}
+
+rb_node_t* rb_next(const rb_node_t* node) {
+    if (node->right) {
+        node = node->right;
+        while (node->left) node = node->left;
+        return (rb_node_t*)node;
+    }
+    while (node->parent && node == node->parent->right) node = node->parent;
+    return node->parent;
+}
+
+/* Put v where u was (u's subtree links are the caller's business). */
+static void transplant(rb_root_t* root, rb_node_t* u, rb_node_t* v) {
+    if (!u->parent) root->root = v;
+    else if (u == u->parent->left) u->parent->left = v;
+    else u->parent->right = v;
+    if (v) v->parent = u->parent;
+}
+
+void rb_erase(rb_root_t* root, rb_node_t* z) {
+    if (root->leftmost == z) root->leftmost = rb_next(z);
+
+    rb_node_t* x;
+    rb_node_t* x_parent;
+    bool removed_red;
+
+    if (!z->left) {
+        x = z->right;
+        x_parent = z->parent;
+        removed_red = z->red;
+        transplant(root, z, z->right);
+    } else if (!z->right) {
+        x = z->left;
+        x_parent = z->parent;
+        removed_red = z->red;
+        transplant(root, z, z->left);
+    } else {
+        rb_node_t* y = z->right;
+        while (y->left) y = y->left;
+        removed_red = y->red;
+        x = y->right;
+        if (y->parent == z) {
+            x_parent = y;
+        } else {
+            x_parent = y->parent;
+            transplant(root, y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+        transplant(root, z, y);
+        y->left = z->left;
+        y->left->parent = y;
+        y->red = z->red;
+    }
+    z->parent = z->left = z->right = 0;
+    if (removed_red) return;
+
+    /* Fix up: x carries an extra black. */
+    while (x != root->root && (!x || !x->red)) {
+        if (x == x_parent->left) {
+            rb_node_t* w = x_parent->right;
+            if (w->red) {
+                w->red = false;
+                x_parent->red = true;
+                rotate_left(root, x_parent);
+                w = x_parent->right;
+            }
+            if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+                w->red = true;
+                x = x_parent;
+                x_parent = x->parent;
+            } else {
+                if (!w->right || !w->right->red) {
+                    w->left->red = false;
+                    w->red = true;
+                    rotate_right(root, w);
+                    w = x_parent->right;
+                }
+                w->red = x_parent->red;
+                x_parent->red = false;
+                if (w->right) w->right->red = false;
+                rotate_left(root, x_parent);
+                x = root->root;
+                break;
+            }
+        } else {
+            rb_node_t* w = x_parent->left;
+            if (w->red) {
+                w->red = false;
+                x_parent->red = true;
+                rotate_right(root, x_parent);
+                w = x_parent->left;
+            }
+            if ((!w->right || !w->right->red) && (!w->left || !w->left->red)) {
+                w->red = true;
+                x = x_parent;
+                x_parent = x->parent;
+            } else {
+                if (!w->left || !w->left->red) {
+                    w->right->red = false;
+                    w->red = true;
+                    rotate_left(root, w);
+                    w = x_parent->left;
+                }
+                w->red = x_parent->red;
+                x_parent->red = false;
+                if (w->left) w->left->red = false;
+                rotate_right(root, x_parent);
+                x = root->root;
+                break;
+            }
+        }
+    }
+    if (x) x->red = false;
+}
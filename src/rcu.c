@@ -0,0 +1,183 @@
+#include "rcu.h"
+#include "thread.h"
+#include "scheduler.h"
+#include "sync.h"
+#include "procfs.h"
+#include "lib.h"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/common.h"
+#include "arch/x86_64/spinlock.h"
+#include "arch/x86_64/smp.h"
+
+/* Per-CPU quiescent-state tracking, a line per CPU so reports from the
+ * context switch and kernel entry don't bounce between CPUs. */
+typedef struct {
+    volatile uint64_t qs;       /* quiescent states passed so far */
+    volatile uint32_t idle;     /* in the idle loop: quiescent until cleared */
+} __attribute__((aligned(64))) rcu_cpu_t;
+
+static rcu_cpu_t g_cpu[MAX_CPUS];
+
+/* Failed grace-period checks between IPIs to CPUs yet to report. */
+#define RCU_KICK_POLLS 16
+
+/* Callbacks waiting for the rcu thread to start a grace period for them. */
+static spinlock_t g_cb_lock;
+static rcu_head_t* g_cb_head;
+static rcu_head_t** g_cb_tail = &g_cb_head;
+static wait_queue_t g_cb_wq;
+static thread_t* g_rcu_thread;
+
+static volatile uint64_t g_gp_count;
+static volatile uint64_t g_cb_queued;
+static volatile uint64_t g_cb_invoked;
+
+void rcu_read_lock(void) {
+    preempt_disable();
+}
+
+void rcu_read_unlock(void) {
+    preempt_enable();
+}
+
+void rcu_note_qs(uint32_t cpu) {
+    if (cpu >= MAX_CPUS) return;
+    g_cpu[cpu].idle = 0;
+    g_cpu[cpu].qs++;
+}
+
+/* The idle loop holds no references; the next context switch away from
+ * it clears the flag again through rcu_note_qs(). */
+void rcu_idle_enter(uint32_t cpu) {
+    if (cpu >= MAX_CPUS) return;
+    __sync_synchronize();
+    g_cpu[cpu].idle = 1;
+}
+
+typedef struct {
+    uint32_t ncpus;
+    uint32_t self;
+    uint64_t qs[MAX_CPUS];
+} rcu_snapshot_t;
+
+static void gp_snapshot(rcu_snapshot_t* s) {
+    __sync_synchronize();
+    s->ncpus = cpu_online_count();
+    if (s->ncpus == 0 || s->ncpus > MAX_CPUS) s->ncpus = s->ncpus ? MAX_CPUS : 1;
+    s->self = cpu_current_id();
+    for (uint32_t c = 0; c < s->ncpus; c++) s->qs[c] = g_cpu[c].qs;
+}
+
+/* Our own CPU is quiescent by construction: readers cannot be preempted,
+ * so none is running here while we are. */
+static bool gp_done(const rcu_snapshot_t* s) {
+    for (uint32_t c = 0; c < s->ncpus; c++) {
+        if (c == s->self) continue;
+        if (g_cpu[c].qs == s->qs[c] && !g_cpu[c].idle) return false;
+    }
+    __sync_synchronize();
+    return true;
+}
+
+/* A CPU running one user thread may have no tick and never switch:
+ * interrupt it, and its return to the kernel from user mode reports. */
+static void gp_kick(const rcu_snapshot_t* s) {
+    for (uint32_t c = 0; c < s->ncpus; c++) {
+        if (c == s->self) continue;
+        if (g_cpu[c].qs == s->qs[c] && !g_cpu[c].idle) smp_send_resched(c);
+    }
+}
+
+static void gp_wait(void) {
+    rcu_snapshot_t s;
+    gp_snapshot(&s);
+    for (uint32_t polls = 0; !gp_done(&s); polls++) {
+        if ((polls & (RCU_KICK_POLLS - 1)) == 1) gp_kick(&s);
+        if (scheduler_can_block()) scheduler_sleep(1);
+        else cpu_pause();
+    }
+    g_gp_count++;
+}
+
+void call_rcu(rcu_head_t* head, void (*func)(rcu_head_t* head)) {
+    head->func = func;
+    head->next = 0;
+    uint64_t irq = spinlock_lock_irqsave(&g_cb_lock);
+    *g_cb_tail = head;
+    g_cb_tail = &head->next;
+    g_cb_queued++;
+    spinlock_unlock_irqrestore(&g_cb_lock, irq);
+    wake_up(&g_cb_wq);
+}
+
+typedef struct {
+    rcu_head_t   head;
+    completion_t done;
+} rcu_sync_t;
+
+static void rcu_sync_done(rcu_head_t* head) {
+    complete(&container_of(head, rcu_sync_t, head)->done);
+}
+
+void synchronize_rcu(void) {
+    /* Before the rcu thread exists, or where we cannot sleep, poll. */
+    if (!g_rcu_thread || !scheduler_can_block()) {
+        gp_wait();
+        return;
+    }
+    rcu_sync_t s;
+    completion_init(&s.done);
+    call_rcu(&s.head, rcu_sync_done);
+    wait_for_completion(&s.done);
+}
+
+static bool rcu_has_callbacks(void* arg) {
+    (void)arg;
+    return g_cb_head != 0;
+}
+
+/* Takes the whole pending list, waits out one grace period for all of
+ * it and runs the callbacks; callbacks queued meanwhile form the next
+ * batch. */
+static void rcu_thread(void* arg) {
+    (void)arg;
+    for (;;) {
+        wait_until(&g_cb_wq, rcu_has_callbacks, 0, 0);
+
+        uint64_t irq = spinlock_lock_irqsave(&g_cb_lock);
+        rcu_head_t* list = g_cb_head;
+        g_cb_head = 0;
+        g_cb_tail = &g_cb_head;
+        spinlock_unlock_irqrestore(&g_cb_lock, irq);
+
+        gp_wait();
+        while (list) {
+            rcu_head_t* next = list->next;
+            list->func(list);
+            g_cb_invoked++;
+            list = next;
+        }
+    }
+}
+
+static size_t rcu_proc_show(char* buf, size_t size) {
+    size_t n = (size_t)ksnprintf(buf, size, "grace_periods %llu callbacks queued %llu invoked %llu\n",
+                                 (unsigned long long)g_gp_count, (unsigned long long)g_cb_queued,
+                                 (unsigned long long)g_cb_invoked);
+    uint32_t online = cpu_online_count();
+    if (online == 0) online = 1;
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                               "cpu%u: qs=%llu idle=%u\n", c, (unsigned long long)g_cpu[c].qs,
+                               g_cpu[c].idle);
+    }
+    return n;
+}
+
+void rcu_init(void) {
+    spinlock_init(&g_cb_lock);
+    spinlock_set_name(&g_cb_lock, "rcu_callbacks");
+    wait_queue_init(&g_cb_wq);
+    procfs_register("rcu", rcu_proc_show);
+    g_rcu_thread = thread_create_kernel("rcu", rcu_thread, 0);
+}
@@ -0,0 +1,141 @@
+#include "sched_trace.h"
+#include "procfs.h"
+#include "lib.h"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/common.h"
+#include "arch/x86_64/spinlock.h"
+
+/* Bucket b > 0 counts samples of [2^(b-1), 2^b) us; bucket 0, under 1 us. */
+#define SCHED_HIST_BUCKETS 24
+
+typedef struct {
+    volatile uint64_t head;     /* records written so far */
+    uint64_t start;             /* head when tracing last started */
+    sched_event_t ev[SCHED_TRACE_EVENTS];
+} __attribute__((aligned(64))) trace_ring_t;
+
+typedef struct {
+    uint64_t count[SCHED_HIST_BUCKETS];
+    uint64_t samples;
+    uint64_t max_ns;
+} sched_hist_t;
+
+/* Written by their own CPU only. */
+typedef struct {
+    sched_hist_t runq;
+    sched_hist_t slice;
+} __attribute__((aligned(64))) cpu_hist_t;
+
+volatile bool g_sched_trace_on;
+static trace_ring_t g_ring[MAX_CPUS];
+static cpu_hist_t g_hist[MAX_CPUS];
+
+void sched_trace_record(uint32_t type, uint32_t pid, uint32_t arg0, uint32_t arg1) {
+    uint64_t irq = irq_save();
+    uint32_t cpu = cpu_current_id();
+    trace_ring_t* r = &g_ring[cpu];
+    uint64_t h = r->head;
+    sched_event_t* e = &r->ev[h & (SCHED_TRACE_EVENTS - 1)];
+    e->tsc = rdtsc();
+    e->type = type;
+    e->cpu = cpu;
+    e->pid = pid;
+    e->arg0 = arg0;
+    e->arg1 = arg1;
+    e->reserved = 0;
+    /* x86 keeps stores in order: the record is complete before head moves. */
+    __asm__ volatile("" ::: "memory");
+    r->head = h + 1;
+    irq_restore(irq);
+}
+
+static void hist_add(sched_hist_t* h, uint64_t ns) {
+    uint64_t us = ns / 1000;
+    uint32_t b = us ? 64 - (uint32_t)__builtin_clzll(us) : 0;
+    if (b >= SCHED_HIST_BUCKETS) b = SCHED_HIST_BUCKETS - 1;
+    h->count[b]++;
+    h->samples++;
+    if (ns > h->max_ns) h->max_ns = ns;
+}
+
+void sched_hist_runq(uint32_t cpu, uint64_t wait_ns) {
+    if (cpu < MAX_CPUS) hist_add(&g_hist[cpu].runq, wait_ns);
+}
+
+void sched_hist_slice(uint32_t cpu, uint64_t ran_ns) {
+    if (cpu < MAX_CPUS) hist_add(&g_hist[cpu].slice, ran_ns);
+}
+
+/* Histograms are reset with tracing stopped; a sample racing the memset
+ * is lost or kept, either way harmless. */
+void sched_trace_start(void) {
+    g_sched_trace_on = false;
+    for (uint32_t c = 0; c < MAX_CPUS; c++) {
+        g_ring[c].start = g_ring[c].head;
+        memset(&g_hist[c], 0, sizeof(g_hist[c]));
+    }
+    __sync_synchronize();
+    g_sched_trace_on = true;
+}
+
+void sched_trace_stop(void) {
+    g_sched_trace_on = false;
+}
+
+int64_t sched_trace_read(uint32_t cpu, sched_event_t* out, uint64_t max) {
+    if (cpu >= MAX_CPUS || !out) return -1;
+    trace_ring_t* r = &g_ring[cpu];
+    uint64_t h1 = r->head;
+    uint64_t first = h1 > SCHED_TRACE_EVENTS ? h1 - SCHED_TRACE_EVENTS : 0;
+    if (first < r->start) first = r->start;
+    if (h1 - first > max) first = h1 - max;
+    for (uint64_t i = first; i < h1; i++) {
+        out[i - first] = r->ev[i & (SCHED_TRACE_EVENTS - 1)];
+    }
+    __asm__ volatile("" ::: "memory");
+    /* The writer may have lapped the oldest copies, and be overwriting
+     * slot h2 right now: keep only what it cannot have touched. */
+    uint64_t h2 = r->head;
+    uint64_t valid = h2 + 1 > SCHED_TRACE_EVENTS ? h2 + 1 - SCHED_TRACE_EVENTS : 0;
+    if (valid <= first) return (int64_t)(h1 - first);
+    if (valid >= h1) return 0;
+    uint64_t skip = valid - first;
+    for (uint64_t i = 0; i < h1 - valid; i++) out[i] = out[i + skip];
+    return (int64_t)(h1 - valid);
+}
+
+static size_t hist_show(char* buf, size_t size, const char* name, bool slice) {
+    sched_hist_t sum;
+    memset(&sum, 0, sizeof(sum));
+    uint32_t online = cpu_online_count();
+    if (online == 0) online = 1;
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        const sched_hist_t* h = slice ? &g_hist[c].slice : &g_hist[c].runq;
+        for (uint32_t b = 0; b < SCHED_HIST_BUCKETS; b++) sum.count[b] += h->count[b];
+        sum.samples += h->samples;
+        if (h->max_ns > sum.max_ns) sum.max_ns = h->max_ns;
+    }
+    size_t n = (size_t)ksnprintf(buf, size, "%s samples=%llu max_us=%llu\n", name,
+                                 (unsigned long long)sum.samples,
+                                 (unsigned long long)(sum.max_ns / 1000));
+    for (uint32_t b = 0; b < SCHED_HIST_BUCKETS; b++) {
+        if (!sum.count[b]) continue;
+        uint64_t lo = b ? 1ULL << (b - 1) : 0;
+        uint64_t hi = 1ULL << b;
+        n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                               "%s %llu %llu %llu\n", name, (unsigned long long)lo,
+                               (unsigned long long)hi, (unsigned long long)sum.count[b]);
+    }
+    return n;
+}
+
+/* Lines "<histogram> <lo_us> <hi_us> <count>", after a summary line. */
+static size_t schedlat_proc_show(char* buf, size_t size) {
+    size_t n = hist_show(buf, size, "runq", false);
+    n += hist_show(buf + (n < size ? n : size), n < size ? size - n : 0, "slice", true);
+    return n;
+}
+
+void sched_trace_init(void) {
+    procfs_register("schedlat", schedlat_proc_show);
+}
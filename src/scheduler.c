@@ -5,22 +5,161 @@
 #include "vmm.h"
 #include "vfs.h"
 #include "kmalloc.h"
+#include "kstack.h"
 #include "arch/x86_64/common.h"
 #include "arch/x86_64/gdt.h"
 #include "arch/x86_64/pit.h"
+#include "arch/x86_64/tsc.h"
 #include "arch/x86_64/cpu.h"
+#include "arch/x86_64/fpu.h"
 #include "arch/x86_64/spinlock.h"
+#include "arch/x86_64/smp.h"
+#include "procfs.h"
+#include "tick.h"
+#include "timer.h"
+#include "hrtimer.h"
+#include "time.h"
+#include "futex.h"
+#include "rcu.h"
+#include "cputime.h"
+#include "sched_trace.h"
 
-#define MAX_THREADS   64
-#define KSTACK_PAGES  4   /* 16 KiB */
 #define USTACK_PAGES  4   /* 16 KiB */
 
-static thread_t g_threads[MAX_THREADS];
-static thread_t* g_current[MAX_CPUS];
-static uint64_t g_next_id = 1;
+/* Fair class.  A thread's vruntime advances by its run time scaled by
+ * NICE_0_WEIGHT / weight, and each CPU runs its queued thread with the
+ * smallest vruntime.  Every runnable thread gets a turn within
+ * SCHED_LATENCY_NS unless that would cut slices below SCHED_MIN_GRAN_NS;
+ * a waking thread preempts only if it trails by SCHED_WAKEUP_GRAN_NS. */
+#define NICE_0_WEIGHT        1024
+#define SCHED_LATENCY_NS     6000000ULL
+#define SCHED_MIN_GRAN_NS    750000ULL
+#define SCHED_WAKEUP_GRAN_NS 1000000ULL
+
+/* Real-time and deadline classes.  SCHED_RR threads of equal priority
+ * take turns every SCHED_RR_SLICE_NS.  Deadline reservations are admitted
+ * per CPU while their total bandwidth (runtime/period, DL_BW_SHIFT fixed
+ * point) stays within DL_BW_LIMIT, leaving room for everything else. */
+#define SCHED_RR_SLICE_NS    100000000ULL
+#define DL_BW_SHIFT          20
+#define DL_BW_LIMIT          ((95ULL << DL_BW_SHIFT) / 100)
+#define DL_PERIOD_MAX_NS     1000000000ULL
+#define DL_RUNTIME_MIN_NS    10000ULL
+
+/* Weight per nice level (-20..19), each ~1.25x the next. */
+static const uint32_t k_nice_weight[THREAD_NICE_MAX - THREAD_NICE_MIN + 1] = {
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916,
+     9548,  7620,  6100,  4904,  3906,  3121,  2501,  1991,  1586,  1277,
+     1024,   820,   655,   526,   423,   335,   272,   215,   172,   137,
+      110,    87,    70,    56,    45,    36,    29,    23,    18,    15,
+};
+
+/* Threads are looked up by id through a hash; ids are sequential, so the
+ * low bits spread them evenly over the buckets. */
+#define PID_HASH_BITS 10
+#define PID_HASH_SIZE (1u << PID_HASH_BITS)
+
+/* Load balancing.  The periodic balance counts 10 ms load-clock periods
+ * whatever HZ is; the other intervals are in scheduler ticks. */
+#define SCHED_BALANCE_TICKS   10  /* periodic pull from the busiest CPU */
+#define SCHED_CACHE_HOT_TICKS 2   /* ran this recently: leave it where it is */
+
+/* Load averages are 16.16 fixed point, decayed per elapsed 10 ms period
+ * with e^(-1/100), e^(-1/1000), e^(-1/6000): ~1 s, 10 s and 60 s windows. */
+#define LOAD_CLOCK_HZ 100
+#define LOAD_SHIFT 16
+#define LOAD_ONE   (1ULL << LOAD_SHIFT)
+#define LOAD_WINDOWS 3
+static const uint64_t k_load_decay[LOAD_WINDOWS] = { 64884, 65470, 65525 };
+
+/*
+ * Locking:
+ *   g_sched_lock  PID hash, parent/child links, lifecycle (zombie/reap).
+ *   rq->lock      one CPU's run queue, and the state of threads assigned
+ *                 to that CPU.  Sleeps are timers on the sleeper's CPU wheel.
+ * Order is g_sched_lock -> rq->lock; schedule() takes only its own rq lock.
+ *
+ * Cross-CPU wakeup: the waker locks the target thread's runqueue, marks the
+ * thread READY and enqueues it, and sets need_resched if it should preempt
+ * what runs there.  After dropping the lock it sends a RESCHED IPI if the
+ * target is another CPU; that CPU then enters schedule() from the IPI.
+ * The flag lives in the target's percpu_t, where an idle CPU MWAITs on it:
+ * then setting it is the whole wakeup and smp_send_resched() skips the IPI.
+ */
+typedef struct {
+    thread_t* head;
+    thread_t* tail;
+} thread_list_t;
+
+#define RT_PRIO_LEVELS (SCHED_RT_PRIO_MAX + 1)
+
+typedef struct runqueue {
+    spinlock_t lock;
+    rb_root_t dl;                           /* READY deadline threads by deadline */
+    uint32_t dl_nr;
+    uint64_t dl_bw;                         /* admitted deadline bandwidth */
+    uint64_t dl_throttles;
+    uint64_t rt_bitmap[2];                  /* bit p set: rt_queue[p] non-empty */
+    thread_list_t rt_queue[RT_PRIO_LEVELS]; /* READY real-time threads, FIFO per priority */
+    uint32_t rt_nr;
+    rb_root_t fair;                         /* READY fair threads by vruntime */
+    uint32_t fair_nr;
+    uint64_t fair_weight;                   /* sum of their weights */
+    uint64_t min_vruntime;                  /* monotonic; floor for placement */
+    uint32_t nr_running;                    /* queued threads (excludes current) */
+    thread_t* idle;                         /* per-CPU bootstrap thread, never queued */
+    bool yielded;                           /* current asked to go behind its peers */
+    uint64_t nr_switches;
+
+    /* Thread switched away from last; its on_cpu is cleared at the next
+     * schedule(), once this CPU is certainly off its kernel stack. */
+    thread_t* switched_from;
+
+    /* Current thread descheduled by the last schedule() because its
+     * affinity no longer includes this CPU; moved on from the next one,
+     * when it is certainly off this CPU. */
+    thread_t* push_thread;
+
+    /* Balancing state and statistics; written only by the owning CPU
+     * except the migration counters (under both runqueue locks). */
+    uint64_t last_load_clock;
+    uint64_t nr_timer_events;
+    uint32_t balance_countdown;
+    uint64_t load_avg[LOAD_WINDOWS];
+    uint64_t migrations_in;
+    uint64_t migrations_out;
+} runqueue_t;
+
+static uint64_t g_fs_base[MAX_CPUS];        /* IA32_FS_BASE as last loaded */
+static runqueue_t g_rq[MAX_CPUS];
+static uint64_t g_next_id = 0;
+
+/* Thread objects are carved out of whole pages and recycled through a free
+ * list, so fork/exit churn never touches the page allocator for them. */
+static thread_t* g_thread_free;
+static spinlock_t g_thread_cache_lock;
+static uint64_t g_thread_cache_objs;
+
+static thread_t* g_pid_hash[PID_HASH_SIZE];
+static volatile uint64_t g_thread_count;
+
+/* Reaped threads whose CPU may still be on their kernel stack; destroyed
+ * from schedule() once on_cpu drops. */
+static thread_t* g_dead_list;
+static spinlock_t g_dead_lock;
+
+/* Last tick an idle CPU was kicked to pull work from a busy one. */
+static uint64_t g_nohz_balance_tick;
 static spinlock_t g_sched_lock;
 static uint32_t g_cpu_rr = 0;
 
+/* Runnable threads on a CPU, counting the one it is running. */
+static uint32_t rq_load(uint32_t cpu) {
+    runqueue_t* rq = &g_rq[cpu];
+    thread_t* cur = percpu_of(cpu)->current;
+    return rq->nr_running + ((cur && cur != rq->idle && cur->state == THREAD_RUNNING) ? 1u : 0u);
+}
+
 static uint64_t kspace_cr3 = 0;
 
 static uint64_t make_kstack_canary(const thread_t* t) {
@@ -34,12 +173,6 @@ static uint64_t make_kstack_canary(const thread_t* t) {
     return v;
 }
 
-thread_t* thread_current(void) {
-    uint32_t cpu = cpu_current_id();
-    if (cpu >= MAX_CPUS) cpu = 0;
-    return g_current[cpu];
-}
-
 void thread_kstack_canary_init(thread_t* t) {
     if (!t || !t->kstack || t->kstack_size < sizeof(uint64_t)) return;
     t->kstack_canary = make_kstack_canary(t);
@@ -51,12 +184,6 @@ bool thread_kstack_canary_ok(const thread_t* t) {
     return *(const uint64_t*)(uintptr_t)t->kstack == t->kstack_canary;
 }
 
-static void* alloc_pages(size_t pages) {
-    uint64_t p = pmm_alloc_pages(pages);
-    if (!p) return 0;
-    return (void*)(uintptr_t)p; /* identity mapped */
-}
-
 static void build_kernel_thread_frame(thread_t* t, void (*fn)(void*), void* arg) {
     uint8_t* top = t->kstack + t->kstack_size;
     /* Make entry RSP = top-8 so a C function entered via iret sees RSP%16==8. */
@@ -141,46 +268,241 @@ void thread_trampoline(void (*fn)(void*), void* arg) {
     for (;;) { cpu_hlt(); }
 }
 
-static thread_t* thread_alloc_slot(void) {
-    for (size_t i = 0; i < MAX_THREADS; i++) {
-        if (g_threads[i].state == THREAD_UNUSED) {
-            memset(&g_threads[i], 0, sizeof(thread_t));
-            g_threads[i].state = THREAD_READY;
-            g_threads[i].priority = 1;
-            g_threads[i].id = g_next_id++;
-            return &g_threads[i];
+_Static_assert(sizeof(thread_t) <= PAGE_SIZE, "thread_t must fit in a page");
+
+static thread_t* thread_cache_alloc(void) {
+    uint64_t irq = spinlock_lock_irqsave(&g_thread_cache_lock);
+    if (!g_thread_free) {
+        uint64_t page = pmm_alloc_pages(1);
+        if (!page) {
+            spinlock_unlock_irqrestore(&g_thread_cache_lock, irq);
+            return 0;
+        }
+        thread_t* objs = (thread_t*)(uintptr_t)page;
+        size_t n = PAGE_SIZE / sizeof(thread_t);
+        for (size_t i = 0; i < n; i++) {
+            objs[i].hash_next = g_thread_free;
+            g_thread_free = &objs[i];
+        }
+        g_thread_cache_objs += n;
+    }
+    thread_t* t = g_thread_free;
+    g_thread_free = t->hash_next;
+    spinlock_unlock_irqrestore(&g_thread_cache_lock, irq);
+    memset(t, 0, sizeof(thread_t));
+    return t;
+}
+
+static void thread_cache_free(thread_t* t) {
+    t->state = THREAD_UNUSED;
+    uint64_t irq = spinlock_lock_irqsave(&g_thread_cache_lock);
+    t->hash_next = g_thread_free;
+    g_thread_free = t;
+    spinlock_unlock_irqrestore(&g_thread_cache_lock, irq);
+}
+
+static void pid_hash_insert(thread_t* t) {
+    thread_t** head = &g_pid_hash[t->id & (PID_HASH_SIZE - 1)];
+    t->hash_next = *head;
+    *head = t;
+}
+
+static void pid_hash_remove(thread_t* t) {
+    thread_t** pp = &g_pid_hash[t->id & (PID_HASH_SIZE - 1)];
+    while (*pp && *pp != t) pp = &(*pp)->hash_next;
+    if (*pp) *pp = t->hash_next;
+    t->hash_next = 0;
+}
+
+static void thread_link_child(thread_t* parent, thread_t* t) {
+    t->parent = parent;
+    if (!parent) return;
+    parent->children++;
+    t->sibling_prev = 0;
+    t->sibling_next = parent->first_child;
+    if (parent->first_child) parent->first_child->sibling_prev = t;
+    parent->first_child = t;
+}
+
+static void thread_unlink_child(thread_t* t) {
+    thread_t* parent = t->parent;
+    if (!parent) return;
+    if (t->sibling_prev) t->sibling_prev->sibling_next = t->sibling_next;
+    else parent->first_child = t->sibling_next;
+    if (t->sibling_next) t->sibling_next->sibling_prev = t->sibling_prev;
+    t->sibling_next = t->sibling_prev = 0;
+    t->parent = 0;
+}
+
+static void dl_replenish(void* arg);
+
+/* New READY thread with the next id, hashed and counted.  Caller holds
+ * g_sched_lock. */
+static thread_t* thread_alloc(void) {
+    thread_t* t = thread_cache_alloc();
+    if (!t) return 0;
+    t->state = THREAD_READY;
+    t->weight = NICE_0_WEIGHT;
+    t->cpu_affinity = CPU_MASK_ALL;
+    t->group_refs = 1;
+    t->id = g_next_id++;
+    ktimer_init(&t->sleep_timer, scheduler_timer_wakeup, t);
+    hrtimer_setup(&t->hr_sleep, scheduler_timer_wakeup, t);
+    hrtimer_setup(&t->dl_timer, dl_replenish, t);
+    wait_queue_init(&t->child_exit);
+    t->timer_slack_ns = THREAD_TIMER_SLACK_NS;
+    pid_hash_insert(t);
+    g_thread_count++;
+    return t;
+}
+
+/* Undo thread_alloc() for a thread that never ran; the caller has already
+ * released whatever resources it attached. */
+static void thread_discard(thread_t* t) {
+    if (t->parent && t->parent->children > 0) t->parent->children--;
+    thread_unlink_child(t);
+    pid_hash_remove(t);
+    g_thread_count--;
+    thread_cache_free(t);
+}
+
+/* Next online CPU in mask, round-robin; mask must include one. */
+static uint32_t scheduler_pick_cpu(uint64_t mask) {
+    mask &= cpu_online_mask();
+    if (!mask) return 0;
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        uint32_t cpu = (g_cpu_rr + i) % MAX_CPUS;
+        if (mask & (1ULL << cpu)) {
+            g_cpu_rr = (cpu + 1) % MAX_CPUS;
+            return cpu;
         }
     }
     return 0;
 }
 
-static uint32_t scheduler_pick_cpu(void) {
+static size_t sched_proc_show(char* buf, size_t size) {
+    size_t n = 0;
     uint32_t online = cpu_online_count();
-    if (online == 0) return 0;
-    uint32_t cpu = g_cpu_rr % online;
-    g_cpu_rr = (g_cpu_rr + 1) % online;
-    return cpu;
+    if (online == 0) online = 1;
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        runqueue_t* rq = &g_rq[c];
+        thread_t* cur = percpu_of(c)->current;
+        uint64_t l[LOAD_WINDOWS];
+        for (int w = 0; w < LOAD_WINDOWS; w++) l[w] = (rq->load_avg[w] * 100) >> LOAD_SHIFT;
+        n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                               "cpu%u: running=%u rt=%u dl=%u dl_bw=%llu/1024 dl_throttles=%llu switches=%llu timer_events=%llu migrated_in=%llu "
+                               "migrated_out=%llu load=%llu.%llu%llu,%llu.%llu%llu,%llu.%llu%llu current=%s\n",
+                               c, rq->nr_running, rq->rt_nr, rq->dl_nr,
+                               (unsigned long long)(rq->dl_bw >> (DL_BW_SHIFT - 10)),
+                               (unsigned long long)rq->dl_throttles,
+                               (unsigned long long)rq->nr_switches,
+                               (unsigned long long)rq->nr_timer_events,
+                               (unsigned long long)rq->migrations_in,
+                               (unsigned long long)rq->migrations_out,
+                               (unsigned long long)(l[0] / 100), (unsigned long long)(l[0] / 10 % 10),
+                               (unsigned long long)(l[0] % 10),
+                               (unsigned long long)(l[1] / 100), (unsigned long long)(l[1] / 10 % 10),
+                               (unsigned long long)(l[1] % 10),
+                               (unsigned long long)(l[2] / 100), (unsigned long long)(l[2] / 10 % 10),
+                               (unsigned long long)(l[2] % 10),
+                               cur ? cur->name : "-");
+    }
+    n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                           "threads: live=%llu cached=%llu next_pid=%llu\n",
+                           (unsigned long long)g_thread_count,
+                           (unsigned long long)g_thread_cache_objs,
+                           (unsigned long long)g_next_id);
+    return n;
+}
+
+/* Process totals: the leader's own time, its live members' and its
+ * exited members'.  Caller holds g_sched_lock. */
+static void proc_cputime(const thread_t* proc, cputime_t* out) {
+    *out = proc->cpu;
+    cputime_add(out, &proc->cpu_dead);
+    for (const thread_t* m = proc->group_next; m; m = m->group_next) cputime_add(out, &m->cpu);
+}
+
+static char proc_state_char(const thread_t* t) {
+    if (t == g_rq[t->cpu_id < MAX_CPUS ? t->cpu_id : 0].idle) return 'I';
+    switch (t->state) {
+        case THREAD_RUNNING:
+        case THREAD_READY: return 'R';
+        case THREAD_SLEEPING: return 'S';
+        case THREAD_BLOCKED: return 'D';
+        case THREAD_ZOMBIE: return 'Z';
+        default: return '?';
+    }
+}
+
+/* One line per process (thread group); idle threads show as state I. */
+static size_t pstat_proc_show(char* buf, size_t size) {
+    size_t n = (size_t)ksnprintf(buf, size,
+                                 "pid ppid state threads cpu policy nice user_us sys_us irq_us "
+                                 "wait_us vcsw ivcsw name\n");
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
+    for (size_t b = 0; b < PID_HASH_SIZE; b++) {
+        for (thread_t* t = g_pid_hash[b]; t; t = t->hash_next) {
+            if (t->group_leader) continue;
+            cputime_t c;
+            proc_cputime(t, &c);
+            uint32_t threads = 1;
+            for (thread_t* m = t->group_next; m; m = m->group_next) threads++;
+            n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                                   "%llu %lld %c %u %u %u %d %llu %llu %llu %llu %llu %llu %s\n",
+                                   (unsigned long long)t->id,
+                                   t->parent ? (long long)t->parent->id : -1LL,
+                                   proc_state_char(t), threads, t->cpu_id, t->policy, t->nice,
+                                   (unsigned long long)(tsc_to_ns(c.user_cycles) / 1000),
+                                   (unsigned long long)(tsc_to_ns(c.sys_cycles) / 1000),
+                                   (unsigned long long)(tsc_to_ns(c.irq_cycles) / 1000),
+                                   (unsigned long long)(c.wait_ns / 1000),
+                                   (unsigned long long)c.nvcsw, (unsigned long long)c.nivcsw,
+                                   t->name);
+        }
+    }
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
+    return n;
 }
 
 void scheduler_init(void) {
-    memset(g_threads, 0, sizeof(g_threads));
     kspace_cr3 = vmm_kernel_cr3();
-    memset(g_current, 0, sizeof(g_current));
     spinlock_init(&g_sched_lock);
+    spinlock_init(&g_thread_cache_lock);
+    spinlock_init(&g_dead_lock);
+    spinlock_set_name(&g_sched_lock, "sched");
+    spinlock_set_name(&g_thread_cache_lock, "thread_cache");
+    spinlock_set_name(&g_dead_lock, "dead_threads");
+    memset(g_pid_hash, 0, sizeof(g_pid_hash));
+    g_thread_free = 0;
+    g_thread_count = 0;
+    g_dead_list = 0;
+    g_next_id = 0;
+    memset(g_rq, 0, sizeof(g_rq));
+    for (uint32_t i = 0; i < MAX_CPUS; i++) {
+        spinlock_init(&g_rq[i].lock);
+        spinlock_set_name(&g_rq[i].lock, "runqueue");
+        percpu_of(i)->rq = &g_rq[i];
+    }
+    g_nohz_balance_tick = 0;
     g_cpu_rr = 0;
 
-    /* Bootstrap thread = current execution context (kernel_main). */
-    thread_t* t0 = &g_threads[0];
-    memset(t0, 0, sizeof(thread_t));
-    t0->id = 0;
+    /* Bootstrap thread = current execution context (kernel_main), id 0. */
+    thread_t* t0 = thread_alloc();
+    if (!t0) {
+        console_write("[sched] cannot allocate bootstrap thread\n");
+        for (;;) cpu_hlt();
+    }
     t0->state = THREAD_RUNNING;
     t0->is_user = false;
-    t0->priority = 1;
     t0->cr3 = kspace_cr3;
     t0->cpu_id = 0;
+    t0->cpu_affinity = 1ULL << 0;
+    t0->on_cpu = true;
     strncpy(t0->name, "bootstrap", sizeof(t0->name)-1);
 
-    g_current[0] = t0;
+    percpu_of(0)->current = t0;
+    g_rq[0].idle = t0;
 
     /* RSP0 for privilege switches while still on bootstrap thread. */
     extern uint8_t stack_top[];
@@ -190,6 +512,9 @@ void scheduler_init(void) {
     thread_kstack_canary_init(t0);
     tss_set_rsp0((uint64_t)(uintptr_t)stack_top);
 
+    procfs_register("sched", sched_proc_show);
+    procfs_register("pstat", pstat_proc_show);
+
     console_write("[sched] init, CR3=");
     console_write_hex64(kspace_cr3);
     console_write("\n");
@@ -197,47 +522,380 @@ void scheduler_init(void) {
 
 void scheduler_add(thread_t* t) {
     (void)t;
-    /* Threads are stored in a fixed array; nothing else needed. */
+    /* Threads are hashed when allocated; nothing else needed. */
 }
 
-static thread_t* pick_next(uint32_t cpu_id) {
-    /* Priority-based pick: choose READY thread with highest priority. */
-    thread_t* best = 0;
-    int best_prio = -1;
+static bool vruntime_less(const rb_node_t* a, const rb_node_t* b) {
+    return (int64_t)(rb_entry(a, thread_t, run_node)->vruntime -
+                     rb_entry(b, thread_t, run_node)->vruntime) < 0;
+}
 
-    for (size_t i = 0; i < MAX_THREADS; i++) {
-        thread_t* t = &g_threads[i];
-        if (t->state != THREAD_READY) continue;
-        if (t->cpu_id != cpu_id) continue;
-        if (!best || t->priority > best_prio) {
-            best = t;
-            best_prio = t->priority;
-        }
+static bool deadline_less(const rb_node_t* a, const rb_node_t* b) {
+    return (int64_t)(rb_entry(a, thread_t, run_node)->dl_abs_deadline -
+                     rb_entry(b, thread_t, run_node)->dl_abs_deadline) < 0;
+}
+
+static inline uint64_t calc_delta_fair(uint64_t delta, const thread_t* t) {
+    if (t->weight == NICE_0_WEIGHT) return delta;
+    return delta * NICE_0_WEIGHT / t->weight;
+}
+
+static inline bool is_rt(const thread_t* t) {
+    return t->policy == SCHED_FIFO || t->policy == SCHED_RR;
+}
+
+/* Class rank: deadline > real-time > fair. */
+static inline int sched_class(const thread_t* t) {
+    if (t->policy == SCHED_DEADLINE) return 2;
+    return is_rt(t) ? 1 : 0;
+}
+
+static void list_append(thread_list_t* l, thread_t* t) {
+    t->rt_next = 0;
+    t->rt_prev = l->tail;
+    if (l->tail) l->tail->rt_next = t;
+    else l->head = t;
+    l->tail = t;
+}
+
+static void list_prepend(thread_list_t* l, thread_t* t) {
+    t->rt_prev = 0;
+    t->rt_next = l->head;
+    if (l->head) l->head->rt_prev = t;
+    else l->tail = t;
+    l->head = t;
+}
+
+static void list_remove(thread_list_t* l, thread_t* t) {
+    if (t->rt_prev) t->rt_prev->rt_next = t->rt_next;
+    else l->head = t->rt_next;
+    if (t->rt_next) t->rt_next->rt_prev = t->rt_prev;
+    else l->tail = t->rt_prev;
+    t->rt_next = t->rt_prev = 0;
+}
+
+static int rt_top_prio(const runqueue_t* rq) {
+    if (rq->rt_bitmap[1]) return 127 - __builtin_clzll(rq->rt_bitmap[1]);
+    if (rq->rt_bitmap[0]) return 63 - __builtin_clzll(rq->rt_bitmap[0]);
+    return -1;
+}
+
+/* rq_* helpers require rq->lock.  Real-time threads go to the tail of
+ * their priority's FIFO, or the head when preempted before their turn
+ * (slice) was over. */
+static void rq_enqueue_at(runqueue_t* rq, thread_t* t, bool head) {
+    if (t->on_rq || t == rq->idle) return;
+    if (t->policy == SCHED_DEADLINE) {
+        rb_insert(&rq->dl, &t->run_node, deadline_less);
+        rq->dl_nr++;
+    } else if (is_rt(t)) {
+        uint32_t p = t->rt_priority;
+        if (head) list_prepend(&rq->rt_queue[p], t);
+        else list_append(&rq->rt_queue[p], t);
+        rq->rt_bitmap[p / 64] |= 1ULL << (p % 64);
+        rq->rt_nr++;
+    } else {
+        rb_insert(&rq->fair, &t->run_node, vruntime_less);
+        rq->fair_weight += t->weight;
+        rq->fair_nr++;
     }
+    rq->nr_running++;
+    t->on_rq = true;
+    if (!t->wait_start) t->wait_start = time_now_ns();
+}
 
-    if (best) return best;
-    if (g_current[cpu_id] &&
-        (g_current[cpu_id]->state == THREAD_RUNNING || g_current[cpu_id]->state == THREAD_READY)) {
-        return g_current[cpu_id];
+static void rq_enqueue(runqueue_t* rq, thread_t* t) {
+    rq_enqueue_at(rq, t, false);
+}
+
+static void rq_dequeue(runqueue_t* rq, thread_t* t) {
+    if (!t->on_rq) return;
+    if (t->policy == SCHED_DEADLINE) {
+        rb_erase(&rq->dl, &t->run_node);
+        rq->dl_nr--;
+    } else if (is_rt(t)) {
+        uint32_t p = t->rt_priority;
+        list_remove(&rq->rt_queue[p], t);
+        if (!rq->rt_queue[p].head) rq->rt_bitmap[p / 64] &= ~(1ULL << (p % 64));
+        rq->rt_nr--;
+    } else {
+        rb_erase(&rq->fair, &t->run_node);
+        rq->fair_weight -= t->weight;
+        rq->fair_nr--;
     }
-    return &g_threads[0];
+    rq->nr_running--;
+    t->on_rq = false;
 }
 
-static void wake_sleepers(void) {
-    uint64_t now = pit_ticks();
-    for (size_t i = 0; i < MAX_THREADS; i++) {
-        if (g_threads[i].state == THREAD_SLEEPING && now >= g_threads[i].wakeup_tick) {
-            g_threads[i].state = THREAD_READY;
+static thread_t* fair_first(runqueue_t* rq) {
+    rb_node_t* left = rb_first(&rq->fair);
+    return left ? rb_entry(left, thread_t, run_node) : 0;
+}
+
+static thread_t* dl_first(runqueue_t* rq) {
+    rb_node_t* left = rb_first(&rq->dl);
+    return left ? rb_entry(left, thread_t, run_node) : 0;
+}
+
+/* Highest class first: earliest deadline, highest real-time priority,
+ * then smallest vruntime (passing over `skip`, a fair thread yielding). */
+static thread_t* rq_pick(runqueue_t* rq, const thread_t* skip) {
+    thread_t* t = dl_first(rq);
+    if (t) return t;
+    int p = rt_top_prio(rq);
+    if (p >= 0) return rq->rt_queue[p].head;
+    t = fair_first(rq);
+    if (t && t == skip && rb_next(&t->run_node)) {
+        t = rb_entry(rb_next(&t->run_node), thread_t, run_node);
+    }
+    return t;
+}
+
+/* min_vruntime follows the smaller of the running thread's and the
+ * leftmost queued vruntime, but never goes backwards. */
+static void update_min_vruntime(runqueue_t* rq, const thread_t* cur) {
+    bool have = cur != 0;
+    uint64_t v = cur ? cur->vruntime : 0;
+    thread_t* left = fair_first(rq);
+    if (left && (!have || (int64_t)(left->vruntime - v) < 0)) {
+        v = left->vruntime;
+        have = true;
+    }
+    if (have && (int64_t)(v - rq->min_vruntime) > 0) rq->min_vruntime = v;
+}
+
+/* Out of runtime: off the queue until the next period starts. */
+static void dl_throttle(runqueue_t* rq, thread_t* t, uint64_t now) {
+    rq_dequeue(rq, t);
+    t->dl_throttled = true;
+    rq->dl_throttles++;
+    uint64_t next_period = t->dl_abs_deadline - t->dl_deadline + t->dl_period;
+    hrtimer_start(&t->dl_timer, next_period > now ? next_period : now, 0);
+}
+
+/* Charge the running thread for the time since it was last accounted. */
+static void update_curr(runqueue_t* rq, thread_t* cur, uint64_t now) {
+    if (!cur || cur == rq->idle) return;
+    uint64_t delta = now > cur->exec_start ? now - cur->exec_start : 0;
+    cur->exec_start = now;
+    cur->sum_exec_ns += delta;
+
+    if (cur->policy == SCHED_DEADLINE) {
+        cur->dl_remaining -= (int64_t)delta;
+        if (cur->dl_remaining <= 0 && !cur->dl_throttled) dl_throttle(rq, cur, now);
+        return;
+    }
+    if (is_rt(cur)) return;
+
+    /* Woken again before it got off the CPU: re-sort it. */
+    bool queued = cur->on_rq;
+    if (queued) rq_dequeue(rq, cur);
+    cur->vruntime += calc_delta_fair(delta, cur);
+    if (queued) rq_enqueue(rq, cur);
+    update_min_vruntime(rq, cur->state == THREAD_RUNNING ? cur : 0);
+}
+
+/* Running fair thread t's share of the latency period. */
+static uint64_t sched_slice(const runqueue_t* rq, const thread_t* t) {
+    uint64_t period = SCHED_LATENCY_NS;
+    uint64_t nr = (uint64_t)rq->fair_nr + 1;
+    if (nr * SCHED_MIN_GRAN_NS > period) period = nr * SCHED_MIN_GRAN_NS;
+    return period * t->weight / (rq->fair_weight + t->weight);
+}
+
+/* New threads start at the queue's floor.  Sleepers get at most half a
+ * latency period of credit: an interactive thread runs promptly after
+ * waking, but a long sleep cannot bank enough to monopolise the CPU. */
+static void place_thread(runqueue_t* rq, thread_t* t) {
+    bool initial = t->sum_exec_ns == 0;
+    uint64_t v = rq->min_vruntime;
+    if (!initial) v -= SCHED_LATENCY_NS / 2;
+    if (initial || (int64_t)(t->vruntime - v) < 0) t->vruntime = v;
+}
+
+/* Constant bandwidth server wakeup: keep the current deadline only if the
+ * runtime left fits before it at the reserved bandwidth; otherwise start
+ * a fresh period so a late sleeper cannot overrun its reservation. */
+static void dl_wakeup(thread_t* t, uint64_t now) {
+    uint64_t left = t->dl_remaining > 0 ? (uint64_t)t->dl_remaining : 0;
+    if ((int64_t)(t->dl_abs_deadline - now) <= 0 ||
+        left * t->dl_period > (t->dl_abs_deadline - now) * t->dl_runtime) {
+        t->dl_abs_deadline = now + t->dl_deadline;
+        t->dl_remaining = (int64_t)t->dl_runtime;
+    }
+}
+
+/* Wakeup preemption: a higher class always preempts; within a class the
+ * earlier deadline, the higher real-time priority, or a fair thread that
+ * trails by more than the wakeup granularity. */
+static bool should_preempt(runqueue_t* rq, uint32_t cpu, const thread_t* t) {
+    thread_t* cur = percpu_of(cpu)->current;
+    if (!cur || cur == rq->idle || cur->state != THREAD_RUNNING) return true;
+    if (sched_class(t) != sched_class(cur)) return sched_class(t) > sched_class(cur);
+    if (t->policy == SCHED_DEADLINE) {
+        return (int64_t)(t->dl_abs_deadline - cur->dl_abs_deadline) < 0;
+    }
+    if (is_rt(t)) return t->rt_priority > cur->rt_priority;
+    uint64_t now = time_now_ns();
+    uint64_t v = cur->vruntime;
+    if (now > cur->exec_start) v += calc_delta_fair(now - cur->exec_start, cur);
+    return (int64_t)(v - t->vruntime) > (int64_t)calc_delta_fair(SCHED_WAKEUP_GRAN_NS, t);
+}
+
+/* Should the running thread give way?  To any higher class or earlier
+ * deadline or higher real-time priority; round-robin threads also to a
+ * peer once their SCHED_RR_SLICE_NS is used.  A fair thread never within
+ * SCHED_MIN_GRAN_NS of getting the CPU, always once its slice is used up,
+ * and in between if the leftmost queued thread trails it by a slice. */
+static bool tick_preempt(runqueue_t* rq, const thread_t* cur) {
+    uint64_t ran = cur->sum_exec_ns - cur->slice_start_ns;
+    thread_t* dl = dl_first(rq);
+    if (cur->policy == SCHED_DEADLINE) {
+        return dl && (int64_t)(dl->dl_abs_deadline - cur->dl_abs_deadline) < 0;
+    }
+    if (dl) return true;
+    int top = rt_top_prio(rq);
+    if (is_rt(cur)) {
+        if (top > (int)cur->rt_priority) return true;
+        return cur->policy == SCHED_RR && top == (int)cur->rt_priority &&
+               ran >= SCHED_RR_SLICE_NS;
+    }
+    if (top >= 0) return true;
+
+    thread_t* left = fair_first(rq);
+    if (!left) return false;
+    uint64_t slice = sched_slice(rq, cur);
+    if (ran >= slice) return true;
+    if (ran < SCHED_MIN_GRAN_NS) return false;
+    return (int64_t)(cur->vruntime - left->vruntime) > (int64_t)slice;
+}
+
+/* Tick at which cpu next needs the scheduler: now while it has queued
+ * threads to time-slice or pick, its earliest timer otherwise. */
+static uint64_t rq_next_event(uint32_t cpu, uint64_t now) {
+    runqueue_t* rq = &g_rq[cpu];
+    if (percpu_of(cpu)->need_resched || rq->nr_running > 0 || rq->push_thread) return now;
+    /* Tick a lone deadline thread so overrunning its budget throttles it. */
+    thread_t* cur = percpu_of(cpu)->current;
+    if (cur && cur->policy == SCHED_DEADLINE && cur->state == THREAD_RUNNING) return now;
+    uint64_t wheel = timer_next_expiry(cpu);
+    uint64_t hr = hrtimer_next_tick(cpu);
+    return hr < wheel ? hr : wheel;
+}
+
+/* Make t READY on its CPU's queue (wakeup protocol above), unless it has
+ * left state `from` meanwhile (a timer expiry or wakeup racing with exit
+ * or with another wakeup).  Caller may hold g_sched_lock and wait queue
+ * locks but no runqueue lock. */
+static bool wake_thread(thread_t* t, thread_state_t from) {
+    uint32_t cpu = t->cpu_id;
+    if (cpu >= MAX_CPUS) cpu = 0;
+    /* Affinity changed while it was still on its CPU: wake it elsewhere. */
+    if (!(t->cpu_affinity & (1ULL << cpu)) && !t->on_cpu && t->policy != SCHED_DEADLINE) {
+        cpu = scheduler_pick_cpu(t->cpu_affinity);
+        t->cpu_id = cpu;
+    }
+    runqueue_t* rq = &g_rq[cpu];
+    bool kick = false;
+
+    spinlock_lock(&rq->lock);
+    if (t->state != from) {
+        spinlock_unlock(&rq->lock);
+        return false;
+    }
+    t->state = THREAD_READY;
+    if (t->policy == SCHED_DEADLINE) {
+        /* Throttled: the replenishment timer queues it. */
+        if (t->dl_throttled) {
+            spinlock_unlock(&rq->lock);
+            return true;
+        }
+        dl_wakeup(t, time_now_ns());
+    } else if (!is_rt(t)) {
+        place_thread(rq, t);
+    }
+    rq_enqueue(rq, t);
+    if (g_sched_trace_on) {
+        thread_t* waker = thread_current();
+        sched_trace_record(SCHED_EV_WAKEUP, t->id, cpu, waker ? waker->id : 0);
+    }
+    if (should_preempt(rq, cpu, t) && !percpu_of(cpu)->need_resched) {
+        percpu_of(cpu)->need_resched = true;
+        kick = true;
+    }
+    /* Not preempting, so the target may now have to time-slice: restart
+     * its tick if it had stopped.  Checked under the lock its own re-arm
+     * in schedule() holds, so one side always sees the other. */
+    uint64_t soon = pit_ticks() + 1;
+    bool need_tick = !kick && rq->nr_running > 0 && tick_armed(cpu) > soon;
+    spinlock_unlock(&rq->lock);
+
+    if (kick && cpu != cpu_current_id()) smp_send_resched(cpu);
+    else if (need_tick) tick_request(cpu, soon);
+    return true;
+}
+
+/* Queue a newly created thread. */
+static void thread_wake(thread_t* t) {
+    wake_thread(t, THREAD_READY);
+}
+
+void scheduler_timer_wakeup(void* thread) {
+    wake_thread((thread_t*)thread, THREAD_SLEEPING);
+}
+
+bool scheduler_wake_blocked(thread_t* t) {
+    return wake_thread(t, THREAD_BLOCKED);
+}
+
+/* dl_timer: a new period starts for a throttled deadline thread.  Runs
+ * on the thread's CPU (where it was throttled). */
+static void dl_replenish(void* arg) {
+    thread_t* t = (thread_t*)arg;
+    uint32_t cpu = t->cpu_id < MAX_CPUS ? t->cpu_id : 0;
+    runqueue_t* rq = &g_rq[cpu];
+    spinlock_lock(&rq->lock);
+    if (!t->dl_throttled) {
+        spinlock_unlock(&rq->lock);
+        return;
+    }
+    t->dl_throttled = false;
+    if (t->policy == SCHED_DEADLINE) {
+        while (t->dl_remaining <= 0) {
+            t->dl_abs_deadline += t->dl_period;
+            t->dl_remaining += (int64_t)t->dl_runtime;
         }
+        if (t->dl_remaining > (int64_t)t->dl_runtime) t->dl_remaining = (int64_t)t->dl_runtime;
+    }
+    if (t->state == THREAD_READY && !t->on_cpu) {
+        rq_enqueue(rq, t);
+        if (should_preempt(rq, cpu, t)) percpu_of(cpu)->need_resched = true;
+    }
+    spinlock_unlock(&rq->lock);
+}
+
+/* Take t off its CPU's run queue (kill/exit of a non-running thread) and
+ * give back any deadline bandwidth it held. */
+static void thread_unqueue(thread_t* t) {
+    runqueue_t* rq = &g_rq[t->cpu_id < MAX_CPUS ? t->cpu_id : 0];
+    spinlock_lock(&rq->lock);
+    rq_dequeue(rq, t);
+    if (t->policy == SCHED_DEADLINE) {
+        rq->dl_bw -= t->dl_bw;
+        t->dl_bw = 0;
+        t->dl_throttled = false;
+        t->policy = SCHED_NORMAL;
     }
+    spinlock_unlock(&rq->lock);
 }
 
 static void thread_release_resources(thread_t* t) {
     if (!t) return;
     if (t->kstack) {
-        pmm_free_pages((uint64_t)(uintptr_t)t->kstack, t->kstack_size / PAGE_SIZE);
+        kstack_free(t->kstack);
         t->kstack = 0;
     }
+    fpu_release(t);
 
     if (t->is_user && t->cr3 && t->cr3 != kspace_cr3) {
         vmm_release_user_space(t->cr3);
@@ -248,40 +906,150 @@ static void thread_release_resources(thread_t* t) {
     t->ustack_top = 0;
 }
 
+/* Final teardown; t is unhashed and no CPU is running on its stack.  The
+ * process-wide state (open files, and the thread_t holding it) goes with
+ * the last member of t's thread group. */
+static void thread_destroy(thread_t* t) {
+    thread_release_resources(t);
+    thread_t* proc = thread_proc(t);
+    if (proc != t) thread_cache_free(t);
+    if (__sync_sub_and_fetch(&proc->group_refs, 1) != 0) return;
+    for (size_t i = 0; i < THREAD_MAX_OPEN_FILES; i++) {
+        if (proc->open_files[i]) {
+            vfs_close(proc->open_files[i]);
+            proc->open_files[i] = 0;
+        }
+    }
+    proc->open_file_count = 0;
+    thread_cache_free(proc);
+}
+
+/* Drop a zombie from the PID hash and its parent's child list.  If it may
+ * still be executing (it just exited on some CPU), destruction waits for
+ * that CPU's next schedule().  Caller holds g_sched_lock. */
+static void thread_reap(thread_t* t) {
+    thread_unlink_child(t);
+    pid_hash_remove(t);
+    g_thread_count--;
+    if (!t->on_cpu) {
+        thread_destroy(t);
+        return;
+    }
+    uint64_t irq = spinlock_lock_irqsave(&g_dead_lock);
+    t->hash_next = g_dead_list;
+    g_dead_list = t;
+    spinlock_unlock_irqrestore(&g_dead_lock, irq);
+}
+
+static void reap_dead_threads(void) {
+    thread_t* ready = 0;
+    uint64_t irq = spinlock_lock_irqsave(&g_dead_lock);
+    thread_t** pp = &g_dead_list;
+    while (*pp) {
+        thread_t* t = *pp;
+        if (t->on_cpu) {
+            pp = &t->hash_next;
+            continue;
+        }
+        *pp = t->hash_next;
+        t->hash_next = ready;
+        ready = t;
+    }
+    spinlock_unlock_irqrestore(&g_dead_lock, irq);
+
+    while (ready) {
+        thread_t* t = ready;
+        ready = t->hash_next;
+        thread_destroy(t);
+    }
+}
+
+static void thread_kill_locked(thread_t* target, int sig);
+
+static void group_unlink(thread_t* leader, thread_t* t) {
+    for (thread_t** pp = &leader->group_next; *pp; pp = &(*pp)->group_next) {
+        if (*pp == t) {
+            *pp = t->group_next;
+            t->group_next = 0;
+            return;
+        }
+    }
+}
+
+/* clone()'s child-tid word: zero it and wake joiners.  Written through
+ * the identity map, since t need not be the current address space. */
+static void thread_clear_tid(thread_t* t) {
+    uint64_t phys = 0;
+    uint64_t flags = 0;
+    if (vmm_resolve(t->cr3, t->clear_tid, &phys, &flags) && (flags & VMM_FLAG_USER)) {
+        *(volatile uint32_t*)(uintptr_t)phys = 0;
+        futex_wake_phys(phys, UINT32_MAX);
+    }
+    t->clear_tid = 0;
+}
+
 static void thread_mark_zombie(thread_t* t, int exit_code) {
     if (!t) return;
+    sched_trace(SCHED_EV_EXIT, t->id, (uint32_t)exit_code, 0);
+    if (t->clear_tid) thread_clear_tid(t);
+    /* The process ends with its leader: take the other threads down too.
+     * A member leaves the group's list (not the group: see destroy). */
+    if (t->group_leader) {
+        group_unlink(t->group_leader, t);
+        cputime_add(&t->group_leader->cpu_dead, &t->cpu);
+    } else {
+        while (t->group_next) {
+            thread_t* m = t->group_next;
+            group_unlink(t, m);
+            if (m->state != THREAD_ZOMBIE) thread_kill_locked(m, 9);
+        }
+    }
+    /* First, so a sleep timer firing concurrently is finished (and its
+     * wakeup undone by the dequeue) before t turns into a zombie. */
+    ktimer_cancel(&t->sleep_timer);
+    hrtimer_cancel(&t->hr_sleep);
+    hrtimer_cancel(&t->dl_timer);
+    thread_unqueue(t);
     t->exit_code = exit_code;
     t->state = THREAD_ZOMBIE;
 
-    if (t->parent) {
+    /* Orphans have nobody to wait for them: exited ones go now, live ones
+     * reap themselves when they exit. */
+    while (t->first_child) {
+        thread_t* c = t->first_child;
+        thread_unlink_child(c);
+        if (c->state == THREAD_ZOMBIE) thread_reap(c);
+    }
+    t->children = 0;
+
+    if (!t->parent) {
+        thread_reap(t);
+    } else {
         if (t->parent->children > 0) t->parent->children--;
-        /* Wake a waiting parent if it waits for us or for any child (pid<=0). */
-        if (t->parent->state == THREAD_BLOCKED &&
-            (t->parent->wait_target <= 0 || t->parent->wait_target == (int)t->id)) {
-            if (t->parent->wait_status_ptr) {
-                int* sp = (int*)(uintptr_t)t->parent->wait_status_ptr;
-                *sp = t->exit_code;
-            }
-            t->parent->wait_target = 0;
-            t->parent->wait_status_ptr = 0;
-            t->parent->state = THREAD_READY;
-        }
+        wake_up(&t->parent->child_exit);
     }
 }
 
 static thread_t* find_thread_by_id(int pid) {
-    for (size_t i = 0; i < MAX_THREADS; i++) {
-        thread_t* t = &g_threads[i];
-        if (t->state == THREAD_UNUSED) continue;
+    if (pid < 0) return 0;
+    for (thread_t* t = g_pid_hash[(uint32_t)pid & (PID_HASH_SIZE - 1)]; t; t = t->hash_next) {
         if ((int)t->id == pid) return t;
     }
     return 0;
 }
 
 static intr_frame_t* do_switch(uint32_t cpu_id, intr_frame_t* frame, thread_t* next) {
-    if (next == g_current[cpu_id]) return frame;
+    if (next == percpu_of(cpu_id)->current) {
+        if (next->state == THREAD_READY) next->state = THREAD_RUNNING;
+        return frame;
+    }
 
-    thread_t* prev = g_current[cpu_id];
+    thread_t* prev = percpu_of(cpu_id)->current;
+    cputime_sys(prev);
+    if (prev != g_rq[cpu_id].idle) sched_hist_slice(cpu_id, prev->sum_exec_ns - prev->slice_start_ns);
+    sched_trace(SCHED_EV_SWITCH, prev->id, next->id, prev->state);
+    if (prev->state == THREAD_RUNNING || prev->state == THREAD_READY) prev->cpu.nivcsw++;
+    else if (prev->state != THREAD_ZOMBIE) prev->cpu.nvcsw++;
 
     /* Save current context */
     prev->rsp = (uint64_t)(uintptr_t)frame;
@@ -289,7 +1057,13 @@ static intr_frame_t* do_switch(uint32_t cpu_id, intr_frame_t* frame, thread_t* n
 
     /* Activate next */
     next->state = THREAD_RUNNING;
-    g_current[cpu_id] = next;
+    percpu_of(cpu_id)->current = next;
+    g_rq[cpu_id].nr_switches++;
+    g_rq[cpu_id].switched_from = prev;
+    rcu_note_qs(cpu_id);
+    prev->last_ran_tick = pit_ticks();
+    next->on_cpu = true;
+    fpu_switch(prev, next, cpu_id);
 
     /* Update RSP0 for privilege switches (user threads need it). */
     if (next->kstack) {
@@ -299,22 +1073,304 @@ static intr_frame_t* do_switch(uint32_t cpu_id, intr_frame_t* frame, thread_t* n
 
     /* Switch address space if needed */
     if (next->cr3 && next->cr3 != prev->cr3) {
-        write_cr3(next->cr3);
+        vmm_activate(next->cr3);
+    }
+
+    /* User TLS; kernel threads never touch FS. */
+    if (next->is_user && next->fs_base != g_fs_base[cpu_id]) {
+        write_msr(MSR_FS_BASE, next->fs_base);
+        g_fs_base[cpu_id] = next->fs_base;
     }
 
     return (intr_frame_t*)(uintptr_t)next->rsp;
 }
 
-intr_frame_t* scheduler_on_tick(intr_frame_t* frame) {
+/* d^n in 16.16 fixed point. */
+static uint64_t load_decay_pow(uint64_t d, uint64_t n) {
+    uint64_t r = LOAD_ONE;
+    while (n) {
+        if (n & 1) r = (r * d) >> LOAD_SHIFT;
+        d = (d * d) >> LOAD_SHIFT;
+        n >>= 1;
+    }
+    return r;
+}
+
+/* At most once per load-clock period per CPU: fold the current load into
+ * the averages.  With dynamic ticks a CPU may skip many periods; the load
+ * is taken to have been constant since the last update. */
+static bool update_load(uint32_t cpu) {
+    runqueue_t* rq = &g_rq[cpu];
+    uint64_t now = pit_ticks() * LOAD_CLOCK_HZ / pit_frequency_hz();
+    if (now == rq->last_load_clock) return false;
+    uint64_t elapsed = now - rq->last_load_clock;
+    rq->last_load_clock = now;
+
+    uint64_t n = (uint64_t)rq_load(cpu) << LOAD_SHIFT;
+    for (int w = 0; w < LOAD_WINDOWS; w++) {
+        uint64_t d = elapsed == 1 ? k_load_decay[w] : load_decay_pow(k_load_decay[w], elapsed);
+        rq->load_avg[w] = (rq->load_avg[w] * d + n * (LOAD_ONE - d)) >> LOAD_SHIFT;
+    }
+    return true;
+}
+
+static void lock_rq_pair(uint32_t a, uint32_t b) {
+    if (a < b) {
+        spinlock_lock(&g_rq[a].lock);
+        spinlock_lock(&g_rq[b].lock);
+    } else {
+        spinlock_lock(&g_rq[b].lock);
+        spinlock_lock(&g_rq[a].lock);
+    }
+}
+
+static void unlock_rq_pair(uint32_t a, uint32_t b) {
+    spinlock_unlock(&g_rq[a].lock);
+    spinlock_unlock(&g_rq[b].lock);
+}
+
+/* Move a thread that is not executing from src's runqueue (queued or not)
+ * to dst's.  Both runqueue locks held. */
+static void migrate_thread(uint32_t src_cpu, uint32_t dst_cpu, thread_t* t) {
+    runqueue_t* src = &g_rq[src_cpu];
+    runqueue_t* dst = &g_rq[dst_cpu];
+    bool queued = t->on_rq;
+    if (queued) rq_dequeue(src, t);
+    /* Keep its lag: vruntimes are relative to each queue's floor. */
+    t->vruntime = t->vruntime - src->min_vruntime + dst->min_vruntime;
+    t->cpu_id = dst_cpu;
+    t->nr_migrations++;
+    sched_trace(SCHED_EV_MIGRATE, t->id, dst_cpu, src_cpu);
+    if (queued) rq_enqueue(dst, t);
+    src->migrations_out++;
+    dst->migrations_in++;
+}
+
+/* Queue a descheduled thread on dst and preempt there if it should. */
+static void push_to_cpu(uint32_t src_cpu, uint32_t dst_cpu, thread_t* t) {
+    runqueue_t* dst = &g_rq[dst_cpu];
+    if (dst_cpu == src_cpu) {
+        /* Affinity was widened again meanwhile. */
+        spinlock_lock(&dst->lock);
+        if (t->state == THREAD_READY && !t->on_rq) rq_enqueue(dst, t);
+        spinlock_unlock(&dst->lock);
+        return;
+    }
+    lock_rq_pair(src_cpu, dst_cpu);
+    bool kick = false;
+    if (t->state == THREAD_READY && !t->on_rq && !t->on_cpu && t->cpu_id == src_cpu) {
+        migrate_thread(src_cpu, dst_cpu, t);
+        rq_enqueue(dst, t);
+        if (should_preempt(dst, dst_cpu, t) && !percpu_of(dst_cpu)->need_resched) {
+            percpu_of(dst_cpu)->need_resched = true;
+            kick = true;
+        }
+    }
+    bool need_tick = !kick && dst->nr_running > 0 && tick_armed(dst_cpu) > pit_ticks() + 1;
+    unlock_rq_pair(src_cpu, dst_cpu);
+    if (kick || need_tick) smp_send_resched(dst_cpu);
+}
+
+/* Queued thread on src that may move to dst: not executing, allowed there
+ * and, unless allow_hot, not run recently enough to still be cache-hot.
+ * Scans in vruntime order (next to run there first). */
+static thread_t* find_migratable(runqueue_t* src, uint32_t dst, bool allow_hot) {
+    uint64_t now = pit_ticks();
+    for (rb_node_t* n = rb_first(&src->fair); n; n = rb_next(n)) {
+        thread_t* t = rb_entry(n, thread_t, run_node);
+        if (t->on_cpu) continue;
+        if (!(t->cpu_affinity & (1ULL << dst))) continue;
+        if (!allow_hot && now - t->last_ran_tick < SCHED_CACHE_HOT_TICKS) continue;
+        return t;
+    }
+    return 0;
+}
+
+/* Pull one thread to cpu from the CPU with the most queued threads.  An
+ * idle CPU pulls whenever something is waiting; a busy one only when the
+ * imbalance is at least two.  Cache-hot threads move only if the source
+ * would still have work left. */
+static bool load_balance(uint32_t cpu, bool idle) {
+    uint32_t online = cpu_online_count();
+    uint32_t busiest = cpu;
+    uint32_t max_queued = 0;
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        if (c == cpu) continue;
+        if (g_rq[c].nr_running > max_queued) {
+            max_queued = g_rq[c].nr_running;
+            busiest = c;
+        }
+    }
+    if (busiest == cpu || max_queued == 0) return false;
+    if (!idle && rq_load(busiest) < rq_load(cpu) + 2) return false;
+
+    runqueue_t* src = &g_rq[busiest];
+    lock_rq_pair(cpu, busiest);
+    thread_t* t = find_migratable(src, cpu, false);
+    if (!t && src->nr_running >= 2) t = find_migratable(src, cpu, true);
+    if (t) migrate_thread(busiest, cpu, t);
+    unlock_rq_pair(cpu, busiest);
+    return t != 0;
+}
+
+/* Idle CPUs take no tick, so nothing makes them balance; while threads
+ * queue up on cpu, kick one every SCHED_BALANCE_TICKS to come and pull. */
+static void nohz_balance_kick(uint32_t cpu, uint64_t now) {
+    if (now - g_nohz_balance_tick < SCHED_BALANCE_TICKS) return;
+    uint32_t online = cpu_online_count();
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        if (c == cpu) continue;
+        if (percpu_of(c)->current != g_rq[c].idle || g_rq[c].nr_running > 0) continue;
+        g_nohz_balance_tick = now;
+        percpu_of(c)->need_resched = true;
+        smp_send_resched(c);
+        return;
+    }
+}
+
+/* Charge the current thread, then either let it keep the CPU (slice not
+ * used up, nothing forced a switch) or requeue it if still runnable and
+ * switch to the leftmost queued thread (or this CPU's idle thread).
+ * O(log n) apart from expiring timers and the occasional balance pass.
+ * Not itself preemptible: what it calls must not cond_resched() here. */
+static intr_frame_t* schedule(intr_frame_t* frame) {
     uint32_t cpu_id = cpu_current_id();
-    spinlock_lock(&g_sched_lock);
-    wake_sleepers();
-    thread_t* next = pick_next(cpu_id);
-    intr_frame_t* next_frame = do_switch(cpu_id, frame, next);
-    spinlock_unlock(&g_sched_lock);
+    if (cpu_id >= MAX_CPUS) cpu_id = 0;
+    runqueue_t* rq = &g_rq[cpu_id];
+    /* The interrupted code's own count, without an IRQ handler's. */
+    bool atomic = (preempt_count() & PREEMPT_MASK) != 0;
+    preempt_count_add(1);
+
+    if (rq->switched_from) {
+        rq->switched_from->on_cpu = false;
+        rq->switched_from = 0;
+    }
+    if (rq->push_thread) {
+        thread_t* t = rq->push_thread;
+        rq->push_thread = 0;
+        push_to_cpu(cpu_id, scheduler_pick_cpu(t->cpu_affinity), t);
+    }
+    if (g_dead_list) reap_dead_threads();
+    hrtimer_run();
+    timer_run(pit_ticks());
+
+    if (update_load(cpu_id) && ++rq->balance_countdown >= SCHED_BALANCE_TICKS) {
+        rq->balance_countdown = 0;
+        load_balance(cpu_id, false);
+    }
+    thread_t* cur = percpu_of(cpu_id)->current;
+    if (rq->nr_running == 0 && (!cur || cur == rq->idle || cur->state != THREAD_RUNNING)) {
+        load_balance(cpu_id, true);
+    }
+
+    spinlock_lock(&rq->lock);
+    bool forced = percpu_of(cpu_id)->need_resched || rq->yielded;
+    bool yielded = rq->yielded;
+    percpu_of(cpu_id)->need_resched = false;
+    rq->yielded = false;
+
+    uint64_t now_ns = time_now_ns();
+    thread_t* prev = percpu_of(cpu_id)->current;
+    update_curr(rq, prev, now_ns);
+
+    /* A deadline thread yields the rest of its runtime this period. */
+    if (yielded && prev && prev->policy == SCHED_DEADLINE && !prev->dl_throttled &&
+        prev->state == THREAD_RUNNING) {
+        prev->dl_remaining = 0;
+        dl_throttle(rq, prev, now_ns);
+    }
+
+    thread_t* next;
+    bool allowed = prev && (prev->cpu_affinity & (1ULL << cpu_id));
+    bool in_kernel = prev && prev != rq->idle && prev->state == THREAD_RUNNING &&
+                     (frame->cs & 3) == 0;
+    if (in_kernel && atomic) {
+        /* Interrupted holding a lock or inside an RCU read section: the
+         * preempt_enable() that ends it comes back here. */
+        next = prev;
+        percpu_of(cpu_id)->need_resched = true;
+    } else if (prev && prev != rq->idle && prev->state == THREAD_RUNNING && allowed &&
+               !forced && !prev->dl_throttled && !tick_preempt(rq, prev)) {
+        next = prev;
+    } else {
+        if (prev && prev->state == THREAD_RUNNING) {
+            prev->state = THREAD_READY;
+            /* A preempted real-time thread keeps its place in line. */
+            bool head = is_rt(prev) && !yielded &&
+                        (prev->policy == SCHED_FIFO ||
+                         prev->sum_exec_ns - prev->slice_start_ns < SCHED_RR_SLICE_NS);
+            if (prev != rq->idle && !allowed) rq->push_thread = prev;
+            else if (!prev->dl_throttled) rq_enqueue_at(rq, prev, head);
+        }
+        next = rq_pick(rq, yielded ? prev : 0);
+        if (next) {
+            rq_dequeue(rq, next);
+            next->exec_start = now_ns;
+            next->slice_start_ns = next->sum_exec_ns;
+            if (next->wait_start && now_ns > next->wait_start) {
+                next->cpu.wait_ns += now_ns - next->wait_start;
+                sched_hist_runq(cpu_id, now_ns - next->wait_start);
+            }
+            next->wait_start = 0;
+        } else if (rq->idle && rq->idle->state != THREAD_ZOMBIE) {
+            next = rq->idle;
+        } else {
+            next = prev;
+        }
+    }
+
+    if (in_kernel && next && next != prev) percpu_of(cpu_id)->kernel_preemptions++;
+    intr_frame_t* next_frame = next ? do_switch(cpu_id, frame, next) : frame;
+    uint64_t now = pit_ticks();
+    tick_rearm(rq_next_event(cpu_id, now));
+    bool waiting = rq->nr_running > 0;
+    spinlock_unlock(&rq->lock);
+
+    if (waiting) nohz_balance_kick(cpu_id, now);
+    preempt_count_sub(1);
     return next_frame;
 }
 
+uint64_t scheduler_timer_due(uint64_t now, uint64_t* next_event) {
+    uint32_t online = cpu_online_count();
+    if (online == 0) online = 1;
+    uint64_t due = 0;
+    uint64_t next = UINT64_MAX;
+
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        uint64_t ev = rq_next_event(c, now);
+        if (ev <= now) {
+            due |= 1ULL << c;
+            ev = now + 1;
+        }
+        if (ev < next) next = ev;
+    }
+
+    if (next_event) *next_event = next;
+    return due;
+}
+
+/* A kill deferred while the thread was in the kernel lands on its way
+ * back to user mode. */
+static intr_frame_t* deliver_pending_kill(intr_frame_t* frame) {
+    thread_t* cur = thread_current();
+    if (cur && cur->pending_kill && (frame->cs & 3) == 3) {
+        return scheduler_on_exit(frame, -cur->pending_kill);
+    }
+    return frame;
+}
+
+intr_frame_t* scheduler_on_tick(intr_frame_t* frame) {
+    uint32_t cpu_id = cpu_current_id();
+    if (cpu_id < MAX_CPUS) g_rq[cpu_id].nr_timer_events++;
+    return deliver_pending_kill(schedule(frame));
+}
+
+intr_frame_t* scheduler_preempt_check(intr_frame_t* frame) {
+    if (this_cpu()->need_resched) frame = schedule(frame);
+    return deliver_pending_kill(frame);
+}
+
 intr_frame_t* scheduler_fork(intr_frame_t* frame) {
     thread_t* parent = thread_current();
     if (!parent || !parent->is_user) {
@@ -322,10 +1378,10 @@ intr_frame_t* scheduler_fork(intr_frame_t* frame) {
         return frame;
     }
 
-    spinlock_lock(&g_sched_lock);
-    thread_t* child = thread_alloc_slot();
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
+    thread_t* child = thread_alloc();
     if (!child) {
-        spinlock_unlock(&g_sched_lock);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
         frame->rax = (uint64_t)-1;
         return frame;
     }
@@ -333,19 +1389,30 @@ intr_frame_t* scheduler_fork(intr_frame_t* frame) {
     child->is_user = true;
     child->cr3 = parent->cr3;
     vmm_retain_user_space(child->cr3);
-    child->priority = parent->priority;
+    child->nice = parent->nice;
+    child->weight = parent->weight;
+    /* Real-time policy is inherited; a deadline reservation is not. */
+    if (is_rt(parent)) {
+        child->policy = parent->policy;
+        child->rt_priority = parent->rt_priority;
+    }
     child->cpu_id = parent->cpu_id;
-    child->parent = parent;
-    parent->children++;
-    child->ustack = parent->ustack;
-    child->ustack_size = parent->ustack_size;
-    child->ustack_top = parent->ustack_top;
-    child->brk_start = parent->brk_start;
-    child->brk_end = parent->brk_end;
-    child->mmap_base = parent->mmap_base;
+    child->cpu_affinity = parent->cpu_affinity;
+    child->timer_slack_ns = parent->timer_slack_ns;
+    thread_link_child(parent, child);
+    /* Forking from a clone()d thread copies its process's state. */
+    thread_t* proc = thread_proc(parent);
+    child->ustack = proc->ustack;
+    child->ustack_size = proc->ustack_size;
+    child->ustack_top = proc->ustack_top;
+    child->brk_start = proc->brk_start;
+    child->brk_end = proc->brk_end;
+    child->mmap_base = proc->mmap_base;
+    memcpy(child->mmap_holes, proc->mmap_holes, sizeof(child->mmap_holes));
+    child->fs_base = parent->fs_base;
 
     for (size_t i = 0; i < THREAD_MAX_OPEN_FILES; i++) {
-        if (!parent->open_files[i]) continue;
+        if (!proc->open_files[i]) continue;
         vfs_file_t* dup = (vfs_file_t*)kmalloc(sizeof(vfs_file_t));
         if (!dup) {
             for (size_t j = 0; j < THREAD_MAX_OPEN_FILES; j++) {
@@ -356,122 +1423,493 @@ intr_frame_t* scheduler_fork(intr_frame_t* frame) {
             }
             child->open_file_count = 0;
             vmm_release_user_space(child->cr3);
-            child->state = THREAD_UNUSED;
-            spinlock_unlock(&g_sched_lock);
+            thread_discard(child);
+            spinlock_unlock_irqrestore(&g_sched_lock, irq);
             frame->rax = (uint64_t)-1;
             return frame;
         }
-        *dup = *parent->open_files[i];
+        *dup = *proc->open_files[i];
         child->open_files[i] = dup;
         child->open_file_count++;
     }
 
-    child->kstack_size = parent->kstack_size;
-    child->kstack = (uint8_t*)pmm_alloc_pages(child->kstack_size / PAGE_SIZE);
+    child->kstack_size = KSTACK_SIZE;
+    child->kstack = (uint8_t*)kstack_alloc();
     if (!child->kstack) {
         vmm_release_user_space(child->cr3);
-        child->state = THREAD_UNUSED;
-        spinlock_unlock(&g_sched_lock);
+        thread_discard(child);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
         frame->rax = (uint64_t)-1;
         return frame;
     }
     thread_kstack_canary_init(child);
 
+    if (!fpu_fork(child, parent)) {
+        kstack_free(child->kstack);
+        vmm_release_user_space(child->cr3);
+        thread_discard(child);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
+        frame->rax = (uint64_t)-1;
+        return frame;
+    }
+
     uint8_t* top = child->kstack + child->kstack_size;
     intr_frame_t* child_frame = (intr_frame_t*)(top - sizeof(intr_frame_t));
     *child_frame = *frame;
     child_frame->rax = 0;
     child->rsp = (uint64_t)(uintptr_t)child_frame;
-    child->state = THREAD_READY;
+    thread_wake(child);
+    sched_trace(SCHED_EV_FORK, parent->id, child->id, 0);
 
     frame->rax = child->id;
-    spinlock_unlock(&g_sched_lock);
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
     return frame;
 }
 
+int64_t scheduler_clone(intr_frame_t* frame, uint64_t entry, uint64_t stack, uint64_t arg,
+                        uint64_t tls, uint64_t clear_tid) {
+    thread_t* parent = thread_current();
+    if (!parent || !parent->is_user || !entry || !stack) return -1;
+    thread_t* leader = thread_proc(parent);
+
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
+    if (leader->state == THREAD_ZOMBIE || leader->pending_kill) {
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
+        return -1;
+    }
+    thread_t* t = thread_alloc();
+    if (!t) {
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
+        return -1;
+    }
+    t->is_user = true;
+    t->cr3 = parent->cr3;
+    t->nice = parent->nice;
+    t->weight = parent->weight;
+    if (is_rt(parent)) {
+        t->policy = parent->policy;
+        t->rt_priority = parent->rt_priority;
+    }
+    t->cpu_affinity = parent->cpu_affinity;
+    t->cpu_id = scheduler_pick_cpu(t->cpu_affinity);
+    t->timer_slack_ns = parent->timer_slack_ns;
+    t->ustack_top = stack;
+    t->fs_base = tls;
+    t->clear_tid = clear_tid;
+    memcpy(t->name, parent->name, sizeof(t->name));
+
+    t->kstack_size = KSTACK_SIZE;
+    t->kstack = (uint8_t*)kstack_alloc();
+    if (!t->kstack) {
+        thread_discard(t);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
+        return -1;
+    }
+    thread_kstack_canary_init(t);
+    vmm_retain_user_space(t->cr3);
+
+    /* Joins the group: no parent to wait for it, reaped when it exits. */
+    t->group_leader = leader;
+    t->group_next = leader->group_next;
+    leader->group_next = t;
+    __sync_fetch_and_add(&leader->group_refs, 1);
+
+    /* Enter entry(arg) on the new stack as if called: rsp = 16n - 8. */
+    intr_frame_t* tf = (intr_frame_t*)(t->kstack + t->kstack_size - sizeof(intr_frame_t));
+    *tf = *frame;
+    tf->rip = entry;
+    tf->rsp = (stack & ~0xFULL) - 8;
+    tf->rdi = arg;
+    tf->rax = 0;
+    t->rsp = (uint64_t)(uintptr_t)tf;
+    thread_wake(t);
+    sched_trace(SCHED_EV_FORK, parent->id, t->id, 0);
+
+    int64_t tid = (int64_t)t->id;
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
+    return tid;
+}
+
+void scheduler_set_tls(uint64_t base) {
+    uint32_t cpu_id = cpu_current_id();
+    thread_t* cur = thread_current();
+    cur->fs_base = base;
+    write_msr(MSR_FS_BASE, base);
+    if (cpu_id < MAX_CPUS) g_fs_base[cpu_id] = base;
+}
+
 intr_frame_t* scheduler_yield(intr_frame_t* frame) {
     uint32_t cpu_id = cpu_current_id();
-    spinlock_lock(&g_sched_lock);
-    wake_sleepers();
-    thread_t* next = pick_next(cpu_id);
-    intr_frame_t* next_frame = do_switch(cpu_id, frame, next);
-    spinlock_unlock(&g_sched_lock);
-    return next_frame;
+    if (cpu_id < MAX_CPUS) g_rq[cpu_id].yielded = true;
+    return schedule(frame);
 }
 
 intr_frame_t* scheduler_on_exit(intr_frame_t* frame, int exit_code) {
     uint32_t cpu_id = cpu_current_id();
-    thread_t* cur = g_current[cpu_id];
+    thread_t* cur = percpu_of(cpu_id)->current;
     console_write("[sched] thread ");
     console_write_dec_u64(cur->id);
     console_write(" exited\n");
 
-    spinlock_lock(&g_sched_lock);
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
     cur->rsp = (uint64_t)(uintptr_t)frame;
     thread_mark_zombie(cur, exit_code);
 
-    /* Pick next READY thread; if none, fall back to bootstrap (should be READY/RUNNING). */
-    thread_t* next = pick_next(cpu_id);
-    if (next == cur) {
-        /* No other READY threads: run bootstrap. */
-        next = &g_threads[0];
-        if (next->state == THREAD_ZOMBIE) {
-            console_write("[sched] no runnable threads; halting.\n");
-            for(;;) cpu_hlt();
-        }
+    /* Zombies are never requeued, so this picks another thread or idle. */
+    intr_frame_t* next_frame = schedule(frame);
+    if (percpu_of(cpu_id)->current == cur) {
+        console_write("[sched] no runnable threads; halting.\n");
+        for (;;) cpu_hlt();
     }
-
-    intr_frame_t* next_frame = do_switch(cpu_id, frame, next);
-    spinlock_unlock(&g_sched_lock);
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
     return next_frame;
 }
 
+/* Enter schedule() from kernel code through a ring-0 int 0x80 SYS_yield;
+ * the caller has already left RUNNING, so it is not requeued. */
+static void kernel_yield(void) {
+    __asm__ volatile ("movq $3, %%rax; int $0x80" : : : "rax", "memory");
+}
+
+void scheduler_idle_resched(void) {
+    kernel_yield();
+}
+
+bool scheduler_can_block(void) {
+    percpu_t* pc = this_cpu();
+    thread_t* cur = pc->current;
+    if (preempt_count() & PREEMPT_MASK) return false;
+    return cur && pc->rq && cur != pc->rq->idle && cur->state == THREAD_RUNNING;
+}
+
+/* The preempt count stays with the CPU: a thread switching away with it
+ * raised would leave that CPU atomic for good and underflow the count
+ * where it resumes.  Stop at the offending call instead. */
+static void assert_can_sleep(const void* site) {
+    uint32_t count = preempt_count() & PREEMPT_MASK;
+    if (!count) return;
+    cpu_cli();
+    console_write("\n[PANIC] sleeping in atomic context, preempt_count=");
+    console_write_hex64(count);
+    console_write(" caller=");
+    console_write_hex64((uint64_t)(uintptr_t)site);
+    console_write("\n");
+    for (;;) { cpu_hlt(); }
+}
+
+void scheduler_block_prepare(void) {
+    thread_t* cur = thread_current();
+    runqueue_t* rq = &g_rq[cur->cpu_id < MAX_CPUS ? cur->cpu_id : 0];
+    spinlock_lock(&rq->lock);
+    cur->state = THREAD_BLOCKED;
+    spinlock_unlock(&rq->lock);
+}
+
+void scheduler_block(void) {
+    thread_t* cur = thread_current();
+    assert_can_sleep(__builtin_return_address(0));
+    /* Woken already: nothing to wait for. */
+    if (cur->state != THREAD_BLOCKED) return;
+    uint64_t flags = irq_save();
+    kernel_yield();
+    irq_restore(flags);
+}
+
+/* Back to RUNNING after a wait.  A wakeup that came before the thread got
+ * off its CPU queued it there while it kept running; undo that. */
+void scheduler_block_cancel(void) {
+    thread_t* cur = thread_current();
+    runqueue_t* rq = &g_rq[cur->cpu_id < MAX_CPUS ? cur->cpu_id : 0];
+    spinlock_lock(&rq->lock);
+    if (cur->state != THREAD_RUNNING) {
+        if (cur->on_rq) rq_dequeue(rq, cur);
+        cur->state = THREAD_RUNNING;
+    }
+    spinlock_unlock(&rq->lock);
+}
+
 void scheduler_sleep(uint64_t ticks) {
-    /* Only usable from thread context if you have a way to reschedule; keep simple. */
     thread_t* cur = thread_current();
-    spinlock_lock(&g_sched_lock);
-    cur->wakeup_tick = pit_ticks() + ticks;
+    assert_can_sleep(__builtin_return_address(0));
+    runqueue_t* rq = &g_rq[cur->cpu_id < MAX_CPUS ? cur->cpu_id : 0];
+    /* Kernel threads run with IF=1; the timer IRQ takes the same locks. */
+    uint64_t flags = irq_save();
+    spinlock_lock(&rq->lock);
     cur->state = THREAD_SLEEPING;
-    spinlock_unlock(&g_sched_lock);
-    /* Force a yield via int 0x80 SYS_yield (works in ring0 too). */
-    __asm__ volatile ("movq $3, %%rax; int $0x80" : : : "rax", "memory");
+    spinlock_unlock(&rq->lock);
+    ktimer_add(&cur->sleep_timer, pit_ticks() + ticks);
+    kernel_yield();
+    irq_restore(flags);
+}
+
+intr_frame_t* scheduler_sleep_ticks(intr_frame_t* frame, uint64_t ticks) {
+    thread_t* cur = thread_current();
+    if (!cur) return frame;
+    runqueue_t* rq = &g_rq[cur->cpu_id < MAX_CPUS ? cur->cpu_id : 0];
+    spinlock_lock(&rq->lock);
+    cur->state = THREAD_SLEEPING;
+    spinlock_unlock(&rq->lock);
+    ktimer_add(&cur->sleep_timer, pit_ticks() + ticks);
+    return schedule(frame);
+}
+
+intr_frame_t* scheduler_sleep_until_ns(intr_frame_t* frame, uint64_t deadline) {
+    thread_t* cur = thread_current();
+    if (!cur || deadline <= time_now_ns()) return frame;
+    runqueue_t* rq = &g_rq[cur->cpu_id < MAX_CPUS ? cur->cpu_id : 0];
+    spinlock_lock(&rq->lock);
+    cur->state = THREAD_SLEEPING;
+    spinlock_unlock(&rq->lock);
+    hrtimer_start(&cur->hr_sleep, deadline, cur->timer_slack_ns);
+    return schedule(frame);
+}
+
+/* Caller holds g_sched_lock; target is another, live thread.  Only one
+ * stopped in user mode dies on the spot.  One on a CPU or inside the
+ * kernel (a syscall, a wait, preempted at cond_resched()) may hold locks
+ * or be about to sleep: let it finish (or abandon a killable wait) and die
+ * leaving the kernel.  A running one is kicked there now, since its CPU
+ * may have no tick armed. */
+static void thread_kill_locked(thread_t* target, int sig) {
+    uint32_t cpu = target->cpu_id < MAX_CPUS ? target->cpu_id : 0;
+    runqueue_t* rq = &g_rq[cpu];
+    spinlock_lock(&rq->lock);
+    bool running = target->on_cpu || percpu_of(cpu)->current == target;
+    bool defer = running || target->in_wait ||
+                 (((const intr_frame_t*)(uintptr_t)target->rsp)->cs & 3) == 0;
+    if (defer) {
+        target->pending_kill = sig > 0 ? sig : 9;
+        if (running) percpu_of(cpu)->need_resched = true;
+    }
+    spinlock_unlock(&rq->lock);
+
+    if (!defer) {
+        thread_mark_zombie(target, -sig);
+        return;
+    }
+    if (target->in_wait && target->wq_killable) scheduler_wake_blocked(target);
+    if (running && cpu != cpu_current_id()) smp_send_resched(cpu);
 }
 
 int scheduler_kill(int pid, int sig) {
-    spinlock_lock(&g_sched_lock);
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
     thread_t* target = find_thread_by_id(pid);
     if (!target || !target->is_user) {
-        spinlock_unlock(&g_sched_lock);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
         return -1;
     }
     if (target == thread_current()) {
-        spinlock_unlock(&g_sched_lock);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
         return 0;
     }
     if (target->state == THREAD_ZOMBIE) {
-        spinlock_unlock(&g_sched_lock);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
         return 0;
     }
-    thread_mark_zombie(target, -sig);
-    spinlock_unlock(&g_sched_lock);
+    thread_kill_locked(target, sig);
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
     return 0;
 }
 
-uint64_t scheduler_thread_count(void) {
-    spinlock_lock(&g_sched_lock);
-    uint64_t count = 0;
-    for (size_t i = 0; i < MAX_THREADS; i++) {
-        if (g_threads[i].state != THREAD_UNUSED) count++;
+int scheduler_set_nice(thread_t* t, int nice) {
+    if (nice < THREAD_NICE_MIN) nice = THREAD_NICE_MIN;
+    if (nice > THREAD_NICE_MAX) nice = THREAD_NICE_MAX;
+    runqueue_t* rq = &g_rq[t->cpu_id < MAX_CPUS ? t->cpu_id : 0];
+    spinlock_lock(&rq->lock);
+    bool queued = t->on_rq;
+    if (queued) rq_dequeue(rq, t);
+    t->nice = nice;
+    t->weight = k_nice_weight[nice - THREAD_NICE_MIN];
+    if (queued) rq_enqueue(rq, t);
+    spinlock_unlock(&rq->lock);
+    return nice;
+}
+
+static bool sched_attr_valid(int policy, const sched_attr_t* attr) {
+    switch (policy) {
+        case SCHED_NORMAL:
+            return true;
+        case SCHED_FIFO:
+        case SCHED_RR:
+            return attr->priority >= 1 && attr->priority <= SCHED_RT_PRIO_MAX;
+        case SCHED_DEADLINE:
+            return attr->runtime_ns >= DL_RUNTIME_MIN_NS &&
+                   attr->runtime_ns <= attr->deadline_ns &&
+                   attr->deadline_ns <= attr->period_ns &&
+                   attr->period_ns <= DL_PERIOD_MAX_NS;
+        default:
+            return false;
+    }
+}
+
+/* Move t to a new class under its runqueue lock.  A deadline reservation
+ * is refused if it would push the CPU's admitted bandwidth past the
+ * limit.  Caller holds g_sched_lock. */
+static int sched_apply(thread_t* t, int policy, const sched_attr_t* attr) {
+    uint32_t cpu = t->cpu_id < MAX_CPUS ? t->cpu_id : 0;
+    runqueue_t* rq = &g_rq[cpu];
+    uint64_t bw = 0;
+    if (policy == SCHED_DEADLINE) bw = (attr->runtime_ns << DL_BW_SHIFT) / attr->period_ns;
+
+    spinlock_lock(&rq->lock);
+    uint64_t old_bw = t->policy == SCHED_DEADLINE ? t->dl_bw : 0;
+    if (rq->dl_bw - old_bw + bw > DL_BW_LIMIT) {
+        spinlock_unlock(&rq->lock);
+        return -1;
+    }
+    rq->dl_bw = rq->dl_bw - old_bw + bw;
+
+    bool queued = t->on_rq;
+    if (queued) rq_dequeue(rq, t);
+    bool was_fair = sched_class(t) == 0;
+    /* Leaving the deadline class ends any throttling; a stale dl_timer
+     * finds dl_throttled clear and does nothing. */
+    if (t->dl_throttled) {
+        t->dl_throttled = false;
+        if (t->state == THREAD_READY && !t->on_cpu) queued = true;
+    }
+
+    t->policy = (uint8_t)policy;
+    t->rt_priority = is_rt(t) ? (uint8_t)attr->priority : 0;
+    t->dl_bw = bw;
+    if (policy == SCHED_DEADLINE) {
+        t->dl_runtime = attr->runtime_ns;
+        t->dl_deadline = attr->deadline_ns;
+        t->dl_period = attr->period_ns;
+        t->dl_abs_deadline = time_now_ns() + t->dl_deadline;
+        t->dl_remaining = (int64_t)t->dl_runtime;
+    } else if (policy == SCHED_NORMAL && !was_fair) {
+        t->vruntime = rq->min_vruntime;
+    }
+    /* Timer slack would only add latency to real-time wakeups. */
+    t->timer_slack_ns = policy == SCHED_NORMAL ? THREAD_TIMER_SLACK_NS : 0;
+
+    bool kick = false;
+    if (queued) {
+        rq_enqueue(rq, t);
+        kick = should_preempt(rq, cpu, t);
+    } else if (percpu_of(cpu)->current == t) {
+        kick = true;    /* may have dropped below a queued thread */
+    }
+    if (kick) percpu_of(cpu)->need_resched = true;
+    spinlock_unlock(&rq->lock);
+
+    if (kick && cpu != cpu_current_id()) smp_send_resched(cpu);
+    return 0;
+}
+
+int scheduler_setscheduler(int pid, int policy, const sched_attr_t* attr) {
+    if (!attr || !sched_attr_valid(policy, attr)) return -1;
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
+    thread_t* t = pid == 0 ? thread_current() : find_thread_by_id(pid);
+    int rc = -1;
+    if (t && t->state != THREAD_ZOMBIE) rc = sched_apply(t, policy, attr);
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
+    return rc;
+}
+
+int scheduler_set_affinity(int pid, uint64_t mask) {
+    mask &= cpu_online_mask();
+    if (!mask) return -1;
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
+    thread_t* t = pid == 0 ? thread_current() : find_thread_by_id(pid);
+    uint32_t cpu = t ? (t->cpu_id < MAX_CPUS ? t->cpu_id : 0) : 0;
+    /* Per-CPU threads stay put; deadline bandwidth is admitted per CPU. */
+    if (!t || t->state == THREAD_ZOMBIE || t == g_rq[cpu].idle ||
+        (t->policy == SCHED_DEADLINE && !(mask & (1ULL << cpu)))) {
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
+        return -1;
+    }
+
+    t->cpu_affinity = mask;
+    if (!(mask & (1ULL << cpu))) {
+        uint32_t dst = scheduler_pick_cpu(mask);
+        runqueue_t* drq = &g_rq[dst];
+        bool kick_src = false;
+        bool kick_dst = false;
+        lock_rq_pair(cpu, dst);
+        if (percpu_of(cpu)->current == t) {
+            /* Running: its CPU deschedules it and pushes it to dst. */
+            percpu_of(cpu)->need_resched = true;
+            kick_src = cpu != cpu_current_id();
+        } else if (!t->on_cpu) {
+            migrate_thread(cpu, dst, t);
+            if (t->on_rq && should_preempt(drq, dst, t) && !percpu_of(dst)->need_resched) {
+                percpu_of(dst)->need_resched = true;
+                kick_dst = true;
+            }
+        }
+        /* Otherwise it is just switching out: the wakeup moves it. */
+        unlock_rq_pair(cpu, dst);
+        if (kick_src) smp_send_resched(cpu);
+        if (kick_dst && dst != cpu_current_id()) smp_send_resched(dst);
+    }
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
+    return 0;
+}
+
+int64_t scheduler_get_affinity(int pid) {
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
+    thread_t* t = pid == 0 ? thread_current() : find_thread_by_id(pid);
+    int64_t mask = t ? (int64_t)(t->cpu_affinity & cpu_online_mask()) : -1;
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
+    return mask;
+}
+
+int scheduler_getscheduler(int pid, sched_attr_t* attr) {
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
+    thread_t* t = pid == 0 ? thread_current() : find_thread_by_id(pid);
+    int policy = -1;
+    if (t) {
+        policy = t->policy;
+        if (attr) {
+            attr->priority = t->rt_priority;
+            attr->runtime_ns = t->dl_runtime;
+            attr->deadline_ns = t->dl_deadline;
+            attr->period_ns = t->dl_period;
+        }
     }
-    spinlock_unlock(&g_sched_lock);
-    return count;
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
+    return policy;
+}
+
+static void cputime_to_rusage(const cputime_t* c, sched_rusage_t* ru) {
+    ru->utime_ns = tsc_to_ns(c->user_cycles);
+    ru->stime_ns = tsc_to_ns(c->sys_cycles);
+    ru->irq_ns = tsc_to_ns(c->irq_cycles);
+    ru->wait_ns = c->wait_ns;
+    ru->nvcsw = c->nvcsw;
+    ru->nivcsw = c->nivcsw;
+}
+
+int scheduler_getrusage(int who, sched_rusage_t* ru) {
+    thread_t* cur = thread_current();
+    if (!cur || !ru) return -1;
+    cputime_t c;
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
+    if (who == SCHED_RUSAGE_THREAD) {
+        cputime_sys(cur);
+        c = cur->cpu;
+    } else if (who == SCHED_RUSAGE_SELF) {
+        cputime_sys(cur);
+        proc_cputime(thread_proc(cur), &c);
+    } else if (who == SCHED_RUSAGE_CHILDREN) {
+        c = thread_proc(cur)->cpu_children;
+    } else {
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
+        return -1;
+    }
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
+    cputime_to_rusage(&c, ru);
+    return 0;
+}
+
+uint64_t scheduler_thread_count(void) {
+    return g_thread_count;
 }
 
 static thread_t* find_child(thread_t* parent, int pid, bool require_zombie) {
-    for (size_t i = 0; i < MAX_THREADS; i++) {
-        thread_t* t = &g_threads[i];
-        if (t->state == THREAD_UNUSED) continue;
-        if (t->parent != parent) continue;
+    for (thread_t* t = parent->first_child; t; t = t->sibling_next) {
         if (pid > 0 && (int)t->id != pid) continue;
         if (require_zombie && t->state != THREAD_ZOMBIE) continue;
         return t;
@@ -479,88 +1917,111 @@ static thread_t* find_child(thread_t* parent, int pid, bool require_zombie) {
     return 0;
 }
 
-intr_frame_t* scheduler_waitpid(intr_frame_t* frame, int pid, uint64_t status_ptr) {
-    thread_t* cur = thread_current();
-    if (!cur) return frame;
-
-    spinlock_lock(&g_sched_lock);
-    thread_t* zombie = find_child(cur, pid, true);
+typedef struct {
+    thread_t* parent;
+    int pid;
+    int* status;
+    int64_t result;
+    bool done;
+} waitpid_ctx_t;
+
+/* wait_until() condition: reap a matching zombie, or give up if no child
+ * could ever match. */
+static bool waitpid_done(void* arg) {
+    waitpid_ctx_t* w = (waitpid_ctx_t*)arg;
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
+    thread_t* zombie = find_child(w->parent, w->pid, true);
     if (zombie) {
-        if (status_ptr) {
-            int* sp = (int*)(uintptr_t)status_ptr;
-            *sp = zombie->exit_code;
-        }
-        thread_release_resources(zombie);
-        for (size_t i = 0; i < THREAD_MAX_OPEN_FILES; i++) {
-            if (zombie->open_files[i]) {
-                vfs_close(zombie->open_files[i]);
-                zombie->open_files[i] = 0;
-            }
-        }
-        zombie->open_file_count = 0;
-        zombie->state = THREAD_UNUSED;
-        frame->rax = zombie->id;
-        spinlock_unlock(&g_sched_lock);
-        return frame;
+        if (w->status) *w->status = zombie->exit_code;
+        w->result = (int64_t)zombie->id;
+        w->done = true;
+        cputime_t* acc = &thread_proc(w->parent)->cpu_children;
+        cputime_add(acc, &zombie->cpu);
+        cputime_add(acc, &zombie->cpu_dead);
+        cputime_add(acc, &zombie->cpu_children);
+        thread_reap(zombie);
+    } else if (!find_child(w->parent, w->pid, false)) {
+        w->result = -1;
+        w->done = true;
     }
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
+    return w->done;
+}
 
-    /* If there is no matching child at all, return -1. */
-    thread_t* any_child = find_child(cur, pid, false);
-    if (!any_child) {
-        frame->rax = (uint64_t)-1;
-        spinlock_unlock(&g_sched_lock);
-        return frame;
-    }
+int64_t scheduler_waitpid(int pid, int* status) {
+    thread_t* cur = thread_current();
+    if (!cur) return -1;
+    waitpid_ctx_t w = { cur, pid, status, -1, false };
+    if (wait_until(&cur->child_exit, waitpid_done, &w, WAIT_KILLABLE) < 0) return -1;
+    return w.result;
+}
 
-    /* Block current thread until a matching child exits. */
-    cur->wait_target = pid;
-    cur->wait_status_ptr = status_ptr;
-    cur->state = THREAD_BLOCKED;
-    spinlock_unlock(&g_sched_lock);
-    return scheduler_yield(frame);
+static void dump_thread(const thread_t* t) {
+    console_write("  id=");
+    console_write_dec_u64(t->id);
+    console_write(" name=");
+    console_write(t->name);
+    console_write(" state=");
+    switch (t->state) {
+        case THREAD_READY: console_write("READY"); break;
+        case THREAD_RUNNING: console_write("RUNNING"); break;
+        case THREAD_SLEEPING: console_write("SLEEP"); break;
+        case THREAD_BLOCKED: console_write("BLOCK"); break;
+        case THREAD_ZOMBIE: console_write("ZOMBIE"); break;
+        default: console_write("UNUSED"); break;
+    }
+    console_write(" user=");
+    console_write_dec_u64(t->is_user ? 1 : 0);
+    static const char* const k_policy[] = { "normal", "fifo", "rr", "deadline" };
+    console_write(" policy=");
+    console_write(t->policy <= SCHED_DEADLINE ? k_policy[t->policy] : "?");
+    if (is_rt(t)) {
+        console_write("/");
+        console_write_dec_u64(t->rt_priority);
+    }
+    console_write(" nice=");
+    if (t->nice < 0) console_write("-");
+    console_write_dec_u64((uint64_t)(t->nice < 0 ? -t->nice : t->nice));
+    console_write(" cpu_ms=");
+    console_write_dec_u64(t->sum_exec_ns / 1000000ULL);
+    console_write(" user_ms=");
+    console_write_dec_u64(tsc_to_ns(t->cpu.user_cycles) / 1000000ULL);
+    console_write(" sys_ms=");
+    console_write_dec_u64(tsc_to_ns(t->cpu.sys_cycles) / 1000000ULL);
+    console_write(" irq_ms=");
+    console_write_dec_u64(tsc_to_ns(t->cpu.irq_cycles) / 1000000ULL);
+    console_write(" wait_ms=");
+    console_write_dec_u64(t->cpu.wait_ns / 1000000ULL);
+    console_write(" csw=");
+    console_write_dec_u64(t->cpu.nvcsw);
+    console_write("/");
+    console_write_dec_u64(t->cpu.nivcsw);
+    console_write("\n");
 }
 
 void scheduler_dump(void) {
-    spinlock_lock(&g_sched_lock);
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
     console_write("[sched] threads:\n");
-    for (size_t i = 0; i < MAX_THREADS; i++) {
-        thread_t* t = &g_threads[i];
-        if (t->state == THREAD_UNUSED) continue;
-        console_write("  id=");
-        console_write_dec_u64(t->id);
-        console_write(" name=");
-        console_write(t->name);
-        console_write(" state=");
-        switch (t->state) {
-            case THREAD_READY: console_write("READY"); break;
-            case THREAD_RUNNING: console_write("RUNNING"); break;
-            case THREAD_SLEEPING: console_write("SLEEP"); break;
-            case THREAD_BLOCKED: console_write("BLOCK"); break;
-            case THREAD_ZOMBIE: console_write("ZOMBIE"); break;
-            default: console_write("UNUSED"); break;
-        }
-        console_write(" user=");
-        console_write_dec_u64(t->is_user ? 1 : 0);
-        console_write(" prio=");
-        console_write_dec_u64((uint64_t)t->priority);
-        console_write("\n");
+    for (size_t b = 0; b < PID_HASH_SIZE; b++) {
+        for (thread_t* t = g_pid_hash[b]; t; t = t->hash_next) dump_thread(t);
     }
-    spinlock_unlock(&g_sched_lock);
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
 }
 
 void scheduler_register_cpu_bootstrap(uint32_t cpu_id, uint8_t* stack_base, size_t stack_size) {
     if (cpu_id >= MAX_CPUS) cpu_id = 0;
-    spinlock_lock(&g_sched_lock);
-    thread_t* t = thread_alloc_slot();
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
+    thread_t* t = thread_alloc();
     if (!t) {
-        spinlock_unlock(&g_sched_lock);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
         return;
     }
 
     t->is_user = false;
     t->cr3 = kspace_cr3;
-    t->priority = 1;
     t->cpu_id = cpu_id;
+    t->cpu_affinity = 1ULL << cpu_id;
+    t->on_cpu = true;
     t->state = THREAD_RUNNING;
     t->kstack = stack_base;
     t->kstack_size = stack_size;
@@ -576,29 +2037,29 @@ void scheduler_register_cpu_bootstrap(uint32_t cpu_id, uint8_t* stack_base, size
     t->name[7] = 'p';
     t->name[8] = 0;
 
-    g_current[cpu_id] = t;
+    percpu_of(cpu_id)->current = t;
+    g_rq[cpu_id].idle = t;
     tss_set_rsp0((uint64_t)(uintptr_t)(stack_base + stack_size));
-    spinlock_unlock(&g_sched_lock);
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
 }
 
 thread_t* thread_create_kernel(const char* name, void (*fn)(void*), void* arg) {
-    spinlock_lock(&g_sched_lock);
-    thread_t* t = thread_alloc_slot();
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
+    thread_t* t = thread_alloc();
     if (!t) {
-        spinlock_unlock(&g_sched_lock);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
         return 0;
     }
 
     t->is_user = false;
     t->cr3 = kspace_cr3;
-    t->parent = thread_current();
-    if (t->parent) t->parent->children++;
-    t->cpu_id = scheduler_pick_cpu();
-    t->kstack_size = KSTACK_PAGES * PAGE_SIZE;
-    t->kstack = (uint8_t*)alloc_pages(KSTACK_PAGES);
+    thread_link_child(thread_current(), t);
+    t->cpu_id = scheduler_pick_cpu(t->cpu_affinity);
+    t->kstack_size = KSTACK_SIZE;
+    t->kstack = (uint8_t*)kstack_alloc();
     if (!t->kstack) {
-        t->state = THREAD_UNUSED;
-        spinlock_unlock(&g_sched_lock);
+        thread_discard(t);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
         return 0;
     }
     thread_kstack_canary_init(t);
@@ -608,34 +2069,33 @@ thread_t* thread_create_kernel(const char* name, void (*fn)(void*), void* arg) {
     for (size_t i = 0; i < sizeof(t->name)-1 && name[i]; i++) t->name[i] = name[i];
 
     build_kernel_thread_frame(t, fn, arg);
-    t->state = THREAD_READY;
-    spinlock_unlock(&g_sched_lock);
+    thread_wake(t);
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
     return t;
 }
 
 thread_t* thread_create_user(const char* name, uint64_t user_rip, uint64_t brk_start, uint64_t cr3) {
-    spinlock_lock(&g_sched_lock);
-    thread_t* t = thread_alloc_slot();
+    uint64_t irq = spinlock_lock_irqsave(&g_sched_lock);
+    thread_t* t = thread_alloc();
     if (!t) {
-        spinlock_unlock(&g_sched_lock);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
         return 0;
     }
 
     t->is_user = true;
     t->cr3 = cr3;
-    t->parent = thread_current();
-    if (t->parent) t->parent->children++;
-    t->cpu_id = scheduler_pick_cpu();
+    thread_link_child(thread_current(), t);
+    t->cpu_id = scheduler_pick_cpu(t->cpu_affinity);
     if (!t->cr3) {
-        t->state = THREAD_UNUSED;
-        spinlock_unlock(&g_sched_lock);
+        thread_discard(t);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
         return 0;
     }
-    t->kstack_size = KSTACK_PAGES * PAGE_SIZE;
-    t->kstack = (uint8_t*)alloc_pages(KSTACK_PAGES);
+    t->kstack_size = KSTACK_SIZE;
+    t->kstack = (uint8_t*)kstack_alloc();
     if (!t->kstack) {
-        t->state = THREAD_UNUSED;
-        spinlock_unlock(&g_sched_lock);
+        thread_discard(t);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
         return 0;
     }
     thread_kstack_canary_init(t);
@@ -643,8 +2103,9 @@ thread_t* thread_create_user(const char* name, uint64_t user_rip, uint64_t brk_s
     t->ustack_size = USTACK_PAGES * PAGE_SIZE;
     uint64_t stack_phys = pmm_alloc_pages(USTACK_PAGES);
     if (!stack_phys) {
-        t->state = THREAD_UNUSED;
-        spinlock_unlock(&g_sched_lock);
+        kstack_free(t->kstack);
+        thread_discard(t);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
         return 0;
     }
     memset((void*)(uintptr_t)stack_phys, 0, t->ustack_size);
@@ -653,8 +2114,9 @@ thread_t* thread_create_user(const char* name, uint64_t user_rip, uint64_t brk_s
     if (!vmm_map_range(t->cr3, user_stack_base, stack_phys, t->ustack_size,
                        VMM_FLAG_PRESENT | VMM_FLAG_WRITABLE | VMM_FLAG_USER)) {
         pmm_free_pages(stack_phys, USTACK_PAGES);
-        t->state = THREAD_UNUSED;
-        spinlock_unlock(&g_sched_lock);
+        kstack_free(t->kstack);
+        thread_discard(t);
+        spinlock_unlock_irqrestore(&g_sched_lock, irq);
         return 0;
     }
     t->ustack = (uint8_t*)(uintptr_t)stack_phys;
@@ -669,7 +2131,7 @@ thread_t* thread_create_user(const char* name, uint64_t user_rip, uint64_t brk_s
 
     build_user_thread_frame(t, user_rip);
 
-    t->state = THREAD_READY;
-    spinlock_unlock(&g_sched_lock);
+    thread_wake(t);
+    spinlock_unlock_irqrestore(&g_sched_lock, irq);
     return t;
 }
@@ -0,0 +1,135 @@
+#include "sync.h"
+#include "thread.h"
+#include "scheduler.h"
+#include "arch/x86_64/common.h"
+
+/* ---- mutex ---- */
+
+void mutex_init(mutex_t* m) {
+    m->locked = 0;
+    m->owner = 0;
+    m->contended = 0;
+    wait_queue_init(&m->wq);
+}
+
+bool mutex_trylock(mutex_t* m) {
+    if (m->locked || __sync_lock_test_and_set(&m->locked, 1)) return false;
+    m->owner = thread_current();
+    return true;
+}
+
+static bool mutex_acquired(void* arg) {
+    return mutex_trylock((mutex_t*)arg);
+}
+
+void mutex_lock(mutex_t* m) {
+    if (mutex_trylock(m)) return;
+    wait_until(&m->wq, mutex_acquired, m, WAIT_EXCLUSIVE);
+    m->contended++;
+}
+
+void mutex_unlock(mutex_t* m) {
+    m->owner = 0;
+    __sync_lock_release(&m->locked);
+    wake_up(&m->wq);
+}
+
+/* ---- semaphore ---- */
+
+void sem_init(semaphore_t* s, int64_t count) {
+    s->count = count;
+    wait_queue_init(&s->wq);
+}
+
+bool sem_trydown(semaphore_t* s) {
+    for (;;) {
+        int64_t c = s->count;
+        if (c <= 0) return false;
+        if (__sync_bool_compare_and_swap(&s->count, c, c - 1)) return true;
+    }
+}
+
+static bool sem_taken(void* arg) {
+    return sem_trydown((semaphore_t*)arg);
+}
+
+void sem_down(semaphore_t* s) {
+    wait_until(&s->wq, sem_taken, s, WAIT_EXCLUSIVE);
+}
+
+void sem_up(semaphore_t* s) {
+    __sync_fetch_and_add(&s->count, 1);
+    wake_up(&s->wq);
+}
+
+/* ---- completion ---- */
+
+void completion_init(completion_t* c) {
+    c->done = 0;
+    wait_queue_init(&c->wq);
+}
+
+void completion_reinit(completion_t* c) {
+    c->done = 0;
+}
+
+bool try_wait_for_completion(completion_t* c) {
+    for (;;) {
+        uint32_t d = c->done;
+        if (d == 0) return false;
+        if (d & COMPLETION_DONE_ALL) return true;
+        if (__sync_bool_compare_and_swap(&c->done, d, d - 1)) return true;
+    }
+}
+
+static bool completion_taken(void* arg) {
+    return try_wait_for_completion((completion_t*)arg);
+}
+
+void wait_for_completion(completion_t* c) {
+    wait_until(&c->wq, completion_taken, c, WAIT_EXCLUSIVE);
+}
+
+void complete(completion_t* c) {
+    for (;;) {
+        uint32_t d = c->done;
+        if (d & COMPLETION_DONE_ALL) break;
+        if (__sync_bool_compare_and_swap(&c->done, d, d + 1)) break;
+    }
+    wake_up(&c->wq);
+}
+
+void complete_all(completion_t* c) {
+    __sync_fetch_and_or(&c->done, COMPLETION_DONE_ALL);
+    wake_up_all(&c->wq);
+}
+
+/* ---- condition variable ---- */
+
+void cond_init(condvar_t* cv) {
+    wait_queue_init(&cv->wq);
+}
+
+void cond_wait(condvar_t* cv, mutex_t* m) {
+    if (!scheduler_can_block()) {
+        mutex_unlock(m);
+        cpu_pause();
+        mutex_lock(m);
+        return;
+    }
+    /* Queued before the mutex is dropped, so a signal sent by whoever
+     * takes it next cannot be missed. */
+    wait_prepare(&cv->wq, WAIT_EXCLUSIVE);
+    mutex_unlock(m);
+    wait_sleep();
+    wait_finish(&cv->wq);
+    mutex_lock(m);
+}
+
+void cond_signal(condvar_t* cv) {
+    wake_up(&cv->wq);
+}
+
+void cond_broadcast(condvar_t* cv) {
+    wake_up_all(&cv->wq);
+}
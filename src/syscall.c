@@ -11,38 +11,54 @@
 #include "sysinfo.h"
 #include "arch/x86_64/common.h"
 #include "arch/x86_64/pit.h"
+#include "arch/x86_64/fpu.h"
+#include "arch/x86_64/tsc.h"
 #include "time.h"
 #include "net.h"
 #include "input.h"
+#include "futex.h"
+#include "sched_trace.h"
 
 #define USTACK_PAGES  4
 
+/* The fd table is per process: threads of a group use their leader's,
+ * under its proc_lock. */
 static int vfs_fd_allocate(thread_t* t, vfs_file_t* file) {
     if (!t || !file) return -1;
+    thread_t* p = thread_proc(t);
+    int fd = -1;
+    spinlock_lock(&p->proc_lock);
     for (size_t i = 0; i < THREAD_MAX_OPEN_FILES; i++) {
-        if (!t->open_files[i]) {
-            t->open_files[i] = file;
-            t->open_file_count++;
-            return (int)(i + 3);
+        if (!p->open_files[i]) {
+            p->open_files[i] = file;
+            p->open_file_count++;
+            fd = (int)(i + 3);
+            break;
         }
     }
-    return -1;
+    spinlock_unlock(&p->proc_lock);
+    return fd;
 }
 
 static vfs_file_t* vfs_fd_get(thread_t* t, int fd) {
     if (!t || fd < 3) return 0;
     size_t idx = (size_t)(fd - 3);
     if (idx >= THREAD_MAX_OPEN_FILES) return 0;
-    return t->open_files[idx];
+    return thread_proc(t)->open_files[idx];
 }
 
 static int vfs_fd_close(thread_t* t, int fd) {
     if (!t || fd < 3) return -1;
     size_t idx = (size_t)(fd - 3);
-    if (idx >= THREAD_MAX_OPEN_FILES || !t->open_files[idx]) return -1;
-    vfs_close(t->open_files[idx]);
-    t->open_files[idx] = 0;
-    if (t->open_file_count > 0) t->open_file_count--;
+    if (idx >= THREAD_MAX_OPEN_FILES) return -1;
+    thread_t* p = thread_proc(t);
+    spinlock_lock(&p->proc_lock);
+    vfs_file_t* file = p->open_files[idx];
+    p->open_files[idx] = 0;
+    if (file && p->open_file_count > 0) p->open_file_count--;
+    spinlock_unlock(&p->proc_lock);
+    if (!file) return -1;
+    vfs_close(file);
     return 0;
 }
 
@@ -51,10 +67,80 @@ static uint64_t mmap_default_base(uint64_t brk_end) {
     return base + 0x01000000ULL;
 }
 
+/* Mappings, brk and the page tables under them are per process; callers
+ * hold thread_proc(t)->proc_lock.
+ *
+ * Unmapped ranges below mmap_base are kept as holes for later mappings; one
+ * reaching mmap_base lowers it instead.  Every hole is unmapped, so losing
+ * one (no free slot, a hinted mapping splitting it) only wastes address
+ * space. */
+static void mmap_hole_add(thread_t* p, uint64_t base, uint64_t size) {
+    uint64_t end = base + size;
+    for (uint32_t i = 0; i < THREAD_MMAP_HOLES; i++) {
+        uint64_t hb = p->mmap_holes[i].base;
+        uint64_t he = hb + p->mmap_holes[i].size;
+        if (!p->mmap_holes[i].size || he < base || hb > end) continue;
+        if (hb < base) base = hb;
+        if (he > end) end = he;
+        p->mmap_holes[i].size = 0;
+        i = (uint32_t)-1;   /* the wider range may touch another: rescan */
+    }
+    if (end >= p->mmap_base) {
+        if (base < p->mmap_base) p->mmap_base = base;
+        return;
+    }
+    uint32_t slot = 0;
+    for (uint32_t i = 1; i < THREAD_MMAP_HOLES; i++) {
+        if (p->mmap_holes[i].size < p->mmap_holes[slot].size) slot = i;
+    }
+    if (p->mmap_holes[slot].size >= end - base) return;
+    p->mmap_holes[slot].base = base;
+    p->mmap_holes[slot].size = end - base;
+}
+
+/* First fit. */
+static bool mmap_hole_take(thread_t* p, uint64_t size, uint64_t* out) {
+    for (uint32_t i = 0; i < THREAD_MMAP_HOLES; i++) {
+        if (p->mmap_holes[i].size < size) continue;
+        *out = p->mmap_holes[i].base;
+        p->mmap_holes[i].base += size;
+        p->mmap_holes[i].size -= size;
+        return true;
+    }
+    return false;
+}
+
+/* A hinted mapping may land in a hole: cut it out, keeping the lower part
+ * when it splits one in two. */
+static void mmap_hole_carve(thread_t* p, uint64_t base, uint64_t size) {
+    uint64_t end = base + size;
+    for (uint32_t i = 0; i < THREAD_MMAP_HOLES; i++) {
+        uint64_t hb = p->mmap_holes[i].base;
+        uint64_t he = hb + p->mmap_holes[i].size;
+        if (!p->mmap_holes[i].size || he <= base || hb >= end) continue;
+        if (hb < base) {
+            p->mmap_holes[i].size = base - hb;
+        } else if (he > end) {
+            p->mmap_holes[i].base = end;
+            p->mmap_holes[i].size = he - end;
+        } else {
+            p->mmap_holes[i].size = 0;
+        }
+    }
+}
+
 static uint64_t mmap_map_anonymous(thread_t* t, uint64_t addr, uint64_t len, int prot) {
     if (!t || !t->is_user || len == 0) return (uint64_t)-1;
+    thread_t* p = thread_proc(t);
     uint64_t size = align_up_u64(len, PAGE_SIZE);
-    uint64_t base = addr ? align_down_u64(addr, PAGE_SIZE) : align_up_u64(t->mmap_base, PAGE_SIZE);
+    uint64_t base = 0;
+    if (addr) base = align_down_u64(addr, PAGE_SIZE);
+    else if (size == 0 || !mmap_hole_take(p, size, &base)) base = align_up_u64(p->mmap_base, PAGE_SIZE);
+    /* Hinted or not, the mapping stays between the heap and the stack. */
+    uint64_t lo = mmap_default_base(p->brk_start);
+    uint64_t hi = USER_STACK_TOP - p->ustack_size;
+    if (size == 0 || base < lo || base > hi || size > hi - base) return (uint64_t)-1;
+    if (addr) mmap_hole_carve(p, base, size);
     uint64_t flags = VMM_FLAG_PRESENT | VMM_FLAG_USER;
     if (prot & 0x2) flags |= VMM_FLAG_WRITABLE;
     if ((prot & 0x4) == 0) flags |= VMM_FLAG_NOEXEC;
@@ -71,20 +157,74 @@ static uint64_t mmap_map_anonymous(thread_t* t, uint64_t addr, uint64_t len, int
     }
 
     if (mapped != size) {
-        for (uint64_t off = 0; off < mapped; off += PAGE_SIZE) {
-            uint64_t pa = vmm_unmap_page(t->cr3, base + off);
-            if (pa) pmm_free_pages(pa, 1);
-        }
+        vmm_unmap_user_range(t->cr3, base, mapped);
+        /* A hinted range may have run into an older mapping. */
+        mmap_hole_add(p, base, addr ? mapped : size);
         return (uint64_t)-1;
     }
 
-    if (!addr) {
-        t->mmap_base = base + size;
+    if (!addr && base + size > p->mmap_base) {
+        p->mmap_base = base + size;
     }
 
     return base;
 }
 
+static int mmap_unmap_range(thread_t* t, uint64_t addr, uint64_t len) {
+    if (!t || !t->is_user || len == 0) return -1;
+    if (addr & (PAGE_SIZE - 1)) return -1;
+    thread_t* p = thread_proc(t);
+    uint64_t size = align_up_u64(len, PAGE_SIZE);
+    uint64_t lo = mmap_default_base(p->brk_start);
+    uint64_t hi = USER_STACK_TOP - p->ustack_size;
+    if (addr < lo || addr > hi || size > hi - addr) return -1;
+
+    vmm_unmap_user_range(t->cr3, addr, size);
+    mmap_hole_add(p, addr, size);
+    return 0;
+}
+
+/* Validated timespec -> ns, saturating far-future values. */
+static bool timespec_to_ns(const time_spec_t* ts, uint64_t* out) {
+    if (!ts || ts->tv_sec < 0 || ts->tv_nsec < 0 || ts->tv_nsec >= (int64_t)TIME_NS_PER_SEC) {
+        return false;
+    }
+    uint64_t sec = (uint64_t)ts->tv_sec;
+    if (sec >= UINT64_MAX / TIME_NS_PER_SEC) *out = UINT64_MAX;
+    else *out = sec * TIME_NS_PER_SEC + (uint64_t)ts->tv_nsec;
+    return true;
+}
+
+static void ns_to_timespec(uint64_t ns, time_spec_t* ts) {
+    ts->tv_sec = (int64_t)(ns / TIME_NS_PER_SEC);
+    ts->tv_nsec = (int64_t)(ns % TIME_NS_PER_SEC);
+}
+
+/* nanosleep/clock_nanosleep: sleeps always run to completion, so `rem`
+ * is zeroed up front. */
+static intr_frame_t* do_nanosleep(intr_frame_t* frame, uint64_t clock, uint64_t flags,
+                                  const time_spec_t* req, time_spec_t* rem) {
+    uint64_t ns = 0;
+    if ((clock != SYS_CLOCK_REALTIME && clock != SYS_CLOCK_MONOTONIC) ||
+        !timespec_to_ns(req, &ns)) {
+        frame->rax = (uint64_t)-1;
+        return frame;
+    }
+    uint64_t now = time_now_ns();
+    uint64_t deadline;
+    if (!(flags & SYS_TIMER_ABSTIME)) {
+        deadline = ns > UINT64_MAX - now ? UINT64_MAX : now + ns;
+    } else if (clock == SYS_CLOCK_REALTIME) {
+        uint64_t offset = time_realtime_ns() - now;
+        deadline = ns > offset ? ns - offset : 0;
+    } else {
+        deadline = ns;
+    }
+    if (rem) ns_to_timespec(0, rem);
+    frame->rax = 0;
+    return scheduler_sleep_until_ns(frame, deadline);
+}
+
 static char scancode_to_char(uint8_t scancode, int shift) {
     static const char keymap[128] = {
         0, 27, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '-', '=', '\b', '\t',
@@ -114,7 +254,7 @@ static uint64_t stdin_read_chars(char* buf, uint64_t len) {
     while (count < len) {
         key_event_t ev;
         if (!input_read_key(&ev)) {
-            cpu_hlt();
+            if (input_wait_key() < 0) break;
             continue;
         }
 
@@ -205,7 +345,8 @@ intr_frame_t* syscall_handle(intr_frame_t* frame) {
         }
         case SYS_execve: {
             thread_t* cur = thread_current();
-            if (!cur || !cur->is_user) {
+            /* Only a single-threaded process may replace its image. */
+            if (!cur || !cur->is_user || cur->group_leader || cur->group_next) {
                 frame->rax = (uint64_t)-1;
                 return frame;
             }
@@ -271,8 +412,10 @@ intr_frame_t* syscall_handle(intr_frame_t* frame) {
             cur->brk_start = brk;
             cur->brk_end = brk;
             cur->mmap_base = mmap_default_base(brk);
+            memset(cur->mmap_holes, 0, sizeof(cur->mmap_holes));
 
-            write_cr3(new_cr3);
+            vmm_activate(new_cr3);
+            fpu_release(cur);
             if (old_cr3 && old_cr3 != vmm_kernel_cr3()) vmm_release_user_space(old_cr3);
             frame->rip = entry;
             frame->rsp = cur->ustack_top;
@@ -282,7 +425,8 @@ intr_frame_t* syscall_handle(intr_frame_t* frame) {
         case SYS_waitpid: {
             int pid = (int)frame->rdi;
             uint64_t status_ptr = frame->rsi;
-            return scheduler_waitpid(frame, pid, status_ptr);
+            frame->rax = (uint64_t)scheduler_waitpid(pid, (int*)(uintptr_t)status_ptr);
+            return frame;
         }
         case SYS_exit: {
             int code = (int)frame->rdi;
@@ -301,17 +445,20 @@ intr_frame_t* syscall_handle(intr_frame_t* frame) {
                 frame->rax = (uint64_t)-1;
                 return frame;
             }
+            thread_t* p = thread_proc(t);
 
             if (new_end == 0) {
-                frame->rax = t->brk_end;
+                frame->rax = p->brk_end;
                 return frame;
             }
 
+            spinlock_lock(&p->proc_lock);
             if (!vmm_user_set_brk(t, new_end)) {
                 frame->rax = (uint64_t)-1;
             } else {
-                frame->rax = t->brk_end;
+                frame->rax = p->brk_end;
             }
+            spinlock_unlock(&p->proc_lock);
             return frame;
         }
         case SYS_gettimeofday: {
@@ -399,10 +546,73 @@ intr_frame_t* syscall_handle(intr_frame_t* frame) {
             return frame;
         }
         case SYS_getpid: {
+            thread_t* t = thread_current();
+            frame->rax = t ? thread_proc(t)->id : (uint64_t)-1;
+            return frame;
+        }
+        case SYS_gettid: {
             thread_t* t = thread_current();
             frame->rax = t ? t->id : (uint64_t)-1;
             return frame;
         }
+        case SYS_times: {
+            time_tms_t* tms = (time_tms_t*)(uintptr_t)frame->rdi;
+            const uint64_t ns_per_tick = TIME_NS_PER_SEC / TIME_CLK_TCK;
+            if (tms) {
+                sched_rusage_t self, children;
+                scheduler_getrusage(SCHED_RUSAGE_SELF, &self);
+                scheduler_getrusage(SCHED_RUSAGE_CHILDREN, &children);
+                tms->tms_utime = self.utime_ns / ns_per_tick;
+                tms->tms_stime = (self.stime_ns + self.irq_ns) / ns_per_tick;
+                tms->tms_cutime = children.utime_ns / ns_per_tick;
+                tms->tms_cstime = (children.stime_ns + children.irq_ns) / ns_per_tick;
+            }
+            frame->rax = time_now_ns() / ns_per_tick;
+            return frame;
+        }
+        case SYS_getrusage: {
+            sched_rusage_t* ru = (sched_rusage_t*)(uintptr_t)frame->rsi;
+            frame->rax = (uint64_t)(int64_t)scheduler_getrusage((int)frame->rdi, ru);
+            return frame;
+        }
+        case SYS_sched_trace: {
+            int64_t rc = 0;
+            switch ((int)frame->rdi) {
+                case SCHED_TRACE_STOP: sched_trace_stop(); break;
+                case SCHED_TRACE_START: sched_trace_start(); break;
+                case SCHED_TRACE_READ:
+                    rc = sched_trace_read((uint32_t)frame->rsi,
+                                          (sched_event_t*)(uintptr_t)frame->rdx, frame->r10);
+                    break;
+                case SCHED_TRACE_TSC_HZ: rc = (int64_t)tsc_hz(); break;
+                default: rc = -1; break;
+            }
+            frame->rax = (uint64_t)rc;
+            return frame;
+        }
+        case SYS_clone:
+            frame->rax = (uint64_t)scheduler_clone(frame, frame->rdi, frame->rsi, frame->rdx,
+                                                   frame->r10, frame->r8);
+            return frame;
+        case SYS_futex: {
+            uint32_t* uaddr = (uint32_t*)(uintptr_t)frame->rdi;
+            int op = (int)frame->rsi;
+            uint32_t val = (uint32_t)frame->rdx;
+            if (op == FUTEX_WAIT) frame->rax = (uint64_t)futex_wait(uaddr, val);
+            else if (op == FUTEX_WAKE) frame->rax = (uint64_t)futex_wake(uaddr, val);
+            else frame->rax = (uint64_t)-1;
+            return frame;
+        }
+        case SYS_set_tls: {
+            thread_t* t = thread_current();
+            if (!t || !t->is_user) {
+                frame->rax = (uint64_t)-1;
+                return frame;
+            }
+            scheduler_set_tls(frame->rdi);
+            frame->rax = 0;
+            return frame;
+        }
         case SYS_uname: {
             utsname_t* info = (utsname_t*)(uintptr_t)frame->rdi;
             if (!info) {
@@ -442,10 +652,23 @@ intr_frame_t* syscall_handle(intr_frame_t* frame) {
                 frame->rax = (uint64_t)-1;
                 return frame;
             }
+            spinlock_lock(&thread_proc(t)->proc_lock);
             uint64_t base = mmap_map_anonymous(t, addr, len, prot);
+            spinlock_unlock(&thread_proc(t)->proc_lock);
             frame->rax = base;
             return frame;
         }
+        case SYS_munmap: {
+            thread_t* t = thread_current();
+            if (!t) {
+                frame->rax = (uint64_t)-1;
+                return frame;
+            }
+            spinlock_lock(&thread_proc(t)->proc_lock);
+            frame->rax = (uint64_t)mmap_unmap_range(t, frame->rdi, frame->rsi);
+            spinlock_unlock(&thread_proc(t)->proc_lock);
+            return frame;
+        }
         case SYS_kill: {
             int pid = (int)frame->rdi;
             int sig = (int)frame->rsi;
@@ -464,10 +687,64 @@ intr_frame_t* syscall_handle(intr_frame_t* frame) {
                 return frame;
             }
             uint64_t ticks = (ms * hz + 999) / 1000;
-            scheduler_sleep(ticks);
             frame->rax = 0;
+            return scheduler_sleep_ticks(frame, ticks);
+        }
+        case SYS_nanosleep:
+            return do_nanosleep(frame, SYS_CLOCK_MONOTONIC, 0,
+                                (const time_spec_t*)(uintptr_t)frame->rdi,
+                                (time_spec_t*)(uintptr_t)frame->rsi);
+        case SYS_clock_nanosleep:
+            return do_nanosleep(frame, frame->rdi, frame->rsi,
+                                (const time_spec_t*)(uintptr_t)frame->rdx,
+                                (time_spec_t*)(uintptr_t)frame->r10);
+        case SYS_clock_gettime: {
+            time_spec_t* ts = (time_spec_t*)(uintptr_t)frame->rsi;
+            if (!ts || (frame->rdi != SYS_CLOCK_REALTIME && frame->rdi != SYS_CLOCK_MONOTONIC)) {
+                frame->rax = (uint64_t)-1;
+                return frame;
+            }
+            ns_to_timespec(frame->rdi == SYS_CLOCK_REALTIME ? time_realtime_ns() : time_now_ns(), ts);
+            frame->rax = 0;
+            return frame;
+        }
+        case SYS_timer_slack: {
+            thread_t* t = thread_current();
+            if (!t) {
+                frame->rax = (uint64_t)-1;
+                return frame;
+            }
+            uint64_t old = t->timer_slack_ns;
+            if ((int64_t)frame->rdi >= 0) t->timer_slack_ns = frame->rdi;
+            frame->rax = old;
             return frame;
         }
+        case SYS_nice: {
+            thread_t* t = thread_current();
+            if (!t) {
+                frame->rax = (uint64_t)-1;
+                return frame;
+            }
+            int64_t inc = (int64_t)frame->rdi;
+            if (inc > THREAD_NICE_MAX - THREAD_NICE_MIN) inc = THREAD_NICE_MAX - THREAD_NICE_MIN;
+            if (inc < THREAD_NICE_MIN - THREAD_NICE_MAX) inc = THREAD_NICE_MIN - THREAD_NICE_MAX;
+            frame->rax = (uint64_t)(int64_t)scheduler_set_nice(t, t->nice + (int)inc);
+            return frame;
+        }
+        case SYS_sched_setscheduler:
+            frame->rax = (uint64_t)(int64_t)scheduler_setscheduler(
+                (int)frame->rdi, (int)frame->rsi, (const sched_attr_t*)(uintptr_t)frame->rdx);
+            return frame;
+        case SYS_sched_getscheduler:
+            frame->rax = (uint64_t)(int64_t)scheduler_getscheduler(
+                (int)frame->rdi, (sched_attr_t*)(uintptr_t)frame->rsi);
+            return frame;
+        case SYS_sched_setaffinity:
+            frame->rax = (uint64_t)(int64_t)scheduler_set_affinity((int)frame->rdi, frame->rsi);
+            return frame;
+        case SYS_sched_getaffinity:
+            frame->rax = (uint64_t)scheduler_get_affinity((int)frame->rdi);
+            return frame;
         case SYS_socket: {
             int domain = (int)frame->rdi;
             int type = (int)frame->rsi;
@@ -537,20 +814,26 @@ intr_frame_t* syscall_handle(intr_frame_t* frame) {
             }
 
             size_t idx = file->offset;
-            vfs_node_t* child = file->node->children;
-            while (child && idx > 0) {
-                child = child->next;
-                idx--;
+            rcu_read_lock();
+            vfs_node_t* child;
+            rcu_slist_for_each(child, file->node->children) {
+                if (idx-- == 0) break;
             }
 
             if (!child) {
+                rcu_read_unlock();
                 frame->rax = 0;
                 return frame;
             }
 
+            /* Copied out first: the user buffer may fault. */
+            char name[VFS_NAME_MAX + 1];
             size_t name_len = strlen(child->name);
             if (name_len >= len) name_len = len - 1;
-            memcpy(buf, child->name, name_len);
+            if (name_len > VFS_NAME_MAX) name_len = VFS_NAME_MAX;
+            memcpy(name, child->name, name_len);
+            rcu_read_unlock();
+            memcpy(buf, name, name_len);
             buf[name_len] = 0;
             file->offset++;
             frame->rax = (uint64_t)name_len;
@@ -0,0 +1,255 @@
+#include "tick.h"
+#include "scheduler.h"
+#include "hrtimer.h"
+#include "procfs.h"
+#include "lib.h"
+#include "log.h"
+#include "arch/x86_64/apic.h"
+#include "arch/x86_64/pic.h"
+#include "arch/x86_64/pit.h"
+#include "arch/x86_64/tsc.h"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/common.h"
+#include "arch/x86_64/smp.h"
+#include "arch/x86_64/spinlock.h"
+
+typedef enum {
+    TICK_PIT_PERIODIC,
+    TICK_PIT_ONESHOT,
+    TICK_APIC_PERIODIC,
+    TICK_APIC_ONESHOT,
+    TICK_APIC_DEADLINE,
+} tick_mode_t;
+
+static const char* const k_mode_names[] = {
+    "pit-periodic", "pit-oneshot", "apic-periodic", "apic-oneshot", "apic-tsc-deadline",
+};
+
+typedef struct {
+    uint64_t armed;       /* tick of the pending event, UINT64_MAX: none */
+    uint64_t armed_tsc;   /* its exact TSC deadline */
+    uint64_t irqs;
+    uint64_t programs;
+    bool     started;
+} tick_cpu_t;
+
+static tick_mode_t g_mode = TICK_PIT_PERIODIC;
+static tick_cpu_t g_cpu[MAX_CPUS];
+
+/* PIT modes: one timer for all CPUs.  g_tick_lock protects its deadline
+ * and is never held while taking runqueue locks. */
+static spinlock_t g_tick_lock;
+static uint64_t g_next_event = UINT64_MAX;
+static uint64_t g_pit_irqs;
+static uint64_t g_ipis;
+
+static bool mode_is_apic(void) {
+    return g_mode >= TICK_APIC_PERIODIC;
+}
+
+/* Caller holds g_tick_lock. */
+static void pit_arm_locked(uint64_t now, uint64_t when) {
+    if (when <= now) when = now + 1;
+    g_next_event = now + pit_arm_oneshot(when - now);
+}
+
+static void pit_request(uint64_t when) {
+    uint64_t irq = spinlock_lock_irqsave(&g_tick_lock);
+    if (when < g_next_event) pit_arm_locked(pit_ticks(), when);
+    spinlock_unlock_irqrestore(&g_tick_lock, irq);
+}
+
+static size_t tick_proc_show(char* buf, size_t size) {
+    size_t n = 0;
+    uint64_t now = pit_ticks();
+    n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                           "mode: %s\nhz: %u\nnow: %llu\napic_timer_khz: %llu\n"
+                           "pit_irqs: %llu\nresched_ipis: %llu\n",
+                           k_mode_names[g_mode], pit_frequency_hz(), (unsigned long long)now,
+                           (unsigned long long)(apic_timer_hz() / 1000),
+                           (unsigned long long)g_pit_irqs, (unsigned long long)g_ipis);
+    uint32_t online = cpu_online_count();
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        uint64_t armed = mode_is_apic() ? g_cpu[c].armed : g_next_event;
+        n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                               "cpu%u: timer_irqs=%llu programs=%llu next=%s%llu\n", c,
+                               (unsigned long long)g_cpu[c].irqs,
+                               (unsigned long long)g_cpu[c].programs,
+                               armed == UINT64_MAX ? "none" : "+",
+                               (unsigned long long)(armed == UINT64_MAX || armed < now ? 0 : armed - now));
+    }
+    return n;
+}
+
+void tick_init(void) {
+    spinlock_init(&g_tick_lock);
+    spinlock_set_name(&g_tick_lock, "tick");
+    for (uint32_t c = 0; c < MAX_CPUS; c++) {
+        g_cpu[c].armed = UINT64_MAX;
+        g_cpu[c].armed_tsc = UINT64_MAX;
+    }
+    procfs_register("tick", tick_proc_show);
+
+    uint64_t thz = tsc_hz();
+    bool apic = apic_timer_calibrate(thz);
+    bool tsc_clock = thz != 0 && pit_enter_oneshot(thz);
+#ifdef TICK_PERIODIC
+    bool periodic = true;
+#else
+    bool periodic = !tsc_clock;
+#endif
+
+    if (apic) {
+        if (periodic) g_mode = TICK_APIC_PERIODIC;
+        else if (cpu_has_feature(CPU_FEAT_TSC_DEADLINE)) g_mode = TICK_APIC_DEADLINE;
+        else g_mode = TICK_APIC_ONESHOT;
+    } else {
+        g_mode = periodic ? TICK_PIT_PERIODIC : TICK_PIT_ONESHOT;
+    }
+
+    if (g_mode == TICK_PIT_ONESHOT) {
+        spinlock_lock(&g_tick_lock);
+        pit_arm_locked(pit_ticks(), 0);
+        spinlock_unlock(&g_tick_lock);
+    } else if (mode_is_apic() && tsc_clock) {
+        /* The TSC keeps time; the PIT has nothing left to do. */
+        pic_set_mask(0, 1);
+    }
+    log_info("tick: %s at %u Hz\n", k_mode_names[g_mode], (unsigned)HZ);
+
+    if (!mode_is_apic()) return;
+    /* Every CPU arms its own timer from schedule(); get them all there. */
+    tick_rearm(pit_ticks() + 1);
+    uint32_t self = cpu_current_id();
+    uint32_t online = cpu_online_count();
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        if (c != self) smp_send_resched(c);
+    }
+}
+
+void tick_handle_irq(void) {
+    g_pit_irqs++;
+    /* With local APIC timers the PIT at most counts ticks (no TSC). */
+    if (mode_is_apic()) return;
+    uint32_t self = cpu_current_id();
+
+    spinlock_lock(&g_tick_lock);
+    uint64_t now = pit_ticks();
+    uint64_t next = UINT64_MAX;
+    uint64_t due = scheduler_timer_due(now, &next);
+    if (g_mode == TICK_PIT_ONESHOT) pit_arm_locked(now, next);
+    spinlock_unlock(&g_tick_lock);
+
+    for (uint32_t c = 0; c < MAX_CPUS && due; c++) {
+        if (!(due & (1ULL << c))) continue;
+        due &= ~(1ULL << c);
+        if (c == self) continue;
+        smp_send_resched(c);
+        g_ipis++;
+    }
+}
+
+void tick_handle_timer(void) {
+    uint32_t cpu = cpu_current_id();
+    if (cpu >= MAX_CPUS) return;
+    g_cpu[cpu].irqs++;
+    if (g_mode != TICK_APIC_PERIODIC) {
+        g_cpu[cpu].armed = UINT64_MAX;
+        g_cpu[cpu].armed_tsc = UINT64_MAX;
+    }
+}
+
+void tick_rearm(uint64_t when) {
+    uint32_t cpu = cpu_current_id();
+    if (cpu >= MAX_CPUS) return;
+    tick_cpu_t* tc = &g_cpu[cpu];
+
+    switch (g_mode) {
+        case TICK_PIT_PERIODIC:
+            return;
+        case TICK_PIT_ONESHOT: {
+            uint64_t hr = hrtimer_next_tick(cpu);
+            if (hr < when) when = hr;
+            if (when < g_next_event) pit_request(when);
+            return;
+        }
+        case TICK_APIC_PERIODIC:
+            if (!tc->started) {
+                apic_timer_periodic(HZ);
+                tc->started = true;
+                tc->armed = 0;
+            }
+            return;
+        case TICK_APIC_ONESHOT:
+        case TICK_APIC_DEADLINE:
+            break;
+    }
+
+    /* The earliest hrtimer may fall between ticks: fire exactly on it. */
+    uint64_t deadline = UINT64_MAX;
+    if (when != UINT64_MAX) {
+        uint64_t now = pit_ticks();
+        if (when <= now) when = now + 1;
+        deadline = pit_tick_tsc(when);
+    }
+    uint64_t hr = hrtimer_next_event(cpu);
+    if (hr != UINT64_MAX && tsc_deadline_ns(hr) < deadline) deadline = tsc_deadline_ns(hr);
+    if (deadline == tc->armed_tsc) return;
+
+    if (!tc->started) {
+        if (g_mode == TICK_APIC_DEADLINE) apic_timer_deadline_mode();
+        tc->started = true;
+    }
+    tc->programs++;
+    tc->armed_tsc = deadline;
+    if (deadline == UINT64_MAX) {
+        tc->armed = UINT64_MAX;
+        apic_timer_stop();
+        return;
+    }
+
+    tc->armed = pit_tsc_tick(deadline);
+    if (g_mode == TICK_APIC_DEADLINE) {
+        apic_timer_deadline(deadline);
+    } else {
+        uint64_t t = rdtsc();
+        apic_timer_oneshot(deadline > t ? tsc_to_ns(deadline - t) : 0);
+    }
+}
+
+uint64_t tick_armed(uint32_t cpu) {
+    switch (g_mode) {
+        case TICK_PIT_ONESHOT:
+            return g_next_event;
+        case TICK_APIC_ONESHOT:
+        case TICK_APIC_DEADLINE:
+            return cpu < MAX_CPUS ? g_cpu[cpu].armed : 0;
+        default:
+            return 0;   /* periodic: a tick is always coming */
+    }
+}
+
+void tick_request(uint32_t cpu, uint64_t when) {
+    switch (g_mode) {
+        case TICK_PIT_ONESHOT:
+            pit_request(when);
+            return;
+        case TICK_APIC_ONESHOT:
+        case TICK_APIC_DEADLINE:
+            break;
+        default:
+            return;
+    }
+    if (cpu == cpu_current_id()) {
+        if (when < g_cpu[cpu].armed) tick_rearm(when);
+    } else {
+        /* Its schedule() re-arms its timer from the new runqueue state. */
+        smp_send_resched(cpu);
+        g_ipis++;
+    }
+}
+
+bool tick_is_dynamic(void) {
+    return g_mode == TICK_PIT_ONESHOT || g_mode == TICK_APIC_ONESHOT ||
+           g_mode == TICK_APIC_DEADLINE;
+}
@@ -1,6 +1,7 @@
 #include "time.h"
 #include "rtc.h"
 #include "arch/x86_64/pit.h"
+#include "arch/x86_64/tsc.h"
 #include "hpet.h"
 
 static uint64_t g_epoch_base = 0;
@@ -45,17 +46,19 @@ void time_init(void) {
 
 void time_gettimeofday(time_val_t* out) {
     if (!out) return;
-    uint64_t ticks = pit_ticks();
-    uint32_t hz = pit_frequency_hz();
-    if (hz == 0 || !g_time_ready) {
+    if (!g_time_ready) {
         out->tv_sec = 0;
         out->tv_usec = 0;
         return;
     }
-    uint64_t sec = ticks / hz;
-    uint64_t usec = (ticks % hz) * 1000000ull / hz;
-    out->tv_sec = g_epoch_base + sec;
-    out->tv_usec = usec;
+    uint64_t ns = time_now_ns();
+    out->tv_sec = g_epoch_base + ns / 1000000000ull;
+    out->tv_usec = (ns % 1000000000ull) / 1000ull;
+}
+
+uint64_t time_realtime_ns(void) {
+    if (!g_time_ready) return 0;
+    return g_epoch_base * 1000000000ull + time_now_ns();
 }
 
 uint64_t time_now_ms(void) {
@@ -65,6 +68,8 @@ uint64_t time_now_ms(void) {
     return (ticks * 1000ull) / hz;
 }
 
+/* Monotonic clock: the TSC once calibrated, the tick count otherwise. */
 uint64_t time_now_ns(void) {
+    if (tsc_hz()) return tsc_now_ns();
     return hpet_now_ns();
 }
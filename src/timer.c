@@ -0,0 +1,250 @@
+#include "timer.h"
+#include "tick.h"
+#include "procfs.h"
+#include "lib.h"
+#include "arch/x86_64/pit.h"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/common.h"
+#include "arch/x86_64/spinlock.h"
+
+/*
+ * Five levels: 256 one-tick slots, then four levels of 64 slots, each slot
+ * 64 times coarser than the one below (2^32 ticks in total).  A level's
+ * slot is emptied into the levels below when the wheel's clock reaches it.
+ */
+#define TVR_BITS   8
+#define TVN_BITS   6
+#define TVR_SIZE   (1u << TVR_BITS)
+#define TVN_SIZE   (1u << TVN_BITS)
+#define TVR_MASK   (TVR_SIZE - 1)
+#define TVN_MASK   (TVN_SIZE - 1)
+#define TVN_LEVELS 4
+#define MAX_TVAL   ((1ULL << (TVR_BITS + TVN_LEVELS * TVN_BITS)) - 1)
+
+#define LEVEL_SHIFT(l) (TVR_BITS + (l) * TVN_BITS)
+
+typedef struct {
+    spinlock_t lock;
+    uint64_t   clk;             /* next tick to process */
+    uint64_t   next_expiry;     /* lower bound on the earliest pending timer */
+    ktimer_t*  running;         /* callback executing right now */
+    uint32_t   count;
+    ktimer_t*  tv1[TVR_SIZE];
+    ktimer_t*  tvn[TVN_LEVELS][TVN_SIZE];
+    uint64_t   expired;
+    uint64_t   cascaded;
+} timer_base_t;
+
+static timer_base_t g_bases[MAX_CPUS];
+
+static void list_add(ktimer_t** head, ktimer_t* t) {
+    t->next = *head;
+    if (t->next) t->next->pprev = &t->next;
+    t->pprev = head;
+    *head = t;
+}
+
+static void list_del(ktimer_t* t) {
+    *t->pprev = t->next;
+    if (t->next) t->next->pprev = t->pprev;
+    t->next = 0;
+    t->pprev = 0;
+}
+
+/* Caller holds b->lock. */
+static void internal_add(timer_base_t* b, ktimer_t* t) {
+    uint64_t expires = t->expires;
+    if (expires < b->clk) expires = b->clk;
+    uint64_t idx = expires - b->clk;
+    if (idx > MAX_TVAL) {
+        idx = MAX_TVAL;
+        expires = b->clk + idx;
+    }
+
+    if (idx < TVR_SIZE) {
+        list_add(&b->tv1[expires & TVR_MASK], t);
+        return;
+    }
+    for (int l = 0; l < TVN_LEVELS; l++) {
+        if (idx < (1ULL << LEVEL_SHIFT(l + 1)) || l == TVN_LEVELS - 1) {
+            list_add(&b->tvn[l][(expires >> LEVEL_SHIFT(l)) & TVN_MASK], t);
+            return;
+        }
+    }
+}
+
+/* Re-file every timer of one coarse slot; returns the slot index. */
+static uint32_t cascade(timer_base_t* b, int level, uint32_t index) {
+    ktimer_t* t = b->tvn[level][index];
+    b->tvn[level][index] = 0;
+    while (t) {
+        ktimer_t* next = t->next;
+        t->next = 0;
+        t->pprev = 0;
+        internal_add(b, t);
+        b->cascaded++;
+        t = next;
+    }
+    return index;
+}
+
+/* Caller holds b->lock.  Exact within the 256-tick level; for coarser
+ * levels the time the first non-empty slot cascades. */
+static uint64_t compute_next_expiry(const timer_base_t* b) {
+    if (b->count == 0) return UINT64_MAX;
+    uint64_t clk = b->clk;
+    uint64_t best = UINT64_MAX;
+
+    for (uint32_t i = 0; i < TVR_SIZE; i++) {
+        if (b->tv1[(clk + i) & TVR_MASK]) {
+            best = clk + i;
+            break;
+        }
+    }
+    for (int l = 0; l < TVN_LEVELS; l++) {
+        uint64_t period = 1ULL << LEVEL_SHIFT(l);
+        uint64_t boundary = (clk + period - 1) & ~(period - 1);
+        if (boundary >= best) break;
+        uint32_t first = (uint32_t)(boundary >> LEVEL_SHIFT(l)) & TVN_MASK;
+        for (uint32_t k = 0; k < TVN_SIZE; k++) {
+            if (b->tvn[l][(first + k) & TVN_MASK]) {
+                uint64_t when = boundary + k * period;
+                if (when < best) best = when;
+                break;
+            }
+        }
+    }
+    return best;
+}
+
+void ktimer_init(ktimer_t* t, ktimer_fn_t fn, void* arg) {
+    memset(t, 0, sizeof(*t));
+    t->fn = fn;
+    t->arg = arg;
+}
+
+/* Caller holds b->lock; t is pending on b. */
+static void detach(timer_base_t* b, ktimer_t* t) {
+    list_del(t);
+    b->count--;
+}
+
+void ktimer_add(ktimer_t* t, uint64_t expires) {
+    ktimer_cancel(t);
+
+    uint64_t flags = irq_save();
+    uint32_t cpu = cpu_current_id();
+    if (cpu >= MAX_CPUS) cpu = 0;
+    timer_base_t* b = &g_bases[cpu];
+
+    spinlock_lock(&b->lock);
+    if (b->count == 0) b->clk = pit_ticks();
+    t->expires = expires;
+    t->cpu = cpu;
+    internal_add(b, t);
+    b->count++;
+    if (expires < b->next_expiry) b->next_expiry = expires < b->clk ? b->clk : expires;
+    uint64_t next = b->next_expiry;
+    spinlock_unlock(&b->lock);
+
+    if (next < tick_armed(cpu)) tick_request(cpu, next);
+    irq_restore(flags);
+}
+
+bool ktimer_cancel(ktimer_t* t) {
+    for (;;) {
+        uint32_t cpu = t->cpu < MAX_CPUS ? t->cpu : 0;
+        timer_base_t* b = &g_bases[cpu];
+        uint64_t flags = irq_save();
+        spinlock_lock(&b->lock);
+        if (t->cpu != cpu) {
+            /* Re-added elsewhere meanwhile; retry on its new base. */
+            spinlock_unlock(&b->lock);
+            irq_restore(flags);
+            continue;
+        }
+        if (ktimer_pending(t)) {
+            detach(b, t);
+            spinlock_unlock(&b->lock);
+            irq_restore(flags);
+            return true;
+        }
+        bool running = b->running == t;
+        spinlock_unlock(&b->lock);
+        irq_restore(flags);
+        if (!running) return false;
+        while (b->running == t) cpu_pause();
+        return false;
+    }
+}
+
+void timer_run(uint64_t now) {
+    uint32_t cpu = cpu_current_id();
+    if (cpu >= MAX_CPUS) return;
+    timer_base_t* b = &g_bases[cpu];
+    if (now < b->next_expiry) return;
+
+    spinlock_lock(&b->lock);
+    while (b->clk <= now && b->count > 0) {
+        uint32_t index = (uint32_t)(b->clk & TVR_MASK);
+        if (index == 0) {
+            for (int l = 0; l < TVN_LEVELS; l++) {
+                uint32_t slot = (uint32_t)(b->clk >> LEVEL_SHIFT(l)) & TVN_MASK;
+                if (cascade(b, l, slot) != 0) break;
+            }
+        }
+        b->clk++;
+
+        /* Move the slot to a local list: a callback or a remote cancel may
+         * unlink entries while the lock is dropped. */
+        ktimer_t* work = b->tv1[index];
+        b->tv1[index] = 0;
+        if (work) work->pprev = &work;
+        while (work) {
+            ktimer_t* t = work;
+            detach(b, t);
+            b->expired++;
+            b->running = t;
+            spinlock_unlock(&b->lock);
+            t->fn(t->arg);
+            spinlock_lock(&b->lock);
+            b->running = 0;
+        }
+    }
+    if (b->count == 0 && b->clk <= now) b->clk = now + 1;
+    b->next_expiry = compute_next_expiry(b);
+    spinlock_unlock(&b->lock);
+}
+
+uint64_t timer_next_expiry(uint32_t cpu) {
+    if (cpu >= MAX_CPUS) return UINT64_MAX;
+    return g_bases[cpu].next_expiry;
+}
+
+static size_t timer_proc_show(char* buf, size_t size) {
+    size_t n = 0;
+    uint64_t now = pit_ticks();
+    uint32_t online = cpu_online_count();
+    if (online == 0) online = 1;
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        timer_base_t* b = &g_bases[c];
+        uint64_t next = b->next_expiry;
+        n += (size_t)ksnprintf(buf + (n < size ? n : size), n < size ? size - n : 0,
+                               "cpu%u: pending=%u expired=%llu cascaded=%llu next=%s%llu\n",
+                               c, b->count, (unsigned long long)b->expired,
+                               (unsigned long long)b->cascaded,
+                               next == UINT64_MAX ? "none" : "+",
+                               (unsigned long long)(next == UINT64_MAX || next < now ? 0 : next - now));
+    }
+    return n;
+}
+
+void timer_init(void) {
+    memset(g_bases, 0, sizeof(g_bases));
+    for (uint32_t c = 0; c < MAX_CPUS; c++) {
+        spinlock_init(&g_bases[c].lock);
+        spinlock_set_name(&g_bases[c].lock, "timer_base");
+        g_bases[c].next_expiry = UINT64_MAX;
+    }
+    procfs_register("timers", timer_proc_show);
+}
@@ -1,9 +1,12 @@
 #include "vfs.h"
 #include "kmalloc.h"
 #include "lib.h"
+#include "arch/x86_64/spinlock.h"
 
 static vfs_node_t* g_root = 0;
 static vfs_node_t* g_cwd = 0;
+/* Serializes changes to the tree; lookups use RCU instead. */
+static spinlock_t g_tree_lock;
 
 static char* vfs_strdup(const char* s) {
     size_t n = strlen(s);
@@ -15,6 +18,8 @@ static char* vfs_strdup(const char* s) {
 }
 
 void vfs_init(vfs_node_t* root) {
+    spinlock_init(&g_tree_lock);
+    spinlock_set_name(&g_tree_lock, "vfs_tree");
     g_root = root;
     g_cwd = root;
 }
@@ -49,35 +54,42 @@ vfs_node_t* vfs_create_node(const char* name, vfs_node_type_t type, vfs_node_ops
 
 vfs_node_t* vfs_find_child(vfs_node_t* parent, const char* name) {
     if (!parent || parent->type != VFS_NODE_DIR) return 0;
-    vfs_node_t* cur = parent->children;
-    while (cur) {
-        if (strcmp(cur->name, name) == 0) return cur;
-        cur = cur->next;
+    vfs_node_t* cur;
+    rcu_read_lock();
+    rcu_slist_for_each(cur, parent->children) {
+        if (strcmp(cur->name, name) == 0) break;
     }
-    return 0;
+    rcu_read_unlock();
+    return cur;
 }
 
 int vfs_add_child(vfs_node_t* parent, vfs_node_t* child) {
     if (!parent || !child || parent->type != VFS_NODE_DIR) return -1;
-    if (vfs_find_child(parent, child->name)) return -1;
+    uint64_t irq = spinlock_lock_irqsave(&g_tree_lock);
+    if (vfs_find_child(parent, child->name)) {
+        spinlock_unlock_irqrestore(&g_tree_lock, irq);
+        return -1;
+    }
     child->parent = parent;
-    child->next = parent->children;
-    parent->children = child;
+    rcu_slist_add_head(parent->children, child);
+    spinlock_unlock_irqrestore(&g_tree_lock, irq);
     return 0;
 }
 
 int vfs_remove_child(vfs_node_t* parent, vfs_node_t* child) {
     if (!parent || !child || parent->type != VFS_NODE_DIR) return -1;
+    uint64_t irq = spinlock_lock_irqsave(&g_tree_lock);
     vfs_node_t** cur = &parent->children;
     while (*cur) {
         if (*cur == child) {
-            *cur = child->next;
-            child->next = 0;
-            child->parent = 0;
+            /* child->next stays intact for readers standing on child. */
+            rcu_slist_del(cur, child);
+            spinlock_unlock_irqrestore(&g_tree_lock, irq);
             return 0;
         }
         cur = &(*cur)->next;
     }
+    spinlock_unlock_irqrestore(&g_tree_lock, irq);
     return -1;
 }
 
@@ -100,6 +112,7 @@ vfs_node_t* vfs_resolve(const char* path, vfs_node_t* cwd) {
 
     if (*p == 0) return cur;
 
+    rcu_read_lock();
     while (*p) {
         const char* seg = p;
         size_t len = 0;
@@ -111,16 +124,20 @@ vfs_node_t* vfs_resolve(const char* path, vfs_node_t* cwd) {
             if (cur->parent) cur = cur->parent;
         } else if (len > 0) {
             char name[VFS_NAME_MAX + 1];
-            if (len > VFS_NAME_MAX) return 0;
+            if (len > VFS_NAME_MAX) {
+                cur = 0;
+                break;
+            }
             strncpy(name, seg, len);
             name[len] = 0;
             cur = vfs_find_child(cur, name);
-            if (!cur) return 0;
+            if (!cur) break;
         }
 
         p += len;
         p = vfs_skip_slashes(p);
     }
+    rcu_read_unlock();
 
     return cur;
 }
@@ -4,7 +4,10 @@
 #include "pmm.h"
 #include "console.h"
 #include "lib.h"
+#include "sync.h"
 #include "arch/x86_64/common.h"
+#include "arch/x86_64/irq.h"
+#include "arch/x86_64/pic.h"
 
 /* Legacy virtio PCI I/O register offsets (OSDev virtio legacy layout) */
 #define VIRTIO_PCI_HOST_FEATURES   0x00 /* 32-bit */
@@ -64,6 +67,15 @@ typedef struct {
 
     uint16_t last_used_idx;
 
+    /* One request in flight at a time, under lock; its submitter sleeps on
+     * done_wait until the completion interrupt (or polls if the device has
+     * no usable INTx line or the caller cannot sleep). */
+    mutex_t lock;
+    wait_queue_t done_wait;
+    uint8_t irq_line;
+    bool has_irq;
+    uint64_t irqs;
+
     /* Request buffers (single in-flight request) */
     struct {
         uint32_t type;
@@ -72,6 +84,11 @@ typedef struct {
     } __attribute__((packed)) req;
 
     uint8_t status;
+
+    /* Sector data goes through here: callers' buffers (kernel stacks
+     * above all) need not be identity-mapped, so their addresses are not
+     * ones the device can use. */
+    uint8_t data[512];
 } virtio_blk_t;
 
 static virtio_blk_t g_dev;
@@ -87,6 +104,32 @@ static void out8(uint16_t base, uint16_t off, uint8_t v)   { outb((uint16_t)(bas
 static void out16(uint16_t base, uint16_t off, uint16_t v) { outw((uint16_t)(base + off), v); }
 static void out32(uint16_t base, uint16_t off, uint32_t v) { outl((uint16_t)(base + off), v); }
 
+static void virtio_blk_irq(uint8_t irq, intr_frame_t* frame) {
+    (void)irq;
+    (void)frame;
+    /* Reading ISR acknowledges the interrupt and deasserts the line. */
+    if (in8(g_dev.io_base, VIRTIO_PCI_ISR) & 1) {
+        g_dev.irqs++;
+        wake_up(&g_dev.done_wait);
+    }
+}
+
+static bool used_advanced(void* arg) {
+    virtio_blk_t* d = (virtio_blk_t*)arg;
+    return d->used->idx != d->last_used_idx;
+}
+
+/* Wait for the device to retire the request just made available. */
+static void wait_used(virtio_blk_t* d) {
+    if (d->has_irq) {
+        wait_until(&d->done_wait, used_advanced, d, 0);
+        return;
+    }
+    while (d->used->idx == d->last_used_idx) {
+        cpu_pause();
+    }
+}
+
 static bool setup_queue(virtio_blk_t* d) {
     /* Select queue 0 */
     out16(d->io_base, VIRTIO_PCI_QUEUE_SELECT, 0);
@@ -149,6 +192,8 @@ bool virtio_blk_try_init_legacy(uint8_t bus, uint8_t slot, uint8_t func) {
 
     memset(&g_dev, 0, sizeof(g_dev));
     g_dev.io_base = iobase;
+    mutex_init(&g_dev.lock);
+    wait_queue_init(&g_dev.done_wait);
 
     /* Reset */
     out8(iobase, VIRTIO_PCI_STATUS, 0);
@@ -173,12 +218,27 @@ bool virtio_blk_try_init_legacy(uint8_t bus, uint8_t slot, uint8_t func) {
     uint8_t st = in8(iobase, VIRTIO_PCI_STATUS);
     out8(iobase, VIRTIO_PCI_STATUS, (uint8_t)(st | VIRTIO_STATUS_DRIVEROK));
 
+    /* Legacy INTx routed through the PIC; 0xFF means not connected. */
+    uint8_t line = pci_read8(bus, slot, func, 0x3C);
+    if (line > 0 && line < 16 && line != 2) {
+        g_dev.irq_line = line;
+        g_dev.has_irq = true;
+        irq_register_handler(line, virtio_blk_irq, "virtio-blk");
+        pic_set_mask(line, 0);
+    }
+
     g_inited = 1;
 
     console_write("[virtio-blk] legacy device initialized at io=");
     console_write_hex64(iobase);
     console_write(" qsz=");
     console_write_dec_u64(g_dev.queue_num);
+    if (g_dev.has_irq) {
+        console_write(" irq=");
+        console_write_dec_u64(g_dev.irq_line);
+    } else {
+        console_write(" polled");
+    }
     console_write("\n");
 
     /* Capacity in sectors (64-bit) in device-specific config offset 0 */
@@ -199,6 +259,7 @@ bool virtio_blk_read_sector(uint64_t sector, void* out512) {
     const uint16_t qsz = d->queue_num;
     if (qsz < 3) return false;
 
+    mutex_lock(&d->lock);
     d->req.type = 0; /* VIRTIO_BLK_T_IN */
     d->req.reserved = 0;
     d->req.sector = sector;
@@ -210,7 +271,7 @@ bool virtio_blk_read_sector(uint64_t sector, void* out512) {
     d->desc[0].flags = VIRTQ_DESC_F_NEXT;
     d->desc[0].next = 1;
 
-    d->desc[1].addr = (uint64_t)(uintptr_t)out512;
+    d->desc[1].addr = (uint64_t)(uintptr_t)d->data;
     d->desc[1].len = 512;
     d->desc[1].flags = VIRTQ_DESC_F_NEXT | VIRTQ_DESC_F_WRITE; /* device writes data */
     d->desc[1].next = 2;
@@ -232,9 +293,7 @@ bool virtio_blk_read_sector(uint64_t sector, void* out512) {
     out16(d->io_base, VIRTIO_PCI_QUEUE_NOTIFY, 0);
 
     /* Wait for used->idx to advance */
-    while (d->used->idx == d->last_used_idx) {
-        cpu_pause();
-    }
+    wait_used(d);
 
     mb();
     /* used ring starts after 4 bytes (flags, idx) */
@@ -243,7 +302,10 @@ bool virtio_blk_read_sector(uint64_t sector, void* out512) {
 
     d->last_used_idx++;
 
-    return d->status == 0;
+    bool ok = d->status == 0;
+    if (ok) memcpy(out512, d->data, sizeof(d->data));
+    mutex_unlock(&d->lock);
+    return ok;
 }
 
 bool virtio_blk_write_sector(uint64_t sector, const void* in512) {
@@ -253,17 +315,19 @@ bool virtio_blk_write_sector(uint64_t sector, const void* in512) {
     const uint16_t qsz = d->queue_num;
     if (qsz < 3) return false;
 
+    mutex_lock(&d->lock);
     d->req.type = 1; /* VIRTIO_BLK_T_OUT */
     d->req.reserved = 0;
     d->req.sector = sector;
     d->status = 0xFF;
+    memcpy(d->data, in512, sizeof(d->data));
 
     d->desc[0].addr = (uint64_t)(uintptr_t)&d->req;
     d->desc[0].len = sizeof(d->req);
     d->desc[0].flags = VIRTQ_DESC_F_NEXT;
     d->desc[0].next = 1;
 
-    d->desc[1].addr = (uint64_t)(uintptr_t)in512;
+    d->desc[1].addr = (uint64_t)(uintptr_t)d->data;
     d->desc[1].len = 512;
     d->desc[1].flags = VIRTQ_DESC_F_NEXT;
     d->desc[1].next = 2;
@@ -282,14 +346,14 @@ bool virtio_blk_write_sector(uint64_t sector, const void* in512) {
 
     out16(d->io_base, VIRTIO_PCI_QUEUE_NOTIFY, 0);
 
-    while (d->used->idx == d->last_used_idx) {
-        cpu_pause();
-    }
+    wait_used(d);
 
     mb();
     d->last_used_idx++;
 
-    return d->status == 0;
+    bool ok = d->status == 0;
+    mutex_unlock(&d->lock);
+    return ok;
 }
 
 bool virtio_blk_is_ready(void) {
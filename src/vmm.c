@@ -5,6 +5,10 @@
 #include "thread.h"
 #include "arch/x86_64/common.h"
 #include "arch/x86_64/spinlock.h"
+#include "arch/x86_64/preempt.h"
+#include "arch/x86_64/percpu.h"
+#include "arch/x86_64/cpu.h"
+#include "arch/x86_64/apic.h"
 
 #define ENTRIES_PER_TABLE 512
 
@@ -25,6 +29,100 @@ static inline void tlb_invalidate(uint64_t virt) {
     __asm__ volatile ("invlpg (%0)" : : "r"(virt) : "memory");
 }
 
+/*
+ * TLB shootdown.  Frames unmapped from a space that other CPUs are running
+ * may still sit in their TLBs, so they are not freed, nor written, on the
+ * spot: they wait in a batch, a page of its own that user mode never
+ * maps, until every such CPU has flushed.  Those CPUs get an APIC_TLB_VECTOR IPI; the last to flush frees
+ * the batch.  Nobody waits for the acknowledgements, so unmapping is safe
+ * under spinlocks that the targets may be spinning on with IRQs off.
+ */
+#define TLB_BATCH_FRAMES ((PAGE_SIZE - 32) / sizeof(uint64_t))
+
+typedef struct tlb_batch {
+    struct tlb_batch* next;
+    volatile uint64_t pending;  /* CPUs yet to flush */
+    uint64_t cr3;
+    uint64_t count;
+    uint64_t frames[TLB_BATCH_FRAMES];
+} tlb_batch_t;
+
+_Static_assert(sizeof(tlb_batch_t) <= PAGE_SIZE, "tlb_batch_t must fit in a page");
+
+static spinlock_t g_tlb_lock = SPINLOCK_INIT;
+static tlb_batch_t* g_tlb_batches;
+
+static void tlb_batch_free(tlb_batch_t* b) {
+    for (uint64_t i = 0; i < b->count; i++) pmm_free_pages(b->frames[i], 1);
+    pmm_free_pages((uint64_t)(uintptr_t)b, 1);
+}
+
+static tlb_batch_t* tlb_batch_alloc(uint64_t cr3) {
+    tlb_batch_t* b = (tlb_batch_t*)(uintptr_t)pmm_alloc_pages(1);
+    if (!b) return 0;
+    b->next = 0;
+    b->pending = 0;
+    b->cr3 = cr3;
+    b->count = 0;
+    return b;
+}
+
+void vmm_activate(uint64_t cr3) {
+    /* Published before the load: a shootdown that misses it changed the
+     * tables before this CPU walks them. */
+    this_cpu()->cr3 = cr3;
+    __sync_synchronize();
+    write_cr3(cr3);
+}
+
+/* Flushed under the lock, so every batch it acknowledges here had its
+ * entries cleared before the flush. */
+void vmm_tlb_ipi(void) {
+    uint64_t bit = 1ULL << cpu_current_id();
+    tlb_batch_t* done = 0;
+    uint64_t irq = spinlock_lock_irqsave(&g_tlb_lock);
+    write_cr3(read_cr3());
+    for (tlb_batch_t** pp = &g_tlb_batches; *pp;) {
+        tlb_batch_t* b = *pp;
+        b->pending &= ~bit;
+        if (b->pending) {
+            pp = &b->next;
+            continue;
+        }
+        *pp = b->next;
+        b->next = done;
+        done = b;
+    }
+    spinlock_unlock_irqrestore(&g_tlb_lock, irq);
+    while (done) {
+        tlb_batch_t* b = done;
+        done = b->next;
+        tlb_batch_free(b);
+    }
+}
+
+static void tlb_batch_submit(tlb_batch_t* b) {
+    uint32_t self = cpu_current_id();
+    uint32_t online = cpu_online_count();
+    uint64_t mask = 0;
+    __sync_synchronize();
+    for (uint32_t c = 0; c < online && c < MAX_CPUS; c++) {
+        if (c != self && percpu_of(c)->cr3 == b->cr3) mask |= 1ULL << c;
+    }
+    if (!mask) {
+        tlb_batch_free(b);
+        return;
+    }
+    b->pending = mask;
+    uint64_t irq = spinlock_lock_irqsave(&g_tlb_lock);
+    b->next = g_tlb_batches;
+    g_tlb_batches = b;
+    spinlock_unlock_irqrestore(&g_tlb_lock, irq);
+    for (uint32_t c = 0; c < MAX_CPUS; c++) {
+        if (mask & (1ULL << c)) apic_send_ipi(cpu_apic_id(c), APIC_TLB_VECTOR);
+    }
+}
+
 static uint64_t alloc_zero_page(void) {
     uint64_t pa = pmm_alloc_pages(1);
     if (!pa) return 0;
@@ -101,7 +199,11 @@ bool vmm_map_range(uint64_t cr3, uint64_t virt, uint64_t phys, size_t size, uint
     return true;
 }
 
+/* 4 KiB mappings in the lower half only: an address with bits above 47
+ * would alias a lower PML4 slot, and a huge entry's frame is data, not a
+ * page table. */
 uint64_t vmm_unmap_page(uint64_t cr3, uint64_t virt) {
+    if (virt >> 47) return 0;
     uint64_t* pml4 = pml4_from_phys(cr3 & ~0xFFFULL);
     size_t l4 = (virt >> 39) & 0x1FF;
     size_t l3 = (virt >> 30) & 0x1FF;
@@ -113,11 +215,11 @@ uint64_t vmm_unmap_page(uint64_t cr3, uint64_t virt) {
     uint64_t* pdpt = (uint64_t*)(uintptr_t)pdpt_phys;
 
     uint64_t pd_phys = pdpt[l3] & VMM_ADDR_MASK;
-    if (!(pdpt[l3] & VMM_FLAG_PRESENT)) return 0;
+    if (!(pdpt[l3] & VMM_FLAG_PRESENT) || (pdpt[l3] & VMM_FLAG_HUGE)) return 0;
     uint64_t* pd = (uint64_t*)(uintptr_t)pd_phys;
 
     uint64_t pt_phys = pd[l2] & VMM_ADDR_MASK;
-    if (!(pd[l2] & VMM_FLAG_PRESENT)) return 0;
+    if (!(pd[l2] & VMM_FLAG_PRESENT) || (pd[l2] & VMM_FLAG_HUGE)) return 0;
     uint64_t* pt = (uint64_t*)(uintptr_t)pt_phys;
 
     uint64_t entry = pt[l1];
@@ -128,6 +230,65 @@ uint64_t vmm_unmap_page(uint64_t cr3, uint64_t virt) {
     return entry & VMM_ADDR_MASK;
 }
 
+/* Out of memory for a batch: leaking the frame is safe, freeing it under
+ * a live TLB entry is not. */
+static void tlb_batch_add(tlb_batch_t** b, uint64_t cr3, uint64_t pa) {
+    if (!*b && !(*b = tlb_batch_alloc(cr3))) return;
+    (*b)->frames[(*b)->count++] = pa;
+    if ((*b)->count == TLB_BATCH_FRAMES) {
+        tlb_batch_submit(*b);
+        *b = 0;
+    }
+}
+
+static bool table_empty(const uint64_t* table) {
+    for (size_t i = 0; i < ENTRIES_PER_TABLE; i++) {
+        if (table[i]) return false;
+    }
+    return true;
+}
+
+/* Drop the page table mapping virt if nothing is left in it, then its page
+ * directory likewise.  The frames go through the batch too: other CPUs'
+ * paging-structure caches may still point at them. */
+static void prune_tables(uint64_t cr3, uint64_t virt, tlb_batch_t** b) {
+    uint64_t* pml4 = pml4_from_phys(cr3 & ~0xFFFULL);
+    size_t l4 = (virt >> 39) & 0x1FF;
+    size_t l3 = (virt >> 30) & 0x1FF;
+    size_t l2 = (virt >> 21) & 0x1FF;
+
+    if (!(pml4[l4] & VMM_FLAG_PRESENT)) return;
+    uint64_t* pdpt = (uint64_t*)(uintptr_t)(pml4[l4] & VMM_ADDR_MASK);
+    if (!(pdpt[l3] & VMM_FLAG_PRESENT) || (pdpt[l3] & VMM_FLAG_HUGE)) return;
+    uint64_t pd_phys = pdpt[l3] & VMM_ADDR_MASK;
+    uint64_t* pd = (uint64_t*)(uintptr_t)pd_phys;
+    if (!(pd[l2] & VMM_FLAG_PRESENT) || (pd[l2] & VMM_FLAG_HUGE)) return;
+    uint64_t pt_phys = pd[l2] & VMM_ADDR_MASK;
+
+    if (!table_empty((const uint64_t*)(uintptr_t)pt_phys)) return;
+    pd[l2] = 0;
+    tlb_invalidate(virt);
+    tlb_batch_add(b, cr3, pt_phys);
+
+    if (!table_empty(pd)) return;
+    pdpt[l3] = 0;
+    tlb_invalidate(virt);
+    tlb_batch_add(b, cr3, pd_phys);
+}
+
+void vmm_unmap_user_range(uint64_t cr3, uint64_t virt, uint64_t size) {
+    if (virt < USER_REGION_BASE || virt > USER_STACK_TOP || size > USER_STACK_TOP - virt) return;
+    tlb_batch_t* b = 0;
+    uint64_t end = virt + size;
+    for (uint64_t va = virt; va < end; va += PAGE_SIZE) {
+        uint64_t pa = vmm_unmap_page(cr3, va);
+        if (pa) tlb_batch_add(&b, cr3, pa);
+        /* Leaving a page table's 2 MiB, or done: it may be empty now. */
+        if (((va + PAGE_SIZE) & 0x1FFFFFULL) == 0 || va + PAGE_SIZE >= end) prune_tables(cr3, va, &b);
+    }
+    if (b) tlb_batch_submit(b);
+}
+
 bool vmm_resolve(uint64_t cr3, uint64_t virt, uint64_t* out_phys, uint64_t* out_flags) {
     uint64_t* pml4 = pml4_from_phys(cr3 & ~0xFFFULL);
     size_t l4 = (virt >> 39) & 0x1FF;
@@ -220,6 +381,7 @@ static void vmm_destroy_user_space(uint64_t cr3) {
         uint64_t pdpt_phys = entry & VMM_ADDR_MASK;
         vmm_free_pdpt(pdpt_phys);
         pml4[i] = 0;
+        cond_resched();
     }
     pmm_free_pages(pml4_phys, 1);
 }
@@ -246,6 +408,7 @@ static void map_identity_kernel(uint64_t pml4_phys) {
 
 void vmm_init(void) {
     spinlock_init(&g_space_lock);
+    spinlock_set_name(&g_space_lock, "vm_space");
     memset(g_user_spaces, 0, sizeof(g_user_spaces));
 
     uint64_t pml4_phys = alloc_zero_page();
@@ -257,7 +420,7 @@ void vmm_init(void) {
     map_identity_kernel(pml4_phys);
     g_kernel_cr3 = pml4_phys;
 
-    write_cr3(g_kernel_cr3);
+    vmm_activate(g_kernel_cr3);
 
     console_write("[vmm] kernel CR3=");
     console_write_hex64(g_kernel_cr3);
@@ -328,11 +491,12 @@ void vmm_release_user_space(uint64_t cr3) {
 
 bool vmm_user_set_brk(thread_t* t, uint64_t new_end) {
     if (!t || !t->is_user) return false;
-    uint64_t start = align_up_u64(t->brk_start, PAGE_SIZE);
+    thread_t* p = thread_proc(t);
+    uint64_t start = align_up_u64(p->brk_start, PAGE_SIZE);
     uint64_t new_aligned = align_up_u64(new_end, PAGE_SIZE);
     if (new_aligned < start) new_aligned = start;
 
-    uint64_t cur = align_up_u64(t->brk_end, PAGE_SIZE);
+    uint64_t cur = align_up_u64(p->brk_end, PAGE_SIZE);
     uint64_t cr3 = t->cr3;
 
     if (new_aligned > cur) {
@@ -346,12 +510,9 @@ bool vmm_user_set_brk(thread_t* t, uint64_t new_end) {
             }
         }
     } else if (new_aligned < cur) {
-        for (uint64_t va = new_aligned; va < cur; va += PAGE_SIZE) {
-            uint64_t pa = vmm_unmap_page(cr3, va);
-            if (pa) pmm_free_pages(pa, 1);
-        }
+        vmm_unmap_user_range(cr3, new_aligned, cur - new_aligned);
     }
 
-    t->brk_end = new_end;
+    p->brk_end = new_end;
     return true;
 }
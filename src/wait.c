@@ -0,0 +1,122 @@
+#include "wait.h"
+#include "thread.h"
+#include "scheduler.h"
+#include "arch/x86_64/common.h"
+
+void wait_queue_init(wait_queue_t* wq) {
+    spinlock_init(&wq->lock);
+    wq->head = 0;
+    wq->tail = 0;
+}
+
+static void wq_add(wait_queue_t* wq, thread_t* t) {
+    t->wq = wq;
+    t->wq_next = 0;
+    t->wq_prev = wq->tail;
+    if (wq->tail) wq->tail->wq_next = t;
+    else wq->head = t;
+    wq->tail = t;
+}
+
+static void wq_del(wait_queue_t* wq, thread_t* t) {
+    if (t->wq_prev) t->wq_prev->wq_next = t->wq_next;
+    else wq->head = t->wq_next;
+    if (t->wq_next) t->wq_next->wq_prev = t->wq_prev;
+    else wq->tail = t->wq_prev;
+    t->wq = 0;
+    t->wq_next = 0;
+    t->wq_prev = 0;
+}
+
+void wait_prepare(wait_queue_t* wq, uint32_t flags) {
+    thread_t* cur = thread_current();
+    uint64_t irq = irq_save();
+    spinlock_lock(&wq->lock);
+    /* Still queued from the previous round of a wait_until() loop? */
+    if (cur->wq != wq) wq_add(wq, cur);
+    cur->wq_exclusive = (flags & WAIT_EXCLUSIVE) != 0;
+    cur->wq_killable = (flags & WAIT_KILLABLE) != 0;
+    cur->in_wait = true;
+    scheduler_block_prepare();
+    spinlock_unlock(&wq->lock);
+    irq_restore(irq);
+}
+
+void wait_sleep(void) {
+    scheduler_block();
+}
+
+void wait_finish(wait_queue_t* wq) {
+    thread_t* cur = thread_current();
+    uint64_t irq = irq_save();
+    scheduler_block_cancel();
+    /* A waker unlinks us before waking us; only a wait that ended some
+     * other way (condition already true, kill) is still queued. */
+    if (cur->wq) {
+        spinlock_lock(&wq->lock);
+        if (cur->wq == wq) wq_del(wq, cur);
+        spinlock_unlock(&wq->lock);
+    }
+    cur->in_wait = false;
+    irq_restore(irq);
+}
+
+int wait_until(wait_queue_t* wq, wait_cond_t cond, void* arg, uint32_t flags) {
+    if (cond(arg)) return 0;
+    if (!scheduler_can_block()) {
+        while (!cond(arg)) cpu_pause();
+        return 0;
+    }
+    thread_t* cur = thread_current();
+    int ret = 0;
+    for (;;) {
+        wait_prepare(wq, flags);
+        if (cond(arg)) break;
+        if ((flags & WAIT_KILLABLE) && cur->pending_kill) {
+            ret = -1;
+            break;
+        }
+        wait_sleep();
+    }
+    wait_finish(wq);
+    return ret;
+}
+
+static uint32_t wake_common(wait_queue_t* wq, bool all) {
+    uint32_t woken = 0;
+    uint64_t irq = irq_save();
+    spinlock_lock(&wq->lock);
+    bool exclusive_done = false;
+    for (thread_t* t = wq->head; t; ) {
+        thread_t* next = t->wq_next;
+        if (t->wq_exclusive && !all) {
+            if (exclusive_done) {
+                t = next;
+                continue;
+            }
+            exclusive_done = true;
+        }
+        wq_del(wq, t);
+        scheduler_wake_blocked(t);
+        woken++;
+        t = next;
+    }
+    spinlock_unlock(&wq->lock);
+    irq_restore(irq);
+    return woken;
+}
+
+/* The unlocked emptiness check pairs with wait_prepare(): the waker's
+ * store to the condition must be ordered before its load of the queue
+ * head, as the waiter's queueing is before its load of the condition. */
+uint32_t wake_up(wait_queue_t* wq) {
+    __sync_synchronize();
+    if (!wq->head) return 0;
+    return wake_common(wq, false);
+}
+
+uint32_t wake_up_all(wait_queue_t* wq) {
+    __sync_synchronize();
+    if (!wq->head) return 0;
+    return wake_common(wq, true);
+}
@@ -0,0 +1,63 @@
+#include "lib.h"
+#include "syscall.h"
+#include "arch/x86_64/common.h"
+
+/*
+ * Context-switch benchmark: N forked workers each call sys_yield() in a
+ * loop.  Reports aggregate TSC cycles per yield for N = 1..16 and the
+ * per-CPU switch counters from /proc/sched.  Boot with `make run SMP=n`
+ * to compare 2..8 CPUs.
+ */
+
+#define YIELDS_PER_WORKER 20000
+#define MAX_WORKERS 16
+
+static void show_sched(void) {
+    int fd = (int)sys_open("/proc/sched", O_RDONLY);
+    if (fd < 0) return;
+    char buf[256];
+    for (;;) {
+        int64_t n = sys_read(fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        sys_write(1, buf, n);
+    }
+    sys_close(fd);
+}
+
+static void worker(void) {
+    for (int i = 0; i < YIELDS_PER_WORKER; i++) sys_yield();
+    sys_exit(0);
+}
+
+static void run(int workers) {
+    int64_t pids[MAX_WORKERS];
+    int started = 0;
+
+    uint64_t start = rdtsc();
+    for (int i = 0; i < workers; i++) {
+        int64_t pid = sys_fork();
+        if (pid == 0) worker();
+        if (pid < 0) break;
+        pids[started++] = pid;
+    }
+    for (int i = 0; i < started; i++) {
+        int status = 0;
+        sys_waitpid(pids[i], &status);
+    }
+    uint64_t cycles = rdtsc() - start;
+
+    uint64_t yields = (uint64_t)started * YIELDS_PER_WORKER;
+    if (yields == 0) {
+        printf("%d workers: fork failed\n", (int64_t)workers);
+        return;
+    }
+    printf("%d workers: %u cycles/yield\n", (int64_t)started, cycles / yields);
+}
+
+int main(void) {
+    printf("ctxbench: %u yields per worker\n", (uint64_t)YIELDS_PER_WORKER);
+    show_sched();
+    for (int n = 1; n <= MAX_WORKERS; n *= 2) run(n);
+    show_sched();
+    return 0;
+}
@@ -0,0 +1,89 @@
+#include "lib.h"
+#include "syscall.h"
+
+/*
+ * Fair-scheduling benchmark.  An "interactive" thread sleeps 5 ms at a
+ * time and records how late it gets the CPU back, first on an idle system
+ * and then against CPU hogs at nice 0 and nice 5.  The hogs report how many
+ * loop iterations they got, which shows the nice weighting.
+ */
+
+#define HOGS          6
+#define HOG_SECONDS   3
+#define WAKE_PERIOD   5000000ull
+#define WAKE_SAMPLES  400
+
+static uint64_t g_late[WAKE_SAMPLES];
+
+static uint64_t now_ns(void) {
+    timespec_t ts;
+    if (sys_clock_gettime(CLOCK_MONOTONIC, &ts) < 0) return 0;
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sort_u64(uint64_t* v, int n) {
+    for (int i = 1; i < n; i++) {
+        uint64_t x = v[i];
+        int j = i - 1;
+        while (j >= 0 && v[j] > x) {
+            v[j + 1] = v[j];
+            j--;
+        }
+        v[j + 1] = x;
+    }
+}
+
+static void hog(int nice, uint64_t until) {
+    sys_nice(nice);
+    uint64_t loops = 0;
+    while (now_ns() < until) {
+        for (volatile int i = 0; i < 10000; i++) {
+        }
+        loops++;
+    }
+    printf("  hog pid %d nice %d: %u loops\n", sys_getpid(), (int64_t)nice, loops);
+    sys_exit(0);
+}
+
+static void interactive(const char* label, int samples) {
+    uint64_t next = now_ns();
+    for (int i = 0; i < samples; i++) {
+        next += WAKE_PERIOD;
+        timespec_t ts = { (int64_t)(next / 1000000000ull), (int64_t)(next % 1000000000ull) };
+        sys_clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+        uint64_t t = now_ns();
+        g_late[i] = t > next ? t - next : 0;
+        /* A little work per wakeup, like a shell echoing a key. */
+        for (volatile int k = 0; k < 2000; k++) {
+        }
+    }
+    sort_u64(g_late, samples);
+    printf("%s: wakeup latency p50 %u p99 %u max %u us\n", label,
+           g_late[samples / 2] / 1000, g_late[samples * 99 / 100] / 1000,
+           g_late[samples - 1] / 1000);
+}
+
+int main(void) {
+    printf("fairbench: %d hogs for %d s\n", (int64_t)HOGS, (int64_t)HOG_SECONDS);
+    interactive("idle", WAKE_SAMPLES / 4);
+
+    uint64_t until = now_ns() + HOG_SECONDS * 1000000000ull;
+    int64_t pids[HOGS];
+    int started = 0;
+    for (int i = 0; i < HOGS; i++) {
+        int64_t pid = sys_fork();
+        if (pid == 0) hog(i % 2 ? 5 : 0, until);
+        if (pid < 0) break;
+        pids[started++] = pid;
+    }
+
+    int samples = (int)(HOG_SECONDS * 1000000000ull / WAKE_PERIOD) - 20;
+    if (samples > WAKE_SAMPLES) samples = WAKE_SAMPLES;
+    interactive("loaded", samples);
+
+    for (int i = 0; i < started; i++) {
+        int status = 0;
+        sys_waitpid(pids[i], &status);
+    }
+    return 0;
+}
@@ -197,6 +197,31 @@ static int hex_value(char c) {
     return -1;
 }
 
+static int parse_hex_u64(const char* s, uint64_t* out) {
+    if (!s || !out) return 0;
+    if (s[0] == '0' && (s[1] == 'x' || s[1] == 'X')) s += 2;
+    if (!*s) return 0;
+    uint64_t value = 0;
+    for (; *s; s++) {
+        int v = hex_value(*s);
+        if (v < 0 || value >> 60) return 0;
+        value = (value << 4) | (uint64_t)v;
+    }
+    *out = value;
+    return 1;
+}
+
+static int parse_pid(const char* s, int64_t* out) {
+    if (!s || !out || !is_digit(*s)) return 0;
+    int64_t value = 0;
+    for (; *s; s++) {
+        if (!is_digit(*s) || value > 100000000) return 0;
+        value = value * 10 + (*s - '0');
+    }
+    *out = value;
+    return 1;
+}
+
 static int parse_port(const char* s, uint16_t* out) {
     if (!s || !out) return 0;
     if (!is_digit(*s)) return 0;
@@ -1406,6 +1431,331 @@ static void cmd_echo(int argc, char* argv[]) {
     if (redirect_path) sys_close(fd);
 }
 
+/* taskset <mask> <program> | taskset -p [<mask>] <pid> */
+static void cmd_taskset(int argc, char* argv[]) {
+    uint64_t mask = 0;
+    int64_t pid = 0;
+    if (argc == 3 && strcmp(argv[1], "-p") == 0) {
+        if (!parse_pid(argv[2], &pid)) {
+            puts("taskset: bad pid");
+            return;
+        }
+        int64_t cur = sys_sched_getaffinity(pid);
+        if (cur < 0) {
+            printf("taskset: no such pid %d\n", pid);
+            return;
+        }
+        printf("pid %d's affinity mask: %x\n", pid, (uint64_t)cur);
+        return;
+    }
+    if (argc == 4 && strcmp(argv[1], "-p") == 0) {
+        if (!parse_hex_u64(argv[2], &mask) || !parse_pid(argv[3], &pid)) {
+            puts("taskset: usage: taskset -p <mask> <pid>");
+            return;
+        }
+        int64_t old = sys_sched_getaffinity(pid);
+        if (sys_sched_setaffinity(pid, mask) < 0) {
+            printf("taskset: failed to set pid %d's affinity\n", pid);
+            return;
+        }
+        printf("pid %d's current affinity mask: %x\n", pid, (uint64_t)old);
+        printf("pid %d's new affinity mask: %x\n", pid, (uint64_t)sys_sched_getaffinity(pid));
+        return;
+    }
+    if (argc == 3 && parse_hex_u64(argv[1], &mask)) {
+        int64_t child = sys_fork();
+        if (child == 0) {
+            if (sys_sched_setaffinity(0, mask) < 0) {
+                printf("taskset: no online CPU in mask %x\n", mask);
+                sys_exit(1);
+            }
+            if (sys_execve(argv[2]) < 0) {
+                printf("exec: failed to run %s\n", argv[2]);
+                sys_exit(1);
+            }
+            sys_exit(0);
+        } else if (child > 0) {
+            int status = 0;
+            sys_waitpid(child, &status);
+        } else {
+            printf("fork failed\n");
+        }
+        return;
+    }
+    puts("taskset: usage: taskset <mask> <program> | taskset -p [<mask>] <pid>");
+}
+
+/* top: per-process CPU use from /proc/pstat, sampled every delay seconds. */
+#define TOP_MAX_PROCS 64
+#define TOP_MAX_ROWS  16
+
+typedef struct {
+    int64_t  pid;
+    char     state;
+    uint64_t threads;
+    uint64_t cpu;
+    uint64_t user_us;
+    uint64_t sys_us;
+    uint64_t irq_us;
+    uint64_t wait_us;
+    uint64_t vcsw;
+    uint64_t ivcsw;
+    char     name[16];
+    uint64_t delta_us;      /* CPU time since the previous sample */
+    int      shown;
+} top_proc_t;
+
+static top_proc_t g_top_prev[TOP_MAX_PROCS];
+static top_proc_t g_top_cur[TOP_MAX_PROCS];
+static char g_top_buf[4096];
+
+static const char* top_field(const char* p, uint64_t* out) {
+    while (*p == ' ') p++;
+    int neg = *p == '-';
+    if (neg) p++;
+    uint64_t v = 0;
+    while (is_digit(*p)) v = v * 10u + (uint64_t)(*p++ - '0');
+    *out = neg ? 0 : v;
+    return p;
+}
+
+static int top_sample(top_proc_t* procs) {
+    int fd = (int)sys_open("/proc/pstat", O_RDONLY);
+    if (fd < 0) return -1;
+    int64_t len = 0;
+    while (len < (int64_t)sizeof(g_top_buf) - 1) {
+        int64_t n = sys_read(fd, g_top_buf + len, (int64_t)sizeof(g_top_buf) - 1 - len);
+        if (n <= 0) break;
+        len += n;
+    }
+    sys_close(fd);
+    g_top_buf[len] = 0;
+
+    int count = 0;
+    const char* p = find_char(g_top_buf, '\n');    /* skip the header */
+    while (p && p[1] && count < TOP_MAX_PROCS) {
+        p++;
+        top_proc_t* t = &procs[count];
+        uint64_t pid = 0, ppid = 0, policy = 0, nice = 0;
+        p = top_field(p, &pid);
+        p = top_field(p, &ppid);
+        while (*p == ' ') p++;
+        t->state = *p ? *p++ : '?';
+        p = top_field(p, &t->threads);
+        p = top_field(p, &t->cpu);
+        p = top_field(p, &policy);
+        p = top_field(p, &nice);
+        p = top_field(p, &t->user_us);
+        p = top_field(p, &t->sys_us);
+        p = top_field(p, &t->irq_us);
+        p = top_field(p, &t->wait_us);
+        p = top_field(p, &t->vcsw);
+        p = top_field(p, &t->ivcsw);
+        while (*p == ' ') p++;
+        size_t i = 0;
+        while (*p && *p != '\n' && i + 1 < sizeof(t->name)) t->name[i++] = *p++;
+        t->name[i] = 0;
+        t->pid = (int64_t)pid;
+        count++;
+        p = find_char(p, '\n');
+    }
+    return count;
+}
+
+static void append_u64_col(char* out, size_t out_size, size_t* pos, uint64_t value, int width) {
+    char tmp[24];
+    int len = 0;
+    do {
+        tmp[len++] = (char)('0' + (value % 10u));
+        value /= 10u;
+    } while (value && len < (int)sizeof(tmp));
+    for (int i = len; i < width; i++) append_char(out, out_size, pos, ' ');
+    while (len > 0) append_char(out, out_size, pos, tmp[--len]);
+}
+
+/* part/whole as a percentage with one decimal, right-aligned. */
+static void append_pct_col(char* out, size_t out_size, size_t* pos, uint64_t part, uint64_t whole,
+                           int width) {
+    uint64_t tenths = whole ? part * 1000u / whole : 0;
+    append_u64_col(out, out_size, pos, tenths / 10u, width - 2);
+    append_char(out, out_size, pos, '.');
+    append_char(out, out_size, pos, (char)('0' + tenths % 10u));
+}
+
+static void top_print(int nprocs, uint64_t elapsed_us, uint64_t uptime_s) {
+    uint64_t user = 0, sys = 0, irq = 0, idle = 0;
+    int ncpus = 0;
+    for (int i = 0; i < nprocs; i++) {
+        top_proc_t* t = &g_top_cur[i];
+        uint64_t busy = t->user_us + t->sys_us + t->irq_us;
+        t->delta_us = busy;
+        for (int j = 0; j < TOP_MAX_PROCS; j++) {
+            top_proc_t* o = &g_top_prev[j];
+            if (o->pid == t->pid && o->name[0]) {
+                uint64_t before = o->user_us + o->sys_us + o->irq_us;
+                t->delta_us = busy > before ? busy - before : 0;
+                if (t->state == 'I') idle += t->delta_us;
+                else {
+                    user += t->user_us > o->user_us ? t->user_us - o->user_us : 0;
+                    sys += t->sys_us > o->sys_us ? t->sys_us - o->sys_us : 0;
+                    irq += t->irq_us > o->irq_us ? t->irq_us - o->irq_us : 0;
+                }
+                break;
+            }
+        }
+        if (t->state == 'I') ncpus++;
+    }
+    uint64_t capacity = elapsed_us * (uint64_t)(ncpus ? ncpus : 1);
+
+    char line[128];
+    size_t pos = 0;
+    printf("top - up %us, %d processes, %d cpus\n", uptime_s, (int64_t)(nprocs - ncpus),
+           (int64_t)ncpus);
+    append_str(line, sizeof(line), &pos, "cpu:");
+    append_pct_col(line, sizeof(line), &pos, user, capacity, 7);
+    append_str(line, sizeof(line), &pos, "% user");
+    append_pct_col(line, sizeof(line), &pos, sys, capacity, 7);
+    append_str(line, sizeof(line), &pos, "% sys");
+    append_pct_col(line, sizeof(line), &pos, irq, capacity, 7);
+    append_str(line, sizeof(line), &pos, "% irq");
+    append_pct_col(line, sizeof(line), &pos, idle, capacity, 7);
+    append_str(line, sizeof(line), &pos, "% idle");
+    line[pos < sizeof(line) ? pos : sizeof(line) - 1] = 0;
+    puts(line);
+    puts("  PID S THR CPU  %CPU  USER_MS   SYS_MS  WAIT_MS    VCSW   IVCSW NAME");
+
+    /* Busiest first; idle threads are the header's idle figure. */
+    for (int row = 0; row < TOP_MAX_ROWS; row++) {
+        int best = -1;
+        for (int i = 0; i < nprocs; i++) {
+            top_proc_t* t = &g_top_cur[i];
+            if (t->state == 'I' || t->shown) continue;
+            if (best < 0 || t->delta_us > g_top_cur[best].delta_us) best = i;
+        }
+        if (best < 0) break;
+        top_proc_t* t = &g_top_cur[best];
+        pos = 0;
+        append_u64_col(line, sizeof(line), &pos, (uint64_t)t->pid, 5);
+        append_char(line, sizeof(line), &pos, ' ');
+        append_char(line, sizeof(line), &pos, t->state);
+        append_u64_col(line, sizeof(line), &pos, t->threads, 4);
+        append_u64_col(line, sizeof(line), &pos, t->cpu, 4);
+        append_pct_col(line, sizeof(line), &pos, t->delta_us, elapsed_us, 6);
+        append_u64_col(line, sizeof(line), &pos, t->user_us / 1000u, 9);
+        append_u64_col(line, sizeof(line), &pos, (t->sys_us + t->irq_us) / 1000u, 9);
+        append_u64_col(line, sizeof(line), &pos, t->wait_us / 1000u, 9);
+        append_u64_col(line, sizeof(line), &pos, t->vcsw, 8);
+        append_u64_col(line, sizeof(line), &pos, t->ivcsw, 8);
+        append_char(line, sizeof(line), &pos, ' ');
+        append_str(line, sizeof(line), &pos, t->name);
+        line[pos < sizeof(line) ? pos : sizeof(line) - 1] = 0;
+        puts(line);
+        t->shown = 1;
+    }
+}
+
+/* top [-d <seconds>] [-n <iterations>] */
+static void cmd_top(int argc, char* argv[]) {
+    int64_t delay = 2;
+    int64_t iterations = 10;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc && parse_pid(argv[i + 1], &delay) && delay > 0) {
+            i++;
+        } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc && parse_pid(argv[i + 1], &iterations)) {
+            i++;
+        } else {
+            puts("top: usage: top [-d <seconds>] [-n <iterations>]");
+            return;
+        }
+    }
+
+    timespec_t ts;
+    memset(g_top_prev, 0, sizeof(g_top_prev));
+    if (top_sample(g_top_prev) < 0) {
+        puts("top: cannot read /proc/pstat");
+        return;
+    }
+    sys_clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t last_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+
+    for (int64_t iter = 0; iter < iterations; iter++) {
+        sys_sleep((uint64_t)delay * 1000u);
+        memset(g_top_cur, 0, sizeof(g_top_cur));
+        int n = top_sample(g_top_cur);
+        if (n < 0) return;
+        sys_clock_gettime(CLOCK_MONOTONIC, &ts);
+        uint64_t now_ns = (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+        uint64_t elapsed_us = (now_ns - last_ns) / 1000u;
+        last_ns = now_ns;
+
+        if (iter) puts("");
+        top_print(n, elapsed_us ? elapsed_us : 1, now_ns / 1000000000ull);
+        memcpy(g_top_prev, g_top_cur, sizeof(g_top_prev));
+    }
+}
+
+/* One trace ring's worth; CPUs are dumped one after another. */
+#define TRACE_MAX_EVENTS 1024
+#define TRACE_MAX_CPUS   8
+
+static sched_event_t g_trace_buf[TRACE_MAX_EVENTS];
+
+/* trace start|stop|dump.  The dump is one event per line, "tsc=<n> cpu=<n>
+ * ev=<type> pid=<n>" plus the event's own fields, after a header with the
+ * TSC rate; each CPU's events are in order, sort on tsc to merge them. */
+static void cmd_trace(int argc, char* argv[]) {
+    if (argc < 2) {
+        puts("trace: usage: trace start|stop|dump");
+        return;
+    }
+    if (strcmp(argv[1], "start") == 0) {
+        sys_sched_trace(SCHED_TRACE_START, 0, 0, 0);
+        return;
+    }
+    if (strcmp(argv[1], "stop") == 0) {
+        sys_sched_trace(SCHED_TRACE_STOP, 0, 0, 0);
+        return;
+    }
+    if (strcmp(argv[1], "dump") != 0) {
+        puts("trace: usage: trace start|stop|dump");
+        return;
+    }
+
+    printf("# sched_trace tsc_hz=%u\n", (uint64_t)sys_sched_trace(SCHED_TRACE_TSC_HZ, 0, 0, 0));
+    for (int64_t cpu = 0; cpu < TRACE_MAX_CPUS; cpu++) {
+        int64_t n = sys_sched_trace(SCHED_TRACE_READ, cpu, g_trace_buf, TRACE_MAX_EVENTS);
+        if (n < 0) break;
+        for (int64_t i = 0; i < n; i++) {
+            const sched_event_t* e = &g_trace_buf[i];
+            printf("tsc=%u cpu=%u ", e->tsc, (uint64_t)e->cpu);
+            switch (e->type) {
+                case SCHED_EV_SWITCH:
+                    printf("ev=switch pid=%u next=%u prev_state=%u\n", (uint64_t)e->pid,
+                           (uint64_t)e->arg0, (uint64_t)e->arg1);
+                    break;
+                case SCHED_EV_WAKEUP:
+                    printf("ev=wakeup pid=%u target_cpu=%u waker=%u\n", (uint64_t)e->pid,
+                           (uint64_t)e->arg0, (uint64_t)e->arg1);
+                    break;
+                case SCHED_EV_MIGRATE:
+                    printf("ev=migrate pid=%u dst_cpu=%u src_cpu=%u\n", (uint64_t)e->pid,
+                           (uint64_t)e->arg0, (uint64_t)e->arg1);
+                    break;
+                case SCHED_EV_FORK:
+                    printf("ev=fork pid=%u child=%u\n", (uint64_t)e->pid, (uint64_t)e->arg0);
+                    break;
+                case SCHED_EV_EXIT:
+                    printf("ev=exit pid=%u code=%d\n", (uint64_t)e->pid,
+                           (int64_t)(int32_t)e->arg0);
+                    break;
+                default:
+                    printf("ev=%u pid=%u\n", (uint64_t)e->type, (uint64_t)e->pid);
+                    break;
+            }
+        }
+    }
+}
+
 static void run_external(char* path) {
     int64_t pid = sys_fork();
     if (pid == 0) {
@@ -1444,7 +1794,7 @@ int main(void) {
     if (argc == 0) continue;
 
     if (strcmp(argv[0], "help") == 0) {
-            puts("Built-ins: help ls cat touch echo exit mkfs mount umount df du fsck lsblk blkid stat ifconfig ip route ping traceroute tracepath nslookup dig netstat ss tcpdump systemctl");
+            puts("Built-ins: help ls cat touch echo exit mkfs mount umount df du fsck lsblk blkid stat ifconfig ip route ping traceroute tracepath nslookup dig netstat ss tcpdump systemctl taskset top trace");
         } else if (strcmp(argv[0], "ls") == 0) {
             cmd_ls(argc > 1 ? argv[1] : "/");
         } else if (strcmp(argv[0], "cat") == 0) {
@@ -1575,6 +1925,12 @@ int main(void) {
             } else {
                 puts("systemctl: usage: systemctl start|stop NetworkManager");
             }
+        } else if (strcmp(argv[0], "taskset") == 0) {
+            cmd_taskset(argc, argv);
+        } else if (strcmp(argv[0], "top") == 0) {
+            cmd_top(argc, argv);
+        } else if (strcmp(argv[0], "trace") == 0) {
+            cmd_trace(argc, argv);
         } else if (strcmp(argv[0], "exit") == 0) {
             break;
         } else {
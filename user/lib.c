@@ -2,39 +2,6 @@
 #include "syscall.h"
 #include <stdarg.h>
 
-void* memcpy(void* dst, const void* src, size_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    const uint8_t* s = (const uint8_t*)src;
-    for (size_t i = 0; i < n; i++) d[i] = s[i];
-    return dst;
-}
-
-void* memset(void* dst, int v, size_t n) {
-    uint8_t* d = (uint8_t*)dst;
-    for (size_t i = 0; i < n; i++) d[i] = (uint8_t)v;
-    return dst;
-}
-
-int memcmp(const void* a, const void* b, size_t n) {
-    const uint8_t* x = (const uint8_t*)a;
-    const uint8_t* y = (const uint8_t*)b;
-    for (size_t i = 0; i < n; i++) {
-        if (x[i] != y[i]) return (int)x[i] - (int)y[i];
-    }
-    return 0;
-}
-
-size_t strlen(const char* s) {
-    size_t n = 0;
-    while (s[n]) n++;
-    return n;
-}
-
-int strcmp(const char* a, const char* b) {
-    while (*a && (*a == *b)) { a++; b++; }
-    return (unsigned char)*a - (unsigned char)*b;
-}
-
 int strncmp(const char* a, const char* b, size_t n) {
     for (size_t i = 0; i < n; i++) {
         unsigned char ac = (unsigned char)a[i];
@@ -1,86 +1,469 @@
 #include "malloc.h"
+#include "lib.h"
 #include "syscall.h"
+#include "pthread.h"
 #include <stdint.h>
 
-typedef struct ublock {
-    struct ublock* next;
-    size_t size;
-    int free;
-} ublock_t;
+/*
+ * Segregated-fit allocator with boundary tags.
+ *
+ * Every chunk starts with two words: prev_foot holds the size of the
+ * physically previous chunk while that chunk is free, head holds this chunk's
+ * size plus the CINUSE/PINUSE flags.  An in-use chunk may spill into the next
+ * chunk's prev_foot word, so the per-allocation overhead is a single word.
+ *
+ * Free chunks sit in size-class bins: exact-size small bins below
+ * MALLOC_SMALL_LIMIT and power-of-two ranged large bins above it.  A bitmap of
+ * non-empty bins finds the next fitting bin without walking the heap, and
+ * free() only ever looks at the two physical neighbours of a chunk.
+ *
+ * The heap tail ("top") is never binned; it is carved for requests no bin can
+ * satisfy and grown with sbrk().  Once more than MALLOC_TRIM_THRESHOLD bytes
+ * of top are free the break is lowered again, and requests of at least
+ * MALLOC_MMAP_THRESHOLD bytes bypass the heap entirely: they get their own
+ * anonymous mapping that is handed back with munmap() on free.  All state
+ * lives in a malloc_arena_t so that per-thread caches can later sit in front
+ * of the shared arena without changing the chunk format.
+ */
 
-extern uint8_t _end[];
-static ublock_t* g_head = 0;
-static void* g_program_break = 0;
+#define MALLOC_ALIGN        16
+#define MALLOC_ALIGN_MASK   (MALLOC_ALIGN - 1)
+#define CHUNK_OVERHEAD      sizeof(size_t)
+#define CHUNK_HDR_SIZE      (2 * sizeof(size_t))
+#define MIN_CHUNK_SIZE      32
+#define MAX_REQUEST         ((size_t)1 << 46)
 
-static void* sbrk(size_t inc) {
-    if (!g_program_break) {
-        g_program_break = _end;
-        sys_brk(g_program_break);
+#define MALLOC_SMALL_LIMIT  1024
+#define MALLOC_NSMALLBINS   (MALLOC_SMALL_LIMIT / MALLOC_ALIGN)
+#define MALLOC_NLARGEBINS   32
+#define MALLOC_NBINS        (MALLOC_NSMALLBINS + MALLOC_NLARGEBINS)
+#define MALLOC_LARGE_SHIFT  10 /* log2(MALLOC_SMALL_LIMIT) */
+
+#define MALLOC_PAGE_SIZE    4096
+#define MALLOC_TOP_PAD      (64 * 1024)
+#define MALLOC_TRIM_THRESHOLD (256 * 1024)
+#define MALLOC_MMAP_THRESHOLD (128 * 1024)
+
+#define PINUSE_BIT 0x1 /* previous chunk is in use */
+#define CINUSE_BIT 0x2 /* this chunk is in use */
+#define MMAPPED_BIT 0x4 /* chunk is a private mapping, not part of the heap */
+#define FLAG_BITS  (PINUSE_BIT | CINUSE_BIT | MMAPPED_BIT)
+
+typedef struct mchunk {
+    size_t prev_foot;
+    size_t head;
+    struct mchunk* fd; /* free chunks only */
+    struct mchunk* bk;
+} mchunk_t;
+
+typedef struct malloc_arena {
+    mchunk_t* bins[MALLOC_NBINS];
+    uint64_t  binmap[(MALLOC_NBINS + 63) / 64];
+    mchunk_t* top;
+    uint8_t*  heap_base;
+    uint8_t*  heap_end;
+    int       initialized;
+
+    size_t    peak_heap;
+    size_t    inuse_bytes;
+    size_t    inuse_chunks;
+    size_t    free_bytes;
+    size_t    free_chunks;
+    uint64_t  n_malloc;
+    uint64_t  n_free;
+    uint64_t  n_sbrk;
+    uint64_t  n_split;
+    uint64_t  n_coalesce;
+
+    size_t    mmapped_bytes;
+    size_t    mmapped_chunks;
+    uint64_t  n_mmap;
+    uint64_t  n_munmap;
+    uint64_t  n_trim;
+    size_t    trimmed_bytes;
+
+    pthread_mutex_t lock;
+} malloc_arena_t;
+
+/* The arena is shared by every thread of the process. */
+#define ARENA_LOCK(a)   pthread_mutex_lock(&(a)->lock)
+#define ARENA_UNLOCK(a) pthread_mutex_unlock(&(a)->lock)
+
+static malloc_arena_t g_main_arena;
+
+static inline size_t chunk_size(const mchunk_t* c) { return c->head & ~(size_t)FLAG_BITS; }
+static inline mchunk_t* chunk_at(void* base, size_t off) { return (mchunk_t*)((uint8_t*)base + off); }
+static inline mchunk_t* chunk_next(mchunk_t* c) { return chunk_at(c, chunk_size(c)); }
+static inline void* chunk2mem(mchunk_t* c) { return (uint8_t*)c + CHUNK_HDR_SIZE; }
+static inline mchunk_t* mem2chunk(void* p) { return (mchunk_t*)((uint8_t*)p - CHUNK_HDR_SIZE); }
+
+static inline void set_free_foot(mchunk_t* c, size_t size) {
+    chunk_at(c, size)->prev_foot = size;
+}
+
+static size_t request2size(size_t n) {
+    size_t size = (n + CHUNK_OVERHEAD + MALLOC_ALIGN_MASK) & ~(size_t)MALLOC_ALIGN_MASK;
+    return size < MIN_CHUNK_SIZE ? MIN_CHUNK_SIZE : size;
+}
+
+static uint32_t bin_index(size_t size) {
+    if (size < MALLOC_SMALL_LIMIT) return (uint32_t)(size / MALLOC_ALIGN);
+    uint32_t log2 = 63u - (uint32_t)__builtin_clzll((unsigned long long)size);
+    uint32_t idx = MALLOC_NSMALLBINS + (log2 - MALLOC_LARGE_SHIFT);
+    return idx < MALLOC_NBINS ? idx : MALLOC_NBINS - 1;
+}
+
+static inline void binmap_set(malloc_arena_t* a, uint32_t idx) {
+    a->binmap[idx / 64] |= 1ULL << (idx % 64);
+}
+
+static inline void binmap_clear(malloc_arena_t* a, uint32_t idx) {
+    a->binmap[idx / 64] &= ~(1ULL << (idx % 64));
+}
+
+/* First non-empty bin with index >= idx, or MALLOC_NBINS. */
+static uint32_t binmap_next(const malloc_arena_t* a, uint32_t idx) {
+    while (idx < MALLOC_NBINS) {
+        uint64_t word = a->binmap[idx / 64] & (~0ULL << (idx % 64));
+        if (word) return (idx & ~63u) + (uint32_t)__builtin_ctzll(word);
+        idx = (idx & ~63u) + 64;
+    }
+    return MALLOC_NBINS;
+}
+
+static void bin_insert(malloc_arena_t* a, mchunk_t* c) {
+    size_t size = chunk_size(c);
+    uint32_t idx = bin_index(size);
+    c->bk = 0;
+    c->fd = a->bins[idx];
+    if (c->fd) c->fd->bk = c;
+    a->bins[idx] = c;
+    binmap_set(a, idx);
+    a->free_bytes += size;
+    a->free_chunks++;
+}
+
+static void bin_unlink(malloc_arena_t* a, mchunk_t* c) {
+    size_t size = chunk_size(c);
+    uint32_t idx = bin_index(size);
+    if (c->bk) {
+        c->bk->fd = c->fd;
+    } else {
+        a->bins[idx] = c->fd;
+        if (!c->fd) binmap_clear(a, idx);
     }
-    void* old = g_program_break;
-    void* new_brk = (uint8_t*)g_program_break + inc;
-    if (sys_brk(new_brk) == -1) return (void*)-1;
-    g_program_break = new_brk;
+    if (c->fd) c->fd->bk = c->bk;
+    a->free_bytes -= size;
+    a->free_chunks--;
+}
+
+static void* sbrk(intptr_t inc) {
+    uint8_t* old = g_main_arena.heap_end;
+    if (inc == 0) return old;
+    uint8_t* new_end = old + inc;
+    if (sys_brk(new_end) == -1) return (void*)-1;
+    g_main_arena.heap_end = new_end;
+    g_main_arena.n_sbrk++;
     return old;
 }
 
-static ublock_t* request_space(size_t size) {
-    size_t total = sizeof(ublock_t) + size;
-    total = (total + 15) & ~((size_t)15);
-    ublock_t* block = (ublock_t*)sbrk(total);
-    if (block == (void*)-1) return 0;
-    block->next = 0;
-    block->free = 0;
-    block->size = total - sizeof(ublock_t);
+static int arena_init(malloc_arena_t* a) {
+    int64_t cur = sys_brk(0);
+    if (cur == -1) return 0;
+
+    a->heap_end = (uint8_t*)(uintptr_t)cur;
+    uintptr_t base = ((uintptr_t)a->heap_end + MALLOC_ALIGN_MASK) & ~(uintptr_t)MALLOC_ALIGN_MASK;
+    size_t pad = (size_t)(base - (uintptr_t)a->heap_end);
+    if (sbrk((intptr_t)(pad + MALLOC_TOP_PAD)) == (void*)-1) return 0;
+
+    a->heap_base = (uint8_t*)base;
+    a->top = (mchunk_t*)base;
+    a->top->prev_foot = 0;
+    a->top->head = (size_t)(a->heap_end - a->heap_base) | PINUSE_BIT;
+    a->peak_heap = (size_t)(a->heap_end - a->heap_base);
+    a->initialized = 1;
+    return 1;
+}
+
+/* Grow top so that it can hold nb bytes plus a minimum remainder. */
+static int arena_grow_top(malloc_arena_t* a, size_t nb) {
+    size_t top_size = chunk_size(a->top);
+    size_t need = nb + MIN_CHUNK_SIZE - top_size + MALLOC_TOP_PAD;
+    need = (need + MALLOC_PAGE_SIZE - 1) & ~(size_t)(MALLOC_PAGE_SIZE - 1);
+    if (sbrk((intptr_t)need) == (void*)-1) return 0;
+    a->top->head = (top_size + need) | (a->top->head & PINUSE_BIT);
+    size_t heap = (size_t)(a->heap_end - a->heap_base);
+    if (heap > a->peak_heap) a->peak_heap = heap;
+    return 1;
+}
+
+/* Give trailing free pages of top back to the kernel, keeping pad bytes. */
+static int arena_trim(malloc_arena_t* a, size_t pad) {
+    size_t top_size = chunk_size(a->top);
+    if (top_size <= pad + MIN_CHUNK_SIZE) return 0;
+    uintptr_t keep_end = (uintptr_t)a->top + pad + MIN_CHUNK_SIZE;
+    keep_end = (keep_end + MALLOC_PAGE_SIZE - 1) & ~(uintptr_t)(MALLOC_PAGE_SIZE - 1);
+    if (keep_end >= (uintptr_t)a->heap_end) return 0;
 
-    if (g_head) {
-        ublock_t* cur = g_head;
-        while (cur->next) cur = cur->next;
-        cur->next = block;
+    size_t release = (size_t)((uintptr_t)a->heap_end - keep_end);
+    if (sbrk(-(intptr_t)release) == (void*)-1) return 0;
+    a->top->head = (top_size - release) | (a->top->head & PINUSE_BIT);
+    a->n_trim++;
+    a->trimmed_bytes += release;
+    return 1;
+}
+
+static void* mmap_chunk_alloc(malloc_arena_t* a, size_t n) {
+    /* Mapped chunks have no successor to spill into: the full header counts. */
+    size_t size = (n + CHUNK_HDR_SIZE + MALLOC_PAGE_SIZE - 1) & ~(size_t)(MALLOC_PAGE_SIZE - 1);
+    void* base = sys_mmap(0, size, PROT_READ | PROT_WRITE);
+    if (base == (void*)-1 || !base) return 0;
+    mchunk_t* c = (mchunk_t*)base;
+    c->prev_foot = 0;
+    c->head = size | MMAPPED_BIT | CINUSE_BIT;
+    a->mmapped_bytes += size;
+    a->mmapped_chunks++;
+    a->n_mmap++;
+    return chunk2mem(c);
+}
+
+static void mmap_chunk_free(malloc_arena_t* a, mchunk_t* c) {
+    size_t size = chunk_size(c);
+    if (sys_munmap(c, size) != 0) return;
+    a->mmapped_bytes -= size;
+    a->mmapped_chunks--;
+    a->n_munmap++;
+}
+
+/* Mark c (already unlinked) in use, splitting off the tail if it is big enough. */
+static void* use_chunk(malloc_arena_t* a, mchunk_t* c, size_t nb) {
+    size_t size = chunk_size(c);
+    size_t rem = size - nb;
+    if (rem >= MIN_CHUNK_SIZE) {
+        mchunk_t* r = chunk_at(c, nb);
+        r->head = rem | PINUSE_BIT;
+        set_free_foot(r, rem);
+        bin_insert(a, r);
+        c->head = nb | (c->head & PINUSE_BIT) | CINUSE_BIT;
+        a->n_split++;
+        size = nb;
     } else {
-        g_head = block;
+        c->head |= CINUSE_BIT;
+        chunk_next(c)->head |= PINUSE_BIT;
     }
-    return block;
+    a->inuse_bytes += size;
+    a->inuse_chunks++;
+    return chunk2mem(c);
 }
 
-static ublock_t* find_block(size_t size) {
-    ublock_t* cur = g_head;
-    while (cur) {
-        if (cur->free && cur->size >= size) return cur;
-        cur = cur->next;
+static void* arena_malloc(malloc_arena_t* a, size_t n) {
+    if (!a->initialized && !arena_init(a)) return 0;
+    if (n >= MAX_REQUEST) return 0;
+    size_t nb = request2size(n);
+    a->n_malloc++;
+
+    if (nb >= MALLOC_MMAP_THRESHOLD) {
+        void* p = mmap_chunk_alloc(a, n);
+        if (p) return p;
+        /* Fall back to the heap if the address space refused the mapping. */
+    }
+
+    uint32_t idx = bin_index(nb);
+    if (idx >= MALLOC_NSMALLBINS) {
+        /* Large bins span a size range; look for a fit inside the exact bin. */
+        for (mchunk_t* c = a->bins[idx]; c; c = c->fd) {
+            if (chunk_size(c) >= nb) {
+                bin_unlink(a, c);
+                return use_chunk(a, c, nb);
+            }
+        }
+        idx++;
+    }
+
+    /* Any chunk in bin idx or above fits (small bins hold exactly one size). */
+    idx = binmap_next(a, idx);
+    if (idx < MALLOC_NBINS) {
+        mchunk_t* c = a->bins[idx];
+        bin_unlink(a, c);
+        return use_chunk(a, c, nb);
     }
-    return 0;
+
+    if (chunk_size(a->top) < nb + MIN_CHUNK_SIZE && !arena_grow_top(a, nb)) return 0;
+
+    mchunk_t* c = a->top;
+    size_t top_size = chunk_size(c);
+    a->top = chunk_at(c, nb);
+    a->top->head = (top_size - nb) | PINUSE_BIT;
+    c->head = nb | (c->head & PINUSE_BIT) | CINUSE_BIT;
+    a->inuse_bytes += nb;
+    a->inuse_chunks++;
+    return chunk2mem(c);
 }
 
-void* malloc(size_t size) {
-    if (size == 0) return 0;
-    size = (size + 15) & ~((size_t)15);
+/* Release an in-use chunk, coalescing with free neighbours in O(1). */
+static void arena_free_chunk(malloc_arena_t* a, mchunk_t* c) {
+    size_t size = chunk_size(c);
+    a->inuse_bytes -= size;
+    a->inuse_chunks--;
+
+    mchunk_t* next = chunk_at(c, size);
+    if (!(c->head & PINUSE_BIT)) {
+        size_t prev_size = c->prev_foot;
+        mchunk_t* prev = (mchunk_t*)((uint8_t*)c - prev_size);
+        bin_unlink(a, prev);
+        c = prev;
+        size += prev_size;
+        a->n_coalesce++;
+    }
+
+    if (next == a->top) {
+        size += chunk_size(next);
+        c->head = size | PINUSE_BIT;
+        a->top = c;
+        a->n_coalesce++;
+        if (size >= MALLOC_TRIM_THRESHOLD) arena_trim(a, MALLOC_TOP_PAD);
+        return;
+    }
 
-    ublock_t* block = find_block(size);
-    if (!block) {
-        block = request_space(size);
-        if (!block) return 0;
+    if (!(next->head & CINUSE_BIT)) {
+        bin_unlink(a, next);
+        size += chunk_size(next);
+        a->n_coalesce++;
     } else {
-        block->free = 0;
+        next->head &= ~(size_t)PINUSE_BIT;
     }
-    return (void*)(block + 1);
+
+    c->head = size | PINUSE_BIT;
+    set_free_foot(c, size);
+    bin_insert(a, c);
 }
 
-static void merge(void) {
-    ublock_t* cur = g_head;
-    while (cur && cur->next) {
-        if (cur->free && cur->next->free) {
-            cur->size += sizeof(ublock_t) + cur->next->size;
-            cur->next = cur->next->next;
-        } else {
-            cur = cur->next;
+static void arena_free(malloc_arena_t* a, void* ptr) {
+    mchunk_t* c = mem2chunk(ptr);
+    if (!(c->head & CINUSE_BIT)) return; /* double free or foreign pointer */
+    a->n_free++;
+    if (c->head & MMAPPED_BIT) {
+        mmap_chunk_free(a, c);
+        return;
+    }
+    arena_free_chunk(a, c);
+}
+
+static void* arena_realloc(malloc_arena_t* a, void* ptr, size_t n) {
+    if (n >= MAX_REQUEST) return 0;
+    mchunk_t* c = mem2chunk(ptr);
+    size_t nb = request2size(n);
+    size_t size = chunk_size(c);
+
+    if (c->head & MMAPPED_BIT) {
+        /* Keep the mapping while the request still fits and stays large. */
+        if (n + CHUNK_HDR_SIZE <= size && nb >= MALLOC_MMAP_THRESHOLD / 2) return ptr;
+        void* out = arena_malloc(a, n);
+        if (!out) return 0;
+        size_t keep = size - CHUNK_HDR_SIZE;
+        memcpy(out, ptr, keep < n ? keep : n);
+        arena_free(a, ptr);
+        return out;
+    }
+
+    if (size < nb) {
+        /* Try to grow in place into top or the following free chunk. */
+        mchunk_t* next = chunk_at(c, size);
+        if (next == a->top) {
+            if (size + chunk_size(next) >= nb + MIN_CHUNK_SIZE || arena_grow_top(a, nb - size)) {
+                size_t total = size + chunk_size(a->top);
+                a->top = chunk_at(c, nb);
+                a->top->head = (total - nb) | PINUSE_BIT;
+                c->head = nb | (c->head & PINUSE_BIT) | CINUSE_BIT;
+                a->inuse_bytes += nb - size;
+                return ptr;
+            }
+        } else if (!(next->head & CINUSE_BIT) && size + chunk_size(next) >= nb) {
+            size_t next_size = chunk_size(next);
+            bin_unlink(a, next);
+            size += next_size;
+            c->head = size | (c->head & PINUSE_BIT) | CINUSE_BIT;
+            chunk_at(c, size)->head |= PINUSE_BIT;
+            a->inuse_bytes += next_size;
+            a->n_coalesce++;
         }
+
+        if (size < nb) {
+            void* out = arena_malloc(a, n);
+            if (!out) return 0;
+            memcpy(out, ptr, size - CHUNK_OVERHEAD);
+            arena_free(a, ptr);
+            return out;
+        }
+    }
+
+    /* Shrink (or trim the slack left by in-place growth). */
+    if (size - nb >= MIN_CHUNK_SIZE) {
+        mchunk_t* r = chunk_at(c, nb);
+        r->head = (size - nb) | PINUSE_BIT | CINUSE_BIT;
+        c->head = nb | (c->head & PINUSE_BIT) | CINUSE_BIT;
+        a->inuse_chunks++;
+        a->n_split++;
+        arena_free_chunk(a, r);
     }
+    return ptr;
+}
+
+void* malloc(size_t size) {
+    if (size == 0) return 0;
+    ARENA_LOCK(&g_main_arena);
+    void* p = arena_malloc(&g_main_arena, size);
+    ARENA_UNLOCK(&g_main_arena);
+    return p;
 }
 
 void free(void* ptr) {
     if (!ptr) return;
-    ublock_t* block = ((ublock_t*)ptr) - 1;
-    block->free = 1;
-    merge();
+    ARENA_LOCK(&g_main_arena);
+    arena_free(&g_main_arena, ptr);
+    ARENA_UNLOCK(&g_main_arena);
+}
+
+void* calloc(size_t count, size_t size) {
+    if (count && size > (size_t)-1 / count) return 0;
+    size_t total = count * size;
+    void* p = malloc(total);
+    if (p) memset(p, 0, total);
+    return p;
+}
+
+void* realloc(void* ptr, size_t size) {
+    if (!ptr) return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return 0;
+    }
+    ARENA_LOCK(&g_main_arena);
+    void* p = arena_realloc(&g_main_arena, ptr, size);
+    ARENA_UNLOCK(&g_main_arena);
+    return p;
+}
+
+int malloc_trim(size_t pad) {
+    ARENA_LOCK(&g_main_arena);
+    int released = g_main_arena.initialized ? arena_trim(&g_main_arena, pad) : 0;
+    ARENA_UNLOCK(&g_main_arena);
+    return released;
+}
+
+void malloc_stats(void) {
+    malloc_arena_t* a = &g_main_arena;
+    ARENA_LOCK(a);
+    size_t heap = a->initialized ? (size_t)(a->heap_end - a->heap_base) : 0;
+    size_t top = a->initialized ? chunk_size(a->top) : 0;
+    printf("heap:    %u bytes (peak %u)\n", (uint64_t)heap, (uint64_t)a->peak_heap);
+    printf("in use:  %u bytes in %u chunks\n", (uint64_t)a->inuse_bytes, (uint64_t)a->inuse_chunks);
+    printf("free:    %u bytes in %u chunks, top %u bytes\n",
+           (uint64_t)a->free_bytes, (uint64_t)a->free_chunks, (uint64_t)top);
+    printf("mmapped: %u bytes in %u chunks (mmap=%u munmap=%u)\n",
+           (uint64_t)a->mmapped_bytes, (uint64_t)a->mmapped_chunks, a->n_mmap, a->n_munmap);
+    printf("trimmed: %u bytes in %u trims\n", (uint64_t)a->trimmed_bytes, a->n_trim);
+    printf("calls:   malloc=%u free=%u sbrk=%u split=%u coalesce=%u\n",
+           a->n_malloc, a->n_free, a->n_sbrk, a->n_split, a->n_coalesce);
+    ARENA_UNLOCK(a);
 }
@@ -3,3 +3,11 @@
 
 void* malloc(size_t size);
 void  free(void* ptr);
+void* calloc(size_t count, size_t size);
+void* realloc(void* ptr, size_t size);
+
+/* Return free memory at the top of the heap to the kernel, keeping pad bytes. */
+int   malloc_trim(size_t pad);
+
+/* Print heap usage and allocator counters to stdout. */
+void  malloc_stats(void);
@@ -0,0 +1,95 @@
+#include "lib.h"
+#include "string_ops.h"
+#include "arch/x86_64/common.h"
+
+/*
+ * Compare every string_ops_t variant the CPU supports on a range of sizes.
+ * Throughput is reported in bytes per TSC cycle (x100) since user space has
+ * no calibrated clock finer than the 10 ms tick.
+ */
+
+#define BUF_BYTES   (64u * 1024u)
+#define TOTAL_BYTES (16u * 1024u * 1024u)
+#define MISALIGN    3
+
+enum { OP_MEMCPY, OP_MEMSET, OP_MEMCMP, OP_STRLEN, OP_STRCMP, OP_COUNT };
+
+static const char* const g_op_names[OP_COUNT] = {
+    "memcpy", "memset", "memcmp", "strlen", "strcmp"
+};
+
+static const size_t g_sizes[] = { 16, 64, 256, 1500, 4096, BUF_BYTES - 64 };
+
+static volatile uint64_t g_sink;
+
+static void run_op(const string_ops_t* ops, int op, uint8_t* dst, uint8_t* src, size_t n) {
+    switch (op) {
+        case OP_MEMCPY: ops->memcpy_fn(dst, src, n); break;
+        case OP_MEMSET: ops->memset_fn(dst, 0x5A, n); break;
+        case OP_MEMCMP: g_sink += (uint64_t)ops->memcmp_fn(dst, src, n); break;
+        case OP_STRLEN: g_sink += ops->strlen_fn((const char*)src); break;
+        case OP_STRCMP: g_sink += (uint64_t)ops->strcmp_fn((const char*)dst, (const char*)src); break;
+    }
+}
+
+/* Fill src with a NUL-terminated string of n-1 bytes and make dst equal, so
+ * every op has to walk the full length. */
+static void prepare(uint8_t* dst, uint8_t* src, size_t n) {
+    for (size_t i = 0; i + 1 < n; i++) src[i] = (uint8_t)('a' + i % 26);
+    src[n - 1] = 0;
+    for (size_t i = 0; i < n; i++) dst[i] = src[i];
+}
+
+/* Bytes per cycle x100. */
+static uint64_t measure(const string_ops_t* ops, int op, uint8_t* dst, uint8_t* src, size_t n) {
+    uint64_t iters = TOTAL_BYTES / n;
+    prepare(dst, src, n);
+    run_op(ops, op, dst, src, n);
+    uint64_t start = rdtsc();
+    for (uint64_t i = 0; i < iters; i++) run_op(ops, op, dst, src, n);
+    uint64_t cycles = rdtsc() - start;
+    if (cycles == 0) cycles = 1;
+    return iters * n * 100 / cycles;
+}
+
+static void print_rate(const char* name, uint64_t rate, uint64_t base) {
+    printf(" %s %u.%u%u", name, rate / 100, (rate / 10) % 10, rate % 10);
+    if (base) printf(" (x%u.%u)", rate / base, (rate * 10 / base) % 10);
+}
+
+static void bench(const string_ops_t* variants, size_t count, uint8_t* dst, uint8_t* src, size_t skew) {
+    for (int op = 0; op < OP_COUNT; op++) {
+        for (size_t s = 0; s < sizeof(g_sizes) / sizeof(g_sizes[0]); s++) {
+            size_t n = g_sizes[s];
+            printf("%s %u:", g_op_names[op], (uint64_t)n);
+            uint64_t base = 0;
+            for (size_t v = 0; v < count; v++) {
+                uint64_t rate = measure(&variants[v], op, dst + skew, src, n);
+                print_rate(variants[v].name, rate, v ? base : 0);
+                if (v == 0) base = rate ? rate : 1;
+            }
+            printf("\n");
+        }
+    }
+}
+
+int main(void) {
+    size_t count = 0;
+    const string_ops_t* variants = string_ops_variants(&count);
+    uint8_t* src = (uint8_t*)malloc(BUF_BYTES + 64);
+    uint8_t* dst = (uint8_t*)malloc(BUF_BYTES + 64);
+    if (!src || !dst) {
+        puts("membench: out of memory");
+        return 1;
+    }
+
+    printf("membench: active=%s, bytes/cycle (speedup vs scalar)\n", string_ops_active()->name);
+    puts("-- aligned --");
+    bench(variants, count, dst, src, 0);
+    puts("-- dst misaligned --");
+    bench(variants, count, dst, src, MISALIGN);
+
+    free(src);
+    free(dst);
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include "lib.h"
+#include "syscall.h"
+#include "pthread.h"
+
+/*
+ * Thread scaling.  Splits a fixed amount of CPU-bound work across 1..N
+ * threads (N = CPUs in our affinity mask) and prints the wall time and
+ * speedup over one thread, then has the same threads bump one shared
+ * counter under a pthread mutex to show what contention costs.
+ */
+
+#define MAX_THREADS  16
+#define WORK_ITERS   (1u << 26)
+#define LOCK_ITERS   200000
+
+typedef struct {
+    uint64_t iters;
+    uint64_t result;
+} work_t;
+
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile uint64_t g_counter;
+
+static uint64_t now_ns(void) {
+    timespec_t ts;
+    if (sys_clock_gettime(CLOCK_MONOTONIC, &ts) < 0) return 0;
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void* spin_work(void* arg) {
+    work_t* w = (work_t*)arg;
+    uint64_t x = 88172645463325252ull;
+    for (uint64_t i = 0; i < w->iters; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+    }
+    w->result = x;
+    return 0;
+}
+
+static void* lock_work(void* arg) {
+    work_t* w = (work_t*)arg;
+    for (uint64_t i = 0; i < w->iters; i++) {
+        pthread_mutex_lock(&g_lock);
+        g_counter++;
+        pthread_mutex_unlock(&g_lock);
+    }
+    return 0;
+}
+
+/* Runs fn over n threads, the caller being one of them; returns ns. */
+static uint64_t run(int n, void* (*fn)(void*), uint64_t total) {
+    pthread_t tids[MAX_THREADS];
+    work_t work[MAX_THREADS];
+    uint64_t start = now_ns();
+    for (int i = 0; i < n; i++) work[i].iters = total / (uint64_t)n;
+    for (int i = 1; i < n; i++) {
+        if (pthread_create(&tids[i], fn, &work[i]) < 0) {
+            printf("parbench: pthread_create failed\n");
+            n = i;
+            break;
+        }
+    }
+    fn(&work[0]);
+    for (int i = 1; i < n; i++) pthread_join(tids[i], 0);
+    return now_ns() - start;
+}
+
+int main(void) {
+    uint64_t mask = (uint64_t)sys_sched_getaffinity(0);
+    int ncpus = 0;
+    for (; mask; mask &= mask - 1) ncpus++;
+    if (ncpus < 1) ncpus = 1;
+    if (ncpus > MAX_THREADS) ncpus = MAX_THREADS;
+    printf("parbench: %d cpus\n", (int64_t)ncpus);
+
+    uint64_t base = 0;
+    for (int n = 1; n <= ncpus; n++) {
+        uint64_t ns = run(n, spin_work, WORK_ITERS);
+        if (n == 1) base = ns;
+        uint64_t speedup = ns ? base * 100 / ns : 0;
+        printf("  compute %d threads: %u ms  speedup %u.%u%ux\n", (int64_t)n, ns / 1000000,
+               speedup / 100, (speedup / 10) % 10, speedup % 10);
+    }
+
+    for (int n = 1; n <= ncpus; n++) {
+        g_counter = 0;
+        uint64_t ns = run(n, lock_work, LOCK_ITERS);
+        printf("  mutex   %d threads: %u ms  %u ns/op  count %u%s\n", (int64_t)n, ns / 1000000,
+               ns / LOCK_ITERS, g_counter,
+               g_counter == (LOCK_ITERS / (uint64_t)n) * (uint64_t)n ? "" : " (LOST UPDATES)");
+    }
+    return 0;
+}
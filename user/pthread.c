@@ -0,0 +1,126 @@
+#include "pthread.h"
+#include "lib.h"
+#include "syscall.h"
+
+static struct pthread g_main_thread;
+
+void pthread_init(void) {
+    g_main_thread.self = &g_main_thread;
+    g_main_thread.tid = (uint32_t)sys_gettid();
+    sys_set_tls(&g_main_thread);
+}
+
+static void pthread_start(void* arg) {
+    pthread_t self = (pthread_t)arg;
+    /* The creator set a nonzero placeholder; the kernel zeroes this word
+     * when we exit, which is what pthread_join() sleeps on. */
+    self->tid = (uint32_t)sys_gettid();
+    pthread_exit(self->fn(self->arg));
+}
+
+int pthread_create(pthread_t* thread, void* (*fn)(void*), void* arg) {
+    uint8_t* stack = (uint8_t*)sys_mmap(0, PTHREAD_STACK_SIZE, PROT_READ | PROT_WRITE);
+    if ((int64_t)(uintptr_t)stack <= 0) return -1;
+
+    uintptr_t top = ((uintptr_t)stack + PTHREAD_STACK_SIZE - sizeof(struct pthread)) & ~(uintptr_t)15;
+    pthread_t t = (pthread_t)top;
+    t->self = t;
+    t->fn = fn;
+    t->arg = arg;
+    t->ret = 0;
+    t->tid = ~0u;
+    t->stack = stack;
+    t->stack_size = PTHREAD_STACK_SIZE;
+
+    if (sys_clone(pthread_start, t, t, t, (uint32_t*)&t->tid) < 0) {
+        sys_munmap(stack, PTHREAD_STACK_SIZE);
+        return -1;
+    }
+    *thread = t;
+    return 0;
+}
+
+int pthread_join(pthread_t t, void** ret) {
+    if (!t || t == pthread_self() || !t->stack) return -1;
+    for (;;) {
+        uint32_t tid = t->tid;
+        if (tid == 0) break;
+        sys_futex((uint32_t*)&t->tid, FUTEX_WAIT, tid);
+    }
+    if (ret) *ret = t->ret;
+    sys_munmap(t->stack, t->stack_size);
+    return 0;
+}
+
+void pthread_exit(void* ret) {
+    pthread_self()->ret = ret;
+    sys_exit(0);
+    for (;;) {
+    }
+}
+
+/* ---- mutex ---- */
+
+int pthread_mutex_init(pthread_mutex_t* m) {
+    m->state = 0;
+    return 0;
+}
+
+int pthread_mutex_trylock(pthread_mutex_t* m) {
+    return __sync_bool_compare_and_swap(&m->state, 0, 1) ? 0 : -1;
+}
+
+/* Take the lock marking it contended, so our unlock wakes the next
+ * sleeper; used after sleeping, when others may be queued behind us. */
+static void mutex_lock_contended(pthread_mutex_t* m) {
+    while (__sync_lock_test_and_set(&m->state, 2) != 0) {
+        sys_futex((uint32_t*)&m->state, FUTEX_WAIT, 2);
+    }
+}
+
+int pthread_mutex_lock(pthread_mutex_t* m) {
+    uint32_t c = __sync_val_compare_and_swap(&m->state, 0, 1);
+    if (c == 0) return 0;
+    /* Spin briefly: most critical sections are shorter than a futex trip. */
+    for (int i = 0; i < 100; i++) {
+        __asm__ volatile("pause");
+        if (m->state == 0 && __sync_bool_compare_and_swap(&m->state, 0, 1)) return 0;
+    }
+    mutex_lock_contended(m);
+    return 0;
+}
+
+int pthread_mutex_unlock(pthread_mutex_t* m) {
+    if (__sync_fetch_and_sub(&m->state, 1) != 1) {
+        m->state = 0;
+        sys_futex((uint32_t*)&m->state, FUTEX_WAKE, 1);
+    }
+    return 0;
+}
+
+/* ---- condition variable ---- */
+
+int pthread_cond_init(pthread_cond_t* cv) {
+    cv->seq = 0;
+    return 0;
+}
+
+int pthread_cond_wait(pthread_cond_t* cv, pthread_mutex_t* m) {
+    uint32_t seq = cv->seq;
+    pthread_mutex_unlock(m);
+    sys_futex((uint32_t*)&cv->seq, FUTEX_WAIT, seq);
+    mutex_lock_contended(m);
+    return 0;
+}
+
+int pthread_cond_signal(pthread_cond_t* cv) {
+    __sync_fetch_and_add(&cv->seq, 1);
+    sys_futex((uint32_t*)&cv->seq, FUTEX_WAKE, 1);
+    return 0;
+}
+
+int pthread_cond_broadcast(pthread_cond_t* cv) {
+    __sync_fetch_and_add(&cv->seq, 1);
+    sys_futex((uint32_t*)&cv->seq, FUTEX_WAKE, 0xFFFFFFFFu);
+    return 0;
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Minimal POSIX-style threads on clone() and futexes.  Each thread's
+ * descriptor sits at the top of its own mmap'd stack and doubles as its
+ * TLS block: the FS base points at it, so pthread_self() is one load.
+ * The mutex and condition variable stay in user space until they have
+ * to sleep.
+ */
+
+typedef struct pthread* pthread_t;
+
+struct pthread {
+    struct pthread*   self;         /* %fs:0 */
+    void*           (*fn)(void*);
+    void*             arg;
+    void*             ret;
+    volatile uint32_t tid;          /* cleared by the kernel at exit */
+    void*             stack;        /* mapping base, 0 for the main thread */
+    size_t            stack_size;
+};
+
+#define PTHREAD_STACK_SIZE (64 * 1024)
+
+int  pthread_create(pthread_t* thread, void* (*fn)(void*), void* arg);
+int  pthread_join(pthread_t thread, void** ret);
+void pthread_exit(void* ret) __attribute__((noreturn));
+
+static inline pthread_t pthread_self(void) {
+    pthread_t self;
+    __asm__ volatile("movq %%fs:0, %0" : "=r"(self));
+    return self;
+}
+
+/* Called once from libc_init() to give the main thread its descriptor. */
+void pthread_init(void);
+
+/* 0 unlocked, 1 locked, 2 locked with (possible) sleepers. */
+typedef struct {
+    volatile uint32_t state;
+} pthread_mutex_t;
+
+#define PTHREAD_MUTEX_INITIALIZER { 0 }
+
+int pthread_mutex_init(pthread_mutex_t* m);
+int pthread_mutex_lock(pthread_mutex_t* m);
+int pthread_mutex_trylock(pthread_mutex_t* m);
+int pthread_mutex_unlock(pthread_mutex_t* m);
+
+/* Waiters sleep on seq, which every signal bumps, so a signal between
+ * dropping the mutex and sleeping makes the futex wait return at once. */
+typedef struct {
+    volatile uint32_t seq;
+} pthread_cond_t;
+
+#define PTHREAD_COND_INITIALIZER { 0 }
+
+int pthread_cond_init(pthread_cond_t* cv);
+int pthread_cond_wait(pthread_cond_t* cv, pthread_mutex_t* m);
+int pthread_cond_signal(pthread_cond_t* cv);
+int pthread_cond_broadcast(pthread_cond_t* cv);
@@ -0,0 +1,90 @@
+#include "lib.h"
+#include "syscall.h"
+
+/*
+ * Real-time wakeup latency under load.  Forks CPU hogs in the normal
+ * class, then sleeps to absolute 1 ms deadlines and records how late it
+ * ran again, once per policy: SCHED_NORMAL, SCHED_FIFO, SCHED_RR and a
+ * SCHED_DEADLINE reservation of 100 us every 1 ms.  Prints p50/p99/max.
+ */
+
+#define HOGS        8
+#define PERIOD_NS   1000000ull
+#define SAMPLES     2000
+
+static uint64_t g_late[SAMPLES];
+
+static uint64_t now_ns(void) {
+    timespec_t ts;
+    if (sys_clock_gettime(CLOCK_MONOTONIC, &ts) < 0) return 0;
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void sort_u64(uint64_t* v, int n) {
+    for (int i = 1; i < n; i++) {
+        uint64_t x = v[i];
+        int j = i - 1;
+        while (j >= 0 && v[j] > x) {
+            v[j + 1] = v[j];
+            j--;
+        }
+        v[j + 1] = x;
+    }
+}
+
+static void measure(const char* label, int64_t policy) {
+    sched_attr_t attr = { 0, 0, 0, 0 };
+    if (policy == SCHED_FIFO || policy == SCHED_RR) attr.priority = 50;
+    if (policy == SCHED_DEADLINE) {
+        attr.runtime_ns = 100000;
+        attr.deadline_ns = PERIOD_NS;
+        attr.period_ns = PERIOD_NS;
+    }
+    if (sys_sched_setscheduler(0, policy, &attr) < 0) {
+        printf("%s: sched_setscheduler refused\n", label);
+        return;
+    }
+
+    uint64_t next = now_ns();
+    for (int i = 0; i < SAMPLES; i++) {
+        next += PERIOD_NS;
+        timespec_t ts = { (int64_t)(next / 1000000000ull), (int64_t)(next % 1000000000ull) };
+        sys_clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+        uint64_t t = now_ns();
+        g_late[i] = t > next ? t - next : 0;
+    }
+
+    attr.priority = 0;
+    sys_sched_setscheduler(0, SCHED_NORMAL, &attr);
+    sort_u64(g_late, SAMPLES);
+    printf("%s: p50 %u p99 %u max %u us\n", label, g_late[SAMPLES / 2] / 1000,
+           g_late[SAMPLES * 99 / 100] / 1000, g_late[SAMPLES - 1] / 1000);
+}
+
+int main(void) {
+    int64_t pids[HOGS];
+    int started = 0;
+    for (int i = 0; i < HOGS; i++) {
+        int64_t pid = sys_fork();
+        if (pid == 0) {
+            for (;;) {
+            }
+        }
+        if (pid < 0) break;
+        pids[started++] = pid;
+    }
+    printf("rtlat: %d hogs, %u samples per policy at %u us\n", (int64_t)started,
+           (uint64_t)SAMPLES, PERIOD_NS / 1000);
+
+    measure("normal  ", SCHED_NORMAL);
+    measure("fifo/50 ", SCHED_FIFO);
+    measure("rr/50   ", SCHED_RR);
+    measure("deadline", SCHED_DEADLINE);
+
+    for (int i = 0; i < started; i++) {
+        int status = 0;
+        sys_kill(pids[i], 9);
+        sys_waitpid(pids[i], &status);
+    }
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include "lib.h"
+#include "syscall.h"
+
+/*
+ * Sleep-accuracy benchmark: sleeps to absolute CLOCK_MONOTONIC deadlines
+ * with clock_nanosleep(TIMER_ABSTIME) and reports how late each wakeup
+ * was (min/p50/p90/p99/max, in ns) for several periods, first with zero
+ * timer slack and then with the default slack.  /proc/hrtimers shows how
+ * many expiries the slack batched.
+ */
+
+#define MAX_SAMPLES 500
+
+static const uint64_t k_periods_ns[] = { 50000, 100000, 1000000, 10000000 };
+static uint64_t g_late[MAX_SAMPLES];
+
+static uint64_t now_ns(void) {
+    timespec_t ts;
+    if (sys_clock_gettime(CLOCK_MONOTONIC, &ts) < 0) return 0;
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static void show_hrtimers(void) {
+    int fd = (int)sys_open("/proc/hrtimers", O_RDONLY);
+    if (fd < 0) return;
+    char buf[256];
+    for (;;) {
+        int64_t n = sys_read(fd, buf, sizeof(buf));
+        if (n <= 0) break;
+        sys_write(1, buf, n);
+    }
+    sys_close(fd);
+}
+
+static void sort_u64(uint64_t* v, int n) {
+    for (int i = 1; i < n; i++) {
+        uint64_t x = v[i];
+        int j = i - 1;
+        while (j >= 0 && v[j] > x) {
+            v[j + 1] = v[j];
+            j--;
+        }
+        v[j + 1] = x;
+    }
+}
+
+static void run(uint64_t period, int samples) {
+    uint64_t next = now_ns();
+    for (int i = 0; i < samples; i++) {
+        next += period;
+        timespec_t ts = { (int64_t)(next / 1000000000ull), (int64_t)(next % 1000000000ull) };
+        sys_clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, 0);
+        uint64_t t = now_ns();
+        g_late[i] = t > next ? t - next : 0;
+    }
+    sort_u64(g_late, samples);
+    printf("  period %u us: min %u p50 %u p90 %u p99 %u max %u ns\n",
+           period / 1000, g_late[0], g_late[samples / 2], g_late[samples * 90 / 100],
+           g_late[samples * 99 / 100], g_late[samples - 1]);
+}
+
+static void run_all(void) {
+    for (unsigned i = 0; i < sizeof(k_periods_ns) / sizeof(k_periods_ns[0]); i++) {
+        uint64_t period = k_periods_ns[i];
+        int samples = period >= 10000000 ? 100 : MAX_SAMPLES;
+        run(period, samples);
+    }
+}
+
+int main(void) {
+    int64_t slack = sys_timer_slack(-1);
+    printf("sleepbench: wakeup lateness vs. absolute deadline\n");
+
+    sys_timer_slack(0);
+    printf("timer slack 0 ns:\n");
+    run_all();
+
+    sys_timer_slack(slack);
+    printf("timer slack %d ns:\n", slack);
+    run_all();
+
+    show_hrtimers();
+    return 0;
+}
@@ -0,0 +1,354 @@
+#include "lib.h"
+#include "string_ops.h"
+#include "pthread.h"
+#include "arch/x86_64/common.h"
+
+/*
+ * memcpy/memset/memcmp/strlen/strcmp with scalar, SSE2 and AVX2 bodies.
+ * libc_init() selects one set from CPUID and the public entry points call
+ * through g_ops.  The vector code uses GCC vector extensions plus the
+ * pmovmskb builtins so it needs no intrinsic headers.
+ */
+
+typedef char v16_t  __attribute__((vector_size(16), may_alias));
+typedef char v16u_t __attribute__((vector_size(16), may_alias, aligned(1)));
+typedef char v32_t  __attribute__((vector_size(32), may_alias));
+typedef char v32u_t __attribute__((vector_size(32), may_alias, aligned(1)));
+
+typedef uint64_t u64u_t __attribute__((may_alias, aligned(1)));
+typedef uint32_t u32u_t __attribute__((may_alias, aligned(1)));
+typedef uint16_t u16u_t __attribute__((may_alias, aligned(1)));
+
+#define PAGE_BYTES 4096u
+
+/* The scalar loops must stay loops: gcc would otherwise turn them into
+ * calls to memcpy/memset, i.e. back into this dispatcher. */
+#define NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+/* ---- scalar ---- */
+
+NO_LIBCALL static void* memcpy_scalar(void* dst, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    for (size_t i = 0; i < n; i++) d[i] = s[i];
+    return dst;
+}
+
+NO_LIBCALL static void* memset_scalar(void* dst, int v, size_t n) {
+    uint8_t* d = (uint8_t*)dst;
+    for (size_t i = 0; i < n; i++) d[i] = (uint8_t)v;
+    return dst;
+}
+
+static int memcmp_scalar(const void* a, const void* b, size_t n) {
+    const uint8_t* x = (const uint8_t*)a;
+    const uint8_t* y = (const uint8_t*)b;
+    for (size_t i = 0; i < n; i++) {
+        if (x[i] != y[i]) return (int)x[i] - (int)y[i];
+    }
+    return 0;
+}
+
+static size_t strlen_scalar(const char* s) {
+    size_t n = 0;
+    while (s[n]) n++;
+    return n;
+}
+
+static int strcmp_scalar(const char* a, const char* b) {
+    while (*a && (*a == *b)) { a++; b++; }
+    return (unsigned char)*a - (unsigned char)*b;
+}
+
+/* ---- shared helpers ---- */
+
+/* n < 16: two overlapping stores of the widest size that fits. */
+static inline void copy_small(uint8_t* d, const uint8_t* s, size_t n) {
+    if (n >= 8) {
+        uint64_t lo = *(const u64u_t*)s, hi = *(const u64u_t*)(s + n - 8);
+        *(u64u_t*)d = lo;
+        *(u64u_t*)(d + n - 8) = hi;
+    } else if (n >= 4) {
+        uint32_t lo = *(const u32u_t*)s, hi = *(const u32u_t*)(s + n - 4);
+        *(u32u_t*)d = lo;
+        *(u32u_t*)(d + n - 4) = hi;
+    } else if (n >= 2) {
+        uint16_t lo = *(const u16u_t*)s, hi = *(const u16u_t*)(s + n - 2);
+        *(u16u_t*)d = lo;
+        *(u16u_t*)(d + n - 2) = hi;
+    } else if (n) {
+        *d = *s;
+    }
+}
+
+static inline void set_small(uint8_t* d, uint8_t b, size_t n) {
+    uint64_t w = 0x0101010101010101ull * b;
+    if (n >= 8) {
+        *(u64u_t*)d = w;
+        *(u64u_t*)(d + n - 8) = w;
+    } else if (n >= 4) {
+        *(u32u_t*)d = (uint32_t)w;
+        *(u32u_t*)(d + n - 4) = (uint32_t)w;
+    } else if (n >= 2) {
+        *(u16u_t*)d = (uint16_t)w;
+        *(u16u_t*)(d + n - 2) = (uint16_t)w;
+    } else if (n) {
+        *d = b;
+    }
+}
+
+/* True if an unaligned load of `width` bytes at p could touch the next page. */
+static inline int near_page_end(const void* p, size_t width) {
+    return ((uintptr_t)p & (PAGE_BYTES - 1)) > PAGE_BYTES - width;
+}
+
+static inline unsigned mask16(v16_t v) {
+    return (unsigned)__builtin_ia32_pmovmskb128(v);
+}
+
+/* ---- SSE2 ---- */
+
+static void* memcpy_sse2(void* dst, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    if (n < 16) {
+        copy_small(d, s, n);
+        return dst;
+    }
+    /* Unaligned head and tail; aligned stores in between. */
+    v16_t head = *(const v16u_t*)s;
+    v16_t tail = *(const v16u_t*)(s + n - 16);
+    if (n > 32) {
+        size_t skip = 16 - ((uintptr_t)d & 15);
+        uint8_t* dp = d + skip;
+        const uint8_t* sp = s + skip;
+        uint8_t* end = d + n - 16;
+        for (; dp < end; dp += 16, sp += 16) *(v16_t*)dp = *(const v16u_t*)sp;
+    }
+    *(v16u_t*)d = head;
+    *(v16u_t*)(d + n - 16) = tail;
+    return dst;
+}
+
+static void* memset_sse2(void* dst, int v, size_t n) {
+    uint8_t* d = (uint8_t*)dst;
+    if (n < 16) {
+        set_small(d, (uint8_t)v, n);
+        return dst;
+    }
+    v16_t fill = (v16_t){0} + (char)v;
+    *(v16u_t*)d = fill;
+    *(v16u_t*)(d + n - 16) = fill;
+    uint8_t* dp = d + 16 - ((uintptr_t)d & 15);
+    uint8_t* end = d + n - 16;
+    for (; dp < end; dp += 16) *(v16_t*)dp = fill;
+    return dst;
+}
+
+static int memcmp_sse2(const void* a, const void* b, size_t n) {
+    const uint8_t* x = (const uint8_t*)a;
+    const uint8_t* y = (const uint8_t*)b;
+    if (n < 16) return memcmp_scalar(a, b, n);
+
+    size_t i = 0;
+    for (;;) {
+        if (i + 16 > n) i = n - 16; /* final, overlapping block */
+        unsigned eq = mask16(*(const v16u_t*)(x + i) == *(const v16u_t*)(y + i));
+        if (eq != 0xFFFFu) {
+            size_t k = i + (size_t)__builtin_ctz(~eq);
+            return (int)x[k] - (int)y[k];
+        }
+        if (i + 16 >= n) return 0;
+        i += 16;
+    }
+}
+
+/* Aligned 16-byte loads never cross a page, so reading the bytes around the
+ * string is safe; the first block masks off what precedes s. */
+static size_t strlen_sse2(const char* s) {
+    const v16_t zero = {0};
+    uintptr_t off = (uintptr_t)s & 15;
+    const char* p = s - off;
+    unsigned m = mask16(*(const v16_t*)p == zero) >> off;
+    if (m) return (size_t)__builtin_ctz(m);
+    for (;;) {
+        p += 16;
+        m = mask16(*(const v16_t*)p == zero);
+        if (m) return (size_t)(p - s) + (size_t)__builtin_ctz(m);
+    }
+}
+
+static int strcmp_sse2(const char* a, const char* b) {
+    const v16_t zero = {0};
+    size_t i = 0;
+    for (;;) {
+        if (near_page_end(a + i, 16) || near_page_end(b + i, 16)) {
+            unsigned char ca = (unsigned char)a[i], cb = (unsigned char)b[i];
+            if (ca != cb || !ca) return (int)ca - (int)cb;
+            i++;
+            continue;
+        }
+        v16_t va = *(const v16u_t*)(a + i);
+        v16_t vb = *(const v16u_t*)(b + i);
+        unsigned m = mask16((va != vb) | (va == zero));
+        if (m) {
+            size_t k = i + (size_t)__builtin_ctz(m);
+            return (int)(unsigned char)a[k] - (int)(unsigned char)b[k];
+        }
+        i += 16;
+    }
+}
+
+/* ---- AVX2 ---- */
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static inline unsigned mask32(v32_t v) {
+    return (unsigned)__builtin_ia32_pmovmskb256(v);
+}
+
+AVX2 static void* memcpy_avx2(void* dst, const void* src, size_t n) {
+    uint8_t* d = (uint8_t*)dst;
+    const uint8_t* s = (const uint8_t*)src;
+    if (n < 32) return memcpy_sse2(dst, src, n);
+
+    v32_t head = *(const v32u_t*)s;
+    v32_t tail = *(const v32u_t*)(s + n - 32);
+    if (n > 64) {
+        size_t skip = 32 - ((uintptr_t)d & 31);
+        uint8_t* dp = d + skip;
+        const uint8_t* sp = s + skip;
+        uint8_t* end = d + n - 32;
+        for (; dp < end; dp += 32, sp += 32) *(v32_t*)dp = *(const v32u_t*)sp;
+    }
+    *(v32u_t*)d = head;
+    *(v32u_t*)(d + n - 32) = tail;
+    return dst;
+}
+
+AVX2 static void* memset_avx2(void* dst, int v, size_t n) {
+    uint8_t* d = (uint8_t*)dst;
+    if (n < 32) return memset_sse2(dst, v, n);
+
+    v32_t fill = (v32_t){0} + (char)v;
+    *(v32u_t*)d = fill;
+    *(v32u_t*)(d + n - 32) = fill;
+    uint8_t* dp = d + 32 - ((uintptr_t)d & 31);
+    uint8_t* end = d + n - 32;
+    for (; dp < end; dp += 32) *(v32_t*)dp = fill;
+    return dst;
+}
+
+AVX2 static int memcmp_avx2(const void* a, const void* b, size_t n) {
+    const uint8_t* x = (const uint8_t*)a;
+    const uint8_t* y = (const uint8_t*)b;
+    if (n < 32) return memcmp_sse2(a, b, n);
+
+    size_t i = 0;
+    for (;;) {
+        if (i + 32 > n) i = n - 32;
+        unsigned eq = mask32(*(const v32u_t*)(x + i) == *(const v32u_t*)(y + i));
+        if (eq != 0xFFFFFFFFu) {
+            size_t k = i + (size_t)__builtin_ctz(~eq);
+            return (int)x[k] - (int)y[k];
+        }
+        if (i + 32 >= n) return 0;
+        i += 32;
+    }
+}
+
+AVX2 static size_t strlen_avx2(const char* s) {
+    const v32_t zero = {0};
+    uintptr_t off = (uintptr_t)s & 31;
+    const char* p = s - off;
+    unsigned m = mask32(*(const v32_t*)p == zero) >> off;
+    if (m) return (size_t)__builtin_ctz(m);
+    for (;;) {
+        p += 32;
+        m = mask32(*(const v32_t*)p == zero);
+        if (m) return (size_t)(p - s) + (size_t)__builtin_ctz(m);
+    }
+}
+
+AVX2 static int strcmp_avx2(const char* a, const char* b) {
+    const v32_t zero = {0};
+    size_t i = 0;
+    for (;;) {
+        if (near_page_end(a + i, 32) || near_page_end(b + i, 32)) {
+            unsigned char ca = (unsigned char)a[i], cb = (unsigned char)b[i];
+            if (ca != cb || !ca) return (int)ca - (int)cb;
+            i++;
+            continue;
+        }
+        v32_t va = *(const v32u_t*)(a + i);
+        v32_t vb = *(const v32u_t*)(b + i);
+        unsigned m = mask32((va != vb) | (va == zero));
+        if (m) {
+            size_t k = i + (size_t)__builtin_ctz(m);
+            return (int)(unsigned char)a[k] - (int)(unsigned char)b[k];
+        }
+        i += 32;
+    }
+}
+
+/* ---- dispatch ---- */
+
+enum { OPS_SCALAR, OPS_SSE2, OPS_AVX2, OPS_COUNT };
+
+static const string_ops_t g_variants[OPS_COUNT] = {
+    { "scalar", memcpy_scalar, memset_scalar, memcmp_scalar, strlen_scalar, strcmp_scalar },
+    { "sse2",   memcpy_sse2,   memset_sse2,   memcmp_sse2,   strlen_sse2,   strcmp_sse2   },
+    { "avx2",   memcpy_avx2,   memset_avx2,   memcmp_avx2,   strlen_avx2,   strcmp_avx2   },
+};
+
+/* Scalar until libc_init() runs, so nothing depends on call order. */
+static const string_ops_t* g_ops = &g_variants[OPS_SCALAR];
+static size_t g_variant_count = 1;
+
+static int cpu_has_avx2(void) {
+    uint32_t max_leaf = 0, c = 0, b = 0;
+    cpuid(0, 0, &max_leaf, 0, 0, 0);
+    if (max_leaf < 7) return 0;
+    cpuid(1, 0, 0, 0, &c, 0);
+    /* AVX needs OSXSAVE and the kernel enabling YMM state in XCR0. */
+    if (!(c & (1u << 27)) || !(c & (1u << 28))) return 0;
+    if ((xgetbv(0) & 0x6) != 0x6) return 0;
+    cpuid(7, 0, 0, &b, 0, 0);
+    return (b & (1u << 5)) != 0;
+}
+
+void libc_init(void) {
+    /* SSE2 is architectural on x86_64. */
+    g_variant_count = cpu_has_avx2() ? OPS_AVX2 + 1 : OPS_SSE2 + 1;
+    g_ops = &g_variants[g_variant_count - 1];
+    pthread_init();
+}
+
+const string_ops_t* string_ops_active(void) {
+    return g_ops;
+}
+
+const string_ops_t* string_ops_variants(size_t* count) {
+    if (count) *count = g_variant_count;
+    return g_variants;
+}
+
+void* memcpy(void* dst, const void* src, size_t n) {
+    return g_ops->memcpy_fn(dst, src, n);
+}
+
+void* memset(void* dst, int v, size_t n) {
+    return g_ops->memset_fn(dst, v, n);
+}
+
+int memcmp(const void* a, const void* b, size_t n) {
+    return g_ops->memcmp_fn(a, b, n);
+}
+
+size_t strlen(const char* s) {
+    return g_ops->strlen_fn(s);
+}
+
+int strcmp(const char* a, const char* b) {
+    return g_ops->strcmp_fn(a, b);
+}
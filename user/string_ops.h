@@ -0,0 +1,22 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+/* One implementation set of the hot string/memory routines. */
+typedef struct {
+    const char* name;
+    void*  (*memcpy_fn)(void* dst, const void* src, size_t n);
+    void*  (*memset_fn)(void* dst, int v, size_t n);
+    int    (*memcmp_fn)(const void* a, const void* b, size_t n);
+    size_t (*strlen_fn)(const char* s);
+    int    (*strcmp_fn)(const char* a, const char* b);
+} string_ops_t;
+
+/* Pick the best supported set from CPUID; run once by start.S before main. */
+void libc_init(void);
+
+/* The set memcpy() and friends currently dispatch to. */
+const string_ops_t* string_ops_active(void);
+
+/* All sets usable on this CPU, scalar first (for benchmarks). */
+const string_ops_t* string_ops_variants(size_t* count);
@@ -32,11 +32,32 @@
 #define SYS_route_get 29
 #define SYS_route_add 30
 #define SYS_net_socket_get 31
+#define SYS_munmap 32
+#define SYS_nanosleep 33
+#define SYS_clock_nanosleep 34
+#define SYS_clock_gettime 35
+#define SYS_timer_slack 36
+#define SYS_nice 37
+#define SYS_sched_setscheduler 38
+#define SYS_sched_getscheduler 39
+#define SYS_sched_setaffinity 40
+#define SYS_sched_getaffinity 41
+#define SYS_clone 42
+#define SYS_futex 43
+#define SYS_set_tls 44
+#define SYS_gettid 45
+#define SYS_times 46
+#define SYS_getrusage 47
+#define SYS_sched_trace 48
 
 #define SYS_SEEK_SET 0
 #define SYS_SEEK_CUR 1
 #define SYS_SEEK_END 2
 
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1
+#define TIMER_ABSTIME   0x1
+
 #define O_RDONLY 0x1
 #define O_WRONLY 0x2
 #define O_RDWR   (O_RDONLY | O_WRONLY)
@@ -46,6 +67,68 @@
 #define PROT_WRITE 0x2
 #define PROT_EXEC  0x4
 
+#define SCHED_NORMAL   0
+#define SCHED_FIFO     1
+#define SCHED_RR       2
+#define SCHED_DEADLINE 3
+
+typedef struct sched_attr {
+    int64_t  priority;      /* SCHED_FIFO / SCHED_RR: 1..99 */
+    uint64_t runtime_ns;    /* SCHED_DEADLINE: runtime <= deadline <= period */
+    uint64_t deadline_ns;
+    uint64_t period_ns;
+} sched_attr_t;
+
+typedef struct timespec {
+    int64_t tv_sec;
+    int64_t tv_nsec;
+} timespec_t;
+
+/* times(): clock ticks of CLK_TCK per second. */
+#define CLK_TCK 100
+
+typedef struct tms {
+    uint64_t tms_utime;
+    uint64_t tms_stime;
+    uint64_t tms_cutime;
+    uint64_t tms_cstime;
+} tms_t;
+
+#define RUSAGE_SELF      0
+#define RUSAGE_CHILDREN  (-1)
+#define RUSAGE_THREAD    1
+
+typedef struct rusage {
+    uint64_t utime_ns;
+    uint64_t stime_ns;
+    uint64_t irq_ns;        /* in interrupt handlers */
+    uint64_t wait_ns;       /* runnable, waiting for a CPU */
+    uint64_t nvcsw;         /* voluntary context switches */
+    uint64_t nivcsw;        /* involuntary ones */
+} rusage_t;
+
+/* sched_trace(): scheduler event tracing. */
+#define SCHED_TRACE_STOP   0
+#define SCHED_TRACE_START  1
+#define SCHED_TRACE_READ   2
+#define SCHED_TRACE_TSC_HZ 3
+
+#define SCHED_EV_SWITCH  1  /* pid: prev, arg0: next, arg1: prev state */
+#define SCHED_EV_WAKEUP  2  /* pid: woken, arg0: its CPU, arg1: waker */
+#define SCHED_EV_MIGRATE 3  /* pid, arg0: destination CPU, arg1: source CPU */
+#define SCHED_EV_FORK    4  /* pid: parent, arg0: child */
+#define SCHED_EV_EXIT    5  /* pid, arg0: exit code */
+
+typedef struct sched_event {
+    uint64_t tsc;
+    uint32_t type;
+    uint32_t cpu;
+    uint32_t pid;
+    uint32_t arg0;
+    uint32_t arg1;
+    uint32_t reserved;
+} sched_event_t;
+
 static inline int64_t sys_call3(int64_t num, int64_t a1, int64_t a2, int64_t a3) {
     int64_t ret;
     __asm__ volatile (
@@ -147,11 +230,97 @@ static inline int64_t sys_sleep(uint64_t ms) {
     return sys_call1(SYS_sleep, (int64_t)ms);
 }
 
+static inline int64_t sys_nanosleep(const timespec_t* req, timespec_t* rem) {
+    return sys_call3(SYS_nanosleep, (int64_t)(uintptr_t)req, (int64_t)(uintptr_t)rem, 0);
+}
+
+static inline int64_t sys_clock_nanosleep(int64_t clock, int64_t flags,
+                                          const timespec_t* req, timespec_t* rem) {
+    return sys_call6(SYS_clock_nanosleep, clock, flags, (int64_t)(uintptr_t)req,
+                     (int64_t)(uintptr_t)rem, 0, 0);
+}
+
+static inline int64_t sys_clock_gettime(int64_t clock, timespec_t* ts) {
+    return sys_call3(SYS_clock_gettime, clock, (int64_t)(uintptr_t)ts, 0);
+}
+
+/* Set the calling thread's timer slack in ns (-1: leave it); returns the
+ * previous value. */
+static inline int64_t sys_timer_slack(int64_t ns) {
+    return sys_call1(SYS_timer_slack, ns);
+}
+
+/* Add inc to the calling thread's nice value; returns the new value. */
+static inline int64_t sys_nice(int64_t inc) {
+    return sys_call1(SYS_nice, inc);
+}
+
+/* pid 0 is the caller.  Deadline reservations may fail admission. */
+static inline int64_t sys_sched_setscheduler(int64_t pid, int64_t policy, const sched_attr_t* attr) {
+    return sys_call3(SYS_sched_setscheduler, pid, policy, (int64_t)(uintptr_t)attr);
+}
+
+static inline int64_t sys_sched_getscheduler(int64_t pid, sched_attr_t* attr) {
+    return sys_call3(SYS_sched_getscheduler, pid, (int64_t)(uintptr_t)attr, 0);
+}
+
+/* CPU masks: bit i is CPU i.  pid 0 is the caller. */
+static inline int64_t sys_sched_setaffinity(int64_t pid, uint64_t mask) {
+    return sys_call3(SYS_sched_setaffinity, pid, (int64_t)mask, 0);
+}
+
+static inline int64_t sys_sched_getaffinity(int64_t pid) {
+    return sys_call3(SYS_sched_getaffinity, pid, 0, 0);
+}
+
+#define FUTEX_WAIT 0
+#define FUTEX_WAKE 1
+
+/* Thread in this process running entry(arg) on stack (top), with FS base
+ * tls; *clear_tid is zeroed and futex-woken when it exits. */
+static inline int64_t sys_clone(void (*entry)(void*), void* stack, void* arg,
+                                void* tls, uint32_t* clear_tid) {
+    return sys_call6(SYS_clone, (int64_t)(uintptr_t)entry, (int64_t)(uintptr_t)stack,
+                     (int64_t)(uintptr_t)arg, (int64_t)(uintptr_t)tls,
+                     (int64_t)(uintptr_t)clear_tid, 0);
+}
+
+static inline int64_t sys_futex(uint32_t* uaddr, int64_t op, uint32_t val) {
+    return sys_call3(SYS_futex, (int64_t)(uintptr_t)uaddr, op, val);
+}
+
+static inline int64_t sys_set_tls(void* base) {
+    return sys_call1(SYS_set_tls, (int64_t)(uintptr_t)base);
+}
+
+static inline int64_t sys_gettid(void) {
+    return sys_call1(SYS_gettid, 0);
+}
+
+/* Fills buf (may be null); returns clock ticks since boot. */
+static inline int64_t sys_times(tms_t* buf) {
+    return sys_call1(SYS_times, (int64_t)(uintptr_t)buf);
+}
+
+static inline int64_t sys_getrusage(int64_t who, rusage_t* usage) {
+    return sys_call3(SYS_getrusage, who, (int64_t)(uintptr_t)usage, 0);
+}
+
+/* READ copies up to max of cpu's latest events to buf and returns how
+ * many; the other operations ignore the remaining arguments. */
+static inline int64_t sys_sched_trace(int64_t op, int64_t cpu, sched_event_t* buf, uint64_t max) {
+    return sys_call6(SYS_sched_trace, op, cpu, (int64_t)(uintptr_t)buf, (int64_t)max, 0, 0);
+}
+
 static inline void* sys_mmap(void* addr, uint64_t len, int prot) {
     return (void*)(uintptr_t)sys_call6(SYS_mmap, (int64_t)(uintptr_t)addr,
                                        (int64_t)len, prot, 0, 0, 0);
 }
 
+static inline int64_t sys_munmap(void* addr, uint64_t len) {
+    return sys_call3(SYS_munmap, (int64_t)(uintptr_t)addr, (int64_t)len, 0);
+}
+
 static inline int64_t sys_kill(int64_t pid, int64_t sig) {
     return sys_call3(SYS_kill, pid, sig, 0);
 }